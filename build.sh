@@ -41,7 +41,7 @@ print_error() {
 }
 
 check_dependencies() {
-    local deps=("gcc" "ld" "grub-mkrescue")
+    local deps=("gcc" "ld" "ar" "grub-mkrescue" "tar")
     local missing=()
     
     for dep in "${deps[@]}"; do
@@ -61,24 +61,42 @@ create_directories() {
     mkdir -p "${BUILD_DIR}" "${BOOT_DIR}"
 }
 
+compile_common() {
+    print_info "Building the core library (ATA, strings, WexFS, heap, LZ, CRC32C, search, backup)..."
+    "${CC}" ${CFLAGS} -c kernel/ata.c -o "${BUILD_DIR}/ata.o"
+    "${CC}" ${CFLAGS} -c kernel/klib.c -o "${BUILD_DIR}/klib.o"
+    "${CC}" ${CFLAGS} -c kernel/wexfs.c -o "${BUILD_DIR}/wexfs.o"
+    "${CC}" ${CFLAGS} -c kernel/heap.c -o "${BUILD_DIR}/heap.o"
+    "${CC}" ${CFLAGS} -c kernel/lz.c -o "${BUILD_DIR}/lz.o"
+    "${CC}" ${CFLAGS} -c kernel/crc32c.c -o "${BUILD_DIR}/crc32c.o"
+    "${CC}" ${CFLAGS} -c kernel/search.c -o "${BUILD_DIR}/search.o"
+    "${CC}" ${CFLAGS} -c kernel/backup.c -o "${BUILD_DIR}/backup.o"
+    rm -f "${BUILD_DIR}/libwexcore.a"
+    ar rcs "${BUILD_DIR}/libwexcore.a" "${BUILD_DIR}/ata.o" "${BUILD_DIR}/klib.o" "${BUILD_DIR}/wexfs.o" "${BUILD_DIR}/heap.o" "${BUILD_DIR}/lz.o" "${BUILD_DIR}/crc32c.o" "${BUILD_DIR}/search.o" "${BUILD_DIR}/backup.o"
+}
+
 compile_kernel() {
     print_info "Compiling kernel..."
+    "${CC}" ${CFLAGS} -c kernel/vfs.c -o "${BUILD_DIR}/vfs.o"
+    "${CC}" ${CFLAGS} -c kernel/tmpfs.c -o "${BUILD_DIR}/tmpfs.o"
+    "${CC}" ${CFLAGS} -c kernel/initramfs.c -o "${BUILD_DIR}/initramfs.o"
+    "${CC}" ${CFLAGS} -c kernel/iso9660.c -o "${BUILD_DIR}/iso9660.o"
     "${CC}" ${CFLAGS} -c kernel/kernel.c -o "${BUILD_DIR}/kernel.o"
-    "${LD}" ${LDFLAGS} -o "${BUILD_DIR}/kernel.bin" "${BUILD_DIR}/kernel.o" -e _start
+    "${LD}" ${LDFLAGS} -o "${BUILD_DIR}/kernel.bin" "${BUILD_DIR}/kernel.o" "${BUILD_DIR}/vfs.o" "${BUILD_DIR}/tmpfs.o" "${BUILD_DIR}/initramfs.o" "${BUILD_DIR}/iso9660.o" "${BUILD_DIR}/libwexcore.a" -e _start
     cp "${BUILD_DIR}/kernel.bin" "${BOOT_DIR}/"
 }
 
 compile_recovery() {
     print_info "Compiling recovery..."
     "${CC}" ${CFLAGS} -c kernel/recovery.c -o "${BUILD_DIR}/recovery.o"
-    "${LD}" ${LDFLAGS} -o "${BUILD_DIR}/recovery.bin" "${BUILD_DIR}/recovery.o" -e _start
+    "${LD}" ${LDFLAGS} -o "${BUILD_DIR}/recovery.bin" "${BUILD_DIR}/recovery.o" "${BUILD_DIR}/libwexcore.a" -e _start
     cp "${BUILD_DIR}/recovery.bin" "${BOOT_DIR}/"
 }
 
 compile_installer() {
     print_info "Compiling installer..."
     "${CC}" ${CFLAGS} -c kernel/install.c -o "${BUILD_DIR}/install.o"
-    "${LD}" ${LDFLAGS} -o "${BUILD_DIR}/install.bin" "${BUILD_DIR}/install.o" -e _start
+    "${LD}" ${LDFLAGS} -o "${BUILD_DIR}/install.bin" "${BUILD_DIR}/install.o" "${BUILD_DIR}/libwexcore.a" -e _start
     cp "${BUILD_DIR}/install.bin" "${BOOT_DIR}/"
 }
 
@@ -91,6 +109,11 @@ copy_systemroot() {
     fi
 }
 
+build_initramfs() {
+    print_info "Packing initramfs..."
+    tar --format=ustar -C "${ISO_DIR}" -cf "${BOOT_DIR}/initramfs.tar" SystemRoot
+}
+
 build_iso() {
     print_info "Building ISO image..."
     if grub-mkrescue -o "${OUTPUT_ISO}" "${ISO_DIR}"; then
@@ -120,10 +143,12 @@ main() {
     
     check_dependencies
     create_directories
+    compile_common
     compile_kernel
     compile_recovery
     compile_installer
     copy_systemroot
+    build_initramfs
     build_iso
     cleanup
     show_build_info
@@ -0,0 +1,298 @@
+/* ATA/ATAPI PIO driver, part of the core library */
+#include "ata.h"
+#include "io.h"
+
+#define SECTOR_SIZE 512
+
+void prints(const char* s);
+
+u32 ata_sectors_read = 0;
+u32 ata_sectors_written = 0;
+
+AtaTraceRecord* ata_trace = 0;
+u32 ata_trace_len = 0;
+u32 ata_trace_max = 0;
+int ata_trace_on = 0;
+
+void ata_trace_start(AtaTraceRecord* buf, u32 max) {
+    ata_trace = buf;
+    ata_trace_max = buf ? max : 0;
+    ata_trace_len = 0;
+    ata_trace_on = buf != 0;
+}
+
+static void trace(unsigned long long start, int write, u32 lba, u32 count) {
+    if (!ata_trace_on || ata_trace_len >= ata_trace_max) return;
+    AtaTraceRecord* r = &ata_trace[ata_trace_len++];
+    r->start = start;
+    r->cycles = (u32)(rdtsc() - start);
+    r->lba = lba;
+    r->count = (u16)count;
+    r->write = (u8)write;
+    r->reserved = 0;
+}
+
+void ata_wait_ready(void) {
+    while (inb(ATA_STATUS) & 0x80);
+}
+
+void ata_wait_drq(void) {
+    while (!(inb(ATA_STATUS) & 0x08));
+}
+
+void ata_read_sector(u32 lba, u8* buffer) {
+    unsigned long long start = rdtsc();
+    outb(ATA_DEVICE, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(ATA_SECTOR_COUNT, 1);
+    outb(ATA_LBA_LOW, (u8)lba);
+    outb(ATA_LBA_MID, (u8)(lba >> 8));
+    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
+    outb(ATA_CMD, 0x20);
+    ata_sectors_read++;
+
+    ata_wait_ready();
+    if (inb(ATA_STATUS) & 0x01) {
+        prints("ATA Read Error\n");
+        return;
+    }
+
+    ata_wait_drq();
+    insw(ATA_DATA, buffer, SECTOR_SIZE / 2);
+    trace(start, 0, lba, 1);
+}
+
+/* Several sectors with one READ SECTORS command; the drive raises DRQ
+ * once per sector. A count of 256 is sent as 0. */
+void ata_read_sectors(u32 lba, u32 count, u8* buffer) {
+    unsigned long long start = rdtsc();
+    outb(ATA_DEVICE, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(ATA_SECTOR_COUNT, (u8)count);
+    outb(ATA_LBA_LOW, (u8)lba);
+    outb(ATA_LBA_MID, (u8)(lba >> 8));
+    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
+    outb(ATA_CMD, 0x20);
+    ata_sectors_read += count;
+
+    for (u32 s = 0; s < count; s++) {
+        ata_wait_ready();
+        if (inb(ATA_STATUS) & 0x01) {
+            prints("ATA Read Error\n");
+            return;
+        }
+        ata_wait_drq();
+        insw(ATA_DATA, buffer + s * SECTOR_SIZE, SECTOR_SIZE / 2);
+    }
+    trace(start, 0, lba, count);
+}
+
+void ata_write_sector(u32 lba, u8* buffer) {
+    unsigned long long start = rdtsc();
+    outb(ATA_DEVICE, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(ATA_SECTOR_COUNT, 1);
+    outb(ATA_LBA_LOW, (u8)lba);
+    outb(ATA_LBA_MID, (u8)(lba >> 8));
+    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
+    outb(ATA_CMD, 0x30);
+    ata_sectors_written++;
+
+    ata_wait_ready();
+    ata_wait_drq();
+
+    // One word at a time: some drives miss words sent with rep outsw
+    for (int i = 0; i < SECTOR_SIZE / 2; i++) {
+        u16 data = (buffer[i * 2 + 1] << 8) | buffer[i * 2];
+        outw(ATA_DATA, data);
+    }
+
+    ata_wait_ready();
+    if (inb(ATA_STATUS) & 0x01) {
+        prints("ATA Write Error\n");
+    }
+    trace(start, 1, lba, 1);
+}
+
+/* Number of LBA28 sectors on the drive, 0 if IDENTIFY is not answered */
+u32 ata_identify(void) {
+    outb(ATA_DEVICE, 0xA0);
+    outb(ATA_SECTOR_COUNT, 0);
+    outb(ATA_LBA_LOW, 0);
+    outb(ATA_LBA_MID, 0);
+    outb(ATA_LBA_HIGH, 0);
+    outb(ATA_CMD, 0xEC);
+
+    u8 status = inb(ATA_STATUS);
+    if (status == 0 || status == 0xFF) return 0;
+    ata_wait_ready();
+    if (inb(ATA_LBA_MID) || inb(ATA_LBA_HIGH)) return 0; // ATAPI/SATA signature
+
+    while (!((status = inb(ATA_STATUS)) & 0x09));
+    if (status & 0x01) return 0;
+
+    u16 id[256];
+    for (int i = 0; i < 256; i++) {
+        id[i] = inw(ATA_DATA);
+    }
+    return id[60] | ((u32)id[61] << 16);
+}
+
+/* ---------- Second disk (primary slave) ---------- */
+
+/* Wait for BSY to clear, then for DRQ if `drq`; 0, or -1 on an error,
+ * an empty bus or a timeout */
+static int slave_wait(int drq) {
+    for (u32 i = 0; i < ATA_SLAVE_TIMEOUT; i++) {
+        u8 status = inb(ATA_STATUS);
+        if (status == 0xFF) return -1;
+        if (status & 0x80) continue;
+        if (status & 0x21) return -1;           // ERR or device fault
+        if (!drq || (status & 0x08)) return 0;
+    }
+    return -1;
+}
+
+static void slave_command(u32 lba, u32 count, u8 cmd) {
+    outb(ATA_DEVICE, 0xF0 | ((lba >> 24) & 0x0F));
+    for (int i = 0; i < 4; i++) inb(ATA_CONTROL);  // 400 ns after selecting
+    outb(ATA_SECTOR_COUNT, (u8)count);
+    outb(ATA_LBA_LOW, (u8)lba);
+    outb(ATA_LBA_MID, (u8)(lba >> 8));
+    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
+    outb(ATA_CMD, cmd);
+}
+
+u32 ata_slave_identify(void) {
+    outb(ATA_DEVICE, 0xB0);
+    for (int i = 0; i < 4; i++) inb(ATA_CONTROL);
+    outb(ATA_SECTOR_COUNT, 0);
+    outb(ATA_LBA_LOW, 0);
+    outb(ATA_LBA_MID, 0);
+    outb(ATA_LBA_HIGH, 0);
+    outb(ATA_CMD, 0xEC);
+
+    u8 status = inb(ATA_STATUS);
+    if (status == 0 || status == 0xFF) return 0;
+    for (u32 i = 0; i < ATA_SLAVE_TIMEOUT && (inb(ATA_STATUS) & 0x80); i++);
+    if (inb(ATA_LBA_MID) || inb(ATA_LBA_HIGH)) return 0; // ATAPI/SATA signature
+    if (slave_wait(1) < 0) return 0;
+
+    u16 id[256];
+    for (int i = 0; i < 256; i++) id[i] = inw(ATA_DATA);
+    return id[60] | ((u32)id[61] << 16);
+}
+
+int ata_slave_read(u32 lba, u32 count, u8* buffer) {
+    if (slave_wait(0) < 0) return -1;
+    slave_command(lba, count, 0x20);
+    for (u32 s = 0; s < count; s++) {
+        if (slave_wait(1) < 0) return -1;
+        insw(ATA_DATA, buffer + s * SECTOR_SIZE, SECTOR_SIZE / 2);
+    }
+    return 0;
+}
+
+/* One WRITE SECTORS command for the whole run; the drive asks for each
+ * sector with DRQ */
+int ata_slave_write(u32 lba, u32 count, const u8* buffer) {
+    if (slave_wait(0) < 0) return -1;
+    slave_command(lba, count, 0x30);
+    for (u32 s = 0; s < count; s++) {
+        if (slave_wait(1) < 0) return -1;
+        const u8* b = buffer + s * SECTOR_SIZE;
+        for (int i = 0; i < SECTOR_SIZE / 2; i++) outw(ATA_DATA, (b[i * 2 + 1] << 8) | b[i * 2]);
+    }
+    return slave_wait(0);
+}
+
+int ata_slave_flush(void) {
+    if (slave_wait(0) < 0) return -1;
+    slave_command(0, 0, 0xE7);
+    return slave_wait(0);
+}
+
+/* ---------- ATAPI (CD/DVD) packet interface ---------- */
+#define ATAPI_TIMEOUT 1000000   /* status polls before a command is given up */
+
+static u16 atapi_base = 0;      /* command block of the drive, 0: no drive */
+static u16 atapi_ctrl = 0;
+static u8 atapi_select = 0;     /* 0xA0 master, 0xB0 slave */
+
+/* Wait for BSY to clear, then for DRQ if `drq`; status or -1 on error/timeout */
+static int atapi_wait(int drq) {
+    for (u32 i = 0; i < ATAPI_TIMEOUT; i++) {
+        u8 status = inb(atapi_base + 7);
+        if (status == 0xFF) return -1;          // floating bus
+        if (status & 0x80) continue;
+        if (status & 0x01) return -1;
+        if (!drq || (status & 0x08)) return status;
+    }
+    return -1;
+}
+
+static void atapi_delay(void) {
+    // 400 ns for the drive to put out a valid status
+    for (int i = 0; i < 4; i++) inb(atapi_ctrl);
+}
+
+static int atapi_identify(u16 base, u16 ctrl, u8 select) {
+    atapi_base = base;
+    atapi_ctrl = ctrl;
+    outb(base + 6, select);
+    atapi_delay();
+    if (inb(base + 7) == 0xFF) return 0;
+    // Packet devices answer ATA IDENTIFY with the 0x14/0xEB signature
+    outb(base + 2, 0);
+    outb(base + 3, 0);
+    outb(base + 4, 0);
+    outb(base + 5, 0);
+    outb(base + 7, 0xA1);                       // IDENTIFY PACKET DEVICE
+    atapi_delay();
+    if (inb(base + 7) == 0) return 0;
+    if (atapi_wait(1) < 0) return 0;
+
+    u16 id[256];
+    for (int i = 0; i < 256; i++) id[i] = inw(base);
+    // Word 0: bits 15:14 = 10 (ATAPI), bits 12:8 = 5 (CD/DVD)
+    return (id[0] >> 14) == 2 && ((id[0] >> 8) & 0x1F) == 5;
+}
+
+/* Find the first CD drive: secondary master and slave, then primary slave */
+int atapi_init(void) {
+    static const u16 bases[] = { 0x170, 0x170, 0x1F0 };
+    static const u16 ctrls[] = { 0x376, 0x376, 0x3F6 };
+    static const u8 selects[] = { 0xA0, 0xB0, 0xB0 };
+    for (int i = 0; i < 3; i++) {
+        if (atapi_identify(bases[i], ctrls[i], selects[i])) {
+            atapi_select = selects[i];
+            return 1;
+        }
+    }
+    atapi_base = 0;
+    return 0;
+}
+
+int atapi_read(u32 lba, u32 count, u8* buffer) {
+    if (!atapi_base) return -1;
+    outb(atapi_base + 6, atapi_select);
+    atapi_delay();
+    if (atapi_wait(0) < 0) return -1;
+    outb(atapi_base + 1, 0);                        // PIO, no DMA
+    outb(atapi_base + 4, (u8)ATAPI_SECTOR_SIZE);    // bytes per DRQ block
+    outb(atapi_base + 5, (u8)(ATAPI_SECTOR_SIZE >> 8));
+    outb(atapi_base + 7, 0xA0);                     // PACKET
+    atapi_delay();
+    if (atapi_wait(1) < 0) return -1;
+
+    u8 packet[12] = { 0x28, 0, (u8)(lba >> 24), (u8)(lba >> 16), (u8)(lba >> 8), (u8)lba,
+                      0, (u8)(count >> 8), (u8)count, 0, 0, 0 };   // READ(10)
+    for (int i = 0; i < 12; i += 2) outw(atapi_base, packet[i] | (packet[i + 1] << 8));
+
+    for (u32 s = 0; s < count; s++) {
+        atapi_delay();
+        if (atapi_wait(1) < 0) return -1;
+        u32 bytes = inb(atapi_base + 4) | (inb(atapi_base + 5) << 8);
+        if (bytes != ATAPI_SECTOR_SIZE) return -1;
+        insw(atapi_base, buffer + s * ATAPI_SECTOR_SIZE, ATAPI_SECTOR_SIZE / 2);
+    }
+    atapi_delay();
+    return atapi_wait(0) < 0 ? -1 : 0;
+}
@@ -0,0 +1,76 @@
+#ifndef WEXOS_ATA_H
+#define WEXOS_ATA_H
+
+typedef unsigned int u32;
+typedef unsigned short u16;
+typedef unsigned char u8;
+
+/*
+ * ATA PIO driver for the system disk (primary master, LBA28) and the
+ * ATAPI packet interface for a CD drive. Shared by every boot image
+ * through the core library, so the disk path is the same code in the
+ * kernel, recovery and the installer.
+ */
+#define ATA_DATA 0x1F0
+#define ATA_SECTOR_COUNT 0x1F2
+#define ATA_LBA_LOW 0x1F3
+#define ATA_LBA_MID 0x1F4
+#define ATA_LBA_HIGH 0x1F5
+#define ATA_DEVICE 0x1F6
+#define ATA_STATUS 0x1F7
+#define ATA_CMD 0x1F7
+
+#define ATAPI_SECTOR_SIZE 2048
+
+/* Sector counters, read by fsbench */
+extern u32 ata_sectors_read;
+extern u32 ata_sectors_written;
+
+/*
+ * I/O trace: one record per disk command, start and length in TSC
+ * cycles. Off until ata_trace_start hands it a buffer; the kernel does
+ * that before mounting the disk, so the trace begins with the boot.
+ * Recording stops when the buffer is full. The iotrace command saves it
+ * for tools/disk-replay.
+ */
+typedef struct {
+    unsigned long long start;
+    u32 cycles;
+    u32 lba;
+    u16 count;
+    u8 write;
+    u8 reserved;
+} AtaTraceRecord;
+
+extern AtaTraceRecord* ata_trace;
+extern u32 ata_trace_len;
+extern u32 ata_trace_max;
+extern int ata_trace_on;
+
+void ata_trace_start(AtaTraceRecord* buf, u32 max);
+
+void ata_wait_ready(void);
+void ata_wait_drq(void);
+void ata_read_sector(u32 lba, u8* buffer);
+void ata_read_sectors(u32 lba, u32 count, u8* buffer);     /* count <= 256, one command */
+void ata_write_sector(u32 lba, u8* buffer);
+u32 ata_identify(void);
+
+/* Second disk on the same channel (primary slave), the target of the
+ * backup command. Not traced or counted. ata_slave_identify gives its
+ * LBA28 sector count, 0 when there is none; the others return 0 or -1
+ * and give up on a drive that stops answering. */
+#define ATA_CONTROL 0x3F6
+#define ATA_SLAVE_TIMEOUT 10000000      /* status polls per sector */
+
+u32 ata_slave_identify(void);
+int ata_slave_read(u32 lba, u32 count, u8* buffer);             /* count <= 256 */
+int ata_slave_write(u32 lba, u32 count, const u8* buffer);      /* count <= 256 */
+int ata_slave_flush(void);                                      /* FLUSH CACHE */
+
+/* 1 if a CD drive was found; atapi_read then reads `count` 2 KB sectors
+ * from it, returning 0 or -1 */
+int atapi_init(void);
+int atapi_read(u32 lba, u32 count, u8* buffer);
+
+#endif
@@ -0,0 +1,480 @@
+/* Incremental backup and restore of WexFS, part of the core library */
+#include "backup.h"
+#include "heap.h"
+#include "crc32c.h"
+
+#define RUN_BYTES (BACKUP_RUN * SECTOR_SIZE)
+
+/* Sequential access to the target through one BACKUP_RUN buffer. A
+ * writer collects bytes until the buffer is full and sends it in one
+ * command; a reader refills it the same way. Bytes going through put and
+ * get are added to `crc`. */
+typedef struct {
+    const BackupDev* dev;
+    u8* buf;
+    u32 lba;                /* of buf[0] */
+    u32 pos;                /* next byte in buf */
+    u32 len;                /* reader: bytes valid in buf */
+    u32 end;                /* reader: first sector not to read */
+    u32 written;            /* writer: sectors written */
+    u32 crc;
+    int err;
+} Stream;
+
+/* Inode number -> where its data was last backed up */
+typedef struct {
+    u32 lba;
+    u32 change;
+    u32 crc;
+} BackupRef;
+
+static int stream_open(Stream* s, const BackupDev* dev, u32 lba, u32 end) {
+    memset(s, 0, sizeof(Stream));
+    s->dev = dev;
+    s->lba = lba;
+    s->end = end;
+    s->buf = (u8*)kmalloc(RUN_BYTES);
+    s->err = s->buf ? WEXFS_OK : WEXFS_ENOMEM;
+    return s->err;
+}
+
+static void stream_close(Stream* s) {
+    kfree(s->buf);
+    s->buf = NULL;
+}
+
+/* Sector the next byte goes to or comes from; whole sectors only */
+static u32 stream_sector(const Stream* s) {
+    return s->lba + s->pos / SECTOR_SIZE;
+}
+
+/* ---------- Writing ---------- */
+
+static int put_flush(Stream* w) {
+    u32 count = w->pos / SECTOR_SIZE;
+    if (w->err || !count) return w->err;
+    if (w->lba + count > w->dev->sectors) w->err = WEXFS_ENOSPC;
+    else if (w->dev->write(w->lba, count, w->buf) < 0) w->err = WEXFS_EIO;
+    if (w->err) return w->err;
+    w->lba += count;
+    w->written += count;
+    w->pos = 0;
+    return WEXFS_OK;
+}
+
+static void put(Stream* w, const void* data, u32 len) {
+    const u8* p = (const u8*)data;
+    while (len && !w->err) {
+        u32 n = RUN_BYTES - w->pos;
+        if (n > len) n = len;
+        if (p) memcpy(w->buf + w->pos, (void*)p, n), p += n;
+        else memset(w->buf + w->pos, 0, n);
+        w->crc = crc32c(w->crc, w->buf + w->pos, n);
+        w->pos += n;
+        len -= n;
+        if (w->pos == RUN_BYTES) put_flush(w);
+    }
+}
+
+/* Zeroes up to the next multiple of `align` bytes */
+static void put_pad(Stream* w, u32 align) {
+    u32 rest = w->pos % align;
+    if (rest) put(w, NULL, align - rest);
+}
+
+/* The file's data straight into the buffer; its CRC32C */
+static u32 put_file(Stream* w, FSNode* node) {
+    u32 crc = 0;
+    u32 off = 0;
+    while (off < node->di.size && !w->err) {
+        u32 n = RUN_BYTES - w->pos;
+        if (n > node->di.size - off) n = node->di.size - off;
+        int got = wexfs_read(node, off, w->buf + w->pos, n);
+        if (got != (int)n) {
+            w->err = got < 0 ? got : WEXFS_EIO;
+            break;
+        }
+        crc = crc32c(crc, w->buf + w->pos, n);
+        w->pos += n;
+        off += n;
+        if (w->pos == RUN_BYTES) put_flush(w);
+    }
+    return crc;
+}
+
+/* ---------- Reading ---------- */
+
+static int get_refill(Stream* r) {
+    r->lba += r->len / SECTOR_SIZE;
+    r->pos = 0;
+    r->len = 0;
+    u32 count = r->end > r->lba ? r->end - r->lba : 0;
+    if (count > BACKUP_RUN) count = BACKUP_RUN;
+    if (!count || r->lba + count > r->dev->sectors) r->err = WEXFS_EIO;
+    else if (r->dev->read(r->lba, count, r->buf) < 0) r->err = WEXFS_EIO;
+    else r->len = count * SECTOR_SIZE;
+    return r->err;
+}
+
+/* `len` bytes into `out`, or skipped when it is NULL */
+static int get(Stream* r, void* out, u32 len) {
+    u8* p = (u8*)out;
+    while (len && !r->err) {
+        if (r->pos == r->len && get_refill(r)) break;
+        u32 n = r->len - r->pos;
+        if (n > len) n = len;
+        if (p) memcpy(p, r->buf + r->pos, n), p += n;
+        r->crc = crc32c(r->crc, r->buf + r->pos, n);
+        r->pos += n;
+        len -= n;
+    }
+    return r->err;
+}
+
+/* ---------- Header and records ---------- */
+
+static u32 header_crc(BackupHeader* hdr) {
+    u32 saved = hdr->csum;
+    hdr->csum = 0;
+    u32 crc = crc32c(0, hdr, sizeof(BackupHeader));
+    hdr->csum = saved;
+    return crc;
+}
+
+int backup_header(const BackupDev* dev, BackupHeader* hdr) {
+    if (dev->sectors < 2) return WEXFS_ENOSPC;
+    if (dev->read(0, 1, (u8*)hdr) < 0) return WEXFS_EIO;
+    if (hdr->magic != BACKUP_MAGIC || hdr->version != BACKUP_VERSION || hdr->csum != header_crc(hdr)) {
+        return WEXFS_ENOENT;
+    }
+    return WEXFS_OK;
+}
+
+/* Everything written before reaches the media first, and the header
+ * itself before the caller goes on */
+static int header_write(const BackupDev* dev, BackupHeader* hdr) {
+    hdr->csum = header_crc(hdr);
+    if (dev->flush() < 0 || dev->write(0, 1, (const u8*)hdr) < 0 || dev->flush() < 0) return WEXFS_EIO;
+    return WEXFS_OK;
+}
+
+static u32 record_crc(BackupRecord* rec) {
+    u32 saved = rec->csum;
+    rec->csum = 0;
+    u32 crc = crc32c(0, rec, sizeof(BackupRecord));
+    rec->csum = saved;
+    return crc;
+}
+
+/* Sectors taken by a record of `size` data bytes, without overflowing */
+static u32 record_sectors(u32 size) {
+    return size / SECTOR_SIZE + (size % SECTOR_SIZE + sizeof(BackupRecord) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+/* Fill `refs` from the last catalog; entries without data are skipped */
+static int catalog_load(const BackupDev* dev, const BackupHeader* hdr, BackupRef* refs, u32 slots) {
+    Stream r;
+    int err = stream_open(&r, dev, hdr->catalog_lba, hdr->catalog_lba + hdr->catalog_sectors);
+    for (u32 i = 0; i < hdr->catalog_entries && err == WEXFS_OK; i++) {
+        BackupEntry e;
+        err = get(&r, &e, sizeof(e));
+        if (err == WEXFS_OK && e.path_len >= MAX_PATH) err = WEXFS_EIO;
+        if (err == WEXFS_OK) err = get(&r, NULL, BACKUP_ENTRY_SIZE(e.path_len) - sizeof(e));
+        if (err == WEXFS_OK && e.lba && e.ino < slots) {
+            refs[e.ino].lba = e.lba;
+            refs[e.ino].change = e.change;
+            refs[e.ino].crc = e.crc;
+        }
+    }
+    if (err == WEXFS_OK && r.crc != hdr->catalog_crc) err = WEXFS_EIO;
+    stream_close(&r);
+    return err;
+}
+
+/* Records of an unfinished session, [start, end); each one is read back
+ * whole and goes into `refs`. Returns the sector after the last good one. */
+static u32 records_scan(const BackupDev* dev, u32 start, u32 end, BackupRef* refs, u32 slots) {
+    Stream r;
+    if (stream_open(&r, dev, start, end) != WEXFS_OK) return start;
+    u32 good = start;
+    while (good < end) {
+        BackupRecord rec;
+        if (get(&r, &rec, sizeof(rec))) break;
+        if (rec.magic != BACKUP_RECORD_MAGIC || rec.csum != record_crc(&rec) ||
+            record_sectors(rec.size) > end - good) break;
+        u32 crc = 0;
+        u32 left = rec.size;
+        while (left) {
+            if (r.pos == r.len && get_refill(&r)) break;
+            u32 n = r.len - r.pos;
+            if (n > left) n = left;
+            crc = crc32c(crc, r.buf + r.pos, n);
+            r.pos += n;
+            left -= n;
+        }
+        if (r.err || get(&r, NULL, (SECTOR_SIZE - r.pos % SECTOR_SIZE) % SECTOR_SIZE)) break;
+        if (rec.ino < slots) {
+            refs[rec.ino].lba = good;
+            refs[rec.ino].change = rec.change;
+            refs[rec.ino].crc = crc;
+        }
+        good = stream_sector(&r);
+    }
+    stream_close(&r);
+    return good;
+}
+
+/* Pre-order: a directory always comes before what is in it */
+static FSNode* walk_next(FSNode* node) {
+    if (node->is_dir && node->children) return node->children;
+    while (node) {
+        if (node->next_sibling) return node->next_sibling;
+        node = node->parent;
+    }
+    return NULL;
+}
+
+/* ---------- Backup ---------- */
+
+int backup_run(const BackupDev* dev, u32 flags, BackupResult* res) {
+    memset(res, 0, sizeof(BackupResult));
+    FSNode* root = wexfs_root();
+    if (!root) return WEXFS_ENOENT;
+
+    BackupHeader hdr;
+    int err = backup_header(dev, &hdr);
+    if (err == WEXFS_EIO || err == WEXFS_ENOSPC) return err;
+    // Only a target holding this volume's last backup is continued: the
+    // counters alone match on copies of one image
+    u32 id = wexfs_volume_id();
+    int same = err == WEXFS_OK && !(flags & BACKUP_FULL) && hdr.volume_id == id &&
+               hdr.change == wexfs_sb.backup_mark && hdr.end <= dev->sectors;
+    int resume = same && hdr.pending && wexfs_sb.frozen == WEXFS_CHANGE_ALL && hdr.pending_end <= dev->sectors;
+
+    u32 slots = fs_node_slots ? fs_node_slots : 1;
+    BackupRef* refs = (BackupRef*)kcalloc(slots, sizeof(BackupRef));
+    char* path = (char*)kmalloc(MAX_PATH);
+    Stream w;
+    memset(&w, 0, sizeof(w));
+    u32 headers = 0;
+    err = refs && path ? WEXFS_OK : WEXFS_ENOMEM;
+    if (err == WEXFS_OK && same && hdr.sessions && catalog_load(dev, &hdr, refs, slots) != WEXFS_OK) {
+        same = resume = 0;
+        memset(refs, 0, slots * sizeof(BackupRef));
+    }
+    if (err == WEXFS_OK && !same) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = BACKUP_MAGIC;
+        hdr.version = BACKUP_VERSION;
+        hdr.volume_id = id;
+        hdr.end = 1;
+    }
+    res->full = hdr.sessions == 0;
+    res->resumed = resume;
+
+    u32 start = hdr.end;
+    if (err == WEXFS_OK && resume) start = records_scan(dev, hdr.end, hdr.pending_end, refs, slots);
+    u32 change = wexfs_sb.change;
+    if (err == WEXFS_OK) {
+        // From here on files overwritten in place take new numbers, so
+        // whatever happens before the commit is seen by the next backup
+        wexfs_backup_mark(wexfs_sb.backup_mark, WEXFS_CHANGE_ALL);
+        hdr.pending = 1;
+        hdr.pending_change = change;
+        hdr.pending_end = start;
+        err = header_write(dev, &hdr);
+        headers++;
+    }
+    if (err == WEXFS_OK) err = stream_open(&w, dev, start, 0);
+
+    for (FSNode* node = root; node && err == WEXFS_OK; node = walk_next(node)) {
+        if (node->is_dir || node->di.size == 0) continue;
+        BackupRef* ref = &refs[node->ino];
+        if (ref->lba && ref->change == node->di.change) {
+            res->reused++;
+            continue;
+        }
+        BackupRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.magic = BACKUP_RECORD_MAGIC;
+        rec.ino = node->ino;
+        rec.change = node->di.change;
+        rec.size = node->di.size;
+        rec.session = hdr.sessions;
+        rec.csum = record_crc(&rec);
+        u32 lba = stream_sector(&w);
+        put(&w, &rec, sizeof(rec));
+        u32 crc = put_file(&w, node);
+        put_pad(&w, SECTOR_SIZE);
+        err = w.err;
+        if (err != WEXFS_OK) break;
+        ref->lba = lba;
+        ref->change = rec.change;
+        ref->crc = crc;
+        res->files++;
+        res->bytes += rec.size;
+        if (stream_sector(&w) - hdr.pending_end >= BACKUP_CHECKPOINT) {
+            err = put_flush(&w);
+            hdr.pending_end = w.lba;
+            if (err == WEXFS_OK) err = header_write(dev, &hdr);
+            headers++;
+        }
+    }
+
+    // The catalog: every object as it is now
+    u32 catalog = stream_sector(&w);
+    u32 entries = 0;
+    w.crc = 0;
+    for (FSNode* node = root; node && err == WEXFS_OK; node = walk_next(node)) {
+        BackupEntry e;
+        memset(&e, 0, sizeof(e));
+        int len = node == root ? 0 : wexfs_path(node, path, MAX_PATH);
+        if (len < 0) {
+            err = len;
+            break;
+        }
+        e.ino = node->ino;
+        e.change = node->di.change;
+        e.mode = node->is_dir ? WEXFS_DIR : WEXFS_FILE;
+        e.flags = node->di.flags & (WEXFS_INODE_COMPRESS | WEXFS_INODE_LOG);
+        e.log_max = node->di.log_max;
+        e.log_keep = node->di.log_keep;
+        e.path_len = len;
+        if (!node->is_dir && node->di.size) {
+            e.size = node->di.size;
+            e.lba = refs[node->ino].lba;
+            e.crc = refs[node->ino].crc;
+        }
+        put(&w, &e, sizeof(e));
+        put(&w, path, len);
+        put_pad(&w, 4);
+        err = w.err;
+        entries++;
+    }
+    if (err == WEXFS_OK) {
+        u32 crc = w.crc;
+        put_pad(&w, SECTOR_SIZE);
+        err = put_flush(&w);
+        hdr.sessions++;
+        hdr.change = change;
+        hdr.catalog_lba = catalog;
+        hdr.catalog_sectors = w.lba - catalog;
+        hdr.catalog_entries = entries;
+        hdr.catalog_crc = crc;
+        hdr.end = w.lba;
+        hdr.pending = 0;
+        hdr.pending_end = 0;
+        hdr.session_sectors = w.written + headers + 1;
+        hdr.session_files = res->files;
+    }
+    if (err == WEXFS_OK) {
+        err = header_write(dev, &hdr);
+        headers++;
+    }
+    if (err == WEXFS_OK) {
+        wexfs_backup_mark(change, change);
+        res->session = hdr.sessions;
+        res->objects = entries;
+    }
+    res->sectors = w.written + headers;
+    stream_close(&w);
+    kfree(path);
+    kfree(refs);
+    return err;
+}
+
+/* ---------- Restore ---------- */
+
+/* The file's data from its record, checked against the catalog entry */
+static int restore_data(Stream* d, const BackupEntry* e, FSNode* node) {
+    d->lba = e->lba;
+    d->end = e->lba + record_sectors(e->size);
+    d->pos = d->len = 0;
+    d->err = WEXFS_OK;
+    BackupRecord rec;
+    if (get(d, &rec, sizeof(rec))) return d->err;
+    if (rec.magic != BACKUP_RECORD_MAGIC || rec.csum != record_crc(&rec) || rec.ino != e->ino ||
+        rec.change != e->change || rec.size != e->size) {
+        return WEXFS_EIO;
+    }
+    u32 crc = 0;
+    u32 off = 0;
+    while (off < e->size) {
+        if (d->pos == d->len && get_refill(d)) return d->err;
+        u32 n = d->len - d->pos;
+        if (n > e->size - off) n = e->size - off;
+        crc = crc32c(crc, d->buf + d->pos, n);
+        int done = wexfs_write(node, off, d->buf + d->pos, n);
+        if (done != (int)n) return done < 0 ? done : WEXFS_ENOSPC;
+        d->pos += n;
+        off += n;
+    }
+    return crc == e->crc ? WEXFS_OK : WEXFS_EIO;
+}
+
+int backup_restore(const BackupDev* dev, FSNode* base, BackupResult* res) {
+    memset(res, 0, sizeof(BackupResult));
+    BackupHeader hdr;
+    int err = backup_header(dev, &hdr);
+    if (err != WEXFS_OK) return err;
+    if (!hdr.sessions) return WEXFS_ENOENT;
+    if (hdr.catalog_lba + hdr.catalog_sectors > dev->sectors) return WEXFS_EIO;
+
+    if (!base || !base->is_dir) return WEXFS_ENOTDIR;
+
+    Stream c;
+    Stream d;
+    char* name = (char*)kmalloc(MAX_PATH);
+    err = stream_open(&c, dev, hdr.catalog_lba, hdr.catalog_lba + hdr.catalog_sectors);
+    int derr = stream_open(&d, dev, 0, 0);
+    if (err == WEXFS_OK) err = derr;
+    if (err == WEXFS_OK && !name) err = WEXFS_ENOMEM;
+
+    // Nothing is made from a catalog that fails its checksum
+    for (u32 i = 0; i < hdr.catalog_entries && err == WEXFS_OK; i++) {
+        BackupEntry e;
+        err = get(&c, &e, sizeof(e));
+        if (err == WEXFS_OK && e.path_len >= MAX_PATH) err = WEXFS_EIO;
+        if (err == WEXFS_OK) err = get(&c, NULL, BACKUP_ENTRY_SIZE(e.path_len) - sizeof(e));
+    }
+    if (err == WEXFS_OK && c.crc != hdr.catalog_crc) err = WEXFS_EIO;
+    c.lba = hdr.catalog_lba;
+    c.pos = c.len = 0;
+
+    int first = WEXFS_OK;
+    for (u32 i = 0; i < hdr.catalog_entries && err == WEXFS_OK; i++) {
+        BackupEntry e;
+        err = get(&c, &e, sizeof(e));
+        if (err == WEXFS_OK) err = get(&c, name, e.path_len);
+        if (err == WEXFS_OK) err = get(&c, NULL, BACKUP_ENTRY_SIZE(e.path_len) - sizeof(e) - e.path_len);
+        if (err != WEXFS_OK) break;
+        name[e.path_len] = '\0';
+
+        int rc = WEXFS_OK;
+        FSNode* node = e.path_len ? wexfs_create_path(base, name, e.mode == WEXFS_DIR ? WEXFS_DIR : WEXFS_FILE, &rc)
+                                  : base;
+        if (node && ((node->di.flags ^ e.flags) & WEXFS_INODE_COMPRESS)) {
+            rc = wexfs_set_compress(node, e.flags & WEXFS_INODE_COMPRESS);
+        }
+        if (node && !node->is_dir && rc == WEXFS_OK) {
+            // Compression is set first so the data is stored as it was
+            rc = wexfs_truncate(node, 0);
+            if (rc == WEXFS_OK && e.size) rc = restore_data(&d, &e, node);
+            if (rc == WEXFS_OK) res->bytes += e.size;
+            else wexfs_truncate(node, 0);
+            if (rc == WEXFS_OK && (e.flags & WEXFS_INODE_LOG)) rc = wexfs_set_log(node, e.log_max, e.log_keep);
+        }
+        if (!node || rc != WEXFS_OK) {
+            if (first == WEXFS_OK) first = rc != WEXFS_OK ? rc : WEXFS_EIO;
+            res->failed++;
+            continue;
+        }
+        res->objects++;
+        if (!node->is_dir && e.size) res->files++;
+    }
+    stream_close(&c);
+    stream_close(&d);
+    kfree(name);
+    res->session = hdr.sessions;
+    return err != WEXFS_OK ? err : first;
+}
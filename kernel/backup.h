@@ -0,0 +1,118 @@
+#ifndef WEXOS_BACKUP_H
+#define WEXOS_BACKUP_H
+
+#include "wexfs.h"
+
+/*
+ * Incremental backup of a WexFS volume to a second device, in the core
+ * library so recovery can restore from it. The target is written front
+ * to back in BACKUP_RUN-sector commands:
+ *
+ *   sector 0        BackupHeader, rewritten to commit a session
+ *   records         one per file copied: a BackupRecord, the data right
+ *                   after it, padded to a whole sector
+ *   catalog         after each session's records: a BackupEntry for every
+ *                   object on the volume, parents first, pointing at the
+ *                   record that holds its data in this or an earlier
+ *                   session
+ *
+ * A session copies only the files whose change number (wexfs.h) differs
+ * from the one in the previous catalog; deletes and renames need nothing
+ * more, as the new catalog simply lists the tree as it is. The header is
+ * only rewritten between flushes: about every BACKUP_CHECKPOINT sectors
+ * to remember how far the records reached, and once at the end. A
+ * session that is cut short is resumed from the last checkpoint by the
+ * next backup, as long as the volume has not been backed up elsewhere.
+ */
+#define BACKUP_MAGIC 0x4B414257         /* "WBAK" */
+#define BACKUP_VERSION 1
+#define BACKUP_RECORD_MAGIC 0x43455242  /* "BREC" */
+#define BACKUP_RUN 256                  /* sectors per write, 128 KB */
+#define BACKUP_CHECKPOINT 2048          /* sectors between header checkpoints */
+
+/* Where the backup goes: the second disk in the kernel, a memory or file
+ * image on the host. read and write move `count` <= BACKUP_RUN sectors
+ * and return 0 or -1; flush makes what was written durable. */
+typedef struct {
+    u32 sectors;
+    int (*read)(u32 lba, u32 count, u8* buffer);
+    int (*write)(u32 lba, u32 count, const u8* buffer);
+    int (*flush)(void);
+} BackupDev;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 sessions;           /* committed */
+    u32 change;             /* volume counter the last session covers */
+    u32 catalog_lba;        /* of the last session */
+    u32 catalog_sectors;
+    u32 catalog_entries;
+    u32 catalog_crc;        /* CRC32C of the catalog bytes */
+    u32 end;                /* first sector after the last session */
+    u32 pending;            /* 1: a session started at `end` is unfinished */
+    u32 pending_change;     /* volume counter when it started */
+    u32 pending_end;        /* its records reach here, all flushed */
+    u32 session_sectors;    /* written by the last session */
+    u32 session_files;      /* files it copied */
+    u32 volume_id;          /* of the volume backed up (wexfs_volume_id) */
+    u32 reserved[112];
+    u32 csum;               /* CRC32C of the header with this field zero */
+} BackupHeader;             /* exactly one sector */
+
+typedef struct {
+    u32 magic;              /* BACKUP_RECORD_MAGIC */
+    u32 ino;
+    u32 change;
+    u32 size;
+    u32 session;            /* sessions count when it was written */
+    u32 reserved[2];
+    u32 csum;               /* CRC32C of the record header with this field zero */
+} BackupRecord;             /* the data follows directly */
+
+typedef struct {
+    u32 ino;
+    u32 change;
+    u32 size;
+    u32 lba;                /* its BackupRecord; 0 for directories and empty files */
+    u32 crc;                /* CRC32C of the data */
+    u16 mode;               /* WEXFS_FILE or WEXFS_DIR */
+    u16 flags;              /* WEXFS_INODE_COMPRESS and WEXFS_INODE_LOG */
+    u32 log_max;
+    u32 log_keep;
+    u32 path_len;           /* the path follows, padded to 4 bytes */
+} BackupEntry;
+
+#define BACKUP_ENTRY_SIZE(len) ((sizeof(BackupEntry) + (len) + 3) & ~3u)
+
+/* Backup options */
+#define BACKUP_FULL 0x0001      /* start the target over */
+
+typedef struct {
+    u32 session;            /* number of the session written or restored */
+    u32 objects;            /* in its catalog */
+    u32 files;              /* copied this time */
+    u32 reused;             /* found unchanged in an earlier session */
+    u32 sectors;            /* written to the target, header included */
+    unsigned long long bytes;   /* file data written or restored */
+    u32 failed;             /* restore: objects that could not be made */
+    int full;               /* the target was started over */
+    int resumed;            /* an unfinished session was continued */
+} BackupResult;
+
+/* Back up the mounted volume. Without BACKUP_FULL, a target that holds
+ * the last backup of this volume gets an incremental session and anything
+ * else is started over. */
+int backup_run(const BackupDev* dev, u32 flags, BackupResult* res);
+
+/* Recreate the last session's tree under the directory `base`,
+ * overwriting files that are already there; callers resolve the path the
+ * user gave. Objects that cannot be made or whose record fails its checks
+ * are counted in res->failed and skipped; the first error is returned. */
+int backup_restore(const BackupDev* dev, FSNode* base, BackupResult* res);
+
+/* Read and check the header: WEXFS_OK, WEXFS_ENOENT for a target that
+ * holds no backup */
+int backup_header(const BackupDev* dev, BackupHeader* hdr);
+
+#endif
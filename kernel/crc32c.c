@@ -0,0 +1,80 @@
+/* CRC32C for WexFS block and inode checksums */
+#include "crc32c.h"
+
+typedef unsigned int u32;
+typedef unsigned char u8;
+
+typedef u32 __attribute__((may_alias, aligned(1))) crc_u32;
+
+#define CRC32C_POLY 0x82F63B78u         /* reflected Castagnoli polynomial */
+
+static u32 crc_table[8][256];
+static int crc_ready = 0;
+static int crc_hw = 0;
+
+static void crc32c_init(void) {
+    for (u32 i = 0; i < 256; i++) {
+        u32 c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+        crc_table[0][i] = c;
+    }
+    // Table k advances a byte that is followed by k more bytes
+    for (u32 i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            u32 c = crc_table[k - 1][i];
+            crc_table[k][i] = (c >> 8) ^ crc_table[0][c & 0xFF];
+        }
+    }
+
+    // CPUID.01H:ECX bit 20 = SSE4.2
+    u32 a = 1, b, c, d;
+    __asm__ volatile("cpuid" : "+a"(a), "=b"(b), "=c"(c), "=d"(d));
+    crc_hw = (c >> 20) & 1;
+    crc_ready = 1;
+}
+
+int crc32c_hw_available(void) {
+    if (!crc_ready) crc32c_init();
+    return crc_hw;
+}
+
+u32 crc32c_sw(u32 crc, const void* data, u32 len) {
+    if (!crc_ready) crc32c_init();
+    const u8* p = (const u8*)data;
+    crc = ~crc;
+
+    // Eight bytes per step: one lookup per byte, no serial dependency
+    // between the lookups of a step.
+    while (len >= 8) {
+        u32 lo = *(const crc_u32*)p ^ crc;
+        u32 hi = *(const crc_u32*)(p + 4);
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+static u32 crc32c_hw(u32 crc, const u8* p, u32 len) {
+    crc = ~crc;
+    while (len >= 4) {
+        __asm__("crc32l %1, %0" : "+r"(crc) : "rm"(*(const crc_u32*)p));
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(*p));
+        p++;
+    }
+    return ~crc;
+}
+
+u32 crc32c(u32 crc, const void* data, u32 len) {
+    if (!crc_ready) crc32c_init();
+    if (crc_hw) return crc32c_hw(crc, (const u8*)data, len);
+    return crc32c_sw(crc, data, len);
+}
@@ -0,0 +1,14 @@
+#ifndef WEXOS_CRC32C_H
+#define WEXOS_CRC32C_H
+
+/* CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when CPUID
+ * reports it, a slicing-by-8 table otherwise. Pass 0 as the initial crc;
+ * chained calls continue a running checksum. */
+unsigned int crc32c(unsigned int crc, const void* data, unsigned int len);
+
+/* Table-driven path only, for comparison */
+unsigned int crc32c_sw(unsigned int crc, const void* data, unsigned int len);
+
+int crc32c_hw_available(void);
+
+#endif
@@ -0,0 +1,194 @@
+#include "heap.h"
+
+#define NULL ((void*)0)
+
+/* Block layout: [u32 header][payload ...][u32 footer]
+ * header == footer == block size | used bit. Free blocks keep
+ * next/prev free-list pointers at the start of the payload. */
+#define HEAP_ALIGN 8
+#define HEAP_MIN_BLOCK ((2 * sizeof(void*) + 8 + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
+#define HEAP_BINS 24
+#define HEAP_USED 1u
+
+extern char _kernel_end[];
+
+static u32* heap_bins[HEAP_BINS];
+static u32 heap_used_bytes = 0;
+static u32 heap_free_bytes = 0;
+static int heap_ready = 0;
+
+#define BLK_SIZE(h)     (*(h) & ~7u)
+#define BLK_IS_USED(h)  (*(h) & HEAP_USED)
+#define BLK_FOOTER(h)   ((u32*)((char*)(h) + BLK_SIZE(h) - 4))
+#define BLK_NEXT(h)     ((u32*)((char*)(h) + BLK_SIZE(h)))
+#define BLK_PREV(h)     ((u32*)((char*)(h) - (*((h) - 1) & ~7u)))
+#define FREE_NEXT(h)    (((u32**)((h) + 1))[0])
+#define FREE_PREV(h)    (((u32**)((h) + 1))[1])
+
+static int heap_bin(u32 size) {
+    int bin = 0;
+    size >>= 4;
+    while (size > 1 && bin < HEAP_BINS - 1) {
+        size >>= 1;
+        bin++;
+    }
+    return bin;
+}
+
+static void heap_mark(u32* h, u32 size, u32 used) {
+    *h = size | used;
+    *(u32*)((char*)h + size - 4) = size | used;
+}
+
+static void heap_insert(u32* h) {
+    int bin = heap_bin(BLK_SIZE(h));
+    FREE_PREV(h) = NULL;
+    FREE_NEXT(h) = heap_bins[bin];
+    if (heap_bins[bin]) FREE_PREV(heap_bins[bin]) = h;
+    heap_bins[bin] = h;
+}
+
+static void heap_unlink(u32* h) {
+    int bin = heap_bin(BLK_SIZE(h));
+    if (FREE_PREV(h)) FREE_NEXT(FREE_PREV(h)) = FREE_NEXT(h);
+    else heap_bins[bin] = FREE_NEXT(h);
+    if (FREE_NEXT(h)) FREE_PREV(FREE_NEXT(h)) = FREE_PREV(h);
+}
+
+void heap_init(void* start, u32 size) {
+    unsigned long base = ((unsigned long)start + HEAP_ALIGN - 1) & ~(unsigned long)(HEAP_ALIGN - 1);
+    unsigned long end = ((unsigned long)start + size) & ~(unsigned long)(HEAP_ALIGN - 1);
+
+    for (int i = 0; i < HEAP_BINS; i++) heap_bins[i] = NULL;
+
+    // Prologue and epilogue are permanently "used" so that coalescing
+    // never walks off either end of the arena.
+    u32* prologue = (u32*)(base + 4);
+    *prologue = 8 | HEAP_USED;
+    *(prologue + 1) = 8 | HEAP_USED;
+
+    u32* first = prologue + 2;
+    u32 first_size = (u32)((end - 4) - (unsigned long)first);
+    first_size &= ~7u;
+    heap_mark(first, first_size, 0);
+
+    u32* epilogue = BLK_NEXT(first);
+    *epilogue = 0 | HEAP_USED;
+
+    heap_insert(first);
+    heap_used_bytes = 0;
+    heap_free_bytes = first_size;
+    heap_ready = 1;
+}
+
+static void heap_init_default(void) {
+    unsigned long start = (unsigned long)_kernel_end;
+    heap_init((void*)start, (u32)(HEAP_LIMIT - start));
+}
+
+void* kmalloc(u32 size) {
+    if (!heap_ready) heap_init_default();
+    if (size == 0) return NULL;
+
+    u32 asize = (size + 8 + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    if (asize < HEAP_MIN_BLOCK) asize = HEAP_MIN_BLOCK;
+
+    for (int bin = heap_bin(asize); bin < HEAP_BINS; bin++) {
+        for (u32* h = heap_bins[bin]; h; h = FREE_NEXT(h)) {
+            u32 bsize = BLK_SIZE(h);
+            if (bsize < asize) continue;
+
+            heap_unlink(h);
+            if (bsize - asize >= HEAP_MIN_BLOCK) {
+                heap_mark(h, asize, HEAP_USED);
+                u32* rest = BLK_NEXT(h);
+                heap_mark(rest, bsize - asize, 0);
+                heap_insert(rest);
+            } else {
+                heap_mark(h, bsize, HEAP_USED);
+            }
+            heap_used_bytes += BLK_SIZE(h);
+            heap_free_bytes -= BLK_SIZE(h);
+            return h + 1;
+        }
+    }
+    return NULL;
+}
+
+void* kcalloc(u32 count, u32 size) {
+    u32 total = count * size;
+    if (size && total / size != count) return NULL;
+    char* p = (char*)kmalloc(total);
+    if (p) {
+        for (u32 i = 0; i < total; i++) p[i] = 0;
+    }
+    return p;
+}
+
+void kfree(void* ptr) {
+    if (!ptr) return;
+    u32* h = (u32*)ptr - 1;
+    u32 size = BLK_SIZE(h);
+    heap_used_bytes -= size;
+    heap_free_bytes += size;
+
+    u32* next = BLK_NEXT(h);
+    if (!BLK_IS_USED(next)) {
+        heap_unlink(next);
+        size += BLK_SIZE(next);
+    }
+    if (!(*(h - 1) & HEAP_USED)) {
+        u32* prev = BLK_PREV(h);
+        heap_unlink(prev);
+        size += BLK_SIZE(prev);
+        h = prev;
+    }
+    heap_mark(h, size, 0);
+    heap_insert(h);
+}
+
+void* krealloc(void* ptr, u32 size) {
+    if (!ptr) return kmalloc(size);
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    u32* h = (u32*)ptr - 1;
+    u32 have = BLK_SIZE(h);
+    u32 asize = (size + 8 + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    if (asize <= have) return ptr;
+
+    // Grow in place when the neighbour is free and large enough.
+    u32* next = BLK_NEXT(h);
+    if (!BLK_IS_USED(next) && have + BLK_SIZE(next) >= asize) {
+        u32 total = have + BLK_SIZE(next);
+        heap_unlink(next);
+        heap_free_bytes -= BLK_SIZE(next);
+        heap_used_bytes -= have;
+        if (total - asize >= HEAP_MIN_BLOCK) {
+            heap_mark(h, asize, HEAP_USED);
+            u32* rest = BLK_NEXT(h);
+            heap_mark(rest, total - asize, 0);
+            heap_insert(rest);
+            heap_free_bytes += total - asize;
+        } else {
+            heap_mark(h, total, HEAP_USED);
+        }
+        heap_used_bytes += BLK_SIZE(h);
+        return ptr;
+    }
+
+    char* fresh = (char*)kmalloc(size);
+    if (!fresh) return NULL;
+    char* src = (char*)ptr;
+    for (u32 i = 0; i < have - 8; i++) fresh[i] = src[i];
+    kfree(ptr);
+    return fresh;
+}
+
+void heap_stats(u32* used, u32* free_bytes) {
+    if (!heap_ready) heap_init_default();
+    if (used) *used = heap_used_bytes;
+    if (free_bytes) *free_bytes = heap_free_bytes;
+}
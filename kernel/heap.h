@@ -0,0 +1,18 @@
+#ifndef WEXOS_HEAP_H
+#define WEXOS_HEAP_H
+
+typedef unsigned int u32;
+
+/* Kernel heap: from the end of the image (_kernel_end, boot/linker.ld)
+ * up to HEAP_LIMIT. Segregated explicit free lists with boundary tags,
+ * so kmalloc/kfree cost does not grow with the number of live blocks. */
+#define HEAP_LIMIT 0x02000000   /* 32 MB */
+
+void heap_init(void* start, u32 size);
+void* kmalloc(u32 size);
+void* kcalloc(u32 count, u32 size);
+void* krealloc(void* ptr, u32 size);
+void kfree(void* ptr);
+void heap_stats(u32* used, u32* free_bytes);
+
+#endif
@@ -0,0 +1,112 @@
+/* Initial RAM filesystem: cpio/tar archive from the boot loader onto tmpfs */
+#include "initramfs.h"
+#include "tmpfs.h"
+
+#define CPIO_HEADER 110
+#define TAR_BLOCK 512
+
+#define MODE_TYPE 0170000
+#define MODE_DIR  0040000
+#define MODE_FILE 0100000
+
+static int hex_field(const u8* p, u32* out) {
+    u32 v = 0;
+    for (int i = 0; i < 8; i++) {
+        u8 c = p[i];
+        if (c >= '0' && c <= '9') v = (v << 4) | (c - '0');
+        else if (c >= 'a' && c <= 'f') v = (v << 4) | (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v = (v << 4) | (c - 'A' + 10);
+        else return 0;
+    }
+    *out = v;
+    return 1;
+}
+
+/* Octal number, space or NUL terminated */
+static u32 octal_field(const u8* p, int len) {
+    u32 v = 0;
+    for (int i = 0; i < len && p[i] >= '0' && p[i] <= '7'; i++) v = (v << 3) | (p[i] - '0');
+    return v;
+}
+
+static int add(VfsMount* mnt, const char* path, int type, const u8* data, u32 size, InitramfsStats* st) {
+    int err = tmpfs_add(mnt, path, type, data, size);
+    if (err != WEXFS_OK) {
+        st->skipped++;
+        return err;
+    }
+    if (type == VFS_DIR) {
+        st->dirs++;
+    } else {
+        st->files++;
+        st->bytes += size;
+    }
+    return WEXFS_OK;
+}
+
+static int unpack_cpio(VfsMount* mnt, const u8* p, u32 size, InitramfsStats* st) {
+    u32 pos = 0;
+    while (pos + CPIO_HEADER <= size) {
+        const u8* h = p + pos;
+        if (h[0] != '0' || h[1] != '7' || h[2] != '0' || h[3] != '7' || h[4] != '0' ||
+            (h[5] != '1' && h[5] != '2')) return WEXFS_EINVAL;
+        u32 mode, filesize, namesize;
+        if (!hex_field(h + 14, &mode) || !hex_field(h + 54, &filesize) ||
+            !hex_field(h + 94, &namesize)) return WEXFS_EINVAL;
+        if (namesize == 0 || namesize > size - pos - CPIO_HEADER) return WEXFS_EINVAL;
+
+        const char* name = (const char*)h + CPIO_HEADER;
+        if (name[namesize - 1] != '\0') return WEXFS_EINVAL;
+        if (strcmp(name, "TRAILER!!!") == 0) return WEXFS_OK;
+
+        // Header and name, then the data, each padded to 4 bytes
+        u32 data = (pos + CPIO_HEADER + namesize + 3) & ~3u;
+        if (data > size || filesize > size - data) return WEXFS_EINVAL;
+
+        if ((mode & MODE_TYPE) == MODE_DIR) add(mnt, name, VFS_DIR, NULL, 0, st);
+        else if ((mode & MODE_TYPE) == MODE_FILE) add(mnt, name, VFS_FILE, p + data, filesize, st);
+        else st->skipped++;
+        pos = (data + filesize + 3) & ~3u;
+    }
+    // No trailer: the archive was cut short
+    return WEXFS_EINVAL;
+}
+
+static int unpack_tar(VfsMount* mnt, const u8* p, u32 size, InitramfsStats* st) {
+    char path[MAX_PATH];
+    u32 pos = 0;
+    while (pos + TAR_BLOCK <= size) {
+        const u8* h = p + pos;
+        if (h[0] == '\0') return WEXFS_OK;      // end-of-archive blocks
+        if (h[257] != 'u' || h[258] != 's' || h[259] != 't' || h[260] != 'a' || h[261] != 'r') {
+            return WEXFS_EINVAL;
+        }
+        u32 filesize = octal_field(h + 124, 12);
+        u32 data = pos + TAR_BLOCK;
+        if (filesize > size - data) return WEXFS_EINVAL;
+
+        // prefix "/" name, neither of them necessarily terminated
+        int len = 0;
+        for (int i = 0; i < 155 && h[345 + i]; i++) path[len++] = h[345 + i];
+        if (len) path[len++] = '/';
+        for (int i = 0; i < 100 && h[i]; i++) path[len++] = h[i];
+        path[len] = '\0';
+
+        u8 type = h[156];
+        if (type == '5') add(mnt, path, VFS_DIR, NULL, 0, st);
+        else if (type == '0' || type == '\0') add(mnt, path, VFS_FILE, p + data, filesize, st);
+        else st->skipped++;
+        pos = data + ((filesize + TAR_BLOCK - 1) & ~(TAR_BLOCK - 1));
+    }
+    return WEXFS_OK;
+}
+
+int initramfs_unpack(VfsMount* mnt, const void* image, u32 size, InitramfsStats* st) {
+    const u8* p = (const u8*)image;
+    memset(st, 0, sizeof(InitramfsStats));
+    if (size >= CPIO_HEADER && p[0] == '0' && p[1] == '7' && p[2] == '0' && p[3] == '7') {
+        return unpack_cpio(mnt, p, size, st);
+    }
+    if (size >= TAR_BLOCK) return unpack_tar(mnt, p, size, st);
+    return WEXFS_EINVAL;
+}
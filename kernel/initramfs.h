@@ -0,0 +1,23 @@
+#ifndef WEXOS_INITRAMFS_H
+#define WEXOS_INITRAMFS_H
+
+#include "vfs.h"
+
+/*
+ * Initial RAM filesystem: an archive the boot loader hands over as a
+ * multiboot module, unpacked onto a tmpfs at boot. Both cpio "newc"
+ * (`find . | cpio -o -H newc`) and POSIX tar (`tar --format=ustar`)
+ * are read. Only directories and regular files are taken; links and
+ * devices are counted as skipped. File data is not copied: the tmpfs
+ * files point into the archive until they are first changed.
+ */
+typedef struct {
+    u32 files;
+    u32 dirs;
+    u32 skipped;
+    unsigned long long bytes;   /* file data, all of it still in the archive */
+} InitramfsStats;
+
+int initramfs_unpack(VfsMount* mnt, const void* image, u32 size, InitramfsStats* st);
+
+#endif
@@ -10,33 +10,19 @@ typedef unsigned char u8;
 #define MAX_PATH 1024
 #define SECTOR_SIZE 512
 #define FS_SECTOR_START 1
-#define MAX_FILES 64
 
-/* Структура файловой системы - ИДЕНТИЧНА ЯДРУ! */
-typedef struct { 
-    char name[MAX_PATH];        // 1024 байта
-    int is_dir; 
-    char content[4096];         // 4096 байт - как в ядре!
-    u32 next_sector;
-    u32 size;
-} FSNode;
+/* Структура файловой системы - общая с ядром! */
+#include "wexfs.h"
+#include "ata.h"
+#include "io.h"
+#include "klib.h"
+#include "heap.h"
 
 /* Function prototypes */
 void putchar(char ch);
-void fs_save_to_disk(void);  
 char keyboard_getchar();
-void memcpy(void* dst, void* src, int len);
-int strcmp(const char* a, const char* b);
-int strlen(const char* s);
-void strcpy(char* dst, const char* src);
-char* strcat(char* dest, const char* src);
-char* strchr(const char* s, int c);
-char* strstr(const char* haystack, const char* needle);
-char* strrchr(const char* s, int c);
-void memset(void* ptr, int value, int num);
 void prints(const char* s);
 void newline();
-void itoa(int value, char* str, int base);
 void clear_screen();
 void delay(int seconds);
 void fs_format(void);
@@ -48,38 +34,7 @@ enum { ROWS=25, COLS=80 };
 static unsigned int cursor_row=0, cursor_col=0;
 static unsigned char text_color=0x07;
 
-/* I/O ports */
-static inline void outb(unsigned short port, unsigned char val) {
-    __asm__ volatile("outb %0,%1" : : "a"(val), "Nd"(port));
-}
-static inline unsigned char inb(unsigned short port) {
-    unsigned char r;
-    __asm__ volatile("inb %1,%0" : "=a"(r) : "Nd"(port));
-    return r;
-}
-static inline u16 inw(unsigned short port) {
-    u16 r;
-    __asm__ volatile("inw %1,%0" : "=a"(r) : "Nd"(port));
-    return r;
-}
-static inline void outw(unsigned short port, u16 val) {
-    __asm__ volatile("outw %0,%1" : : "a"(val), "Nd"(port));
-}
-
-/* ATA Disk I/O */
-#define ATA_DATA 0x1F0
-#define ATA_SECTOR_COUNT 0x1F2
-#define ATA_LBA_LOW 0x1F3
-#define ATA_LBA_MID 0x1F4
-#define ATA_LBA_HIGH 0x1F5
-#define ATA_DEVICE 0x1F6
-#define ATA_STATUS 0x1F7
-#define ATA_CMD 0x1F7
-
-FSNode fs_cache[MAX_FILES];
-int fs_count = 0;
 char current_dir[MAX_PATH] = "/";
-int fs_dirty = 0;
 
 /* Multiboot header */
 typedef struct {
@@ -94,86 +49,6 @@ multiboot_header_t multiboot_header __attribute__((section(".multiboot"))) = {
     -(MULTIBOOT_MAGIC + MULTIBOOT_FLAGS)
 };
 
-/* String functions */
-void memcpy(void* dst, void* src, int len) {
-    char* d = (char*)dst;
-    char* s = (char*)src;
-    while (len--) *d++ = *s++;
-}
-
-int strcmp(const char* a, const char* b) {
-    while(*a && *b && *a == *b) { a++; b++; }
-    return (unsigned char)*a - (unsigned char)*b;
-}
-
-int strlen(const char* s) {
-    const char* p = s;
-    while(*p) p++;
-    return p - s;
-}
-
-void strcpy(char* dst, const char* src) {
-    while((*dst++ = *src++));
-}
-
-char* strcat(char* dest, const char* src) {
-    char* ptr = dest;
-    while(*ptr) ptr++;
-    while((*ptr++ = *src++));
-    return dest;
-}
-
-char* strchr(const char* s, int c) {
-    while(*s) {
-        if(*s == c) return (char*)s;
-        s++;
-    }
-    return NULL;
-}
-
-char* strstr(const char* haystack, const char* needle) {
-    if(!*needle) return (char*)haystack;
-    for(const char* p = haystack; *p; p++) {
-        const char* h = p, *n = needle;
-        while(*h && *n && *h == *n) { h++; n++; }
-        if(!*n) return (char*)p;
-    }
-    return NULL;
-}
-
-char* strrchr(const char* s, int c) {
-    const char* last = NULL;
-    while(*s) {
-        if(*s == c) last = s;
-        s++;
-    }
-    return (char*)last;
-}
-
-void memset(void* ptr, int value, int num) {
-    unsigned char* p = (unsigned char*)ptr;
-    for (int i = 0; i < num; i++) {
-        p[i] = (unsigned char)value;
-    }
-}
-
-void itoa(int value, char* str, int base) {
-    char* ptr = str, *ptr1 = str, tmp_char;
-    int tmp_value;
-    do {
-        tmp_value = value;
-        value /= base;
-        *ptr++ = "zyxwvutsrqponmlkjihgfedcba9876543210123456789abcdefghijklmnopqrstuvwxyz"[35 + (tmp_value - value * base)];
-    } while (value);
-    if (tmp_value < 0) *ptr++ = '-';
-    *ptr-- = '\0';
-    while(ptr1 < ptr) {
-        tmp_char = *ptr;
-        *ptr-- = *ptr1;
-        *ptr1++ = tmp_char;
-    }
-}
-
 /* VGA output */
 void clear_screen() {
     for(int r = 0; r < ROWS; r++)
@@ -232,280 +107,88 @@ void delay(int seconds) {
     for (volatile int i = 0; i < seconds * 10000000; i++);
 }
 
-/* ATA functions */
-void ata_wait_ready() {
-    while (inb(ATA_STATUS) & 0x80);
-}
-
-void ata_wait_drq() {
-    while (!(inb(ATA_STATUS) & 0x08));
-}
-
-void ata_read_sector(u32 lba, u8* buffer) {
-    outb(ATA_DEVICE, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_SECTOR_COUNT, 1);
-    outb(ATA_LBA_LOW, (u8)lba);
-    outb(ATA_LBA_MID, (u8)(lba >> 8));
-    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
-    outb(ATA_CMD, 0x20);
-
-    ata_wait_ready();
-    if (inb(ATA_STATUS) & 0x01) {
-        prints("ATA Read Error\n");
-        return;
-    }
-
-    ata_wait_drq();
-    for (int i = 0; i < SECTOR_SIZE / 2; i++) {
-        u16 data = inw(ATA_DATA);
-        buffer[i * 2] = (u8)data;
-        buffer[i * 2 + 1] = (u8)(data >> 8);
+/* Filesystem functions */
+/* Формат WexFS общий с ядром: kernel/wexfs.c */
+void fs_init() {
+    int err = wexfs_mount();
+    if (err != WEXFS_OK) {
+        prints("WexFS: mount failed: ");
+        prints(wexfs_strerror(err));
+        newline();
     }
+    strcpy(current_dir, "/");
 }
 
-void ata_write_sector(u32 lba, u8* buffer) {
-    outb(ATA_DEVICE, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_SECTOR_COUNT, 1);
-    outb(ATA_LBA_LOW, (u8)lba);
-    outb(ATA_LBA_MID, (u8)(lba >> 8));
-    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
-    outb(ATA_CMD, 0x30);
-
-    ata_wait_ready();
-    ata_wait_drq();
-
-    for (int i = 0; i < SECTOR_SIZE / 2; i++) {
-        u16 data = (buffer[i * 2 + 1] << 8) | buffer[i * 2];
-        outw(ATA_DATA, data);
-    }
-
-    ata_wait_ready();
-    if (inb(ATA_STATUS) & 0x01) {
-        prints("ATA Write Error\n");
-    }
+void fs_error(const char* message, const char* name) {
+    prints("Error: ");
+    prints(message);
+    prints(": ");
+    prints(name);
+    newline();
 }
 
-/* Filesystem functions */
-void fs_load_from_disk() {
-    u8 sector_buffer[SECTOR_SIZE];
-    u32 sector = FS_SECTOR_START;
-    fs_count = 0;
-    fs_dirty = 0;
-
-    #define SECTORS_PER_NODE 11
-
-    while (sector != 0 && fs_count < MAX_FILES) {
-        u8* node_data = (u8*)&fs_cache[fs_count];
-        
-        for (int j = 0; j < SECTORS_PER_NODE; j++) {
-            ata_read_sector(sector + j, sector_buffer);
-            int offset = j * SECTOR_SIZE;
-            if (offset < sizeof(FSNode)) {
-                memcpy(node_data + offset, sector_buffer, SECTOR_SIZE);
-            }
-        }
-        
-        sector = fs_cache[fs_count].next_sector;
-        fs_count++;
+/* Create `name` (may contain a path) relative to the current directory */
+FSNode* fs_create(const char* name, int type) {
+    if (strlen(name) >= MAX_PATH) {
+        fs_error("Path too long", name);
+        return NULL;
     }
 
-    if (fs_count == 0) {
-        strcpy(fs_cache[0].name, "/");
-        fs_cache[0].is_dir = 1;
-        fs_cache[0].content[0] = '\0';
-        fs_cache[0].next_sector = 0;
-        fs_cache[0].size = 0;
-        fs_count = 1;
-        fs_dirty = 1;
-        fs_save_to_disk();
-    }
-}
-
-void fs_save_to_disk() {
-    if (!fs_dirty) return;
-
-    u8 sector_buffer[SECTOR_SIZE];
-    u32 sector = FS_SECTOR_START;
-
-    #define SECTORS_PER_NODE 11
-
-    for (int i = 0; i < fs_count; i++) {
-        u8* node_data = (u8*)&fs_cache[i];
-        
-        for (int j = 0; j < SECTORS_PER_NODE; j++) {
-            int offset = j * SECTOR_SIZE;
-            if (offset < sizeof(FSNode)) {
-                memcpy(sector_buffer, node_data + offset, SECTOR_SIZE);
-            } else {
-                memset(sector_buffer, 0, SECTOR_SIZE);
-            }
-            ata_write_sector(sector + j, sector_buffer);
-        }
-        
-        sector = (i == fs_count - 1) ? 0 : FS_SECTOR_START + (i + 1) * SECTORS_PER_NODE;
-        if (i < fs_count - 1) {
-            fs_cache[i].next_sector = sector;
-        } else {
-            fs_cache[i].next_sector = 0;
-        }
+    char leaf[MAX_NAME];
+    FSNode* dir = wexfs_lookup_parent(wexfs_lookup(current_dir), name, leaf);
+    if (!dir) {
+        fs_error("Invalid path", name);
+        return NULL;
     }
 
-    fs_dirty = 0;
-}
-
-void fs_mark_dirty() {
-    fs_dirty = 1;
-}
-
-void fs_init() {
-    fs_load_from_disk();
-    strcpy(current_dir, "/");
+    int err;
+    FSNode* node = wexfs_create(dir, leaf, type, &err);
+    if (!node) fs_error(wexfs_strerror(err), name);
+    return node;
 }
 
 void fs_mkdir(const char* name) {
-    if (fs_count >= MAX_FILES) {
-        prints("Error: Maximum files reached\n");
-        return;
-    }
-
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, name);
-    } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
+    if (fs_create(name, WEXFS_DIR)) {
+        prints("Directory '");
+        prints(name);
+        prints("' created\n");
     }
-
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0) {
-            prints("Error: Name already exists: ");
-            prints(name);
-            newline();
-            return;
-        }
-    }
-
-    strcpy(fs_cache[fs_count].name, full_path);
-    fs_cache[fs_count].is_dir = 1;
-    fs_cache[fs_count].content[0] = '\0';
-    fs_cache[fs_count].next_sector = 0;
-    fs_cache[fs_count].size = 0;
-    fs_count++;
-    fs_mark_dirty();
-    fs_save_to_disk();
-    prints("Directory '");
-    prints(name);
-    prints("' created\n");
 }
 
 void fs_touch(const char* name) {
-    if (fs_count >= MAX_FILES) {
-        prints("Error: Maximum files reached\n");
-        return;
-    }
-
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, name);
-    } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
-    }
-
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0) {
-            prints("Error: Name already exists: ");
-            prints(name);
-            newline();
-            return;
-        }
+    if (fs_create(name, WEXFS_FILE)) {
+        prints("File '");
+        prints(name);
+        prints("' created\n");
     }
-
-    strcpy(fs_cache[fs_count].name, full_path);
-    fs_cache[fs_count].is_dir = 0;
-    fs_cache[fs_count].content[0] = '\0';
-    fs_cache[fs_count].next_sector = 0;
-    fs_cache[fs_count].size = 0;
-    fs_count++;
-    fs_mark_dirty();
-    fs_save_to_disk();
-    prints("File '");
-    prints(name);
-    prints("' created\n");
 }
 
 FSNode* fs_find_file(const char* name) {
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return NULL;
-        }
-        strcpy(full_path, name);
-    } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return NULL;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
+    if (strlen(name) >= MAX_PATH) {
+        fs_error("Path too long", name);
+        return NULL;
     }
 
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0 && !fs_cache[i].is_dir) {
-            return &fs_cache[i];
-        }
-    }
+    FSNode* node = wexfs_lookup_at(wexfs_lookup(current_dir), name);
+    if (node && !node->is_dir) return node;
     return NULL;
 }
 
 void fs_format(void) {
     prints("Formatting filesystem...\n");
     
-    // Сбрасываем файловую систему к начальному состоянию
-    fs_count = 1;
-    strcpy(fs_cache[0].name, "/");
-    fs_cache[0].is_dir = 1;
-    fs_cache[0].content[0] = '\0';
-    fs_cache[0].next_sector = 0;
-    fs_cache[0].size = 0;
+    int err = wexfs_format(0);
     
     // Сбрасываем текущую директорию
     strcpy(current_dir, "/");
     
-    // Помечаем как измененную и сохраняем
-    fs_mark_dirty();
-    fs_save_to_disk();
-    
-    prints("Filesystem formatted successfully.\n");
+    if (err == WEXFS_OK) {
+        prints("Filesystem formatted successfully.\n");
+    } else {
+        prints("Format failed: ");
+        prints(wexfs_strerror(err));
+        newline();
+    }
 }
 
 /* Keyboard input */
@@ -651,7 +334,6 @@ void install_wexos() {
     fs_mkdir("mnt/rootdisk");
     fs_mkdir("mnt/Z:");
     fs_mkdir("tmp");
-    fs_mkdir("tmp/null");
     fs_mkdir("dev");
     fs_mkdir("dev/usb");
     fs_mkdir("dev/usb3.0");
@@ -692,9 +374,7 @@ void install_wexos() {
     prints("Creating system configuration...\n");
     fs_touch("SystemRoot/config/autorun.cfg");
     FSNode* autorun_file = fs_find_file("SystemRoot/config/autorun.cfg");
-    if (autorun_file) {
-        strcpy(autorun_file->content, "desktop");
-        autorun_file->size = strlen("desktop");
+    if (autorun_file && wexfs_write_file(autorun_file, "desktop", strlen("desktop")) >= 0) {
         prints("Desktop autorun configured\n");
     }
 
@@ -703,10 +383,7 @@ void install_wexos() {
         fs_touch("SystemRoot/config/pass.cfg");
         FSNode* passfile = fs_find_file("SystemRoot/config/pass.cfg");
         if (passfile) {
-            strcpy(passfile->content, password);
-            passfile->size = strlen(password);
-            fs_mark_dirty();
-            fs_save_to_disk();
+            wexfs_write_file(passfile, password, strlen(password));
         }
     }
 
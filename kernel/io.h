@@ -0,0 +1,33 @@
+#ifndef WEXOS_IO_H
+#define WEXOS_IO_H
+
+/* x86 port I/O and the time stamp counter */
+static inline void outb(unsigned short port, unsigned char val) {
+    __asm__ volatile("outb %0,%1" : : "a"(val), "Nd"(port));
+}
+static inline unsigned char inb(unsigned short port) {
+    unsigned char r;
+    __asm__ volatile("inb %1,%0" : "=a"(r) : "Nd"(port));
+    return r;
+}
+static inline unsigned short inw(unsigned short port) {
+    unsigned short r;
+    __asm__ volatile("inw %1,%0" : "=a"(r) : "Nd"(port));
+    return r;
+}
+static inline void outw(unsigned short port, unsigned short val) {
+    __asm__ volatile("outw %0,%1" : : "a"(val), "Nd"(port));
+}
+/* `count` words from one port into memory, a single string instruction */
+static inline void insw(unsigned short port, void* buf, unsigned int count) {
+    __asm__ volatile("rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory");
+}
+
+/* Time stamp counter, for benchmarks and the I/O trace */
+static inline unsigned long long rdtsc(void) {
+    unsigned int lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+#endif
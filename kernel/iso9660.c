@@ -0,0 +1,760 @@
+/* ISO9660 with Joliet and Rock Ridge names, read-only */
+#include "iso9660.h"
+#include "heap.h"
+
+#define NAMES_PLAIN     0
+#define NAMES_JOLIET    1
+#define NAMES_ROCKRIDGE 2
+
+#define REC_DIR        0x02
+#define REC_MULTI      0x80     /* more extents of the same file follow */
+
+#define NODE_HASH 64
+
+IsoStats iso_stats;
+
+typedef struct IsoNode {
+    u32 ino;
+    u32 lba;
+    u32 size;
+    int type;
+    struct IsoNode* hash_next;
+} IsoNode;
+
+typedef struct {
+    char* name;
+    u32 ino;
+    u32 lba;
+    u32 size;
+    int type;
+} IsoEntry;
+
+typedef struct IsoDirCache {
+    u32 lba;
+    u32 count;
+    IsoEntry* entries;          /* sorted by name */
+    u32 used;                   /* LRU clock */
+} IsoDirCache;
+
+typedef struct {
+    u32 start;                  /* first sector, ISO_READAHEAD aligned */
+    u32 count;
+    u32 used;
+    u32 pins;                   /* live vfs_map views */
+    u8* data;
+    int valid;
+} IsoRun;
+
+typedef struct {
+    u32 id;
+    u32 blocks;                 /* volume size in sectors */
+    int names;                  /* NAMES_* */
+    u32 susp_skip;              /* Rock Ridge: bytes before each system use area */
+    IsoNode* root;
+    IsoNode* nodes[NODE_HASH];
+    IsoRun runs[ISO_CACHE_RUNS];
+    IsoDirCache dirs[ISO_DIR_CACHE];
+    u32 clock;
+} IsoVolume;
+
+typedef struct {
+    IsoVolume* vol;
+    IsoNode* node;
+    u32 offset;
+} IsoFile;
+
+typedef struct {
+    IsoVolume* vol;
+    IsoNode* dir;
+    u32 index;
+    char name[MAX_NAME];
+} IsoDir;
+
+static IsoFile iso_files[ISO_MAX_OPEN];
+static u32 iso_volumes = 0;
+
+static u32 le32(const u8* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+/* ---------- Sector cache ---------- */
+
+/* The cached sector, reading its whole run on a miss */
+static const u8* sector_get(IsoVolume* vol, u32 lba, int* err) {
+    if (lba >= vol->blocks) {
+        *err = WEXFS_EIO;
+        return NULL;
+    }
+    u32 start = lba & ~(ISO_READAHEAD - 1);
+    IsoRun* victim = NULL;
+    for (int i = 0; i < ISO_CACHE_RUNS; i++) {
+        IsoRun* r = &vol->runs[i];
+        if (r->valid && r->start == start) {
+            r->used = ++vol->clock;
+            iso_stats.hits++;
+            return r->data + (lba - start) * ISO_SECTOR_SIZE;
+        }
+        if (r->pins) continue;
+        if (!victim || !r->valid || (victim->valid && r->used < victim->used)) victim = r;
+    }
+    if (!victim) {
+        *err = WEXFS_ENOMEM;
+        return NULL;
+    }
+    if (!victim->data) victim->data = (u8*)kmalloc(ISO_READAHEAD * ISO_SECTOR_SIZE);
+    if (!victim->data) {
+        *err = WEXFS_ENOMEM;
+        return NULL;
+    }
+
+    u32 count = vol->blocks - start;
+    if (count > ISO_READAHEAD) count = ISO_READAHEAD;
+    victim->valid = 0;
+    iso_stats.reads++;
+    if (atapi_read(start, count, victim->data) != 0) {
+        // The run may cross a bad spot the wanted sector is not in
+        iso_stats.reads++;
+        if (atapi_read(lba, 1, victim->data + (lba - start) * ISO_SECTOR_SIZE) != 0) {
+            *err = WEXFS_EIO;
+            return NULL;
+        }
+        iso_stats.sectors++;
+        return victim->data + (lba - start) * ISO_SECTOR_SIZE;
+    }
+    iso_stats.sectors += count;
+    victim->start = start;
+    victim->count = count;
+    victim->used = ++vol->clock;
+    victim->valid = 1;
+    return victim->data + (lba - start) * ISO_SECTOR_SIZE;
+}
+
+/* ---------- Names ---------- */
+
+static int put_utf8(char* out, int len, u32 c) {
+    if (c < 0x80) {
+        if (len + 1 >= MAX_NAME) return len;
+        out[len++] = c;
+    } else if (c < 0x800) {
+        if (len + 2 >= MAX_NAME) return len;
+        out[len++] = 0xC0 | (c >> 6);
+        out[len++] = 0x80 | (c & 0x3F);
+    } else {
+        if (len + 3 >= MAX_NAME) return len;
+        out[len++] = 0xE0 | (c >> 12);
+        out[len++] = 0x80 | ((c >> 6) & 0x3F);
+        out[len++] = 0x80 | (c & 0x3F);
+    }
+    return len;
+}
+
+/* "NAME.EXT;1" -> "name.ext", "DIR" -> "dir" */
+static int plain_name(const u8* id, int n, char* out) {
+    int len = 0;
+    for (int i = 0; i < n && id[i] != ';' && len < MAX_NAME - 1; i++) {
+        u8 c = id[i];
+        out[len++] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+    }
+    if (len > 1 && out[len - 1] == '.') len--;
+    out[len] = '\0';
+    return len;
+}
+
+/* UCS-2 big endian, without the ";1" */
+static int joliet_name(const u8* id, int n, char* out) {
+    int len = 0;
+    for (int i = 0; i + 1 < n; i += 2) {
+        u32 c = (id[i] << 8) | id[i + 1];
+        if (c == ';') break;
+        len = put_utf8(out, len, c);
+    }
+    if (len > 1 && out[len - 1] == '.') len--;
+    out[len] = '\0';
+    return len;
+}
+
+typedef struct {
+    char name[MAX_NAME];
+    int name_len;               /* -1: no NM entry */
+    int relocated;              /* RE: shown through its CL link instead */
+    u32 child_link;             /* CL: the directory lives there */
+} RockRidge;
+
+/* Walk the SUSP entries of a record, following continuation areas */
+static void rock_ridge(IsoVolume* vol, const u8* su, int n, RockRidge* rr) {
+    rr->name_len = -1;
+    rr->relocated = 0;
+    rr->child_link = 0;
+    for (int hops = 0; hops < 4 && su; hops++) {
+        u32 ce_lba = 0, ce_off = 0, ce_len = 0;
+        int pos = 0;
+        while (pos + 4 <= n) {
+            const u8* e = su + pos;
+            int len = e[2];
+            if (len < 4 || pos + len > n) break;
+            if (e[0] == 'N' && e[1] == 'M' && len >= 5) {
+                // Flags: 1 = continued in the next NM, 2 = ".", 4 = ".."
+                if (rr->name_len < 0) rr->name_len = 0;
+                for (int i = 5; i < len && rr->name_len < MAX_NAME - 1; i++) {
+                    rr->name[rr->name_len++] = e[i];
+                }
+                rr->name[rr->name_len] = '\0';
+            } else if (e[0] == 'R' && e[1] == 'E') {
+                rr->relocated = 1;
+            } else if (e[0] == 'C' && e[1] == 'L' && len >= 12) {
+                rr->child_link = le32(e + 4);
+            } else if (e[0] == 'C' && e[1] == 'E' && len >= 28) {
+                ce_lba = le32(e + 4);
+                ce_off = le32(e + 12);
+                ce_len = le32(e + 20);
+            } else if (e[0] == 'S' && e[1] == 'T') {
+                break;
+            }
+            pos += len;
+        }
+        su = NULL;
+        if (ce_len && ce_off < ISO_SECTOR_SIZE) {
+            int err;
+            const u8* s = sector_get(vol, ce_lba, &err);
+            if (s) {
+                su = s + ce_off;
+                n = ce_len > ISO_SECTOR_SIZE - ce_off ? ISO_SECTOR_SIZE - ce_off : ce_len;
+            }
+        }
+    }
+}
+
+/* ---------- Directories ---------- */
+
+static int name_cmp(const char* a, const char* name, int len) {
+    for (int i = 0; i < len; i++) {
+        if (a[i] != name[i]) return (u8)a[i] - (u8)name[i];
+    }
+    return (u8)a[len];
+}
+
+static void dir_free(IsoDirCache* c) {
+    for (u32 i = 0; i < c->count; i++) kfree(c->entries[i].name);
+    kfree(c->entries);
+    c->entries = NULL;
+    c->count = 0;
+    c->lba = 0;
+}
+
+static void entries_sort(IsoEntry* e, u32 n) {
+    // Shell sort: directories are small and mostly in order already
+    for (u32 gap = n / 2; gap > 0; gap /= 2) {
+        for (u32 i = gap; i < n; i++) {
+            IsoEntry t = e[i];
+            u32 j = i;
+            while (j >= gap && name_cmp(e[j - gap].name, t.name, strlen(t.name)) > 0) {
+                e[j] = e[j - gap];
+                j -= gap;
+            }
+            e[j] = t;
+        }
+    }
+}
+
+/* Size of the directory whose "." record starts sector `lba` */
+static u32 dir_size_at(IsoVolume* vol, u32 lba) {
+    int err;
+    const u8* s = sector_get(vol, lba, &err);
+    return s && s[0] >= 34 ? le32(s + 10) : ISO_SECTOR_SIZE;
+}
+
+static int dir_parse(IsoVolume* vol, IsoNode* dir, IsoDirCache* c) {
+    u32 sectors = (dir->size + ISO_SECTOR_SIZE - 1) / ISO_SECTOR_SIZE;
+    u32 cap = 16;
+    IsoEntry* entries = (IsoEntry*)kmalloc(cap * sizeof(IsoEntry));
+    if (!entries) return WEXFS_ENOMEM;
+    u32 count = 0;
+    int err = WEXFS_OK;
+    char name[MAX_NAME];
+    RockRidge rr;
+    int skip = 0;               /* in the parts of a file left out */
+    iso_stats.dir_parses++;
+
+    for (u32 s = 0; s < sectors && err == WEXFS_OK; s++) {
+        const u8* sec = sector_get(vol, dir->lba + s, &err);
+        if (!sec) break;
+        // Records never cross a sector; a zero length pads to the next one
+        for (u32 off = 0; off + 33 < ISO_SECTOR_SIZE && sec[off]; off += sec[off]) {
+            const u8* r = sec + off;
+            u32 rlen = r[0];
+            int id_len = r[32];
+            if (rlen < 33 + (u32)id_len || off + rlen > ISO_SECTOR_SIZE) break;
+            if (id_len == 1 && (r[33] == 0 || r[33] == 1)) continue;
+
+            // The parts of a multi-extent file follow each other. Reads
+            // take the file as one run from its first sector, so a part
+            // that does not start where the last one ended on disk, or
+            // sizes past 4 GB, leave the whole file out.
+            if (skip) {
+                skip = (r[25] & REC_MULTI) != 0;
+                continue;
+            }
+            if (count && entries[count - 1].type == -REC_MULTI) {
+                IsoEntry* last = &entries[count - 1];
+                u32 part = le32(r + 10);
+                u32 next = last->lba + last->size / ISO_SECTOR_SIZE;
+                if (last->size % ISO_SECTOR_SIZE || le32(r + 2) + r[1] != next || part > 0xFFFFFFFF - last->size) {
+                    kfree(last->name);
+                    count--;
+                    skip = (r[25] & REC_MULTI) != 0;
+                    continue;
+                }
+                last->size += part;
+                if (!(r[25] & REC_MULTI)) last->type = VFS_FILE;
+                continue;
+            }
+
+            int type = (r[25] & REC_DIR) ? VFS_DIR : VFS_FILE;
+            u32 lba = le32(r + 2) + r[1];
+            u32 size = le32(r + 10);
+            int len = -1;
+            if (vol->names == NAMES_ROCKRIDGE) {
+                int su = 33 + id_len + !(id_len & 1) + vol->susp_skip;
+                rock_ridge(vol, r + su, (int)rlen - su, &rr);
+                // A sector the continuation area came from may have replaced this one
+                sec = sector_get(vol, dir->lba + s, &err);
+                if (!sec) break;
+                r = sec + off;
+                if (rr.relocated) continue;
+                if (rr.child_link) {
+                    type = VFS_DIR;
+                    lba = rr.child_link;
+                    size = dir_size_at(vol, lba);
+                    sec = sector_get(vol, dir->lba + s, &err);
+                    if (!sec) break;
+                    r = sec + off;
+                }
+                if (rr.name_len > 0) {
+                    memcpy(name, rr.name, rr.name_len + 1);
+                    len = rr.name_len;
+                }
+            }
+            if (len < 0) {
+                len = vol->names == NAMES_JOLIET ? joliet_name(r + 33, id_len, name)
+                                                 : plain_name(r + 33, id_len, name);
+            }
+            if (len == 0) continue;
+
+            if (count == cap) {
+                IsoEntry* grown = (IsoEntry*)krealloc(entries, cap * 2 * sizeof(IsoEntry));
+                if (!grown) {
+                    err = WEXFS_ENOMEM;
+                    break;
+                }
+                entries = grown;
+                cap *= 2;
+            }
+            IsoEntry* e = &entries[count];
+            e->name = (char*)kmalloc(len + 1);
+            if (!e->name) {
+                err = WEXFS_ENOMEM;
+                break;
+            }
+            memcpy(e->name, name, len + 1);
+            // Directories are known by their "." record, files by their own
+            e->ino = type == VFS_DIR ? lba * 64 : (dir->lba + s) * 64 + off / 32;
+            e->lba = lba;
+            e->size = size;
+            e->type = (type == VFS_FILE && (r[25] & REC_MULTI)) ? -REC_MULTI : type;
+            count++;
+        }
+    }
+    if (count && entries[count - 1].type == -REC_MULTI) entries[count - 1].type = VFS_FILE;
+
+    if (err != WEXFS_OK) {
+        c->entries = entries;
+        c->count = count;
+        dir_free(c);
+        return err;
+    }
+    entries_sort(entries, count);
+    c->lba = dir->lba;
+    c->count = count;
+    c->entries = entries;
+    return WEXFS_OK;
+}
+
+static IsoDirCache* dir_get(IsoVolume* vol, IsoNode* dir, int* err) {
+    IsoDirCache* victim = &vol->dirs[0];
+    for (int i = 0; i < ISO_DIR_CACHE; i++) {
+        IsoDirCache* c = &vol->dirs[i];
+        if (c->entries && c->lba == dir->lba) {
+            c->used = ++vol->clock;
+            return c;
+        }
+        if (!c->entries || (victim->entries && c->used < victim->used)) victim = c;
+    }
+    if (victim->entries) dir_free(victim);
+    *err = dir_parse(vol, dir, victim);
+    if (*err != WEXFS_OK) return NULL;
+    victim->used = ++vol->clock;
+    return victim;
+}
+
+/* The one node object for an inode number, kept until unmount so the
+ * VFS can hold on to it */
+static IsoNode* node_get(IsoVolume* vol, u32 ino, u32 lba, u32 size, int type) {
+    IsoNode** bucket = &vol->nodes[ino % NODE_HASH];
+    for (IsoNode* n = *bucket; n; n = n->hash_next) {
+        if (n->ino == ino) return n;
+    }
+    IsoNode* n = (IsoNode*)kmalloc(sizeof(IsoNode));
+    if (!n) return NULL;
+    n->ino = ino;
+    n->lba = lba;
+    n->size = size;
+    n->type = type;
+    n->hash_next = *bucket;
+    *bucket = n;
+    return n;
+}
+
+static void fill(IsoNode* node, VfsInode* out) {
+    out->ino = node->ino;
+    out->type = node->type;
+    out->size = node->size;
+    out->priv = node;
+}
+
+/* ---------- Volume ---------- */
+
+static void volume_free(IsoVolume* vol) {
+    for (int i = 0; i < ISO_DIR_CACHE; i++) {
+        if (vol->dirs[i].entries) dir_free(&vol->dirs[i]);
+    }
+    for (int i = 0; i < ISO_CACHE_RUNS; i++) kfree(vol->runs[i].data);
+    for (int i = 0; i < NODE_HASH; i++) {
+        while (vol->nodes[i]) {
+            IsoNode* n = vol->nodes[i];
+            vol->nodes[i] = n->hash_next;
+            kfree(n);
+        }
+    }
+    kfree(vol);
+}
+
+static int iso_mount(VfsMount* mnt, const char* source) {
+    IsoVolume* vol = (IsoVolume*)kcalloc(1, sizeof(IsoVolume));
+    if (!vol) return WEXFS_ENOMEM;
+    vol->blocks = 17;       // enough for the descriptors until the PVD says
+    int err = WEXFS_OK;
+    u32 root_lba = 0, root_size = 0, joliet_lba = 0, joliet_size = 0;
+
+    // Volume descriptors from sector 16 up to the terminator
+    for (u32 lba = 16; lba < 16 + 32 && err == WEXFS_OK; lba++) {
+        if (lba >= vol->blocks) vol->blocks = lba + 1;
+        const u8* d = sector_get(vol, lba, &err);
+        if (!d) break;
+        if (d[1] != 'C' || d[2] != 'D' || d[3] != '0' || d[4] != '0' || d[5] != '1') {
+            err = WEXFS_EINVAL;
+            break;
+        }
+        if (d[0] == 255) break;
+        if (d[0] == 1 && !root_lba) {
+            if (d[128] | (d[129] << 8)) {
+                if ((d[128] | (d[129] << 8)) != ISO_SECTOR_SIZE) err = WEXFS_EINVAL;
+            }
+            vol->blocks = le32(d + 80);
+            root_lba = le32(d + 156 + 2);
+            root_size = le32(d + 156 + 10);
+            // The cached runs were sized for the guess above
+            for (int i = 0; i < ISO_CACHE_RUNS; i++) vol->runs[i].valid = 0;
+        } else if (d[0] == 2 && d[88] == '%' && d[89] == '/' &&
+                   (d[90] == '@' || d[90] == 'C' || d[90] == 'E')) {
+            joliet_lba = le32(d + 156 + 2);
+            joliet_size = le32(d + 156 + 10);
+        }
+    }
+    if (err == WEXFS_OK && !root_lba) err = WEXFS_EINVAL;
+
+    if (err == WEXFS_OK) {
+        // Rock Ridge volumes start the root's "." system use area with SP
+        const u8* r = sector_get(vol, root_lba, &err);
+        if (r && r[0] >= 34 + 7 && r[34] == 'S' && r[35] == 'P' && r[38] == 0xBE && r[39] == 0xEF) {
+            vol->names = NAMES_ROCKRIDGE;
+            vol->susp_skip = r[40];
+        } else if (r && joliet_lba) {
+            vol->names = NAMES_JOLIET;
+            root_lba = joliet_lba;
+            root_size = joliet_size;
+        }
+    }
+    if (err == WEXFS_OK) {
+        vol->root = node_get(vol, root_lba * 64, root_lba, root_size, VFS_DIR);
+        if (!vol->root) err = WEXFS_ENOMEM;
+    }
+    if (err != WEXFS_OK) {
+        volume_free(vol);
+        return err;
+    }
+    vol->id = ++iso_volumes;
+    mnt->priv = vol;
+    mnt->flags |= VFS_MNT_RDONLY;
+    return WEXFS_OK;
+}
+
+static void iso_umount(VfsMount* mnt) {
+    volume_free((IsoVolume*)mnt->priv);
+    mnt->priv = NULL;
+}
+
+static int iso_root(VfsMount* mnt, VfsInode* out) {
+    fill(((IsoVolume*)mnt->priv)->root, out);
+    return WEXFS_OK;
+}
+
+static u32 iso_generation(VfsMount* mnt) {
+    return ((IsoVolume*)mnt->priv)->id;
+}
+
+static int iso_statfs(VfsMount* mnt, VfsStatfs* st) {
+    IsoVolume* vol = (IsoVolume*)mnt->priv;
+    st->total_bytes = (unsigned long long)vol->blocks * ISO_SECTOR_SIZE;
+    st->free_bytes = 0;
+    st->objects = 0;
+    return WEXFS_OK;
+}
+
+/* ---------- Names ---------- */
+
+/* Nothing on the media changes */
+static u32 iso_stamp(VfsInode* dir) {
+    return 1;
+}
+
+static int iso_lookup(VfsInode* in, const char* name, int len, VfsInode* out) {
+    IsoNode* dir = (IsoNode*)in->priv;
+    IsoVolume* vol = (IsoVolume*)in->mnt->priv;
+    if (dir->type != VFS_DIR) return WEXFS_ENOTDIR;
+    int err;
+    IsoDirCache* c = dir_get(vol, dir, &err);
+    if (!c) return err;
+
+    int lo = 0, hi = (int)c->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        IsoEntry* e = &c->entries[mid];
+        int cmp = name_cmp(e->name, name, len);
+        if (cmp == 0) {
+            IsoNode* node = node_get(vol, e->ino, e->lba, e->size, e->type);
+            if (!node) return WEXFS_ENOMEM;
+            fill(node, out);
+            return WEXFS_OK;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return WEXFS_ENOENT;
+}
+
+static int iso_create(VfsInode* dir, const char* name, int type, VfsInode* out) {
+    return VFS_EROFS;
+}
+
+static int iso_remove(VfsInode* node) {
+    return VFS_EROFS;
+}
+
+static int iso_rename(VfsInode* node, VfsInode* new_dir, const char* name) {
+    return VFS_EROFS;
+}
+
+static void stat_node(IsoNode* node, VfsStat* st) {
+    st->type = node->type;
+    st->ino = node->ino;
+    st->size = node->type == VFS_DIR ? 0 : node->size;
+    st->tree_bytes = st->size;
+    st->tree_files = node->type == VFS_DIR ? 0 : 1;
+    st->flags = 0;
+}
+
+static int iso_stat(VfsInode* node, VfsStat* st) {
+    stat_node((IsoNode*)node->priv, st);
+    return WEXFS_OK;
+}
+
+/* ---------- Files ---------- */
+
+static IsoFile* file_get(int fh) {
+    if (fh < 0 || fh >= ISO_MAX_OPEN || !iso_files[fh].node) return NULL;
+    return &iso_files[fh];
+}
+
+static int iso_open(VfsInode* in, u32 flags) {
+    IsoNode* node = (IsoNode*)in->priv;
+    if (flags & VFS_O_WRITE) return VFS_EROFS;
+    if (!(flags & VFS_O_READ)) return WEXFS_EINVAL;
+    if (node->type == VFS_DIR) return WEXFS_EISDIR;
+    for (int fh = 0; fh < ISO_MAX_OPEN; fh++) {
+        if (!iso_files[fh].node) {
+            iso_files[fh].vol = (IsoVolume*)in->mnt->priv;
+            iso_files[fh].node = node;
+            iso_files[fh].offset = 0;
+            return fh;
+        }
+    }
+    return WEXFS_ENOMEM;
+}
+
+static int iso_read(int fh, void* buf, u32 len) {
+    IsoFile* f = file_get(fh);
+    if (!f) return WEXFS_EBADF;
+    IsoNode* node = f->node;
+    if (f->offset >= node->size) return 0;
+    if (len > node->size - f->offset) len = node->size - f->offset;
+    u32 done = 0;
+    while (done < len) {
+        u32 pos = f->offset + done;
+        u32 in_sector = pos % ISO_SECTOR_SIZE;
+        u32 n = ISO_SECTOR_SIZE - in_sector;
+        if (n > len - done) n = len - done;
+        int err;
+        const u8* s = sector_get(f->vol, node->lba + pos / ISO_SECTOR_SIZE, &err);
+        if (!s) {
+            if (done) break;
+            return err;
+        }
+        memcpy((u8*)buf + done, (void*)(s + in_sector), n);
+        done += n;
+    }
+    f->offset += done;
+    return done;
+}
+
+static int iso_write(int fh, const void* buf, u32 len) {
+    return VFS_EROFS;
+}
+
+static int iso_seek(int fh, int offset, int whence) {
+    IsoFile* f = file_get(fh);
+    if (!f) return WEXFS_EBADF;
+    long long pos = offset;
+    if (whence == VFS_SEEK_CUR) pos += f->offset;
+    else if (whence == VFS_SEEK_END) pos += f->node->size;
+    else if (whence != VFS_SEEK_SET) return WEXFS_EINVAL;
+    if (pos < 0 || pos > 0x7FFFFFFF) return WEXFS_EINVAL;
+    f->offset = (u32)pos;
+    return (int)pos;
+}
+
+static int iso_truncate(int fh, u32 size) {
+    return VFS_EROFS;
+}
+
+static int iso_fstat(int fh, VfsStat* st) {
+    IsoFile* f = file_get(fh);
+    if (!f) return WEXFS_EBADF;
+    stat_node(f->node, st);
+    return WEXFS_OK;
+}
+
+static int iso_close(int fh) {
+    IsoFile* f = file_get(fh);
+    if (!f) return WEXFS_EBADF;
+    f->node = NULL;
+    return WEXFS_OK;
+}
+
+/* Straight out of the sector cache; the run stays put until unmapped */
+static int iso_map(int fh, u32 offset, u32 len, void** out) {
+    IsoFile* f = file_get(fh);
+    *out = NULL;
+    if (!f) return WEXFS_EBADF;
+    IsoNode* node = f->node;
+    if (offset >= node->size || len == 0) return 0;
+    u32 in_sector = offset % ISO_SECTOR_SIZE;
+    if (len > node->size - offset) len = node->size - offset;
+    if (len > ISO_SECTOR_SIZE - in_sector) len = ISO_SECTOR_SIZE - in_sector;
+    int err;
+    const u8* s = sector_get(f->vol, node->lba + offset / ISO_SECTOR_SIZE, &err);
+    if (!s) return err;
+    for (int i = 0; i < ISO_CACHE_RUNS; i++) {
+        IsoRun* r = &f->vol->runs[i];
+        if (r->data && s >= r->data && s < r->data + ISO_READAHEAD * ISO_SECTOR_SIZE) r->pins++;
+    }
+    *out = (void*)(s + in_sector);
+    return len;
+}
+
+static void iso_unmap(const void* ptr) {
+    const u8* p = (const u8*)ptr;
+    for (int fh = 0; fh < ISO_MAX_OPEN; fh++) {
+        IsoVolume* vol = iso_files[fh].node ? iso_files[fh].vol : NULL;
+        for (int i = 0; vol && i < ISO_CACHE_RUNS; i++) {
+            IsoRun* r = &vol->runs[i];
+            if (r->pins && p >= r->data && p < r->data + ISO_READAHEAD * ISO_SECTOR_SIZE) {
+                r->pins--;
+                return;
+            }
+        }
+    }
+}
+
+/* ---------- Directories ---------- */
+
+static int iso_opendir(VfsInode* in, VfsDir* d) {
+    IsoNode* dir = (IsoNode*)in->priv;
+    if (dir->type != VFS_DIR) return WEXFS_ENOTDIR;
+    IsoDir* it = (IsoDir*)kmalloc(sizeof(IsoDir));
+    if (!it) return WEXFS_ENOMEM;
+    it->vol = (IsoVolume*)in->mnt->priv;
+    it->dir = dir;
+    it->index = 0;
+    d->priv = it;
+    return WEXFS_OK;
+}
+
+/* The parsed table may be evicted between calls; it is parsed again in
+ * the same order */
+static int iso_readdir(VfsDir* d, VfsDirent* out) {
+    IsoDir* it = (IsoDir*)d->priv;
+    int err;
+    IsoDirCache* c = dir_get(it->vol, it->dir, &err);
+    if (!c || it->index >= c->count) return 0;
+    IsoEntry* e = &c->entries[it->index++];
+    strcpy(it->name, e->name);
+    out->name = it->name;
+    out->type = e->type;
+    out->ino = e->ino;
+    out->size = e->type == VFS_DIR ? 0 : e->size;
+    out->tree_bytes = out->size;
+    out->tree_files = e->type == VFS_DIR ? 0 : 1;
+    return 1;
+}
+
+static void iso_closedir(VfsDir* d) {
+    kfree(d->priv);
+    d->priv = NULL;
+}
+
+const VfsOps iso9660_vfs_ops = {
+    .name = "iso9660",
+    .mount = iso_mount,
+    .umount = iso_umount,
+    .root = iso_root,
+    .generation = iso_generation,
+    .statfs = iso_statfs,
+    .stamp = iso_stamp,
+    .lookup = iso_lookup,
+    .create = iso_create,
+    .remove = iso_remove,
+    .rename = iso_rename,
+    .stat = iso_stat,
+    .open = iso_open,
+    .read = iso_read,
+    .write = iso_write,
+    .seek = iso_seek,
+    .truncate = iso_truncate,
+    .fstat = iso_fstat,
+    .close = iso_close,
+    .map = iso_map,
+    .unmap = iso_unmap,
+    .opendir = iso_opendir,
+    .readdir = iso_readdir,
+    .closedir = iso_closedir,
+};
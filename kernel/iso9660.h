@@ -0,0 +1,40 @@
+#ifndef WEXOS_ISO9660_H
+#define WEXOS_ISO9660_H
+
+#include "vfs.h"
+
+/*
+ * ISO9660: read-only VFS driver for CD media, such as the boot CD.
+ * Names come from Rock Ridge when the volume has it. Otherwise they come
+ * from a Joliet supplementary descriptor, and failing that from the
+ * plain 8.3 names, lowercased and without their ";1" version. A file
+ * recorded in several extents is listed when they follow each other on
+ * disk, as mastering tools write them; any other is left out.
+ *
+ * Reads go through a small cache of ISO_READAHEAD-sector runs, so a
+ * sequential read costs one drive command per run. Directories are
+ * parsed once into sorted name tables, and the last ISO_DIR_CACHE of
+ * them are kept. Every mount is read-only, and the media must not be
+ * changed while it is mounted.
+ */
+#define ISO_SECTOR_SIZE 2048
+#define ISO_READAHEAD 16        /* sectors per drive command, power of two */
+#define ISO_CACHE_RUNS 8        /* cached runs of ISO_READAHEAD sectors */
+#define ISO_DIR_CACHE 16        /* parsed directories kept */
+#define ISO_MAX_OPEN 16
+
+typedef struct {
+    u32 reads;                  /* drive commands */
+    u32 sectors;                /* sectors they returned */
+    u32 hits;                   /* sector requests served from the cache */
+    u32 dir_parses;
+} IsoStats;
+
+extern IsoStats iso_stats;
+extern const VfsOps iso9660_vfs_ops;
+
+/* Provided by the ATA driver (ata.c): read `count` (<= ISO_READAHEAD)
+ * 2 KB sectors from the CD drive; 0 or a negative error */
+int atapi_read(u32 lba, u32 count, u8* buffer);
+
+#endif
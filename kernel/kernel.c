@@ -1,7 +1,9 @@
 #include <stdint.h>
 
 #define MULTIBOOT_MAGIC 0x1BADB002
-#define MULTIBOOT_FLAGS 0
+#define MULTIBOOT_FLAGS 0x3         /* page-aligned modules, memory info */
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+#define MULTIBOOT_INFO_MODS 0x8
 
 typedef unsigned int u32;
 typedef unsigned short u16;
@@ -12,7 +14,6 @@ typedef unsigned char u8;
 #define MAX_PATH 1024
 #define SECTOR_SIZE 512
 #define FS_SECTOR_START 1
-#define MAX_FILES 64
 #define MAX_HISTORY 10
 
 #define SCREEN_WIDTH 800
@@ -39,9 +40,28 @@ typedef unsigned char u8;
 #define MAX_VISIBLE_FILES (ROWS - 4)
 #define PATH_MAX_DISPLAY 70
 
-#define AUTORUN_FILE "SystemRoot/config/autorun.cfg"
+#define AUTORUN_FILE "/SystemRoot/config/autorun.cfg"
 #define AUTORUN_MAX_COMMAND 128
 
+/* Kernel log levels, compared against the configured log level */
+#define KLOG_FILE "/SystemRoot/logs/kernel.log"
+#define KLOG_ERROR 1
+#define KLOG_WARN  2            /* also boot and login notices */
+#define KLOG_DEBUG 3
+
+#include "wexfs.h"
+#include "ata.h"
+#include "io.h"
+#include "klib.h"
+#include "vfs.h"
+#include "tmpfs.h"
+#include "initramfs.h"
+#include "iso9660.h"
+#include "heap.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "search.h"
+#include "backup.h"
 
 typedef struct {
     char name[MAX_NAME];
@@ -53,23 +73,15 @@ typedef struct {
     int x, y;
     int width, height;
     char title[MAX_NAME];
-    FileEntry files[MAX_FILES];
+    FileEntry* files;       // kmalloc'd, grows with the directory
+    int file_capacity;
     int file_count;
     int selected_index;
     int scroll_offset;
     char current_path[MAX_PATH];
 } Explorer;
 
-typedef struct { 
-    char name[MAX_PATH];
-    int is_dir; 
-    char content[4096];  // Увеличил до 4096 байт
-    u32 next_sector;
-    u32 size;
-} FSNode;
-
 /* Function prototypes */
-void itoa(int value, char* str, int base);
 void coreview_command(void);
 void putchar(char ch);
 char keyboard_getchar();
@@ -89,37 +101,37 @@ void open_terminal();
 void show_loading_screen(void);
 void draw_wexos_logo(void);
 void draw_loading_animation(int frame, int progress);
-void memcpy(void* dst, void* src, int len);
-int strcmp(const char* a, const char* b);
-int strlen(const char* s);
-void strcpy(char* dst, const char* src);
-char* strchr(const char* s, int c);
-char* strstr(const char* haystack, const char* needle);
-char* strcat(char* dest, const char* src);
-char* strrchr(const char* s, int c);
 void prints(const char* s);
 void newline();
-void ata_read_sector(u32 lba, u8* buffer);
-void ata_write_sector(u32 lba, u8* buffer);
-void ata_wait_ready();
-void ata_wait_drq();
 void memory_command(void);
 void clear_screen();
-void fs_load_from_disk();
-void fs_save_to_disk();
-void fs_mark_dirty();
 void fs_init();
+void fs_mount_tmp();
+void fs_mount_cd();
+int fs_mount_initrd();
+void fs_sync_cwd();
 void fs_ls();
 void fs_mkdir(const char* name);
 void fs_touch(const char* name);
 void fs_rm(const char* name);
 void fs_cd(const char* name);
-FSNode* fs_find_file(const char* name);
 void fs_copy(const char* src_name, const char* dest_name);
+void fs_move(const char* src_name, const char* dest_name);
 void fs_size(const char* name);
 void fs_format(void);
-void fs_check_integrity(void);
-void fsck_command(void);
+int fs_check_integrity(u32 flags);
+void fsck_command(const char* arg);
+void fsck_tick(void);
+void defrag_command(const char* arg);
+void defrag_tick(void);
+void defrag_cancel(void);
+void snapshot_command(char* args);
+void backup_command(char* args);
+void restore_command(char* args);
+void klog(int level, const char* msg);
+void klog_flush(void);
+void klog_tick(void);
+void log_command(const char* arg);
 void fs_cat(const char* filename);
 void writer_command(const char* filename);
 void wexplorer_command(void);
@@ -139,6 +151,13 @@ void trim_whitespace(char* str);
 void matrix_game(void);
 void sphere_rand(void);
 int rand(void);
+void dedup_command(const char* arg);
+void compress_command(char* args);
+void split_args(char* args, char** arg1, char** arg2);
+void lzbench_command(const char* arg);
+void findbench_command(const char* arg);
+void grep_command(char* args);
+void crcbench_command(void);
 
 /* Command history */
 int history_count = 0;
@@ -161,629 +180,1329 @@ multiboot_header_t multiboot_header __attribute__((section(".multiboot"))) = {
     -(MULTIBOOT_MAGIC + MULTIBOOT_FLAGS)
 };
 
+/* What GRUB hands over (only the fields used here) */
+typedef struct {
+    u32 flags;
+    u32 mem_lower;
+    u32 mem_upper;
+    u32 boot_device;
+    u32 cmdline;
+    u32 mods_count;
+    u32 mods_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+typedef struct {
+    u32 mod_start;
+    u32 mod_end;
+    u32 string;
+    u32 reserved;
+} __attribute__((packed)) multiboot_module_t;
+
+u32 multiboot_magic = 0;        /* EAX and EBX as GRUB left them */
+u32 multiboot_info = 0;
+const u8* initrd_image = NULL;  /* first module: the initramfs archive */
+u32 initrd_size = 0;
+int initrd_ignored = 0;         /* 1: it was in the way of the heap */
+
+/* Entry point: keep the multiboot registers before any C code runs */
+__asm__(".text\n"
+        ".global _start\n"
+        "_start:\n"
+        "    movl %eax, multiboot_magic\n"
+        "    movl %ebx, multiboot_info\n"
+        "    jmp kernel_main\n");
+
 /* VGA text buffer */
 volatile unsigned short* VGA = (unsigned short*)0xB8000;
 enum { ROWS=25, COLS=80 };
 static unsigned int cursor_row=0, cursor_col=0;
 static unsigned char text_color=0x07;
 
-/* I/O ports */
-static inline void outb(unsigned short port, unsigned char val) {
-    __asm__ volatile("outb %0,%1" : : "a"(val), "Nd"(port));
-}
-static inline unsigned char inb(unsigned short port) {
-    unsigned char r;
-    __asm__ volatile("inb %1,%0" : "=a"(r) : "Nd"(port));
-    return r;
-}
-static inline u16 inw(unsigned short port) {
-    u16 r;
-    __asm__ volatile("inw %1,%0" : "=a"(r) : "Nd"(port));
-    return r;
-}
-static inline void outw(unsigned short port, u16 val) {
-    __asm__ volatile("outw %0,%1" : : "a"(val), "Nd"(port));
-}
-
-/* ATA Disk I/O */
-#define ATA_DATA 0x1F0
-#define ATA_SECTOR_COUNT 0x1F2
-#define ATA_LBA_LOW 0x1F3
-#define ATA_LBA_MID 0x1F4
-#define ATA_LBA_HIGH 0x1F5
-#define ATA_DEVICE 0x1F6
-#define ATA_STATUS 0x1F7
-#define ATA_CMD 0x1F7
-
-FSNode fs_cache[MAX_FILES];
-int fs_count = 0;
 char current_dir[MAX_PATH] = "/";
-int fs_dirty = 0;
+
+#define FS_LIVE_DISK "/mnt/rootdisk"
+#define IOTRACE_RECORDS 8192     /* disk commands kept from boot on, 24 bytes each */
+const char* fs_disk_root = "/";    /* where the system disk is mounted */
 
 /* Command history */
 char command_history[MAX_HISTORY][128];
 
-/* ATA functions */
-void ata_wait_ready() {
-    while (inb(ATA_STATUS) & 0x80);
+/* Filesystem functions */
+/* Объекты WexFS живут в kernel/wexfs.c, пространство имён - в kernel/vfs.c;
+ * здесь только команды shell */
+void fs_init() {
+    // I/O trace from the first disk command on, for iotrace
+    ata_trace_start((AtaTraceRecord*)kmalloc(IOTRACE_RECORDS * sizeof(AtaTraceRecord)), IOTRACE_RECORDS);
+    int err = wexfs_mount();
+    if (err != WEXFS_OK) {
+        prints("WexFS: mount failed: ");
+        prints(wexfs_strerror(err));
+        newline();
+        prints("WexFS: the disk was left as it is; restore it from recovery mode or run format\n");
+        klog(KLOG_ERROR, "WexFS mount failed");
+    } else {
+        klog(KLOG_WARN, "WexOS kernel started, WexFS mounted");
+    }
+
+    vfs_init();
+    vfs_register(&wexfs_vfs_ops);
+    vfs_register(&tmpfs_vfs_ops);
+    vfs_register(&iso9660_vfs_ops);
+    if (initrd_ignored) {
+        prints("initramfs: the boot module leaves no room for the heap, booting from the disk\n");
+        klog(KLOG_WARN, "initramfs ignored, no room for the heap");
+    }
+    if (!initrd_image || fs_mount_initrd() != WEXFS_OK) {
+        // Системный диск - корень VFS, даже если он ещё не отформатирован
+        vfs_mount("wexfs", "hd0", "/", 0);
+    }
+    fs_mount_tmp();
+    fs_mount_cd();
+    strcpy(current_dir, "/");
 }
 
-void ata_wait_drq() {
-    while (!(inb(ATA_STATUS) & 0x08));
+/* Live session: the root is a tmpfs filled from the initramfs the boot
+ * loader passed, and the system disk moves to /mnt/rootdisk. */
+int fs_mount_initrd() {
+    int err = vfs_mount("tmpfs", "size=8m", "/", 0);
+    if (err != WEXFS_OK) return err;
+    InitramfsStats st;
+    err = initramfs_unpack(vfs_mount_at(0), initrd_image, initrd_size, &st);
+
+    char num[16];
+    prints("initramfs: ");
+    itoa(st.files, num, 10);
+    prints(num);
+    prints(" files, ");
+    itoa(st.dirs, num, 10);
+    prints(num);
+    prints(" directories");
+    if (st.skipped) {
+        prints(", ");
+        itoa(st.skipped, num, 10);
+        prints(num);
+        prints(" skipped");
+    }
+    if (err != WEXFS_OK) prints(" (archive damaged, the rest is ignored)");
+    newline();
+    klog(KLOG_WARN, "Root filesystem unpacked from initramfs");
+
+    vfs_create("/mnt", VFS_DIR);
+    vfs_create(FS_LIVE_DISK, VFS_DIR);
+    if (vfs_mount("wexfs", "hd0", FS_LIVE_DISK, 0) == WEXFS_OK) fs_disk_root = FS_LIVE_DISK;
+    return WEXFS_OK;
 }
 
-void ata_read_sector(u32 lba, u8* buffer) {
-    outb(ATA_DEVICE, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_SECTOR_COUNT, 1);
-    outb(ATA_LBA_LOW, (u8)lba);
-    outb(ATA_LBA_MID, (u8)(lba >> 8));
-    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
-    outb(ATA_CMD, 0x20);
+/* /tmp lives in memory: scratch files never reach the disk and are gone
+ * after a restart. The directory under it is only the mount point. */
+void fs_mount_tmp() {
+    vfs_create("/tmp", VFS_DIR);    // EEXIST when it is already there
+    int err = vfs_mount("tmpfs", "size=4m", "/tmp", 0);
+    if (err != WEXFS_OK && err != VFS_EBUSY) klog(KLOG_WARN, "tmpfs: cannot mount /tmp");
+}
 
-    ata_wait_ready();
-    if (inb(ATA_STATUS) & 0x01) {
-        prints("ATA Read Error\n");
-        return;
+/* The CD drive, if there is one, shows up read-only at /dev/CDROM. No
+ * disc is not an error: it can be mounted later with the mount command. */
+void fs_mount_cd() {
+    if (!atapi_init()) return;
+    vfs_create("/dev", VFS_DIR);
+    vfs_create("/dev/CDROM", VFS_DIR);
+    if (vfs_mount("iso9660", "cd0", "/dev/CDROM", 0) == WEXFS_OK) {
+        klog(KLOG_WARN, "CD mounted at /dev/CDROM");
     }
+}
 
-    ata_wait_drq();
-    for (int i = 0; i < SECTOR_SIZE / 2; i++) {
-        u16 data = inw(ATA_DATA);
-        buffer[i * 2] = (u8)data;
-        buffer[i * 2 + 1] = (u8)(data >> 8);
+/* Shell copy of the VFS working directory, which falls back to the root
+ * if it was removed */
+void fs_sync_cwd() {
+    vfs_getcwd(current_dir, MAX_PATH);
+}
+
+void fs_error(const char* message, const char* name) {
+    prints("Error: ");
+    prints(message);
+    prints(": ");
+    prints(name);
+    newline();
+}
+
+/* Split a path into its directory ("." when there is none) and last name */
+void fs_split(const char* path, char* dir, char* leaf) {
+    int len = strlen(path);
+    if (len >= MAX_PATH) len = MAX_PATH - 1;
+    while (len > 1 && path[len - 1] == '/') len--;
+    int slash = len - 1;
+    while (slash >= 0 && path[slash] != '/') slash--;
+    int n = len - slash - 1;
+    if (n >= MAX_NAME) n = MAX_NAME - 1;
+    memcpy(leaf, (void*)(path + slash + 1), n);
+    leaf[n] = '\0';
+    if (slash < 0) {
+        strcpy(dir, ".");
+    } else if (slash == 0) {
+        strcpy(dir, "/");
+    } else {
+        memcpy(dir, (void*)path, slash);
+        dir[slash] = '\0';
     }
 }
 
-void ata_write_sector(u32 lba, u8* buffer) {
-    outb(ATA_DEVICE, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_SECTOR_COUNT, 1);
-    outb(ATA_LBA_LOW, (u8)lba);
-    outb(ATA_LBA_MID, (u8)(lba >> 8));
-    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
-    outb(ATA_CMD, 0x30);
+/* Is `path` `top` itself or something below it? Both absolute. */
+int path_within(const char* path, const char* top) {
+    int len = strlen(top);
+    for (int i = 0; i < len; i++) {
+        if (path[i] != top[i]) return 0;
+    }
+    return path[len] == '/' || path[len] == '\0';
+}
 
-    ata_wait_ready();
-    ata_wait_drq();
+/* ls - sorted, one screen at a time */
+void fs_ls() {
+    fs_sync_cwd();
+    prints("Contents of ");
+    prints(current_dir);
+    prints(":\n");
 
-    for (int i = 0; i < SECTOR_SIZE / 2; i++) {
-        u16 data = (buffer[i * 2 + 1] << 8) | buffer[i * 2];
-        outw(ATA_DATA, data);
+    VfsDir d;
+    int err = vfs_opendir(".", &d);
+    if (err != WEXFS_OK) {
+        fs_error(vfs_strerror(err), current_dir);
+        return;
     }
+    int lines = 1;
+    VfsDirent e;
+    while (vfs_readdir(&d, &e)) {
+        if (lines == ROWS - 2) {
+            // Страница заполнена: продолжаем с курсора после нажатия
+            prints("-- More -- (q to stop)");
+            char c = keyboard_getchar();
+            newline();
+            if (c == 'q' || c == 'Q') break;
+            lines = 0;
+        }
+        prints(e.name);
+        if (e.type == VFS_DIR) prints("/");
+        newline();
+        lines++;
+    }
+    vfs_closedir(&d);
+}
 
-    ata_wait_ready();
-    if (inb(ATA_STATUS) & 0x01) {
-        prints("ATA Write Error\n");
+/* Create `name` (may contain a path) relative to the current directory */
+int fs_create(const char* name, int type) {
+    int err = vfs_create(name, type);
+    if (err != WEXFS_OK) fs_error(vfs_strerror(err), name);
+    return err == WEXFS_OK;
+}
+
+void fs_mkdir(const char* name) {
+    if (fs_create(name, VFS_DIR)) {
+        prints("Directory '");
+        prints(name);
+        prints("' created\n");
     }
 }
 
-void memset(void* ptr, int value, int num) {
-    unsigned char* p = (unsigned char*)ptr;
-    for (int i = 0; i < num; i++) {
-        p[i] = (unsigned char)value;
+void fs_touch(const char* name) {
+    if (fs_create(name, VFS_FILE)) {
+        prints("File '");
+        prints(name);
+        prints("' created\n");
     }
 }
 
-/* Filesystem functions */
-void fs_load_from_disk() {
-    u8 sector_buffer[SECTOR_SIZE];
-    u32 sector = FS_SECTOR_START;
-    fs_count = 0;
-    fs_dirty = 0;
+void fs_rm(const char* name) {
+    int err = vfs_remove(name);
+    if (err == WEXFS_ENOENT) {
+        fs_error("File or directory not found", name);
+        return;
+    }
+    if (err != WEXFS_OK) {
+        fs_error(vfs_strerror(err), name);
+        return;
+    }
 
-    #define SECTORS_PER_NODE 11
+    prints("'");
+    prints(name);
+    prints("' removed\n");
+}
 
-    while (sector != 0 && fs_count < MAX_FILES) {
-        u8* node_data = (u8*)&fs_cache[fs_count];
-        
-        for (int j = 0; j < SECTORS_PER_NODE; j++) {
-            ata_read_sector(sector + j, sector_buffer);
-            int offset = j * SECTOR_SIZE;
-            if (offset < sizeof(FSNode)) {
-                memcpy(node_data + offset, sector_buffer, SECTOR_SIZE);
-            }
-        }
-        
-        sector = fs_cache[fs_count].next_sector;
-        fs_count++;
+void fs_cd(const char* name) {
+    int err = vfs_chdir(name);
+    if (err != WEXFS_OK) {
+        fs_error(err == WEXFS_ENAMETOOLONG ? "Path too long" : "Directory not found", name);
+        return;
     }
+    fs_sync_cwd();
+}
 
-    if (fs_count == 0) {
-        strcpy(fs_cache[0].name, "/");
-        fs_cache[0].is_dir = 1;
-        fs_cache[0].content[0] = '\0';
-        fs_cache[0].next_sector = 0;
-        fs_cache[0].size = 0;
-        fs_count = 1;
-        fs_dirty = 1;
-        fs_save_to_disk();
+/* Copy through the VFS, for files that cannot share blocks with the source */
+int fs_copy_data(const char* src_name, const char* dest_name) {
+    int in = vfs_open(src_name, VFS_O_READ);
+    if (in < 0) return in;
+    int out = vfs_open(dest_name, VFS_O_WRITE | VFS_O_CREATE | VFS_O_TRUNC);
+    u8* buf = (u8*)kmalloc(WEXFS_BLOCK_SIZE);
+    int err = out < 0 ? out : buf ? WEXFS_OK : WEXFS_ENOMEM;
+    while (err == WEXFS_OK) {
+        int got = vfs_read(in, buf, WEXFS_BLOCK_SIZE);
+        if (got <= 0) {
+            err = got;
+            break;
+        }
+        int done = vfs_write(out, buf, got);
+        if (done != got) err = done < 0 ? done : WEXFS_ENOSPC;
     }
+    kfree(buf);
+    vfs_close(out);
+    vfs_close(in);
+    return err;
 }
 
-void fs_save_to_disk() {
-    if (!fs_dirty) return;
-
-    u8 sector_buffer[SECTOR_SIZE];
-    u32 sector = FS_SECTOR_START;
+void fs_copy(const char* src_name, const char* dest_name) {
+    VfsStat st;
+    if (vfs_stat(src_name, &st) != WEXFS_OK || st.type != VFS_FILE) {
+        prints("Error: Source file not found: ");
+        prints(src_name);
+        newline();
+        return;
+    }
 
-    // Теперь структура FSNode занимает примерно 4096 + 1024 + 4 + 4 = 5128 байт
-    // 5128 / 512 = 10.01 → 11 секторов на узел
-    #define SECTORS_PER_NODE 11
+    char dir_path[MAX_PATH];
+    char leaf[MAX_NAME];
+    fs_split(dest_name, dir_path, leaf);
+    FSNode* src = vfs_wexfs_node(src_name);
+    FSNode* dir = src ? vfs_wexfs_node(dir_path) : NULL;
 
-    for (int i = 0; i < fs_count; i++) {
-        u8* node_data = (u8*)&fs_cache[i];
-        
-        for (int j = 0; j < SECTORS_PER_NODE; j++) {
-            int offset = j * SECTOR_SIZE;
-            if (offset < sizeof(FSNode)) {
-                memcpy(sector_buffer, node_data + offset, SECTOR_SIZE);
-            } else {
-                memset(sector_buffer, 0, SECTOR_SIZE);
-            }
-            ata_write_sector(sector + j, sector_buffer);
-        }
-        
-        sector = (i == fs_count - 1) ? 0 : FS_SECTOR_START + (i + 1) * SECTORS_PER_NODE;
-        if (i < fs_count - 1) {
-            fs_cache[i].next_sector = sector;
-        } else {
-            fs_cache[i].next_sector = 0;
-        }
+    // В пределах WexFS копия ссылается на те же блоки, данные копируются
+    // только при записи; между томами - обычное копирование
+    int err = WEXFS_OK;
+    if (dir) {
+        if (!wexfs_clone(src, dir, leaf, &err) && err == WEXFS_OK) err = WEXFS_EINVAL;
+    } else {
+        err = fs_copy_data(src_name, dest_name);
+    }
+    if (err != WEXFS_OK) {
+        fs_error(vfs_strerror(err), dest_name);
+        return;
     }
 
-    fs_dirty = 0;
+    prints("File copied to '");
+    prints(dest_name);
+    prints("'\n");
 }
 
-void fs_mark_dirty() {
-    fs_dirty = 1;
-}
+/* Move or rename; a directory destination receives the source by its own name */
+void fs_move(const char* src_name, const char* dest_name) {
+    char from[MAX_PATH];
+    char to[MAX_PATH];
+    int err = vfs_realpath(src_name, from, MAX_PATH);
+    if (err != WEXFS_OK) {
+        fs_error("File or directory not found", src_name);
+        return;
+    }
 
-void fs_init() {
-    fs_load_from_disk();
-    strcpy(current_dir, "/");
-}
+    VfsStat st;
+    if (strlen(dest_name) >= MAX_PATH - MAX_NAME) {
+        fs_error("Path too long", dest_name);
+        return;
+    }
+    strcpy(to, dest_name);
+    if (vfs_stat(dest_name, &st) == WEXFS_OK && st.type == VFS_DIR &&
+        (vfs_realpath(dest_name, to, MAX_PATH) != WEXFS_OK || strcmp(to, from) != 0)) {
+        char dir_path[MAX_PATH];
+        char leaf[MAX_NAME];
+        fs_split(from, dir_path, leaf);
+        strcpy(to, dest_name);
+        if (to[strlen(to) - 1] != '/') strcat(to, "/");
+        strcat(to, leaf);
+    } else {
+        strcpy(to, dest_name);
+    }
 
-void fs_ls() {
-    prints("Contents of ");
-    prints(current_dir);
-    prints(":\n");
+    // Текущий каталог хранится строкой, поэтому после переноса пересчитываем путь
+    char cwd[MAX_PATH];
+    vfs_getcwd(cwd, MAX_PATH);
+    err = vfs_rename(from, to);
+    if (err != WEXFS_OK) {
+        fs_error(vfs_strerror(err), dest_name);
+        return;
+    }
+    int len = strlen(from);
+    if (path_within(cwd, from) && vfs_realpath(to, from, MAX_PATH) == WEXFS_OK &&
+        strlen(from) + strlen(cwd + len) < MAX_PATH) {
+        strcat(from, cwd + len);
+        vfs_chdir(from);
+    }
+    fs_sync_cwd();
 
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(current_dir, "/") == 0) {
-            char* slash = strchr(fs_cache[i].name, '/');
-            if (slash == NULL || slash == fs_cache[i].name) {
-                prints(fs_cache[i].name);
-                if (fs_cache[i].is_dir) prints("/");
-                newline();
-            }
-        } else {
-            if (strstr(fs_cache[i].name, current_dir) == fs_cache[i].name) {
-                char* name_part = fs_cache[i].name + strlen(current_dir);
-                if (*name_part != '\0' && strchr(name_part, '/') == NULL) {
-                    prints(name_part);
-                    if (fs_cache[i].is_dir) prints("/");
-                    newline();
-                }
-            }
-        }
+    prints("'");
+    prints(src_name);
+    prints("' moved to '");
+    prints(dest_name);
+    prints("'\n");
+}
+
+/* Byte count for the size commands; itoa is signed, so 2 GB and up
+ * (clones can add up past the volume size) are shown in KB. */
+void print_bytes(unsigned long long bytes) {
+    char buf[16];
+    if (bytes >= 0x80000000ull) {
+        itoa((int)(bytes >> 10), buf, 10);
+        prints(buf);
+        prints(" KB");
+    } else {
+        itoa((int)bytes, buf, 10);
+        prints(buf);
+        prints(" Bytes");
     }
 }
 
-void fs_mkdir(const char* name) {
-    if (fs_count >= MAX_FILES) {
-        prints("Error: Maximum files reached\n");
+void fs_size(const char* name) {
+    VfsStat st;
+    if (vfs_stat(name, &st) != WEXFS_OK) {
+        prints("Error: File or folder not found: ");
+        prints(name);
+        newline();
         return;
     }
 
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, name);
+    if (st.type == VFS_DIR) {
+        // Totals are kept up to date by the filesystem, no walk needed
+        char count[12];
+        prints("Folder size: ");
+        print_bytes(st.tree_bytes);
+        prints(" in ");
+        itoa(st.tree_files, count, 10);
+        prints(count);
+        prints(st.tree_files == 1 ? " file\n" : " files\n");
     } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
+        prints("File size: ");
+        print_bytes(st.size);
+        newline();
+    }
+}
+
+/* mount [<type> <path> [source]] - list mounted volumes or mount one */
+void mount_command(char* args) {
+    char* type;
+    char* rest;
+    split_args(args, &type, &rest);
+    if (*type) {
+        char* path;
+        char* source;
+        if (!rest || !*rest) {
+            prints("Usage: mount [<type> <path> [source]]\n");
+            prints("       mount tmpfs <path> [size=<n>[k|m]]\n");
+            prints("       mount iso9660 <path>\n");
             return;
         }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
+        split_args(rest, &path, &source);
+        int err = vfs_mount(type, source ? source : "", path, 0);
+        if (err != WEXFS_OK) fs_error(vfs_strerror(err), path);
+        return;
     }
 
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0) {
-            prints("Error: Name already exists: ");
-            prints(name);
-            newline();
-            return;
+    VfsMount* m;
+    for (int i = 0; (m = vfs_mount_at(i)); i++) {
+        prints(m->path);
+        prints(" on ");
+        prints(m->source[0] ? m->source : "none");
+        prints(" type ");
+        prints(m->ops->name);
+        if (m->flags & VFS_MNT_RDONLY) prints(" (ro)");
+        VfsStatfs st;
+        if (m->ops->statfs(m, &st) == WEXFS_OK) {
+            prints(", ");
+            print_bytes(st.total_bytes - st.free_bytes);
+            prints(" of ");
+            print_bytes(st.total_bytes);
+            prints(" used");
         }
+        newline();
     }
 
-    strcpy(fs_cache[fs_count].name, full_path);
-    fs_cache[fs_count].is_dir = 1;
-    fs_cache[fs_count].content[0] = '\0';
-    fs_cache[fs_count].next_sector = 0;
-    fs_cache[fs_count].size = 0;
-    fs_count++;
-    fs_mark_dirty();
-    fs_save_to_disk();
-    prints("Directory '");
-    prints(name);
-    prints("' created\n");
+    char buf[12];
+    prints("Dentry cache: ");
+    itoa(vfs_stats.dentries, buf, 10);
+    prints(buf);
+    prints(" names, ");
+    itoa(vfs_stats.hits, buf, 10);
+    prints(buf);
+    prints(" hits (");
+    itoa(vfs_stats.negative_hits, buf, 10);
+    prints(buf);
+    prints(" negative), ");
+    itoa(vfs_stats.misses, buf, 10);
+    prints(buf);
+    prints(" misses\n");
+
+    if (iso_stats.reads) {
+        prints("CD cache: ");
+        itoa(iso_stats.hits, buf, 10);
+        prints(buf);
+        prints(" hits, ");
+        itoa(iso_stats.reads, buf, 10);
+        prints(buf);
+        prints(" reads of ");
+        itoa(iso_stats.sectors, buf, 10);
+        prints(buf);
+        prints(" sectors, ");
+        itoa(iso_stats.dir_parses, buf, 10);
+        prints(buf);
+        prints(" directories parsed\n");
+    }
 }
 
-void fs_touch(const char* name) {
-    if (fs_count >= MAX_FILES) {
-        prints("Error: Maximum files reached\n");
+void umount_command(const char* path) {
+    int err = vfs_umount(path);
+    if (err != WEXFS_OK) fs_error(err == WEXFS_EINVAL ? "Not a mount point" : vfs_strerror(err), path);
+}
+
+/* Depth-first walk below `top` over sorted directories, calling `visit`
+ * for every object with its absolute path; mounted volumes are walked
+ * like any other directory. The path grows and shrinks with the walk
+ * instead of being rebuilt for every object. */
+static void tree_walk(const char* top, void (*visit)(const VfsDirent* e, const char* path, void* ctx), void* ctx) {
+    int depth_max = 16;
+    int depth = 0;
+    VfsDir* stack = (VfsDir*)kmalloc(depth_max * sizeof(VfsDir));
+    int* mark = (int*)kmalloc(depth_max * sizeof(int));
+    char path[MAX_PATH];
+    if (!stack || !mark) {
+        kfree(stack);
+        kfree(mark);
+        prints("Error: Out of memory\n");
+        return;
+    }
+    if (vfs_realpath(top, path, MAX_PATH) != WEXFS_OK || vfs_opendir(path, &stack[0]) != WEXFS_OK) {
+        fs_error("Directory not found", top);
+        kfree(stack);
+        kfree(mark);
         return;
     }
+    mark[0] = strcmp(path, "/") == 0 ? 0 : strlen(path);
+    path[mark[0]] = '\0';
 
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return;
+    VfsDirent e;
+    while (depth >= 0) {
+        if (!vfs_readdir(&stack[depth], &e)) {
+            vfs_closedir(&stack[depth]);
+            depth--;
+            continue;
         }
-        strcpy(full_path, name);
-    } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return;
+        int len = mark[depth];
+        int name_len = strlen(e.name);
+        if (len + name_len + 2 > MAX_PATH) continue;
+        path[len] = '/';
+        strcpy(path + len + 1, e.name);
+        visit(&e, path, ctx);
+        if (e.type != VFS_DIR) continue;
+
+        if (depth + 1 == depth_max) {
+            VfsDir* grown = (VfsDir*)krealloc(stack, depth_max * 2 * sizeof(VfsDir));
+            int* grown_mark = grown ? (int*)krealloc(mark, depth_max * 2 * sizeof(int)) : NULL;
+            if (grown) stack = grown;
+            if (!grown_mark) continue;
+            mark = grown_mark;
+            depth_max *= 2;
         }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
+        if (vfs_opendir(path, &stack[depth + 1]) != WEXFS_OK) continue;
+        depth++;
+        mark[depth] = len + 1 + name_len;
     }
+    kfree(stack);
+    kfree(mark);
+}
 
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0) {
-            prints("Error: Name already exists: ");
-            prints(name);
-            newline();
-            return;
-        }
+/* Patterns with a '/' are matched against whole paths */
+static void find_path_visit(const VfsDirent* e, const char* path, void* ctx) {
+    if (strstr(path, (const char*)ctx) != NULL) {
+        prints(path);
+        if (e->type == VFS_DIR) prints("/");
+        newline();
     }
+}
 
-    strcpy(fs_cache[fs_count].name, full_path);
-    fs_cache[fs_count].is_dir = 0;
-    fs_cache[fs_count].content[0] = '\0';
-    fs_cache[fs_count].next_sector = 0;
-    fs_cache[fs_count].size = 0;
-    fs_count++;
-    fs_mark_dirty();
-    fs_save_to_disk();
-    prints("File '");
-    prints(name);
-    prints("' created\n");
+/* The name test of wexfs_find, for volumes without a name index */
+static void find_name_visit(const VfsDirent* e, const char* path, void* ctx) {
+    const char* pattern = (const char*)ctx;
+    int glob = strchr(pattern, '*') || strchr(pattern, '?');
+    if (glob ? wexfs_glob_match(pattern, e->name) : strstr(e->name, pattern) != NULL) {
+        prints(path);
+        if (e->type == VFS_DIR) prints("/");
+        newline();
+    }
 }
 
-void fs_rm(const char* name) {
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, name);
-    } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
+/* Is `path` hidden under a volume mounted on one of its parents? */
+static int fs_covered(const char* path) {
+    VfsMount* m;
+    for (int i = 0; (m = vfs_mount_at(i)); i++) {
+        if (m->covered && path_within(path, m->path)) return 1;
     }
+    return 0;
+}
 
-    int found = -1;
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0) {
-            found = i;
-            break;
+/* find <name|glob> - objects whose name contains the text or matches the
+ * glob (find *.cfg); looked up through the name index on the system
+ * disk, by walking other mounted volumes */
+void find_command(const char* pattern) {
+    prints("Searching for: ");
+    prints(pattern);
+    newline();
+
+    for (const char* p = pattern; *p; p++) {
+        if (*p == '/') {
+            tree_walk("/", find_path_visit, (void*)pattern);
+            return;
         }
     }
 
-    if (found == -1) {
-        prints("Error: File or directory not found: ");
-        prints(name);
-        newline();
+    FSNode** hits = (FSNode**)kmalloc(fs_count * sizeof(FSNode*));
+    if (!hits) {
+        prints("Error: Out of memory\n");
         return;
     }
+    int count = wexfs_find(pattern, 0, hits, fs_count);
+    char path[MAX_PATH];
+    path[0] = '/';
+    for (int i = 0; i < count; i++) {
+        if (wexfs_path(hits[i], path + 1, MAX_PATH - 1) < 0 || fs_covered(path)) continue;
+        prints(path);
+        if (hits[i]->is_dir) prints("/");
+        newline();
+    }
+    kfree(hits);
 
-    if (fs_cache[found].is_dir) {
-        char dir_path[MAX_PATH];
-        strcpy(dir_path, full_path);
-        if (strcmp(full_path, "/") != 0) {
-            if (strlen(dir_path) + 1 >= MAX_PATH) {
-                prints("Error: Directory path too long\n");
-                return;
-            }
-            strcat(dir_path, "/");
-        }
+    VfsMount* m;
+    for (int i = 0; (m = vfs_mount_at(i)); i++) {
+        if (m->covered) tree_walk(m->path, find_name_visit, (void*)pattern);
+    }
+}
 
-        for (int i = fs_count - 1; i >= 0; i--) {
-            if (i != found && strstr(fs_cache[i].name, dir_path) == fs_cache[i].name) {
-                for (int j = i; j < fs_count - 1; j++) {
-                    fs_cache[j] = fs_cache[j + 1];
-                }
-                fs_count--;
-            }
+/* grep [-r] [-i] [-c] <pattern> [path] - search file contents. Blocks are
+ * scanned in place through vfs_map; only a matching line is copied out
+ * to be printed. */
+#define GREP_MAX_PATTERN 64
+#define GREP_LINE_SHOW (COLS - 2)
+
+typedef struct {
+    Searcher s;
+    int count_only;
+    int show_names;
+    u32 lines;              /* matching lines in all files */
+    u32 files;              /* files with a match */
+} GrepState;
+
+/* Offset just past the end of the line holding `pos` */
+static u32 grep_line_end(int fd, u32 pos, u32 size) {
+    while (pos < size) {
+        const char* data;
+        int got = vfs_map(fd, pos, size - pos, (const void**)&data);
+        if (got <= 0) return size;
+        int at = search_byte(data, got, '\n');
+        vfs_unmap(fd, data);
+        if (at >= 0) return pos + at + 1;
+        pos += got;
+    }
+    return size;
+}
+
+static void grep_print_line(GrepState* g, int fd, const char* path, u32 hit, u32 end) {
+    char buf[GREP_LINE_SHOW + 1];
+
+    // Начало строки: последний перевод строки незадолго до совпадения
+    u32 back = hit < GREP_LINE_SHOW / 2 ? hit : GREP_LINE_SHOW / 2;
+    u32 start = hit - back;
+    vfs_seek(fd, start, VFS_SEEK_SET);
+    int got = vfs_read(fd, buf, back);
+    for (int i = got - 1; i >= 0; i--) {
+        if (buf[i] == '\n') {
+            start += i + 1;
+            break;
         }
     }
 
-    for (int i = found; i < fs_count - 1; i++) {
-        fs_cache[i] = fs_cache[i + 1];
+    u32 len = end - start;
+    if (len > GREP_LINE_SHOW) len = GREP_LINE_SHOW;
+    vfs_seek(fd, start, VFS_SEEK_SET);
+    got = vfs_read(fd, buf, len);
+    if (got < 0) got = 0;
+    while (got > 0 && (buf[got - 1] == '\n' || buf[got - 1] == '\r')) got--;
+    for (int i = 0; i < got; i++) {
+        if ((unsigned char)buf[i] < ' ' && buf[i] != '\t') buf[i] = '.';
     }
-    fs_count--;
-    fs_mark_dirty();
-    fs_save_to_disk();
+    buf[got] = '\0';
 
-    prints("'");
-    prints(name);
-    prints("' removed\n");
+    if (g->show_names) {
+        prints(path);
+        prints(":");
+    }
+    prints(buf);
+    newline();
 }
 
-void fs_cd(const char* name) {
-    if (strcmp(name, "..") == 0) {
-        if (strcmp(current_dir, "/") != 0) {
-            char* last_slash = strrchr(current_dir, '/');
-            if (last_slash != NULL) {
-                *last_slash = '\0';
-                if (current_dir[0] == '\0') {
-                    strcpy(current_dir, "/");
-                }
-            }
+static void grep_file(GrepState* g, const char* path) {
+    int fd = vfs_open(path, VFS_O_READ);
+    VfsStat st;
+    int err = fd < 0 ? fd : vfs_fstat(fd, &st);
+    if (err != WEXFS_OK) {
+        vfs_close(fd);
+        fs_error(vfs_strerror(err), path);
+        return;
+    }
+    u32 size = st.size;
+    u32 len = g->s.len;
+    u32 pos = 0;
+    u32 lines = 0;
+    char window[2 * GREP_MAX_PATTERN];
+
+    while (pos + len <= size) {
+        const char* data;
+        int got = vfs_map(fd, pos, size - pos, (const void**)&data);
+        if (got <= 0) {
+            if (got < 0) fs_error(vfs_strerror(got), path);
+            break;
         }
-    } else if (strcmp(name, "/") == 0) {
-        strcpy(current_dir, "/");
-    } else {
-        char full_path[MAX_PATH];
-        if (strcmp(current_dir, "/") == 0) {
-            if (strlen(name) >= MAX_NAME) {
-                prints("Error: Name too long: ");
-                prints(name);
-                newline();
-                return;
-            }
-            strcpy(full_path, name);
-        } else {
-            if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-                prints("Error: Path too long: ");
-                prints(name);
-                newline();
-                return;
-            }
-            strcpy(full_path, current_dir);
-            strcat(full_path, name);
+        int at = search_find(&g->s, data, got);
+        vfs_unmap(fd, data);
+        if (at < 0 && len > 1) {
+            // A match may straddle the end of the mapped block
+            u32 from = (u32)got >= len - 1 ? pos + got - (len - 1) : pos;
+            vfs_seek(fd, from, VFS_SEEK_SET);
+            int n = vfs_read(fd, window, 2 * (len - 1));
+            at = n > 0 ? search_find(&g->s, window, n) : -1;
+            if (at >= 0) at += from - pos;
         }
-
-        int found = 0;
-        for (int i = 0; i < fs_count; i++) {
-            if (strcmp(fs_cache[i].name, full_path) == 0 && fs_cache[i].is_dir) {
-                strcpy(current_dir, full_path);
-                if (strcmp(full_path, "/") != 0) {
-                    strcat(current_dir, "/");
-                }
-                found = 1;
-                break;
-            }
+        if (at < 0) {
+            pos += got;
+            continue;
         }
-
-        if (!found) {
-            prints("Error: Directory not found: ");
-            prints(name);
-            newline();
+        u32 hit = pos + at;
+        u32 end = grep_line_end(fd, hit, size);
+        lines++;
+        if (!g->count_only) grep_print_line(g, fd, path, hit, end);
+        pos = end;
+    }
+    vfs_close(fd);
+
+    if (g->count_only && (lines || !g->show_names)) {
+        char buf[16];
+        if (g->show_names) {
+            prints(path);
+            prints(":");
         }
+        itoa(lines, buf, 10);
+        prints(buf);
+        newline();
     }
+    g->lines += lines;
+    if (lines) g->files++;
 }
 
-FSNode* fs_find_file(const char* name) {
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return NULL;
+static void grep_visit(const VfsDirent* e, const char* path, void* ctx) {
+    if (e->type != VFS_DIR) grep_file((GrepState*)ctx, path);
+}
+
+void grep_command(char* args) {
+    GrepState* g = (GrepState*)kmalloc(sizeof(GrepState));
+    if (!g) {
+        prints("Error: Out of memory\n");
+        return;
+    }
+    int recursive = 0;
+    u32 flags = 0;
+    g->count_only = 0;
+    g->lines = 0;
+    g->files = 0;
+
+    char* p = args;
+    while (*p == ' ') p++;
+    while (*p == '-') {
+        for (p++; *p && *p != ' '; p++) {
+            if (*p == 'r' || *p == 'R') recursive = 1;
+            else if (*p == 'i') flags |= SEARCH_ICASE;
+            else if (*p == 'c') g->count_only = 1;
+            else {
+                prints("grep: unknown option\n");
+                kfree(g);
+                return;
+            }
         }
-        strcpy(full_path, name);
+        while (*p == ' ') p++;
+    }
+
+    // Шаблон, при необходимости в кавычках
+    char* pattern = p;
+    if (*p == '"') {
+        pattern = ++p;
+        while (*p && *p != '"') p++;
     } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return NULL;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
+        while (*p && *p != ' ') p++;
     }
+    if (*p) *p++ = '\0';
+    while (*p == ' ') p++;
+    char* path = p;
 
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0 && !fs_cache[i].is_dir) {
-            return &fs_cache[i];
-        }
+    int len = strlen(pattern);
+    if (len == 0 || len > GREP_MAX_PATTERN) {
+        prints("Usage: grep [-r] [-i] [-c] <pattern> [path]\n");
+        kfree(g);
+        return;
     }
-    return NULL;
+    search_init(&g->s, pattern, len, flags);
+
+    VfsStat st;
+    if (!*path) path = ".";
+    if (vfs_stat(path, &st) != WEXFS_OK) {
+        fs_error("File or directory not found", path);
+    } else if (st.type != VFS_DIR) {
+        g->show_names = 0;
+        grep_file(g, path);
+    } else if (!recursive) {
+        fs_error("Is a directory (use -r)", path);
+    } else {
+        g->show_names = 1;
+        tree_walk(path, grep_visit, g);
+        if (g->lines == 0) prints("grep: no matches\n");
+    }
+    kfree(g);
 }
 
-void fs_copy(const char* src_name, const char* dest_name) {
-    char src_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(src_name) >= MAX_NAME) {
-            prints("Error: Source name too long: ");
-            prints(src_name);
-            newline();
-            return;
-        }
-        strcpy(src_path, src_name);
-    } else {
-        if (strlen(current_dir) + strlen(src_name) + 1 >= MAX_PATH) {
-            prints("Error: Source path too long: ");
-            prints(src_name);
-            newline();
-            return;
-        }
-        strcpy(src_path, current_dir);
-        strcat(src_path, src_name);
+/* Benchmark timing: TSC (io.h) calibrated against PIT channel 2 */
+/* 64/32 division without libgcc; the quotient must fit in 32 bits */
+static inline u32 div64_32(unsigned long long n, u32 d) {
+    u32 q, r;
+    __asm__("divl %4" : "=a"(q), "=d"(r) : "a"((u32)n), "d"((u32)(n >> 32)), "rm"(d));
+    return q;
+}
+
+u32 tsc_mhz = 0;
+
+u32 bench_tsc_mhz() {
+    if (tsc_mhz) return tsc_mhz;
+
+    // 10 ms one-shot on PIT channel 2 (1193182 Hz), speaker disabled
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+    outb(0x43, 0xB0);
+    outb(0x42, 11932 & 0xFF);
+    outb(0x42, 11932 >> 8);
+
+    unsigned long long start = rdtsc();
+    while (!(inb(0x61) & 0x20));
+    unsigned long long cycles = rdtsc() - start;
+
+    tsc_mhz = div64_32(cycles, 10000);
+    if (tsc_mhz == 0) tsc_mhz = 1;
+    return tsc_mhz;
+}
+
+void bench_report(const char* phase, u32 ops, unsigned long long cycles, u32 sectors) {
+    char buf[16];
+    u32 us = div64_32(cycles, bench_tsc_mhz());
+
+    prints(phase);
+    for (int i = strlen(phase); i < 8; i++) putchar(' ');
+    itoa(us / 1000, buf, 10);
+    prints(buf);
+    prints(" ms, ");
+    itoa(ops ? us / ops : 0, buf, 10);
+    prints(buf);
+    prints(" us/op, ");
+    itoa(ops ? sectors / ops : 0, buf, 10);
+    prints(buf);
+    prints(" sectors/op\n");
+}
+
+/* fsbench [count] - create/lookup/list/delete scaling test */
+void fsbench_command(const char* arg) {
+    int count = (arg && *arg) ? atoi(arg) : 10000;
+    if (count <= 0) {
+        prints("Usage: fsbench [files]\n");
+        return;
+    }
+
+    FSNode* old = wexfs_lookup("fsbench.tmp");
+    if (old) wexfs_remove(old);
+
+    int err;
+    FSNode* dir = wexfs_create(wexfs_root(), "fsbench.tmp", WEXFS_DIR, &err);
+    if (!dir) {
+        fs_error(wexfs_strerror(err), "fsbench.tmp");
+        return;
     }
 
-    FSNode* src = NULL;
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, src_path) == 0 && !fs_cache[i].is_dir) {
-            src = &fs_cache[i];
+    char buf[16];
+    itoa(count, buf, 10);
+    prints("fsbench: ");
+    prints(buf);
+    prints(" files in /fsbench.tmp\n");
+
+    char name[32];
+    char path[48];
+    u32 io_start = ata_sectors_read + ata_sectors_written;
+    unsigned long long start = rdtsc();
+    int created = 0;
+    for (int i = 0; i < count; i++) {
+        strcpy(name, "f");
+        itoa(i, name + 1, 10);
+        if (!wexfs_create(dir, name, WEXFS_FILE, &err)) {
+            fs_error(wexfs_strerror(err), name);
             break;
         }
+        created++;
     }
+    bench_report("create", created, rdtsc() - start, ata_sectors_read + ata_sectors_written - io_start);
 
-    if (!src) {
-        prints("Error: Source file not found: ");
-        prints(src_name);
+    // Look up full paths in a scattered order
+    io_start = ata_sectors_read + ata_sectors_written;
+    start = rdtsc();
+    int found = 0;
+    for (int i = 0; i < created; i++) {
+        strcpy(path, "fsbench.tmp/f");
+        itoa((int)(((u32)i * 7919u) % (u32)created), path + 13, 10);
+        if (wexfs_lookup(path)) found++;
+    }
+    bench_report("lookup", created, rdtsc() - start, ata_sectors_read + ata_sectors_written - io_start);
+
+    // The same through the VFS: a cold pass over every name, then a hot
+    // set of names that fits the dentry cache, then names that do not
+    // exist (negative entries)
+    VfsStat st;
+    int hot = created < 256 ? created : 256;
+    const char* phases[] = { "vfs", "vfs-hot", "vfs-neg" };
+    for (int phase = 0; phase < 3; phase++) {
+        int ops = phase ? hot * 8 : created;
+        io_start = ata_sectors_read + ata_sectors_written;
+        u32 hits = vfs_stats.hits;
+        start = rdtsc();
+        for (int i = 0; i < ops; i++) {
+            strcpy(path, phase == 2 ? "/fsbench.tmp/g" : "/fsbench.tmp/f");
+            itoa((int)(((u32)i * 7919u) % (u32)(phase ? hot : created)), path + 14, 10);
+            if ((vfs_stat(path, &st) == WEXFS_OK) != (phase < 2)) found = -1;
+        }
+        bench_report(phases[phase], ops, rdtsc() - start, ata_sectors_read + ata_sectors_written - io_start);
+        if (phase && vfs_stats.hits - hits < (u32)ops) prints("fsbench: FAILED, dentry cache not used\n");
+    }
+
+    io_start = ata_sectors_read + ata_sectors_written;
+    start = rdtsc();
+    // Sorted listing, one screen-sized page per readdir run; the first
+    // run pays for sorting the directory
+    int listed = 0;
+    WexDir* d = (WexDir*)kmalloc(sizeof(WexDir));
+    if (d) {
+        wexfs_opendir(dir, WEXFS_DIR_SORTED, d);
+        int page;
+        do {
+            page = 0;
+            while (page < 20 && wexfs_readdir(d)) page++;
+            listed += page;
+        } while (page == 20);
+        kfree(d);
+    }
+    bench_report("list", listed, rdtsc() - start, ata_sectors_read + ata_sectors_written - io_start);
+
+    io_start = ata_sectors_read + ata_sectors_written;
+    start = rdtsc();
+    int removed = 0;
+    while (dir->children) {
+        if (wexfs_remove(dir->children) != WEXFS_OK) break;
+        removed++;
+    }
+    bench_report("delete", removed, rdtsc() - start, ata_sectors_read + ata_sectors_written - io_start);
+    wexfs_remove(dir);
+
+    if (found != created || listed != created || removed != created) {
+        prints("fsbench: FAILED, object counts do not match\n");
+    }
+}
+
+/* iotrace [save <file>|clear|off] - the disk commands recorded since boot
+ * (ata.h); save writes them as text for tools/disk-replay:
+ *   <start us> <length us> R|W <lba> <sectors>
+ * Start times count from the first command. */
+void iotrace_command(char* args) {
+    char* cmd;
+    char* rest;
+    split_args(args, &cmd, &rest);
+    char buf[12];
+    if (!*cmd) {
+        prints("I/O trace: ");
+        itoa(ata_trace_len, buf, 10);
+        prints(buf);
+        prints(" of ");
+        itoa(ata_trace_max, buf, 10);
+        prints(buf);
+        prints(" commands recorded");
+        if (!ata_trace_on) prints(", off");
+        else if (ata_trace_len == ata_trace_max) prints(", full");
         newline();
         return;
     }
-
-    if (fs_count >= MAX_FILES) {
-        prints("Error: Maximum files reached\n");
+    if (strcasecmp(cmd, "clear") == 0) {
+        ata_trace_len = 0;
+        ata_trace_on = ata_trace_max != 0;
+        return;
+    }
+    if (strcasecmp(cmd, "off") == 0) {
+        ata_trace_on = 0;
+        return;
+    }
+    if (strcasecmp(cmd, "save") != 0 || !rest || !*rest) {
+        prints("Usage: iotrace [save <file>|clear|off]\n");
         return;
     }
 
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(dest_name) >= MAX_NAME) {
-            prints("Error: Destination name too long: ");
-            prints(dest_name);
-            newline();
-            return;
+    // The file's own writes stay out of the trace
+    int was_on = ata_trace_on;
+    ata_trace_on = 0;
+    int fd = vfs_open(rest, VFS_O_WRITE | VFS_O_CREATE | VFS_O_TRUNC);
+    char* out = (char*)kmalloc(4096);
+    if (fd < 0 || !out) {
+        fs_error(fd < 0 ? vfs_strerror(fd) : "Out of memory", rest);
+        if (fd >= 0) vfs_close(fd);
+        kfree(out);
+        ata_trace_on = was_on;
+        return;
+    }
+    u32 mhz = bench_tsc_mhz();
+    strcpy(out, "# wexos-iotrace 1\n# start_us length_us op lba sectors\n");
+    int len = strlen(out);
+    u32 saved = 0;
+    int err = WEXFS_OK;
+    for (u32 i = 0; i < ata_trace_len && err == WEXFS_OK; i++) {
+        AtaTraceRecord* r = &ata_trace[i];
+        unsigned long long t = r->start - ata_trace[0].start;
+        if ((u32)(t >> 32) >= mhz) break;      // over 71 minutes: no longer fits in 32 bits
+        itoa(div64_32(t, mhz), out + len, 10);
+        len += strlen(out + len);
+        out[len++] = ' ';
+        itoa(r->cycles / mhz, out + len, 10);
+        len += strlen(out + len);
+        strcpy(out + len, r->write ? " W " : " R ");
+        len += 3;
+        itoa(r->lba, out + len, 10);
+        len += strlen(out + len);
+        out[len++] = ' ';
+        itoa(r->count, out + len, 10);
+        len += strlen(out + len);
+        out[len++] = '\n';
+        saved++;
+        if (len > 4096 - 64) {
+            if (vfs_write(fd, out, len) != len) err = WEXFS_EIO;
+            len = 0;
         }
-        strcpy(full_path, dest_name);
-    } else {
-        if (strlen(current_dir) + strlen(dest_name) + 1 >= MAX_PATH) {
-            prints("Error: Destination path too long: ");
-            prints(dest_name);
-            newline();
-            return;
+    }
+    if (len && err == WEXFS_OK && vfs_write(fd, out, len) != len) err = WEXFS_EIO;
+    vfs_close(fd);
+    kfree(out);
+    ata_trace_on = was_on;
+    if (err != WEXFS_OK) {
+        fs_error(vfs_strerror(err), rest);
+        return;
+    }
+    itoa(saved, buf, 10);
+    prints(buf);
+    prints(" commands saved to ");
+    prints(rest);
+    newline();
+}
+
+/* findbench [count] - name search through the index against a full scan */
+void findbench_command(const char* arg) {
+    static const char* queries[] = { "e1234", "*.cfg", "report", "file99?.log", "e5000.dat", "zzz" };
+    static const char* exts[] = { ".txt", ".cfg", ".log", ".dat" };
+    int count = (arg && *arg) ? atoi(arg) : 10000;
+    if (count <= 0) {
+        prints("Usage: findbench [files]\n");
+        return;
+    }
+
+    FSNode* old = wexfs_lookup("findbench.tmp");
+    if (old) wexfs_remove(old);
+    int err;
+    FSNode* dir = wexfs_create(wexfs_root(), "findbench.tmp", WEXFS_DIR, &err);
+    FSNode** hits = (FSNode**)kmalloc((fs_count + count) * sizeof(FSNode*));
+    if (!dir || !hits) {
+        fs_error(dir ? "Out of memory" : wexfs_strerror(err), "findbench.tmp");
+        kfree(hits);
+        if (dir) wexfs_remove(dir);
+        return;
+    }
+
+    char name[32];
+    int created = 0;
+    for (int i = 0; i < count; i++) {
+        strcpy(name, "file");
+        itoa(i, name + 4, 10);
+        strcpy(name + strlen(name), exts[i & 3]);
+        if (wexfs_create(dir, name, WEXFS_FILE, &err)) created++;
+    }
+    char buf[16];
+    itoa(created, buf, 10);
+    prints("findbench: ");
+    prints(buf);
+    prints(" files in /findbench.tmp, ");
+    itoa(sizeof(queries) / sizeof(queries[0]), buf, 10);
+    prints(buf);
+    prints(" queries x 10\n");
+
+    int nq = sizeof(queries) / sizeof(queries[0]);
+    u32 matches[2] = { 0, 0 };
+    for (int mode = 0; mode < 2; mode++) {
+        u32 io_start = ata_sectors_read + ata_sectors_written;
+        unsigned long long start = rdtsc();
+        for (int round = 0; round < 10; round++) {
+            for (int q = 0; q < nq; q++) {
+                matches[mode] += wexfs_find(queries[q], mode ? WEXFS_FIND_SCAN : 0, hits, fs_count);
+            }
         }
-        strcpy(full_path, current_dir);
-        strcat(full_path, dest_name);
+        bench_report(mode ? "scan" : "index", nq * 10, rdtsc() - start,
+                     ata_sectors_read + ata_sectors_written - io_start);
     }
+    if (matches[0] != matches[1]) prints("findbench: FAILED, index and scan disagree\n");
 
-    strcpy(fs_cache[fs_count].name, full_path);
-    fs_cache[fs_count].is_dir = 0;
-    strcpy(fs_cache[fs_count].content, src->content);
-    fs_cache[fs_count].next_sector = 0;
-    fs_cache[fs_count].size = src->size;
-    fs_count++;
-    fs_mark_dirty();
-    fs_save_to_disk();
-    prints("File copied to '");
-    prints(dest_name);
-    prints("'\n");
+    kfree(hits);
+    wexfs_remove(dir);
 }
 
-int folder_size(const char* folder_path) {
-    int total = 0;
-    char path_with_slash[MAX_PATH];
-    strcpy(path_with_slash, folder_path);
-    if (folder_path[strlen(folder_path) - 1] != '/') {
-        strcat(path_with_slash, "/");
+/* dedup [on|off] - block sharing status and write-time dedup switch */
+void dedup_command(const char* arg) {
+    if (strcasecmp(arg, "on") == 0) wexfs_set_dedup(1);
+    else if (strcasecmp(arg, "off") == 0) wexfs_set_dedup(0);
+    else if (*arg) {
+        prints("Usage: dedup [on|off]\n");
+        return;
     }
 
-    for (int i = 0; i < fs_count; i++) {
-        FSNode* node = &fs_cache[i];
-        if (!node->is_dir && strstr(node->name, path_with_slash) == node->name) {
-            total += node->size;
+    char buf[16];
+    prints("Dedup: ");
+    prints((wexfs_sb.features & WEXFS_FEAT_DEDUP) ? "on" : "off");
+    prints(", blocks saved by sharing: ");
+    itoa(wexfs_shared_blocks(), buf, 10);
+    prints(buf);
+    newline();
+}
+
+/* compress <path> [on|off] - compression attribute of a file or directory */
+void compress_command(char* args) {
+    char* name;
+    char* mode;
+    split_args(args, &name, &mode);
+
+    VfsStat st;
+    FSNode* node = vfs_wexfs_node(name);
+    if (!node) {
+        fs_error(vfs_stat(name, &st) == WEXFS_OK ? vfs_strerror(VFS_ENOSYS) : "File or directory not found", name);
+        return;
+    }
+    if (mode && *mode) {
+        if (strcasecmp(mode, "on") == 0) wexfs_set_compress(node, 1);
+        else if (strcasecmp(mode, "off") == 0) wexfs_set_compress(node, 0);
+        else {
+            prints("Usage: compress <path> [on|off]\n");
+            return;
         }
     }
-    return total;
+
+    prints(name);
+    prints(": compression ");
+    prints((node->di.flags & WEXFS_INODE_COMPRESS) ? "on" : "off");
+    newline();
 }
 
-void fs_size(const char* name) {
-    FSNode* node = NULL;
-    // ищем узел с точным именем
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, name) == 0) {
-            node = &fs_cache[i];
-            break;
+void bench_rate(const char* phase, u32 bytes, unsigned long long cycles) {
+    char buf[16];
+    u32 us = div64_32(cycles, bench_tsc_mhz());
+    prints(phase);
+    itoa(us ? bytes / us : 0, buf, 10);
+    prints(buf);
+    prints(" MB/s\n");
+}
+
+/* lzbench [file] - speed and ratio of the WexFS block codec, on a file or
+ * on generated log text */
+void lzbench_command(const char* arg) {
+    u32 size = 1024 * 1024;
+    int file = -1;
+    if (arg && *arg) {
+        VfsStat st;
+        file = vfs_open(arg, VFS_O_READ);
+        if (file < 0 || vfs_fstat(file, &st) != WEXFS_OK) {
+            vfs_close(file);
+            fs_error("File not found", arg);
+            return;
+        }
+        size = st.size < size ? st.size : size;
+        size &= ~(WEXFS_BLOCK_SIZE - 1);
+        if (size == 0) {
+            vfs_close(file);
+            prints("lzbench: file is smaller than one block\n");
+            return;
         }
     }
 
-    if (!node) {
-        prints("Error: File or folder not found: ");
-        prints(name);
-        newline();
+    u8* data = (u8*)kmalloc(size);
+    u8* packed = (u8*)kmalloc(size + size / 8);
+    u8* back = (u8*)kmalloc(WEXFS_BLOCK_SIZE);
+    u32* lens = (u32*)kmalloc(size / WEXFS_BLOCK_SIZE * sizeof(u32));
+    if (!data || !packed || !back || !lens) {
+        prints("Error: Out of memory\n");
+        kfree(data); kfree(packed); kfree(back); kfree(lens);
+        vfs_close(file);
         return;
     }
 
-    int size;
-    if (node->is_dir) {
-        size = folder_size(node->name);
-        prints("Folder size: ");
+    if (file >= 0) {
+        vfs_read(file, data, size);
+        vfs_close(file);
     } else {
-        size = node->size;
-        prints("File size: ");
+        // Log-like text: timestamps, a few task names, varying numbers
+        static const char* tasks[] = { "shell", "wexfs", "explorer", "autorun" };
+        char text[80];
+        char num[16];
+        u32 pos = 0;
+        for (u32 line = 0; pos < size; line++) {
+            strcpy(text, "[");
+            itoa(line * 37, num, 10);
+            strcat(text, num);
+            strcat(text, "] ");
+            strcat(text, tasks[line & 3]);
+            strcat(text, ": wrote block ");
+            itoa(rand() % 4096, num, 10);
+            strcat(text, num);
+            strcat(text, "\n");
+            for (char* c = text; *c && pos < size; c++) data[pos++] = *c;
+        }
     }
 
-    char size_str[16];
-    itoa(size, size_str, 10);
-    prints(size_str);
-    prints(" Bytes\n");
-}
+    u32 blocks = size / WEXFS_BLOCK_SIZE;
+    u32 out = 0;
+    unsigned long long start = rdtsc();
+    for (u32 b = 0; b < blocks; b++) {
+        int n = lz_compress(data + b * WEXFS_BLOCK_SIZE, WEXFS_BLOCK_SIZE, packed + out, WEXFS_BLOCK_SIZE);
+        lens[b] = n > 0 ? (u32)n : 0;
+        out += n > 0 ? (u32)n : WEXFS_BLOCK_SIZE;
+    }
+    unsigned long long comp = rdtsc() - start;
 
-void find_command(const char* pattern) {
-    prints("Searching for: ");
-    prints(pattern);
-    newline();
-    for(int i = 0; i < fs_count; i++) {
-        if(strstr(fs_cache[i].name, pattern) != NULL) {
-            prints(fs_cache[i].name);
-            if(fs_cache[i].is_dir) prints("/");
-            newline();
+    int bad = 0;
+    u32 in = 0;
+    start = rdtsc();
+    for (u32 b = 0; b < blocks; b++) {
+        if (!lens[b]) {
+            in += WEXFS_BLOCK_SIZE;
+            continue;
         }
+        if (lz_decompress(packed + in, lens[b], back, WEXFS_BLOCK_SIZE) != WEXFS_BLOCK_SIZE) bad++;
+        in += lens[b];
+    }
+    unsigned long long decomp = rdtsc() - start;
+
+    // Round trip check outside the timed loop
+    in = 0;
+    for (u32 b = 0; b < blocks; b++) {
+        if (!lens[b]) {
+            in += WEXFS_BLOCK_SIZE;
+            continue;
+        }
+        lz_decompress(packed + in, lens[b], back, WEXFS_BLOCK_SIZE);
+        for (u32 i = 0; i < WEXFS_BLOCK_SIZE; i++) {
+            if (back[i] != data[b * WEXFS_BLOCK_SIZE + i]) {
+                bad++;
+                break;
+            }
+        }
+        in += lens[b];
+    }
+
+    char buf[16];
+    prints("lzbench: ");
+    itoa(size / 1024, buf, 10);
+    prints(buf);
+    prints(" KB in 4 KB blocks\n");
+    bench_rate("compress   ", size, comp);
+    bench_rate("decompress ", size, decomp);
+    u32 ratio = out ? div64_32((unsigned long long)size * 100, out) : 0;
+    prints("ratio      ");
+    itoa(ratio / 100, buf, 10);
+    prints(buf);
+    putchar('.');
+    if (ratio % 100 < 10) putchar('0');
+    itoa(ratio % 100, buf, 10);
+    prints(buf);
+    prints(" (");
+    itoa(out / 1024, buf, 10);
+    prints(buf);
+    prints(" KB)\n");
+    if (bad) prints("lzbench: FAILED, round trip mismatch\n");
+
+    kfree(data);
+    kfree(packed);
+    kfree(back);
+    kfree(lens);
+}
+
+/* crcbench - throughput of the WexFS block checksum */
+void crcbench_command(void) {
+    u32 size = 1024 * 1024;
+    u8* data = (u8*)kmalloc(size);
+    if (!data) {
+        prints("Error: Out of memory\n");
+        return;
     }
+    for (u32 i = 0; i < size; i++) data[i] = (u8)rand();
+
+    prints("crcbench: 1024 KB, ");
+    prints(crc32c_hw_available() ? "SSE4.2 crc32 available\n" : "no SSE4.2, table only\n");
+
+    u32 sum = 0;
+    unsigned long long start = rdtsc();
+    for (u32 off = 0; off < size; off += WEXFS_BLOCK_SIZE) sum ^= crc32c(0, data + off, WEXFS_BLOCK_SIZE);
+    bench_rate("crc32c     ", size, rdtsc() - start);
+
+    start = rdtsc();
+    for (u32 off = 0; off < size; off += WEXFS_BLOCK_SIZE) sum ^= crc32c_sw(0, data + off, WEXFS_BLOCK_SIZE);
+    bench_rate("slice-by-8 ", size, rdtsc() - start);
+
+    // Both paths must agree, so the two passes cancel out
+    if (sum) prints("crcbench: FAILED, hardware and table results differ\n");
+    kfree(data);
 }
 
-void pwd_command() { 
-    prints(current_dir); 
-    newline(); 
+void pwd_command() {
+    fs_sync_cwd();
+    prints(current_dir);
+    newline();
 }
 
 void fs_format(void) {
     prints("WARNING: This will erase ALL files and directories!\n");
     prints("Are you sure you want to continue? (y/N): ");
-    
+
     char confirm = keyboard_getchar();
     putchar(confirm);
     newline();
-    
+
     if (confirm == 'y' || confirm == 'Y') {
         prints("Formatting filesystem...\n");
-        
-        // Сбрасываем файловую систему к начальному состоянию
-        fs_count = 1;
-        strcpy(fs_cache[0].name, "/");
-        fs_cache[0].is_dir = 1;
-        fs_cache[0].content[0] = '\0';
-        fs_cache[0].next_sector = 0;
-        fs_cache[0].size = 0;
-        
-        // Сбрасываем текущую директорию
-        strcpy(current_dir, "/");
-        
-        // Помечаем как измененную и сохраняем
-        fs_mark_dirty();
-        fs_save_to_disk();
-        
-        prints("Filesystem formatted successfully.\n");
+
+        defrag_cancel();
+        int err = wexfs_format(0);
+
+        // Сбрасываем текущую директорию на корень диска
+        vfs_chdir(fs_disk_root);
+        fs_sync_cwd();
+
+        if (err == WEXFS_OK) {
+            fs_mount_tmp();
+            prints("Filesystem formatted successfully.\n");
+        } else {
+            prints("Format failed: ");
+            prints(wexfs_strerror(err));
+            newline();
+        }
     } else {
         prints("Format cancelled.\n");
     }
@@ -791,76 +1510,67 @@ void fs_format(void) {
 
 
 /* Function implementations */
-void fs_check_integrity(void) {
+/* Run a full check in one go, printing each phase as it starts;
+ * returns the number of errors. */
+int fs_check_integrity(u32 flags) {
+    static const char* phases[] = {
+        "Phase 1: Checking names and directory links...\n",
+        "Phase 2: Checking block pointers and checksums...\n",
+        "Phase 3: Checking free space and reference counts...\n",
+    };
+
     prints("Checking filesystem integrity...\n");
     prints("Filesystem: WexFS\n");
-    prints("Version: 1.0\n");
+    prints("Version: 2.0\n");
     prints("======================================\n");
-    
-    int errors_found = 0;
-    int warnings_found = 0;
-    
-    // Проверка на дубликаты
-    prints("Phase 1: Checking for duplicates...\n");
-    for (int i = 0; i < fs_count; i++) {
-        for (int j = i + 1; j < fs_count; j++) {
-            if (strcmp(fs_cache[i].name, fs_cache[j].name) == 0) {
-                prints("ERROR: Duplicate filename: ");
-                prints(fs_cache[i].name);
-                newline();
-                errors_found++;
-            }
-        }
+
+    WexFsck ck;
+    int rc = wexfs_fsck_begin(&ck, flags | WEXFS_FSCK_VERBOSE);
+    if (rc != WEXFS_OK) {
+        prints("Error: ");
+        prints(wexfs_strerror(rc));
+        newline();
+        return 1;
     }
-    
-    // Проверка размера контента
-    prints("Phase 2: Checking file sizes...\n");
-    for (int i = 0; i < fs_count; i++) {
-        if (!fs_cache[i].is_dir) {
-            if (fs_cache[i].size > sizeof(fs_cache[i].content)) {
-                prints("ERROR: File size exceeds content buffer: ");
-                prints(fs_cache[i].name);
-                newline();
-                prints("  File size: ");
-                char size_str[20];
-                itoa(fs_cache[i].size, size_str, 10);
-                prints(size_str);
-                prints(", Max allowed: ");
-                itoa(sizeof(fs_cache[i].content), size_str, 10);
-                prints(size_str);
-                newline();
-                errors_found++;
-            }
+    u32 shown = WEXFS_FSCK_DONE;
+    while (rc == 0) {
+        if (ck.phase != shown && ck.phase < WEXFS_FSCK_DONE) {
+            shown = ck.phase;
+            prints(phases[shown]);
         }
+        rc = wexfs_fsck_step(&ck, 0xFFFFFFFF);
     }
-    
-    // Проверка максимального количества файлов
-    prints("Phase 3: Checking filesystem limits...\n");
-    if (fs_count >= MAX_FILES) {
-        prints("WARNING: Filesystem at maximum capacity (");
-        char max_str[10];
-        itoa(MAX_FILES, max_str, 10);
-        prints(max_str);
-        prints(" files)\n");
+
+    int errors_found = ck.errors;
+    int warnings_found = ck.warnings;
+    if (wexfs_csum_errors) {
+        char count[12];
+        itoa(wexfs_csum_errors, count, 10);
+        prints("ERROR: Checksum mismatches since mount: ");
+        prints(count);
+        newline();
+        errors_found++;
+    }
+    if (wexfs_free_blocks < wexfs_sb.total_blocks / 100) {
+        prints("WARNING: Less than 1% of the volume is free\n");
         warnings_found++;
     }
-    
-    // Статистика
-    prints("Phase 4: Generating statistics...\n");
+
     int total_files = 0;
     int total_dirs = 0;
-    
-    for (int i = 0; i < fs_count; i++) {
-        if (fs_cache[i].is_dir) {
+    for (u32 ino = 0; ino < fs_node_slots; ino++) {
+        FSNode* node = fs_nodes[ino];
+        if (!node) continue;
+        if (node->is_dir) {
             total_dirs++;
         } else {
             total_files++;
         }
     }
-    
+
     prints("======================================\n");
     prints("Filesystem check completed.\n");
-    
+
     char buf[20];
     itoa(total_files, buf, 10);
     prints("Files: "); prints(buf); newline();
@@ -868,55 +1578,439 @@ void fs_check_integrity(void) {
     prints("Directories: "); prints(buf); newline();
     itoa(fs_count, buf, 10);
     prints("Total objects: "); prints(buf); newline();
-    itoa(MAX_FILES - fs_count, buf, 10);
-    prints("Free slots: "); prints(buf); newline();
-    
+    itoa(ck.blocks, buf, 10);
+    prints("Blocks verified: "); prints(buf); newline();
+    itoa(wexfs_free_blocks, buf, 10);
+    prints("Free blocks: "); prints(buf);
+    itoa(wexfs_sb.total_blocks, buf, 10);
+    prints(" of "); prints(buf); newline();
+
     if (errors_found > 0) {
         itoa(errors_found, buf, 10);
         prints("Errors found: "); prints(buf); newline();
-        prints("Run 'format' to fix filesystem errors.\n");
     } else {
         prints("No errors found.\n");
     }
-    
     if (warnings_found > 0) {
         itoa(warnings_found, buf, 10);
         prints("Warnings: "); prints(buf); newline();
     }
-    
+    if (ck.repaired > 0) {
+        itoa(ck.repaired, buf, 10);
+        prints("Repaired: "); prints(buf); newline();
+    }
+
     prints("Filesystem is ");
     if (errors_found == 0) {
         prints("OK");
+    } else if (flags & WEXFS_FSCK_REPAIR) {
+        prints("REPAIRED");
     } else {
         prints("CORRUPTED");
     }
     prints(".\n");
+    wexfs_fsck_end(&ck);
+    return errors_found;
 }
-void fsck_command(void) {
-    prints("Filesystem Consistency Check\n");
-    prints("============================\n");
-    prints("This utility will check WexFS filesystem for errors\n");
-    prints("and report any inconsistencies.\n\n");
-    
-    prints("Continue? (y/N): ");
-    
-    char confirm = keyboard_getchar();
-    putchar(confirm);
+
+/* Background check: a few hundred pointers every 10 ms while the
+ * shell waits for keys. Any change to the volume restarts it. */
+#define FSCK_TICK_BUDGET 256
+
+static WexFsck bg_fsck;
+static int bg_fsck_state = 0;           /* 0 = never run, 1 = running, 2 = done */
+static unsigned long long bg_fsck_next = 0;
+
+void fsck_tick(void) {
+    if (bg_fsck_state != 1) return;
+    unsigned long long now = rdtsc();
+    if (now < bg_fsck_next) return;
+    bg_fsck_next = now + (unsigned long long)bench_tsc_mhz() * 10000;
+
+    int rc = wexfs_fsck_step(&bg_fsck, FSCK_TICK_BUDGET);
+    if (rc == 0) return;
+    bg_fsck_state = 2;
+    if (rc < 0 || bg_fsck.errors) {
+        prints("\nfsck: background check found problems, see 'fsck status'\n");
+        klog(KLOG_ERROR, "fsck: background check found problems");
+    }
+}
+
+/* fsck [bg|status] - check WexFS now, or in the background */
+void fsck_command(const char* arg) {
+    char buf[16];
+    if (!arg || !*arg) {
+        if (fs_check_integrity(0)) prints("Boot the recovery image and run 'fsck' there to repair.\n");
+        return;
+    }
+    if (strcasecmp(arg, "bg") == 0) {
+        if (bg_fsck_state == 1) {
+            prints("fsck: background check already running\n");
+            return;
+        }
+        if (bg_fsck_state == 2) wexfs_fsck_end(&bg_fsck);
+        int rc = wexfs_fsck_begin(&bg_fsck, 0);
+        if (rc != WEXFS_OK) {
+            prints("Error: ");
+            prints(wexfs_strerror(rc));
+            newline();
+            bg_fsck_state = 0;
+            return;
+        }
+        bg_fsck_state = 1;
+        bg_fsck_next = 0;
+        prints("fsck: background check started\n");
+        return;
+    }
+    if (strcasecmp(arg, "status") == 0) {
+        static const char* phases[] = { "names", "blocks", "free space", "done" };
+        if (bg_fsck_state == 0) {
+            prints("fsck: no background check has run\n");
+            return;
+        }
+        prints(bg_fsck_state == 1 ? "fsck: running, phase " : "fsck: finished, phase ");
+        prints(phases[bg_fsck.phase]);
+        prints("\nObjects checked: ");
+        itoa(bg_fsck.objects, buf, 10); prints(buf);
+        prints("\nBlocks verified: ");
+        itoa(bg_fsck.blocks, buf, 10); prints(buf);
+        prints("\nErrors: ");
+        itoa(bg_fsck.errors, buf, 10); prints(buf);
+        prints("\nWarnings: ");
+        itoa(bg_fsck.warnings, buf, 10); prints(buf);
+        prints("\nRestarts: ");
+        itoa(bg_fsck.restarts, buf, 10); prints(buf);
+        newline();
+        if (bg_fsck_state == 2 && bg_fsck.errors) prints("Run 'fsck' for details.\n");
+        return;
+    }
+    prints("Usage: fsck [bg|status]\n");
+}
+
+/* Background defragmenter: a few blocks every 20 ms while the shell
+ * waits for keys, so a long copy never holds up typing. */
+#define DEFRAG_TICK_BUDGET 16
+
+static WexDefrag bg_defrag;
+static int bg_defrag_state = 0;         /* 0 = never run, 1 = running, 2 = done */
+static unsigned long long bg_defrag_next = 0;
+
+static void defrag_print_stats(WexDefrag* df) {
+    char buf[16];
+    prints("Files checked: ");
+    itoa(df->objects, buf, 10); prints(buf);
+    prints("\nFragmented: ");
+    itoa(df->fragmented, buf, 10); prints(buf);
+    if (!(df->flags & WEXFS_DEFRAG_ANALYZE)) {
+        prints("\nMoved: ");
+        itoa(df->moved, buf, 10); prints(buf);
+        prints(" files, ");
+        itoa(df->blocks, buf, 10); prints(buf);
+        prints(" blocks");
+        prints("\nInodes renumbered: ");
+        itoa(df->renumbered, buf, 10); prints(buf);
+        prints("\nInode table blocks freed: ");
+        itoa(df->freed, buf, 10); prints(buf);
+        prints("\nRestarts: ");
+        itoa(df->restarts, buf, 10); prints(buf);
+    }
+    prints("\nSkipped: ");
+    itoa(df->skipped, buf, 10); prints(buf);
     newline();
-    
-    if (confirm == 'y' || confirm == 'Y') {
-        fs_check_integrity();
+}
+
+void defrag_tick(void) {
+    if (bg_defrag_state != 1) return;
+    unsigned long long now = rdtsc();
+    if (now < bg_defrag_next) return;
+    bg_defrag_next = now + (unsigned long long)bench_tsc_mhz() * 20000;
+
+    int rc = wexfs_defrag_step(&bg_defrag, DEFRAG_TICK_BUDGET);
+    if (rc == 0) return;
+    bg_defrag_state = 2;
+    if (rc < 0) {
+        klog(KLOG_ERROR, "defrag: stopped with an error");
+        return;
+    }
+    char msg[64];
+    char num[12];
+    strcpy(msg, "defrag: done, ");
+    itoa(bg_defrag.moved, num, 10);
+    strcat(msg, num);
+    strcat(msg, " files moved");
+    klog(KLOG_DEBUG, msg);
+}
+
+/* Stop a running job; its unfinished copy is released */
+void defrag_cancel(void) {
+    if (bg_defrag_state == 0) return;
+    wexfs_defrag_end(&bg_defrag);
+    bg_defrag_state = 0;
+}
+
+/* defrag [status|stop|analyze] - compact WexFS in the background */
+void defrag_command(const char* arg) {
+    char buf[16];
+    if (!arg || !*arg || strcasecmp(arg, "start") == 0) {
+        if (bg_defrag_state == 1) {
+            prints("defrag: already running, see 'defrag status'\n");
+            return;
+        }
+        defrag_cancel();
+        int rc = wexfs_defrag_begin(&bg_defrag, 0);
+        if (rc != WEXFS_OK) {
+            prints("Error: ");
+            prints(wexfs_strerror(rc));
+            newline();
+            return;
+        }
+        bg_defrag_state = 1;
+        bg_defrag_next = 0;
+        prints("defrag: started in the background, see 'defrag status'\n");
+        return;
+    }
+    if (strcasecmp(arg, "status") == 0) {
+        static const char* phases[] = { "inode table", "files", "done" };
+        if (bg_defrag_state == 0) {
+            prints("defrag: not running\n");
+            return;
+        }
+        prints(bg_defrag_state == 1 ? "defrag: running, phase " : "defrag: finished, phase ");
+        prints(phases[bg_defrag.phase]);
+        prints(", ");
+        itoa(wexfs_defrag_progress(&bg_defrag), buf, 10);
+        prints(buf);
+        prints("%\n");
+        defrag_print_stats(&bg_defrag);
+        return;
+    }
+    if (strcasecmp(arg, "stop") == 0) {
+        if (bg_defrag_state != 1) {
+            prints("defrag: not running\n");
+            return;
+        }
+        wexfs_defrag_end(&bg_defrag);
+        bg_defrag_state = 2;
+        prints("defrag: stopped\n");
+        return;
+    }
+    if (strcasecmp(arg, "analyze") == 0) {
+        WexDefrag df;
+        int rc = wexfs_defrag_begin(&df, WEXFS_DEFRAG_ANALYZE);
+        while (rc == 0) rc = wexfs_defrag_step(&df, 0xFFFFFFFF);
+        if (rc < 0) {
+            prints("Error: ");
+            prints(wexfs_strerror(rc));
+            newline();
+        } else {
+            defrag_print_stats(&df);
+        }
+        wexfs_defrag_end(&df);
+        return;
+    }
+    prints("Usage: defrag [start|status|stop|analyze]\n");
+}
+
+/* List the snapshots, oldest first */
+static void snapshot_list(void) {
+    WexSnapshot* list = (WexSnapshot*)kmalloc(WEXFS_MAX_SNAPSHOTS * sizeof(WexSnapshot));
+    if (!list) {
+        prints("Error: Out of memory\n");
+        return;
+    }
+    int count = wexfs_snapshot_list(list, WEXFS_MAX_SNAPSHOTS);
+    if (count == 0) prints("No snapshots\n");
+    char buf[16];
+    for (int i = 0; i < count; i++) {
+        prints("  ");
+        prints(list[i].name);
+        for (int s = strlen(list[i].name); s < WEXFS_SNAP_NAME; s++) putchar(' ');
+        itoa(list[i].objects, buf, 10);
+        prints(buf);
+        prints(" objects, ");
+        print_bytes((unsigned long long)list[i].blocks * WEXFS_BLOCK_SIZE);
+        prints(" own\n");
+    }
+    kfree(list);
+}
+
+/* snapshot [list|create|restore|delete <name>] - whole-volume snapshots.
+ * Restore replaces every file on the disk with the snapshot's, so it
+ * asks first; the tree it replaces is kept as <name>~. */
+void snapshot_command(char* args) {
+    char* cmd;
+    char* name;
+    split_args(args, &cmd, &name);
+    if (!*cmd || strcasecmp(cmd, "list") == 0) {
+        snapshot_list();
+        return;
+    }
+    if (!name || !*name) {
+        prints("Usage: snapshot [list|create <name>|restore <name>|delete <name>]\n");
+        return;
+    }
+    int err;
+    if (strcasecmp(cmd, "create") == 0) {
+        err = wexfs_snapshot_create(name);
+    } else if (strcasecmp(cmd, "delete") == 0) {
+        err = wexfs_snapshot_delete(name);
+    } else if (strcasecmp(cmd, "restore") == 0) {
+        prints("WARNING: All files will be replaced by snapshot '");
+        prints(name);
+        prints("'!\nAre you sure you want to continue? (y/N): ");
+        char confirm = keyboard_getchar();
+        putchar(confirm);
+        newline();
+        if (confirm != 'y' && confirm != 'Y') {
+            prints("Restore cancelled.\n");
+            return;
+        }
+        defrag_cancel();
+        err = wexfs_snapshot_restore(name);
+        vfs_chdir(fs_disk_root);
+        fs_sync_cwd();
+        if (err == WEXFS_OK) {
+            prints("Restored. The previous files are kept as snapshot '");
+            prints(name);
+            prints("~'.\n");
+            klog(KLOG_WARN, "WexFS restored from a snapshot");
+        }
     } else {
-        prints("Operation cancelled.\n");
+        prints("Usage: snapshot [list|create <name>|restore <name>|delete <name>]\n");
+        return;
+    }
+    if (err != WEXFS_OK) fs_error(wexfs_strerror(err), name);
+}
+
+/* The second disk (primary slave) as the backup target; 0 if there is none */
+static int backup_disk(BackupDev* dev) {
+    dev->sectors = ata_slave_identify();
+    dev->read = ata_slave_read;
+    dev->write = ata_slave_write;
+    dev->flush = ata_slave_flush;
+    if (!dev->sectors) prints("Error: No second disk (primary slave) to back up to\n");
+    return dev->sectors != 0;
+}
+
+static void backup_status(const BackupDev* dev) {
+    BackupHeader hdr;
+    int err = backup_header(dev, &hdr);
+    if (err == WEXFS_ENOENT) {
+        prints("The second disk holds no backup\n");
+        return;
+    }
+    if (err != WEXFS_OK) {
+        fs_error(wexfs_strerror(err), "second disk");
+        return;
+    }
+    char buf[16];
+    prints("Sessions: ");
+    itoa(hdr.sessions, buf, 10); prints(buf);
+    prints("\nLast session: ");
+    itoa(hdr.catalog_entries, buf, 10); prints(buf);
+    prints(" objects, ");
+    itoa(hdr.session_files, buf, 10); prints(buf);
+    prints(" files copied, ");
+    print_bytes((unsigned long long)hdr.session_sectors * SECTOR_SIZE);
+    prints(" written\nDisk used: ");
+    print_bytes((unsigned long long)hdr.end * SECTOR_SIZE);
+    prints(" of ");
+    print_bytes((unsigned long long)dev->sectors * SECTOR_SIZE);
+    newline();
+    if (hdr.pending) prints("An unfinished session will be resumed by the next backup\n");
+    if (hdr.change != wexfs_sb.backup_mark) prints("Not the last backup of this disk: the next one is full\n");
+}
+
+/* backup [full|status] - copy what changed on the system disk since the
+ * last backup to the second disk. The first backup, and any backup to a
+ * disk that was last used for another volume, copies everything. */
+void backup_command(char* args) {
+    BackupDev dev;
+    if (!backup_disk(&dev)) return;
+    if (strcasecmp(args, "status") == 0) {
+        backup_status(&dev);
+        return;
+    }
+    if (*args && strcasecmp(args, "full") != 0) {
+        prints("Usage: backup [full|status]\n");
+        return;
+    }
+    BackupResult res;
+    unsigned long long start = rdtsc();
+    int err = backup_run(&dev, *args ? BACKUP_FULL : 0, &res);
+    if (err != WEXFS_OK) {
+        fs_error(wexfs_strerror(err), "backup");
+        if (err != WEXFS_ENOMEM) prints("Run backup again to resume it\n");
+        return;
+    }
+    char buf[16];
+    prints(res.full ? "Full backup" : "Incremental backup");
+    prints(", session ");
+    itoa(res.session, buf, 10); prints(buf);
+    if (res.resumed) prints(" (resumed)");
+    prints(": ");
+    itoa(res.objects, buf, 10); prints(buf);
+    prints(" objects, ");
+    itoa(res.files, buf, 10); prints(buf);
+    prints(" files copied (");
+    print_bytes(res.bytes);
+    prints("), ");
+    itoa(res.reused, buf, 10); prints(buf);
+    prints(" unchanged\n");
+    print_bytes((unsigned long long)res.sectors * SECTOR_SIZE);
+    prints(" written in ");
+    itoa(div64_32(rdtsc() - start, bench_tsc_mhz() * 1000), buf, 10); prints(buf);
+    prints(" ms\n");
+    klog(KLOG_WARN, "WexFS backed up to the second disk");
+}
+
+/* restore <dir> - recreate the last backup under a directory on WexFS,
+ * made if missing; files already there are overwritten */
+void restore_command(char* args) {
+    VfsStat st;
+    if (vfs_stat(args, &st) == WEXFS_ENOENT) vfs_create(args, VFS_DIR);
+    char path[MAX_PATH];
+    FSNode* base = vfs_realpath(args, path, MAX_PATH) == WEXFS_OK ? vfs_wexfs_node(path) : NULL;
+    if (!base) {
+        fs_error(vfs_stat(args, &st) == WEXFS_OK ? vfs_strerror(VFS_ENOSYS) : "Directory not found", args);
+        return;
+    }
+    if (!base->is_dir) {
+        fs_error(wexfs_strerror(WEXFS_ENOTDIR), args);
+        return;
+    }
+    BackupDev dev;
+    if (!backup_disk(&dev)) return;
+    BackupResult res;
+    int err = backup_restore(&dev, base, &res);
+    char buf[16];
+    if (res.objects || res.failed) {
+        prints("Restored ");
+        itoa(res.objects, buf, 10); prints(buf);
+        prints(" objects (");
+        print_bytes(res.bytes);
+        prints(") from session ");
+        itoa(res.session, buf, 10); prints(buf);
+        newline();
     }
+    if (res.failed) {
+        itoa(res.failed, buf, 10); prints(buf);
+        prints(" could not be restored\n");
+    }
+    if (err != WEXFS_OK) fs_error(wexfs_strerror(err), path);
+    fs_sync_cwd();
 }
 
 int check_login() {
-    FSNode* passfile = fs_find_file("SystemRoot/config/pass.cfg");
-    if (!passfile || passfile->size == 0) {
+    char password[64];
+    int fd = vfs_open("/SystemRoot/config/pass.cfg", VFS_O_READ);
+    int password_len = fd >= 0 ? vfs_read(fd, password, sizeof(password) - 1) : 0;
+    vfs_close(fd);
+    if (password_len <= 0) {
         // Пароль не установлен
         return 1;
     }
+    password[password_len] = '\0';
 
     unsigned char old_color = text_color;
     
@@ -1099,11 +2193,12 @@ int check_login() {
                         buffer[buffer_len] = '\0';
                         newline();
                         
-                        if (strcmp(buffer, passfile->content) == 0) {
+                        if (strcmp(buffer, password) == 0) {
                             // Успешный вход - очищаем экран и возвращаемся
                             text_color = old_color;
                             clear_screen();
                             prints("Login successful!\n");
+                            klog(KLOG_WARN, "login successful");
                             return 1;
                         } else {
                             // Неверный пароль - показываем сообщение об ошибке
@@ -1119,6 +2214,7 @@ int check_login() {
                             cursor_row = area_y + 4;
                             cursor_col = area_x + 2;
                             prints("Incorrect password, try again.");
+                            klog(KLOG_WARN, "login failed: incorrect password");
                             
                             // Очищаем буфер
                             buffer_len = 0;
@@ -1246,143 +2342,86 @@ void fs_cat(const char* filename) {
         return;
     }
 
-    FSNode* file = fs_find_file(filename);
-    if (!file) {
-        prints("Error: File not found: ");
+    int fd = vfs_open(filename, VFS_O_READ);
+    if (fd == WEXFS_EISDIR) {
+        prints("Error: '");
         prints(filename);
-        newline();
+        prints("' is a directory\n");
         return;
     }
-
-    if (file->is_dir) {
-        prints("Error: '");
+    if (fd < 0) {
+        prints("Error: File not found: ");
         prints(filename);
-        prints("' is a directory\n");
+        newline();
         return;
     }
 
-    // Выводим содержимое файла
-    if (file->size > 0) {
-        prints(file->content);
+    // Печатаем прямо из кэша блоков, без копирования
+    const char* data;
+    int got;
+    u32 total = 0;
+    while ((got = vfs_map(fd, total, WEXFS_BLOCK_SIZE, (const void**)&data)) > 0) {
+        for (int i = 0; i < got; i++) {
+            if (data[i]) putchar(data[i]);
+        }
+        vfs_unmap(fd, data);
+        total += got;
+    }
+    if (got < 0) {
+        newline();
+        fs_error(vfs_strerror(got), filename);
+    } else if (total > 0) {
         newline();
     } else {
         prints("File is empty\n");
     }
+    vfs_close(fd);
 }
 
 /* WexExplorer - файловый менеджер */
+/* Папки раньше файлов, внутри группы по алфавиту */
+int explorer_add(Explorer* exp, const char* name, int is_dir, u32 size) {
+    if (exp->file_count == exp->file_capacity) {
+        int capacity = exp->file_capacity ? exp->file_capacity * 2 : 32;
+        FileEntry* grown = (FileEntry*)krealloc(exp->files, capacity * sizeof(FileEntry));
+        if (!grown) return 0;
+        exp->files = grown;
+        exp->file_capacity = capacity;
+    }
+    FileEntry* entry = &exp->files[exp->file_count++];
+    strcpy(entry->name, name);
+    entry->is_dir = is_dir;
+    entry->size = size;
+    return 1;
+}
+
 void explorer_refresh(Explorer* exp) {
     exp->file_count = 0;
     exp->selected_index = 0;
     exp->scroll_offset = 0;
-    
-    // Добавляем ".." для навигации вверх (кроме корня)
-    if (strcmp(exp->current_path, "/") != 0) {
-        strcpy(exp->files[exp->file_count].name, "..");
-        exp->files[exp->file_count].is_dir = 1;
-        exp->files[exp->file_count].size = 0;
-        exp->file_count++;
-    }
-    
-    // Временные массивы для сортировки
-    FileEntry folders[MAX_FILES];
-    FileEntry files[MAX_FILES];
-    int folder_count = 0;
-    int file_count = 0;
-    
-    // Сканируем файловую систему
-    for (int i = 0; i < fs_count; i++) {
-        int is_in_current_dir = 0;
-        char relative_path[MAX_NAME] = "";
-        
-        if (strcmp(exp->current_path, "/") == 0) {
-            // Корневая директория
-            if (fs_cache[i].name[0] == '/') {
-                char* second_slash = strchr(fs_cache[i].name + 1, '/');
-                if (second_slash == NULL) {
-                    is_in_current_dir = 1;
-                    strcpy(relative_path, fs_cache[i].name + 1);
-                }
-            } else {
-                is_in_current_dir = 1;
-                strcpy(relative_path, fs_cache[i].name);
-            }
-        } else {
-            // Поддиректории
-            char search_path[MAX_PATH];
-            strcpy(search_path, exp->current_path);
-            if (search_path[strlen(search_path)-1] != '/') {
-                strcat(search_path, "/");
-            }
-            
-            if (strstr(fs_cache[i].name, search_path) == fs_cache[i].name) {
-                char* name_part = fs_cache[i].name + strlen(search_path);
-                if (name_part[0] != '\0') {
-                    char* next_slash = strchr(name_part, '/');
-                    if (next_slash == NULL) {
-                        is_in_current_dir = 1;
-                        strcpy(relative_path, name_part);
-                    }
-                }
-            }
-        }
-        
-        if (is_in_current_dir && strlen(relative_path) > 0) {
-            int duplicate = 0;
-            for (int j = 0; j < exp->file_count; j++) {
-                if (strcmp(exp->files[j].name, relative_path) == 0) {
-                    duplicate = 1;
-                    break;
-                }
-            }
-            
-            if (!duplicate) {
-                if (fs_cache[i].is_dir) {
-                    strcpy(folders[folder_count].name, relative_path);
-                    folders[folder_count].is_dir = 1;
-                    folders[folder_count].size = fs_cache[i].size;
-                    folder_count++;
-                } else {
-                    strcpy(files[file_count].name, relative_path);
-                    files[file_count].is_dir = 0;
-                    files[file_count].size = fs_cache[i].size;
-                    file_count++;
-                }
-            }
-        }
-    }
-    
-    // Сортируем папки по алфавиту
-    for (int i = 0; i < folder_count - 1; i++) {
-        for (int j = i + 1; j < folder_count; j++) {
-            if (strcmp(folders[i].name, folders[j].name) > 0) {
-                FileEntry temp = folders[i];
-                folders[i] = folders[j];
-                folders[j] = temp;
-            }
-        }
+
+    VfsDir d;
+    if (vfs_opendir(exp->current_path, &d) != WEXFS_OK) {
+        strcpy(exp->current_path, "/");
+        if (vfs_opendir("/", &d) != WEXFS_OK) return;
     }
-    
-    // Сортируем файлы по алфавиту
-    for (int i = 0; i < file_count - 1; i++) {
-        for (int j = i + 1; j < file_count; j++) {
-            if (strcmp(files[i].name, files[j].name) > 0) {
-                FileEntry temp = files[i];
-                files[i] = files[j];
-                files[j] = temp;
-            }
+    vfs_closedir(&d);
+
+    // Добавляем ".." для навигации вверх (кроме корня)
+    if (strcmp(exp->current_path, "/") != 0) explorer_add(exp, "..", 1, 0);
+
+    // Папки, затем файлы; каждый проход уже идет в порядке имен
+    VfsDirent e;
+    for (int pass = 1; pass >= 0; pass--) {
+        if (vfs_opendir(exp->current_path, &d) != WEXFS_OK) break;
+        while (vfs_readdir(&d, &e)) {
+            int is_dir = e.type == VFS_DIR;
+            if (is_dir != pass) continue;
+            u32 size = e.size;
+            if (is_dir) size = e.tree_bytes > 0xFFFFFFFFull ? 0xFFFFFFFF : (u32)e.tree_bytes;
+            if (!explorer_add(exp, e.name, is_dir, size)) break;
         }
-    }
-    
-    // Объединяем: сначала папки, потом файлы
-    for (int i = 0; i < folder_count && exp->file_count < MAX_FILES; i++) {
-        exp->files[exp->file_count] = folders[i];
-        exp->file_count++;
-    }
-    
-    for (int i = 0; i < file_count && exp->file_count < MAX_FILES; i++) {
-        exp->files[exp->file_count] = files[i];
-        exp->file_count++;
+        vfs_closedir(&d);
     }
 }
 
@@ -1430,13 +2469,23 @@ void draw_file_list(Explorer* exp) {
         
         // Размер
         cursor_col = COLS - 25;
-        if (file->is_dir) {
+        if (file->is_dir && strcmp(file->name, "..") == 0) {
             prints("<DIR>");
         } else {
+            // Folders show the total of everything below them
             char size_str[15];
-            itoa(file->size, size_str, 10);
+            u32 size = file->size;
+            const char* unit = " bytes";
+            if (size >= 10000000) {
+                size >>= 20;
+                unit = " MB";
+            } else if (size >= 100000) {
+                size >>= 10;
+                unit = " KB";
+            }
+            itoa(size, size_str, 10);
             prints(size_str);
-            prints(" bytes");
+            prints(unit);
         }
         
         // Тип
@@ -1615,15 +2664,32 @@ int explorer_handle_input(Explorer* exp) {
     }
 }
 
+/* Путь каталога в формате current_dir: "/" или "/a/b"; name - папка
+ * текущего каталога или ".." */
+void explorer_set_dir(Explorer* exp, const char* name) {
+    char path[MAX_PATH];
+    VfsStat st;
+    if (strlen(exp->current_path) + strlen(name) + 2 > MAX_PATH) return;
+    strcpy(path, exp->current_path);
+    if (strcmp(path, "/") != 0) strcat(path, "/");
+    strcat(path, name);
+    if (vfs_stat(path, &st) != WEXFS_OK || st.type != VFS_DIR) return;
+    vfs_realpath(path, exp->current_path, MAX_PATH);
+}
+
 void wexplorer_command(void) {
     Explorer exp;
     exp.x = 0;
     exp.y = 0;
     exp.width = EXPLORER_WIDTH;
     exp.height = EXPLORER_HEIGHT;
+    exp.files = NULL;
+    exp.file_capacity = 0;
+    exp.file_count = 0;
     exp.selected_index = 0;
     exp.scroll_offset = 0;
     
+    fs_sync_cwd();
     strcpy(exp.current_path, current_dir);
     explorer_refresh(&exp);
     
@@ -1640,68 +2706,22 @@ void wexplorer_command(void) {
                     FileEntry* selected = &exp.files[exp.selected_index];
                     
                     if (selected->is_dir) {
-                        // Переход в папку
-                        if (strcmp(selected->name, "..") == 0) {
-                            // Назад
-                            if (strcmp(exp.current_path, "/") != 0) {
-                                char* last_slash = strrchr(exp.current_path, '/');
-                                if (last_slash != NULL) {
-                                    if (last_slash == exp.current_path) {
-                                        strcpy(exp.current_path, "/");
-                                    } else {
-                                        *last_slash = '\0';
-                                        if (strlen(exp.current_path) == 0) {
-                                            strcpy(exp.current_path, "/");
-                                        }
-                                    }
-                                }
-                            }
-                        } else {
-                            // Вход в папку
-                            char new_path[MAX_PATH];
-                            if (strcmp(exp.current_path, "/") == 0) {
-                                strcpy(new_path, "/");
-                                strcat(new_path, selected->name);
-                            } else {
-                                strcpy(new_path, exp.current_path);
-                                if (new_path[strlen(new_path)-1] != '/') {
-                                    strcat(new_path, "/");
-                                }
-                                strcat(new_path, selected->name);
-                            }
-                            
-                            // Проверяем, что это действительно папка
-                            int is_valid_dir = 0;
-                            for (int i = 0; i < fs_count; i++) {
-                                if (strcmp(fs_cache[i].name, new_path) == 0 && fs_cache[i].is_dir) {
-                                    is_valid_dir = 1;
-                                    break;
-                                }
-                            }
-                            
-                            if (is_valid_dir) {
-                                strcpy(exp.current_path, new_path);
-                                // Добавляем слэш в конец если его нет
-                                if (exp.current_path[strlen(exp.current_path)-1] != '/') {
-                                    strcat(exp.current_path, "/");
-                                }
-                            }
-                        }
-                        
+                        // Переход в папку (или назад по ".."), если она всё ещё существует
+                        explorer_set_dir(&exp, selected->name);
                         explorer_refresh(&exp);
                     } else {
-                        // Открыть файл в Writer
+                        // Открыть файл в Writer (абсолютный путь, не зависит от cd)
                         char full_path[MAX_PATH];
-                        if (strcmp(exp.current_path, "/") == 0) {
-                            strcpy(full_path, selected->name);
-                        } else {
-                            strcpy(full_path, exp.current_path);
-                            strcat(full_path, selected->name);
+                        strcpy(full_path, exp.current_path);
+                        if (strcmp(exp.current_path, "/") != 0) {
+                            strcat(full_path, "/");
                         }
+                        strcat(full_path, selected->name);
                         
                         // Выходим из explorer и открываем файл
                         exit_explorer = 1;
                         text_color = old_color;
+                        kfree(exp.files);
                         clear_screen();
                         prints("Opening file in Writer: ");
                         prints(full_path);
@@ -1718,6 +2738,7 @@ void wexplorer_command(void) {
         }
     }
     
+    kfree(exp.files);
     text_color = old_color;
     clear_screen();
     prints("WexExplorer closed.\n> ");
@@ -1725,88 +2746,6 @@ void wexplorer_command(void) {
 
 
 
-/* String functions */
-void memcpy(void* dst, void* src, int len) {
-    char* d = (char*)dst;
-    char* s = (char*)src;
-    while (len--) *d++ = *s++;
-}
-
-int strcmp(const char* a, const char* b) {
-    while(*a && *b && *a == *b) { a++; b++; }
-    return (unsigned char)*a - (unsigned char)*b;
-}
-
-int strlen(const char* s) {
-    const char* p = s;
-    while(*p) p++;
-    return p - s;
-}
-
-void strcpy(char* dst, const char* src) {
-    while((*dst++ = *src++));
-}
-
-char* strchr(const char* s, int c) {
-    while(*s) {
-        if(*s == c) return (char*)s;
-        s++;
-    }
-    return NULL;
-}
-
-char* strstr(const char* haystack, const char* needle) {
-    if(!*needle) return (char*)haystack;
-    for(const char* p = haystack; *p; p++) {
-        const char* h = p, *n = needle;
-        while(*h && *n && *h == *n) { h++; n++; }
-        if(!*n) return (char*)p;
-    }
-    return NULL;
-}
-
-char* strcat(char* dest, const char* src) {
-    char* ptr = dest;
-    while(*ptr) ptr++;
-    while((*ptr++ = *src++));
-    return dest;
-}
-
-char* strrchr(const char* s, int c) {
-    const char* last = NULL;
-    while(*s) {
-        if(*s == c) last = s;
-        s++;
-    }
-    return (char*)last;
-}
-
-int atoi(const char* s) {
-    int r = 0;
-    while(*s >= '0' && *s <= '9') {
-        r = r * 10 + (*s - '0');
-        s++;
-    }
-    return r;
-}
-
-void itoa(int value, char* str, int base) {
-    char* ptr = str, *ptr1 = str, tmp_char;
-    int tmp_value;
-    do {
-        tmp_value = value;
-        value /= base;
-        *ptr++ = "zyxwvutsrqponmlkjihgfedcba9876543210123456789abcdefghijklmnopqrstuvwxyz"[35 + (tmp_value - value * base)];
-    } while (value);
-    if (tmp_value < 0) *ptr++ = '-';
-    *ptr-- = '\0';
-    while(ptr1 < ptr) {
-        tmp_char = *ptr;
-        *ptr-- = *ptr1;
-        *ptr1++ = tmp_char;
-    }
-}
-
 
 /* VGA output */
 void clear_screen() {
@@ -1999,6 +2938,9 @@ static unsigned char shift_pressed = 0;
 
 char keyboard_getchar() {
     while(1) {
+        fsck_tick();
+        defrag_tick();
+        klog_tick();
         unsigned char st = inb(0x64);
         if(st & 1) {
             unsigned char sc = inb(0x60);
@@ -2036,6 +2978,9 @@ char keyboard_getchar() {
 char getch_with_arrows() {
     static unsigned char extended = 0;
     while(1) {
+        fsck_tick();
+        defrag_tick();
+        klog_tick();
         unsigned char st = inb(0x64);
         if (st & 1) {
             unsigned char sc = inb(0x60);
@@ -2084,12 +3029,16 @@ char getch_with_arrows() {
 /* System commands */
 void reboot_system() {
     prints("Rebooting...\n");
+    klog(KLOG_WARN, "reboot");
+    klog_flush();
     outb(0x64, 0xFE);
     while(1) { __asm__ volatile("hlt"); }
 }
 
 void shutdown_system() {
     prints("Shutdown...\n");
+    klog(KLOG_WARN, "shutdown");
+    klog_flush();
     
     // Попытка ACPI выключения через порт 0x604
     outw(0x604, 0x2000);
@@ -3251,6 +4200,85 @@ SystemConfig sys_config = {
 
 SystemConfig temp_config;
 
+/* Kernel log. Lines collect in memory and reach the log file in batches,
+ * one journaled append each, once the buffer fills up or a second after
+ * the first buffered line. The file is a rotating log, so it never grows past
+ * KLOG_MAX_SIZE and the older lines live in kernel.log.1 .. .4 */
+#define KLOG_BUF_SIZE 4096
+#define KLOG_MAX_SIZE (64 * 1024)
+#define KLOG_KEEP 4
+#define KLOG_FLUSH_US 1000000
+
+static char klog_buf[KLOG_BUF_SIZE];
+static int klog_len = 0;
+static int klog_fd = -1;
+static u32 klog_dropped = 0;            /* lines lost without a log file */
+static unsigned long long klog_due = 0;
+
+void klog_flush(void) {
+    if (klog_len == 0) return;
+    // A handle left over from a removed or reformatted file fails once
+    // and is opened again
+    for (int attempt = 0; attempt < 2 && wexfs_root(); attempt++) {
+        if (klog_fd < 0) {
+            klog_fd = vfs_open(KLOG_FILE, VFS_O_WRITE | VFS_O_CREATE | VFS_O_APPEND);
+            FSNode* node = klog_fd >= 0 ? vfs_wexfs_node(KLOG_FILE) : NULL;
+            if (node && !(node->di.flags & WEXFS_INODE_LOG)) wexfs_set_log(node, KLOG_MAX_SIZE, KLOG_KEEP);
+        }
+        if (klog_fd >= 0 && vfs_write(klog_fd, klog_buf, klog_len) == klog_len) {
+            klog_len = 0;
+            return;
+        }
+        vfs_close(klog_fd);
+        klog_fd = -1;
+    }
+    // Файл недоступен - строки теряются, но не копятся в памяти
+    for (int i = 0; i < klog_len; i++) {
+        if (klog_buf[i] == '\n') klog_dropped++;
+    }
+    klog_len = 0;
+}
+
+void klog(int level, const char* msg) {
+    static const char tags[] = "?EWD";
+    if (level > sys_config.log_level) return;
+    int len = strlen(msg);
+    if (len > KLOG_BUF_SIZE - 32) len = KLOG_BUF_SIZE - 32;
+    if (klog_len + len + 24 > KLOG_BUF_SIZE) klog_flush();
+    if (klog_len == 0) klog_due = rdtsc() + (unsigned long long)bench_tsc_mhz() * KLOG_FLUSH_US;
+
+    // [DD.MM.YY HH:MM:SS] E message
+    char* out = klog_buf + klog_len;
+    out[0] = '[';
+    get_datetime(out + 1);
+    out[18] = ']';
+    out[19] = ' ';
+    out[20] = tags[level & 3];
+    out[21] = ' ';
+    memcpy(out + 22, (void*)msg, len);
+    out[22 + len] = '\n';
+    klog_len += len + 23;
+}
+
+void klog_tick(void) {
+    if (klog_len && rdtsc() >= klog_due) klog_flush();
+}
+
+/* log [flush] - show the kernel log, or write out what is buffered */
+void log_command(const char* arg) {
+    klog_flush();
+    if (arg && strcasecmp(arg, "flush") == 0) {
+        if (klog_dropped) {
+            char buf[12];
+            itoa((int)klog_dropped, buf, 10);
+            prints(buf);
+            prints(" log lines were dropped (no log file)\n");
+        }
+        return;
+    }
+    fs_cat(KLOG_FILE);
+}
+
 void install_disk() {
     prints("\nWARNING: ALL DISKS INCLUDING BOOT DISKS WILL BE FORMATTED TO WexFS FOR OS INSTALLATION.\n");
     prints("CONTINUE? Y/N: ");
@@ -3328,8 +4356,6 @@ void install_disk() {
     fs_mkdir("mnt");
     fs_mkdir("mnt/rootdisk");
     fs_mkdir("mnt/Z:");
-    fs_mkdir("tmp");
-    fs_mkdir("tmp/null");
     fs_mkdir("dev");
     fs_mkdir("dev/usb");
     fs_mkdir("dev/usb 3.0");
@@ -3369,23 +4395,18 @@ void install_disk() {
     // Конфигурация системы
     prints("Creating system configuration...\n");
     fs_touch("SystemRoot/config/autorun.cfg");
-    FSNode* autorun_file = fs_find_file("SystemRoot/config/autorun.cfg");
-    if (autorun_file) {
-        strcpy(autorun_file->content, "desktop");
-        autorun_file->size = strlen("desktop");
+    int fd = vfs_open("SystemRoot/config/autorun.cfg", VFS_O_WRITE | VFS_O_TRUNC);
+    if (fd >= 0 && vfs_write(fd, "desktop", strlen("desktop")) >= 0) {
         prints("Desktop autorun configured\n");
     }
+    vfs_close(fd);
 
     // Запись пароля
     if (password[0] != '\0') {
         fs_touch("SystemRoot/config/pass.cfg");
-        FSNode* passfile = fs_find_file("SystemRoot/config/pass.cfg");
-        if (passfile) {
-            strcpy(passfile->content, password);
-            passfile->size = strlen(password);
-            fs_mark_dirty();
-            fs_save_to_disk();
-        }
+        fd = vfs_open("SystemRoot/config/pass.cfg", VFS_O_WRITE | VFS_O_TRUNC);
+        vfs_write(fd, password, strlen(password));
+        vfs_close(fd);
     }
 
     // Завершение установки и перезагрузка
@@ -3408,61 +4429,51 @@ void install_disk() {
 
 void autorun_save_config(const char* command) {
     // Создаем или находим файл автозапуска
-    FSNode* autorun_file = fs_find_file(AUTORUN_FILE);
-    
-    if (!autorun_file) {
-        // Создаем директорию config если её нет
-        fs_mkdir("SystemRoot/config");
-        fs_touch(AUTORUN_FILE);
-        autorun_file = fs_find_file(AUTORUN_FILE);
-    }
-    
-    if (autorun_file) {
-        strcpy(autorun_file->content, command);
-        autorun_file->size = strlen(command);
-        fs_mark_dirty();
-        fs_save_to_disk();
+    // Создаем директорию config и файл, если их нет
+    int fd = vfs_open(AUTORUN_FILE, VFS_O_WRITE | VFS_O_CREATE | VFS_O_TRUNC);
+    if (fd < 0) {
+        fs_error(vfs_strerror(fd), AUTORUN_FILE);
+        return;
     }
+    vfs_write(fd, command, strlen(command));
+    vfs_close(fd);
 }
 
 void autorun_execute(void) {
     // Сохраняем текущую директорию
     char old_dir[MAX_PATH];
-    strcpy(old_dir, current_dir);
+    vfs_getcwd(old_dir, MAX_PATH);
     
-    // Ищем файл во всей файловой системе (без смены директории)
+    // Ищем файл от корня (без смены директории)
     int found = 0;
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, "SystemRoot/config/autorun.cfg") == 0 && !fs_cache[i].is_dir) {
-            FSNode* autorun_file = &fs_cache[i];
-            
-            if (autorun_file->size > 0) {
-                // Копируем содержимое
-                strcpy(autorun_command_buf, autorun_file->content);
-                
-                // Убираем символы переноса строки
-                char* newline = strchr(autorun_command_buf, '\n');
-                if (newline) *newline = '\0';
-                char* cr = strchr(autorun_command_buf, '\r');
-                if (cr) *cr = '\0';
-                
-                // Убираем пробелы
-                trim_whitespace(autorun_command_buf);
-                
-                if (strlen(autorun_command_buf) > 0) {
-                    prints("Executing autorun: '");
-                    prints(autorun_command_buf);
-                    prints("'\n");
-                    run_command(autorun_command_buf);
-                    found = 1;
-                }
-            }
-            break;
+    int fd = vfs_open(AUTORUN_FILE, VFS_O_READ);
+    int len = fd >= 0 ? vfs_read(fd, autorun_command_buf, AUTORUN_MAX_COMMAND - 1) : 0;
+    vfs_close(fd);
+    if (len > 0) {
+        // Копируем содержимое
+        autorun_command_buf[len] = '\0';
+        
+        // Убираем символы переноса строки
+        char* newline = strchr(autorun_command_buf, '\n');
+        if (newline) *newline = '\0';
+        char* cr = strchr(autorun_command_buf, '\r');
+        if (cr) *cr = '\0';
+        
+        // Убираем пробелы
+        trim_whitespace(autorun_command_buf);
+        
+        if (strlen(autorun_command_buf) > 0) {
+            prints("Executing autorun: '");
+            prints(autorun_command_buf);
+            prints("'\n");
+            run_command(autorun_command_buf);
+            found = 1;
         }
     }
     
     // Восстанавливаем директорию
-    strcpy(current_dir, old_dir);
+    vfs_chdir(old_dir);
+    fs_sync_cwd();
 }
 
 void autorun_command(const char* arg) {
@@ -3970,8 +4981,8 @@ void calendar_command() {
 
 /* Writer text editor */
 void writer_command(const char* filename) {
-    FSNode* file = fs_find_file(filename);
-    if (!file) {
+    int fd = vfs_open(filename, VFS_O_RDWR);
+    if (fd < 0) {
         prints("Error: File not found: ");
         prints(filename);
         newline();
@@ -3979,9 +4990,12 @@ void writer_command(const char* filename) {
     }
     
     char content[4096];  // Увеличили буфер до 4096
-    strcpy(content, file->content);
-    int content_len = strlen(content);
+    int content_len = vfs_read(fd, content, sizeof(content) - 1);
+    if (content_len < 0) content_len = 0;
+    content[content_len] = '\0';
+    content_len = strlen(content);
     int cursor_pos = content_len;
+    int dirty_from = content_len;   // только изменённый хвост пишется на диск
     
     unsigned char old_color = text_color;
     int exit_editor = 0;
@@ -4047,6 +5061,7 @@ void writer_command(const char* filename) {
                 
             case '\n': // Enter
                 if (content_len < 4095) {  // Обновили лимит
+                    if (cursor_pos < dirty_from) dirty_from = cursor_pos;
                     for (int i = content_len; i > cursor_pos; i--) {
                         content[i] = content[i-1];
                     }
@@ -4083,6 +5098,7 @@ void writer_command(const char* filename) {
                 
             case '\b': // Backspace
                 if (cursor_pos > 0 && content_len > 0) {
+                    if (cursor_pos - 1 < dirty_from) dirty_from = cursor_pos - 1;
                     for (int i = cursor_pos - 1; i < content_len; i++) {
                         content[i] = content[i+1];
                     }
@@ -4123,6 +5139,7 @@ void writer_command(const char* filename) {
                 
             default: // Обычные символы
                 if (c >= 32 && c <= 126 && content_len < 4095) {  // Обновили лимит
+                    if (cursor_pos < dirty_from) dirty_from = cursor_pos;
                     for (int i = content_len; i > cursor_pos; i--) {
                         content[i] = content[i-1];
                     }
@@ -4161,11 +5178,10 @@ void writer_command(const char* filename) {
     
     // Сохранение файла
     if (save_file) {
-        if (content_len <= sizeof(file->content)) {
-            strcpy(file->content, content);
-            file->size = content_len;
-            fs_mark_dirty();
-            fs_save_to_disk();
+        int err = vfs_seek(fd, dirty_from, VFS_SEEK_SET);
+        if (err >= 0 && content_len > dirty_from) err = vfs_write(fd, content + dirty_from, content_len - dirty_from);
+        if (err >= 0) err = vfs_truncate(fd, content_len);
+        if (err >= 0) {
             prints("\nFile saved: ");
             prints(filename);
             
@@ -4176,9 +5192,12 @@ void writer_command(const char* filename) {
             prints("/4096 bytes)");
             newline();
         } else {
-            prints("\nError: File content too large\n");
+            prints("\nError: ");
+            prints(vfs_strerror(err));
+            newline();
         }
     }
+    vfs_close(fd);
     
     text_color = old_color;
     clear_screen();
@@ -4643,20 +5662,6 @@ void history_command() {
     }
 }
 
-/* Case-insensitive string comparison */
-int strcasecmp(const char* a, const char* b) {
-    while (*a && *b) {
-        char ca = *a;
-        char cb = *b;
-        if (ca >= 'a' && ca <= 'z') ca = ca - 'a' + 'A';
-        if (cb >= 'a' && cb <= 'z') cb = cb - 'a' + 'A';
-        if (ca != cb) return ca - cb;
-        a++;
-        b++;
-    }
-    return (unsigned char)*a - (unsigned char)*b;
-}
-
 /* Command help */
 void show_help() {
     unsigned char old_color = text_color;
@@ -4671,7 +5676,10 @@ void show_help() {
         "time",     "size",     "osver",    "history",  "format",
         "fsck",     "cat",      "explorer", "osinfo",   "autorun",
         "exit",     "pwd",      "find",     "matrix",   "mathgame",
-        "cal",      "rand", NULL
+        "cal",      "rand",     "fsbench",  "mv",       "dedup",
+        "compress", "lzbench", "crcbench",  "log",      "findbench",
+        "grep",     "defrag",   "mount",    "umount",   "iotrace",
+        "snapshot", "backup",   "restore",  NULL
     };
     
     prints("Available commands:");
@@ -4759,6 +5767,7 @@ void run_command(char* line) {
         }
         strcpy(command_history[MAX_HISTORY - 1], line);
     }
+    klog(KLOG_DEBUG, line);
     
     char* p = line;
     while(*p && *p != ' ') p++;
@@ -4784,7 +5793,9 @@ void run_command(char* line) {
         else if(strcasecmp(line, "ls") == 0) fs_ls();
         else if(strcasecmp(line, "cal") == 0) calendar_command();
 	else if(strcasecmp(line, "format") == 0) fs_format();
-	else if(strcasecmp(line, "fsck") == 0) fsck_command();
+	else if(strcasecmp(line, "fsck") == 0) { while(*p == ' ') p++; fsck_command(p); }
+	else if(strcasecmp(line, "defrag") == 0) { while(*p == ' ') p++; defrag_command(p); }
+	else if(strcasecmp(line, "log") == 0) { while(*p == ' ') p++; log_command(p); }
         else if(strcasecmp(line, "cd") == 0) { while(*p == ' ') p++; if(*p) fs_cd(p); else prints("Usage: cd <directory>\n"); }
         else if(strcasecmp(line, "mkdir") == 0) { while(*p == ' ') p++; if(*p) fs_mkdir(p); else prints("Usage: mkdir <name>\n"); }
         else if(strcasecmp(line, "touch") == 0) { while(*p == ' ') p++; if(*p) fs_touch(p); else prints("Usage: touch <name>\n"); }
@@ -4796,9 +5807,23 @@ void run_command(char* line) {
 
 	else if(strcasecmp(line, "exit") == 0) exit_command();
 	else if(strcasecmp(line, "pwd") == 0) {
+    fs_sync_cwd();
     prints(current_dir);
     newline();
 }
+else if(strcasecmp(line, "fsbench") == 0) { while(*p == ' ') p++; fsbench_command(p); }
+else if(strcasecmp(line, "findbench") == 0) { while(*p == ' ') p++; findbench_command(p); }
+else if(strcasecmp(line, "dedup") == 0) { while(*p == ' ') p++; dedup_command(p); }
+else if(strcasecmp(line, "compress") == 0) { while(*p == ' ') p++; if(*p) compress_command(p); else prints("Usage: compress <path> [on|off]\n"); }
+else if(strcasecmp(line, "lzbench") == 0) { while(*p == ' ') p++; lzbench_command(p); }
+else if(strcasecmp(line, "crcbench") == 0) crcbench_command();
+else if(strcasecmp(line, "grep") == 0) grep_command(p);
+else if(strcasecmp(line, "mount") == 0) { while(*p == ' ') p++; mount_command(p); }
+else if(strcasecmp(line, "iotrace") == 0) { while(*p == ' ') p++; iotrace_command(p); }
+else if(strcasecmp(line, "snapshot") == 0) { while(*p == ' ') p++; snapshot_command(p); }
+else if(strcasecmp(line, "backup") == 0) { while(*p == ' ') p++; backup_command(p); }
+else if(strcasecmp(line, "restore") == 0) { while(*p == ' ') p++; if(*p) restore_command(p); else prints("Usage: restore <dir>\n"); }
+else if(strcasecmp(line, "umount") == 0) { while(*p == ' ') p++; if(*p) umount_command(p); else prints("Usage: umount <path>\n"); }
 else if(strcasecmp(line, "find") == 0) {
     while(*p == ' ') p++;
     if(*p) find_command(p);
@@ -4814,6 +5839,18 @@ else if(strcasecmp(line, "find") == 0) {
 	if(*p) fs_cat(p); 
     else prints("Usage: cat <filename>\n"); 
     }
+    else if(strcasecmp(line, "mv") == 0) {
+        while(*p == ' ') p++;
+        if(*p) {
+            char* src;
+            char* dest;
+            split_args(p, &src, &dest);
+            if (dest) fs_move(src, dest);
+            else prints("Usage: mv <src> <dest>\n");
+        } else {
+            prints("Usage: mv <src> <dest>\n");
+        }
+    }
     else if(strcasecmp(line, "copy") == 0) {
         while(*p == ' ') p++;
         if(*p) {
@@ -5069,8 +6106,48 @@ void all_functions(void) {
     autorun_execute();
 }
 
+/* Push the heap start in *end past [start, stop) when that range lies
+ * inside the default heap [_kernel_end, HEAP_LIMIT) */
+static void heap_reserve(u32 start, u32 stop, u32* end) {
+    extern char _kernel_end[];
+    if (start < HEAP_LIMIT && stop > (u32)_kernel_end && stop > *end) *end = stop;
+}
+
+/* GRUB puts modules right after the kernel image, where the heap would
+ * start: move the heap above them and everything describing them. A
+ * module loaded elsewhere leaves the heap where it is. */
+void multiboot_init(void) {
+    extern char _kernel_end[];
+    if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC) return;
+    multiboot_info_t* mbi = (multiboot_info_t*)multiboot_info;
+    if (!(mbi->flags & MULTIBOOT_INFO_MODS) || mbi->mods_count == 0) return;
+    multiboot_module_t* mods = (multiboot_module_t*)mbi->mods_addr;
+
+    u32 end = (u32)_kernel_end;
+    heap_reserve(mbi->mods_addr, (u32)(mods + mbi->mods_count), &end);
+    heap_reserve(multiboot_info, multiboot_info + sizeof(multiboot_info_t), &end);
+    for (u32 i = 0; i < mbi->mods_count; i++) {
+        heap_reserve(mods[i].mod_start, mods[i].mod_end, &end);
+        if (mods[i].string) {
+            heap_reserve(mods[i].string, mods[i].string + strlen((const char*)mods[i].string) + 1, &end);
+        }
+    }
+    int moved = end != (u32)_kernel_end;
+    end = (end + 4095) & ~4095u;
+    // Без места под кучу модуль не нужен - куча важнее; fs_init says so
+    if (end + 0x400000 > HEAP_LIMIT) {
+        initrd_ignored = 1;
+        return;
+    }
+
+    initrd_image = (const u8*)mods[0].mod_start;
+    initrd_size = mods[0].mod_end - mods[0].mod_start;
+    if (moved) heap_init((void*)end, HEAP_LIMIT - end);
+}
+
 /* Kernel main */
-void _start() {
+void kernel_main() {
+    multiboot_init();
     text_color = 0x07;
 
      //Вызов функций которая вызывает другие функций а эти функций другие функций. WTF 0_0
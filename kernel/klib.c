@@ -0,0 +1,119 @@
+/* String and memory helpers, part of the core library */
+#include "klib.h"
+#include "search.h"
+
+#ifndef NULL
+#define NULL ((void*)0)
+#endif
+
+typedef unsigned int u32;
+
+/* Dwords with one string instruction, then the 0-3 bytes left. Copies
+ * forward, so an overlapping copy to a lower address is safe. */
+void memcpy(void* dst, void* src, int len) {
+    if (len <= 0) return;
+    u32 dwords = (u32)len >> 2;
+    __asm__ volatile("rep movsl\n\t"
+                     "mov %3, %%ecx\n\t"
+                     "rep movsb"
+                     : "+D"(dst), "+S"(src), "+c"(dwords)
+                     : "r"((u32)len & 3)
+                     : "memory");
+}
+
+void memset(void* ptr, int value, int num) {
+    if (num <= 0) return;
+    u32 dwords = (u32)num >> 2;
+    __asm__ volatile("rep stosl\n\t"
+                     "mov %3, %%ecx\n\t"
+                     "rep stosb"
+                     : "+D"(ptr), "+c"(dwords)
+                     : "a"((unsigned char)value * 0x01010101u), "r"((u32)num & 3)
+                     : "memory");
+}
+
+int strcmp(const char* a, const char* b) {
+    while(*a && *b && *a == *b) { a++; b++; }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+/* Case-insensitive string comparison */
+int strcasecmp(const char* a, const char* b) {
+    while (*a && *b) {
+        char ca = *a;
+        char cb = *b;
+        if (ca >= 'a' && ca <= 'z') ca = ca - 'a' + 'A';
+        if (cb >= 'a' && cb <= 'z') cb = cb - 'a' + 'A';
+        if (ca != cb) return ca - cb;
+        a++;
+        b++;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+int strlen(const char* s) {
+    const char* p = s;
+    while(*p) p++;
+    return p - s;
+}
+
+void strcpy(char* dst, const char* src) {
+    while((*dst++ = *src++));
+}
+
+char* strcat(char* dest, const char* src) {
+    char* ptr = dest;
+    while(*ptr) ptr++;
+    while((*ptr++ = *src++));
+    return dest;
+}
+
+char* strchr(const char* s, int c) {
+    while(*s) {
+        if(*s == c) return (char*)s;
+        s++;
+    }
+    return NULL;
+}
+
+char* strrchr(const char* s, int c) {
+    const char* last = NULL;
+    while(*s) {
+        if(*s == c) last = s;
+        s++;
+    }
+    return (char*)last;
+}
+
+char* strstr(const char* haystack, const char* needle) {
+    Searcher s;
+    search_init(&s, needle, strlen(needle), 0);
+    int at = search_find(&s, haystack, strlen(haystack));
+    return at < 0 ? NULL : (char*)haystack + at;
+}
+
+int atoi(const char* s) {
+    int r = 0;
+    while(*s >= '0' && *s <= '9') {
+        r = r * 10 + (*s - '0');
+        s++;
+    }
+    return r;
+}
+
+void itoa(int value, char* str, int base) {
+    char* ptr = str, *ptr1 = str, tmp_char;
+    int tmp_value;
+    do {
+        tmp_value = value;
+        value /= base;
+        *ptr++ = "zyxwvutsrqponmlkjihgfedcba9876543210123456789abcdefghijklmnopqrstuvwxyz"[35 + (tmp_value - value * base)];
+    } while (value);
+    if (tmp_value < 0) *ptr++ = '-';
+    *ptr-- = '\0';
+    while(ptr1 < ptr) {
+        tmp_char = *ptr;
+        *ptr-- = *ptr1;
+        *ptr1++ = tmp_char;
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef WEXOS_KLIB_H
+#define WEXOS_KLIB_H
+
+/* String and memory helpers of the core library, shared by every boot
+ * image. The signatures are the kernel's own, not the C library's. */
+void memcpy(void* dst, void* src, int len);
+void memset(void* ptr, int value, int num);
+int strcmp(const char* a, const char* b);
+int strcasecmp(const char* a, const char* b);
+int strlen(const char* s);
+void strcpy(char* dst, const char* src);
+char* strcat(char* dest, const char* src);
+char* strchr(const char* s, int c);
+char* strrchr(const char* s, int c);
+char* strstr(const char* haystack, const char* needle);
+int atoi(const char* s);
+void itoa(int value, char* str, int base);
+
+#endif
@@ -0,0 +1,194 @@
+/* LZ4-style block compressor with hash chains */
+#include "lz.h"
+
+typedef unsigned int u32;
+typedef unsigned short u16;
+typedef unsigned char u8;
+
+/* Unaligned 32-bit access; x86 handles it in hardware */
+typedef u32 __attribute__((may_alias, aligned(1))) lz_u32;
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_CHAIN_DEPTH 16
+#define LZ_SKIP_TRIGGER 6       /* misses before the scan starts skipping */
+
+/* Positions are absolute (lz_base + offset in the current input), so the
+ * tables never need clearing between calls: anything below lz_base
+ * belongs to an earlier input and is ignored. */
+static u32 lz_head[LZ_HASH_SIZE];
+static u32 lz_chain[LZ_MAX_INPUT];
+static u32 lz_base = 1;
+
+static inline u32 lz_read32(const u8* p) {
+    return *(const lz_u32*)p;
+}
+
+static inline u32 lz_hash(u32 v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Length of the common prefix of a and b, comparing four bytes at a time */
+static inline int lz_common(const u8* a, const u8* b, const u8* end) {
+    const u8* start = b;
+    while (b + 4 <= end) {
+        u32 diff = lz_read32(a) ^ lz_read32(b);
+        if (diff) return (int)(b - start) + (__builtin_ctz(diff) >> 3);
+        a += 4;
+        b += 4;
+    }
+    while (b < end && *a == *b) {
+        a++;
+        b++;
+    }
+    return (int)(b - start);
+}
+
+static inline void lz_insert(const u8* src, int pos) {
+    u32 h = lz_hash(lz_read32(src + pos));
+    lz_chain[pos] = lz_head[h];
+    lz_head[h] = lz_base + pos;
+}
+
+/* Write a length continuation (value already reduced by 15) */
+static inline u8* lz_put_len(u8* op, int n) {
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (u8)n;
+    return op;
+}
+
+static u8* lz_emit(u8* op, u8* limit, const u8* lit, int lit_len, int offset, int match_len) {
+    // Worst case: token, two length runs, literals, offset
+    if (op + 1 + lit_len + lit_len / 255 + 1 + 2 + match_len / 255 + 1 > limit) return 0;
+
+    u8* token = op++;
+    int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    *token = (u8)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15) op = lz_put_len(op, lit_len - 15);
+    for (int i = 0; i < lit_len; i++) op[i] = lit[i];
+    op += lit_len;
+
+    if (match_len) {
+        *op++ = (u8)offset;
+        *op++ = (u8)(offset >> 8);
+        if (ml >= 15) op = lz_put_len(op, ml - 15);
+    }
+    return op;
+}
+
+int lz_compress(const unsigned char* src, int len, unsigned char* dst, int cap) {
+    if (len <= 0 || len > LZ_MAX_INPUT) return 0;
+    if (lz_base > 0xFFFFFFFFu - 2 * LZ_MAX_INPUT) {
+        for (int i = 0; i < LZ_HASH_SIZE; i++) lz_head[i] = 0;
+        lz_base = 1;
+    }
+    lz_base += LZ_MAX_INPUT;        // retire the previous input, even if it was cut short
+
+    const u8* end = src + len;
+    u8* op = dst;
+    u8* limit = dst + cap;
+    int anchor = 0;
+    int pos = 0;
+    int misses = 0;
+
+    while (pos + LZ_MIN_MATCH <= len) {
+        u32 seq = lz_read32(src + pos);
+        u32 h = lz_hash(seq);
+        u32 cand = lz_head[h];
+        lz_chain[pos] = cand;
+        lz_head[h] = lz_base + pos;
+
+        int best_len = 0;
+        int best_pos = 0;
+        for (int depth = 0; depth < LZ_CHAIN_DEPTH && cand >= lz_base; depth++) {
+            int cpos = (int)(cand - lz_base);
+            if (lz_read32(src + cpos) == seq) {
+                int n = LZ_MIN_MATCH + lz_common(src + cpos + LZ_MIN_MATCH, src + pos + LZ_MIN_MATCH, end);
+                if (n > best_len) {
+                    best_len = n;
+                    best_pos = cpos;
+                    if (pos + n == len) break;
+                }
+            }
+            cand = lz_chain[cpos];
+        }
+
+        if (best_len < LZ_MIN_MATCH) {
+            // Incompressible stretches are scanned with a growing stride
+            pos += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+
+        op = lz_emit(op, limit, src + anchor, pos - anchor, pos - best_pos, best_len);
+        if (!op) return 0;
+
+        // Index the positions the match covered so later data can refer to them
+        int stop = pos + best_len;
+        for (int p = pos + 1; p < stop && p + LZ_MIN_MATCH <= len; p++) lz_insert(src, p);
+        pos = stop;
+        anchor = pos;
+    }
+
+    op = lz_emit(op, limit, src + anchor, len - anchor, 0, 0);
+    if (!op) return 0;
+    return (int)(op - dst);
+}
+
+int lz_decompress(const unsigned char* src, int slen, unsigned char* dst, int dlen) {
+    const u8* ip = src;
+    const u8* iend = src + slen;
+    u8* op = dst;
+    u8* oend = dst + dlen;
+
+    while (ip < iend && op < oend) {
+        u32 token = *ip++;
+
+        u32 lit = token >> 4;
+        if (lit == 15) {
+            u32 b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (u32)(iend - ip) || lit > (u32)(oend - op)) return -1;
+        u32 n = 0;
+        for (; n + 4 <= lit; n += 4) *(lz_u32*)(op + n) = lz_read32(ip + n);
+        for (; n < lit; n++) op[n] = ip[n];
+        ip += lit;
+        op += lit;
+        if (op == oend || ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        u32 offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (u32)(op - dst)) return -1;
+
+        u32 mlen = (token & 15);
+        if (mlen == 15) {
+            u32 b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (u32)(oend - op)) return -1;
+
+        const u8* match = op - offset;
+        u32 i = 0;
+        if (offset >= 4) {
+            // Every 4-byte read lies entirely in already written output
+            for (; i + 4 <= mlen; i += 4) *(lz_u32*)(op + i) = lz_read32(match + i);
+        }
+        for (; i < mlen; i++) op[i] = match[i];
+        op += mlen;
+    }
+    return (int)(op - dst);
+}
@@ -0,0 +1,22 @@
+#ifndef WEXOS_LZ_H
+#define WEXOS_LZ_H
+
+/* LZ4-style block codec used by WexFS compressed files.
+ *
+ * A stream is a list of sequences: a token byte (literal count in the
+ * high nibble, match length - 4 in the low one, 15 = more length bytes
+ * follow, each 255 meaning "keep adding"), the literals, then a 16-bit
+ * little-endian match offset. The last sequence has literals only.
+ * Inputs are at most one filesystem block, so offsets always fit. */
+#define LZ_MAX_INPUT 4096
+#define LZ_MIN_MATCH 4
+
+/* Compress `len` bytes into at most `cap` bytes; returns the compressed
+ * size, or 0 if the result would not fit. */
+int lz_compress(const unsigned char* src, int len, unsigned char* dst, int cap);
+
+/* Decode up to `dlen` bytes; returns the number of bytes produced, or -1
+ * when the input is malformed. Never reads or writes out of bounds. */
+int lz_decompress(const unsigned char* src, int slen, unsigned char* dst, int dlen);
+
+#endif
@@ -12,7 +12,6 @@ typedef unsigned char u8;
 #define MAX_PATH 1024
 #define SECTOR_SIZE 512
 #define FS_SECTOR_START 1
-#define MAX_FILES 64
 #define MAX_HISTORY 10
 
 #define BLACK 0x000000
@@ -26,8 +25,14 @@ typedef unsigned char u8;
 #define KEY_RIGHT 0x4D
 #define KEY_ENTER 0x1C
 
+#include "wexfs.h"
+#include "ata.h"
+#include "io.h"
+#include "klib.h"
+#include "heap.h"
+#include "backup.h"
+
 /* Function prototypes */
-void itoa(int value, char* str, int base);
 void putchar(char ch);
 char keyboard_getchar();
 void reboot_system();
@@ -36,38 +41,30 @@ void fill_screen(int color);
 void draw_rect(int x, int y, int w, int h, int color);
 void draw_text(int x, int y, char* text, int color);
 unsigned char get_key();
-void memcpy(void* dst, void* src, int len);
-int strcmp(const char* a, const char* b);
-int strlen(const char* s);
-void strcpy(char* dst, const char* src);
-char* strchr(const char* s, int c);
-char* strstr(const char* haystack, const char* needle);
-char* strcat(char* dest, const char* src);
-char* strrchr(const char* s, int c);
 void prints(const char* s);
 void newline();
-void ata_read_sector(u32 lba, u8* buffer);
-void ata_write_sector(u32 lba, u8* buffer);
-void ata_wait_ready();
-void ata_wait_drq();
 void clear_screen();
-void fs_load_from_disk();
-void fs_save_to_disk();
-void fs_mark_dirty();
 void fs_init();
+FSNode* fs_cwd();
 void fs_ls();
 void fs_mkdir(const char* name);
 void fs_touch(const char* name);
 void fs_rm(const char* name);
 void fs_cd(const char* name);
 void fs_copy(const char* src_name, const char* dest_name);
+void fs_move(const char* src_name, const char* dest_name);
 void fs_size(const char* name);
 void fs_format(void);
-void fs_check_integrity(void);
-void fsck_command(void);
+int fs_check_integrity(u32 flags);
+void fsck_command(const char* arg);
+void defrag_command(const char* arg);
+void snapshot_command(char* args);
+void backup_command(char* args);
+void restore_command(char* args);
 void fs_cat(const char* filename);
 void run_command(char* line);
 void trim_whitespace(char* str);
+void split_args(char* args, char** arg1, char** arg2);
 void show_recovery_menu(void);
 
 /* Command history */
@@ -93,374 +90,125 @@ enum { ROWS=25, COLS=80 };
 static unsigned int cursor_row=0, cursor_col=0;
 static unsigned char text_color=0x07;
 
-/* I/O ports */
-static inline void outb(unsigned short port, unsigned char val) {
-    __asm__ volatile("outb %0,%1" : : "a"(val), "Nd"(port));
-}
-static inline unsigned char inb(unsigned short port) {
-    unsigned char r;
-    __asm__ volatile("inb %1,%0" : "=a"(r) : "Nd"(port));
-    return r;
-}
-static inline u16 inw(unsigned short port) {
-    u16 r;
-    __asm__ volatile("inw %1,%0" : "=a"(r) : "Nd"(port));
-    return r;
-}
-static inline void outw(unsigned short port, u16 val) {
-    __asm__ volatile("outw %0,%1" : : "a"(val), "Nd"(port));
-}
-
-/* ATA Disk I/O */
-#define ATA_DATA 0x1F0
-#define ATA_SECTOR_COUNT 0x1F2
-#define ATA_LBA_LOW 0x1F3
-#define ATA_LBA_MID 0x1F4
-#define ATA_LBA_HIGH 0x1F5
-#define ATA_DEVICE 0x1F6
-#define ATA_STATUS 0x1F7
-#define ATA_CMD 0x1F7
-
-typedef struct { 
-    char name[MAX_PATH];
-    int is_dir; 
-    char content[4096];  // Увеличил до 4096 байт
-    u32 next_sector;
-    u32 size;
-} FSNode;
-
-FSNode fs_cache[MAX_FILES];
-int fs_count = 0;
 char current_dir[MAX_PATH] = "/";
-int fs_dirty = 0;
 
 /* Command history */
 char command_history[MAX_HISTORY][128];
 
-/* ATA functions */
-void ata_wait_ready() {
-    while (inb(ATA_STATUS) & 0x80);
-}
-
-void ata_wait_drq() {
-    while (!(inb(ATA_STATUS) & 0x08));
-}
-
-void ata_read_sector(u32 lba, u8* buffer) {
-    outb(ATA_DEVICE, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_SECTOR_COUNT, 1);
-    outb(ATA_LBA_LOW, (u8)lba);
-    outb(ATA_LBA_MID, (u8)(lba >> 8));
-    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
-    outb(ATA_CMD, 0x20);
-
-    ata_wait_ready();
-    if (inb(ATA_STATUS) & 0x01) {
-        prints("ATA Read Error\n");
-        return;
-    }
-
-    ata_wait_drq();
-    for (int i = 0; i < SECTOR_SIZE / 2; i++) {
-        u16 data = inw(ATA_DATA);
-        buffer[i * 2] = (u8)data;
-        buffer[i * 2 + 1] = (u8)(data >> 8);
-    }
-}
-
-void ata_write_sector(u32 lba, u8* buffer) {
-    outb(ATA_DEVICE, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(ATA_SECTOR_COUNT, 1);
-    outb(ATA_LBA_LOW, (u8)lba);
-    outb(ATA_LBA_MID, (u8)(lba >> 8));
-    outb(ATA_LBA_HIGH, (u8)(lba >> 16));
-    outb(ATA_CMD, 0x30);
-
-    ata_wait_ready();
-    ata_wait_drq();
-
-    for (int i = 0; i < SECTOR_SIZE / 2; i++) {
-        u16 data = (buffer[i * 2 + 1] << 8) | buffer[i * 2];
-        outw(ATA_DATA, data);
-    }
-
-    ata_wait_ready();
-    if (inb(ATA_STATUS) & 0x01) {
-        prints("ATA Write Error\n");
-    }
-}
-
-void memset(void* ptr, int value, int num) {
-    unsigned char* p = (unsigned char*)ptr;
-    for (int i = 0; i < num; i++) {
-        p[i] = (unsigned char)value;
-    }
-}
-
 /* Filesystem functions */
-void fs_load_from_disk() {
-    u8 sector_buffer[SECTOR_SIZE];
-    u32 sector = FS_SECTOR_START;
-    fs_count = 0;
-    fs_dirty = 0;
-
-    #define SECTORS_PER_NODE 11
-
-    while (sector != 0 && fs_count < MAX_FILES) {
-        u8* node_data = (u8*)&fs_cache[fs_count];
-        
-        for (int j = 0; j < SECTORS_PER_NODE; j++) {
-            ata_read_sector(sector + j, sector_buffer);
-            int offset = j * SECTOR_SIZE;
-            if (offset < sizeof(FSNode)) {
-                memcpy(node_data + offset, sector_buffer, SECTOR_SIZE);
-            }
-        }
-        
-        sector = fs_cache[fs_count].next_sector;
-        fs_count++;
-    }
-
-    if (fs_count == 0) {
-        strcpy(fs_cache[0].name, "/");
-        fs_cache[0].is_dir = 1;
-        fs_cache[0].content[0] = '\0';
-        fs_cache[0].next_sector = 0;
-        fs_cache[0].size = 0;
-        fs_count = 1;
-        fs_dirty = 1;
-        fs_save_to_disk();
+/* Сами объекты WexFS живут в kernel/wexfs.c, здесь только команды shell */
+void fs_init() {
+    int err = wexfs_mount();
+    if (err != WEXFS_OK) {
+        prints("WexFS: mount failed: ");
+        prints(wexfs_strerror(err));
+        newline();
+        prints("WexFS: the disk was left as it is. Use restore to bring back a backup,\n"
+               "or format to start over (erases the disk).\n");
     }
+    strcpy(current_dir, "/");
 }
 
-void fs_save_to_disk() {
-    if (!fs_dirty) return;
-
-    u8 sector_buffer[SECTOR_SIZE];
-    u32 sector = FS_SECTOR_START;
-
-    // Теперь структура FSNode занимает примерно 4096 + 1024 + 4 + 4 = 5128 байт
-    // 5128 / 512 = 10.01 → 11 секторов на узел
-    #define SECTORS_PER_NODE 11
-
-    for (int i = 0; i < fs_count; i++) {
-        u8* node_data = (u8*)&fs_cache[i];
-        
-        for (int j = 0; j < SECTORS_PER_NODE; j++) {
-            int offset = j * SECTOR_SIZE;
-            if (offset < sizeof(FSNode)) {
-                memcpy(sector_buffer, node_data + offset, SECTOR_SIZE);
-            } else {
-                memset(sector_buffer, 0, SECTOR_SIZE);
-            }
-            ata_write_sector(sector + j, sector_buffer);
-        }
-        
-        sector = (i == fs_count - 1) ? 0 : FS_SECTOR_START + (i + 1) * SECTORS_PER_NODE;
-        if (i < fs_count - 1) {
-            fs_cache[i].next_sector = sector;
-        } else {
-            fs_cache[i].next_sector = 0;
-        }
+/* Current shell directory; falls back to the root if it was removed */
+FSNode* fs_cwd() {
+    FSNode* dir = wexfs_lookup(current_dir);
+    if (!dir || !dir->is_dir) {
+        strcpy(current_dir, "/");
+        dir = wexfs_root();
     }
-
-    fs_dirty = 0;
+    return dir;
 }
 
-void fs_mark_dirty() {
-    fs_dirty = 1;
-}
-
-void fs_init() {
-    fs_load_from_disk();
-    strcpy(current_dir, "/");
+void fs_error(const char* message, const char* name) {
+    prints("Error: ");
+    prints(message);
+    prints(": ");
+    prints(name);
+    newline();
 }
 
+/* ls - sorted, one screen at a time */
 void fs_ls() {
     prints("Contents of ");
     prints(current_dir);
     prints(":\n");
 
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(current_dir, "/") == 0) {
-            char* slash = strchr(fs_cache[i].name, '/');
-            if (slash == NULL || slash == fs_cache[i].name) {
-                prints(fs_cache[i].name);
-                if (fs_cache[i].is_dir) prints("/");
-                newline();
-            }
-        } else {
-            if (strstr(fs_cache[i].name, current_dir) == fs_cache[i].name) {
-                char* name_part = fs_cache[i].name + strlen(current_dir);
-                if (*name_part != '\0' && strchr(name_part, '/') == NULL) {
-                    prints(name_part);
-                    if (fs_cache[i].is_dir) prints("/");
-                    newline();
-                }
-            }
-        }
-    }
-}
-
-void fs_mkdir(const char* name) {
-    if (fs_count >= MAX_FILES) {
-        prints("Error: Maximum files reached\n");
+    WexDir* d = (WexDir*)kmalloc(sizeof(WexDir));
+    if (!d) {
+        prints("Error: Out of memory\n");
         return;
     }
-
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, name);
-    } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
-    }
-
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0) {
-            prints("Error: Name already exists: ");
-            prints(name);
+    wexfs_opendir(fs_cwd(), WEXFS_DIR_SORTED, d);
+    int lines = 1;
+    FSNode* node;
+    while ((node = wexfs_readdir(d))) {
+        if (lines == ROWS - 2) {
+            prints("-- More -- (q to stop)");
+            char c = keyboard_getchar();
             newline();
-            return;
+            if (c == 'q' || c == 'Q') break;
+            lines = 0;
         }
+        prints(node->name);
+        if (node->is_dir) prints("/");
+        newline();
+        lines++;
     }
-
-    strcpy(fs_cache[fs_count].name, full_path);
-    fs_cache[fs_count].is_dir = 1;
-    fs_cache[fs_count].content[0] = '\0';
-    fs_cache[fs_count].next_sector = 0;
-    fs_cache[fs_count].size = 0;
-    fs_count++;
-    fs_mark_dirty();
-    fs_save_to_disk();
-    prints("Directory '");
-    prints(name);
-    prints("' created\n");
+    kfree(d);
 }
 
-void fs_touch(const char* name) {
-    if (fs_count >= MAX_FILES) {
-        prints("Error: Maximum files reached\n");
-        return;
-    }
-
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, name);
-    } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
+/* Create `name` (may contain a path) relative to the current directory */
+FSNode* fs_create(const char* name, int type) {
+    if (strlen(name) >= MAX_PATH) {
+        fs_error("Path too long", name);
+        return NULL;
     }
 
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0) {
-            prints("Error: Name already exists: ");
-            prints(name);
-            newline();
-            return;
-        }
+    char leaf[MAX_NAME];
+    FSNode* dir = wexfs_lookup_parent(fs_cwd(), name, leaf);
+    if (!dir) {
+        fs_error("Invalid path", name);
+        return NULL;
     }
 
-    strcpy(fs_cache[fs_count].name, full_path);
-    fs_cache[fs_count].is_dir = 0;
-    fs_cache[fs_cache[fs_count].content[0] = '\0'];
-    fs_cache[fs_count].next_sector = 0;
-    fs_cache[fs_count].size = 0;
-    fs_count++;
-    fs_mark_dirty();
-    fs_save_to_disk();
-    prints("File '");
-    prints(name);
-    prints("' created\n");
+    int err;
+    FSNode* node = wexfs_create(dir, leaf, type, &err);
+    if (!node) fs_error(wexfs_strerror(err), name);
+    return node;
 }
 
-void fs_rm(const char* name) {
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, name);
-    } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
+void fs_mkdir(const char* name) {
+    if (fs_create(name, WEXFS_DIR)) {
+        prints("Directory '");
+        prints(name);
+        prints("' created\n");
     }
+}
 
-    int found = -1;
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0) {
-            found = i;
-            break;
-        }
+void fs_touch(const char* name) {
+    if (fs_create(name, WEXFS_FILE)) {
+        prints("File '");
+        prints(name);
+        prints("' created\n");
     }
+}
 
-    if (found == -1) {
-        prints("Error: File or directory not found: ");
-        prints(name);
-        newline();
+void fs_rm(const char* name) {
+    FSNode* node = wexfs_lookup_at(fs_cwd(), name);
+    if (!node) {
+        fs_error("File or directory not found", name);
         return;
     }
-
-    if (fs_cache[found].is_dir) {
-        char dir_path[MAX_PATH];
-        strcpy(dir_path, full_path);
-        if (strcmp(full_path, "/") != 0) {
-            if (strlen(dir_path) + 1 >= MAX_PATH) {
-                prints("Error: Directory path too long\n");
-                return;
-            }
-            strcat(dir_path, "/");
-        }
-
-        for (int i = fs_count - 1; i >= 0; i--) {
-            if (i != found && strstr(fs_cache[i].name, dir_path) == fs_cache[i].name) {
-                for (int j = i; j < fs_count - 1; j++) {
-                    fs_cache[j] = fs_cache[j + 1];
-                }
-                fs_count--;
-            }
-        }
+    if (node == wexfs_root()) {
+        prints("Error: Cannot remove the root directory\n");
+        return;
     }
 
-    for (int i = found; i < fs_count - 1; i++) {
-        fs_cache[i] = fs_cache[i + 1];
+    int err = wexfs_remove(node);
+    if (err != WEXFS_OK) {
+        fs_error(wexfs_strerror(err), name);
+        return;
     }
-    fs_count--;
-    fs_mark_dirty();
-    fs_save_to_disk();
 
     prints("'");
     prints(name);
@@ -468,117 +216,34 @@ void fs_rm(const char* name) {
 }
 
 void fs_cd(const char* name) {
-    if (strcmp(name, "..") == 0) {
-        if (strcmp(current_dir, "/") != 0) {
-            char* last_slash = strrchr(current_dir, '/');
-            if (last_slash != NULL) {
-                *last_slash = '\0';
-                if (current_dir[0] == '\0') {
-                    strcpy(current_dir, "/");
-                }
-            }
-        }
-    } else if (strcmp(name, "/") == 0) {
-        strcpy(current_dir, "/");
-    } else {
-        char full_path[MAX_PATH];
-        if (strcmp(current_dir, "/") == 0) {
-            if (strlen(name) >= MAX_NAME) {
-                prints("Error: Name too long: ");
-                prints(name);
-                newline();
-                return;
-            }
-            strcpy(full_path, name);
-        } else {
-            if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-                prints("Error: Path too long: ");
-                prints(name);
-                newline();
-                return;
-            }
-            strcpy(full_path, current_dir);
-            strcat(full_path, name);
-        }
-
-        int found = 0;
-        for (int i = 0; i < fs_count; i++) {
-            if (strcmp(fs_cache[i].name, full_path) == 0 && fs_cache[i].is_dir) {
-                strcpy(current_dir, full_path);
-                if (strcmp(full_path, "/") != 0) {
-                    strcat(current_dir, "/");
-                }
-                found = 1;
-                break;
-            }
-        }
+    FSNode* dir = wexfs_lookup_at(fs_cwd(), name);
+    if (!dir || !dir->is_dir) {
+        fs_error("Directory not found", name);
+        return;
+    }
 
-        if (!found) {
-            prints("Error: Directory not found: ");
-            prints(name);
-            newline();
-        }
+    char path[MAX_PATH];
+    if (wexfs_path(dir, path, MAX_PATH - 1) < 0) {
+        fs_error("Path too long", name);
+        return;
     }
+    strcpy(current_dir, path);
+    if (dir->parent) strcat(current_dir, "/");
 }
 
 FSNode* fs_find_file(const char* name) {
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(name) >= MAX_NAME) {
-            prints("Error: Name too long: ");
-            prints(name);
-            newline();
-            return NULL;
-        }
-        strcpy(full_path, name);
-    } else {
-        if (strlen(current_dir) + strlen(name) + 1 >= MAX_PATH) {
-            prints("Error: Path too long: ");
-            prints(name);
-            newline();
-            return NULL;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, name);
+    if (strlen(name) >= MAX_PATH) {
+        fs_error("Path too long", name);
+        return NULL;
     }
 
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, full_path) == 0 && !fs_cache[i].is_dir) {
-            return &fs_cache[i];
-        }
-    }
+    FSNode* node = wexfs_lookup_at(fs_cwd(), name);
+    if (node && !node->is_dir) return node;
     return NULL;
 }
 
 void fs_copy(const char* src_name, const char* dest_name) {
-    char src_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(src_name) >= MAX_NAME) {
-            prints("Error: Source name too long: ");
-            prints(src_name);
-            newline();
-            return;
-        }
-        strcpy(src_path, src_name);
-    } else {
-        if (strlen(current_dir) + strlen(src_name) + 1 >= MAX_PATH) {
-            prints("Error: Source path too long: ");
-            prints(src_name);
-            newline();
-            return;
-        }
-        strcpy(src_path, current_dir);
-        strcat(src_path, src_name);
-    }
-
-    FSNode* src = NULL;
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, src_path) == 0 && !fs_cache[i].is_dir) {
-            src = &fs_cache[i];
-            break;
-        }
-    }
-
+    FSNode* src = fs_find_file(src_name);
     if (!src) {
         prints("Error: Source file not found: ");
         prints(src_name);
@@ -586,70 +251,86 @@ void fs_copy(const char* src_name, const char* dest_name) {
         return;
     }
 
-    if (fs_count >= MAX_FILES) {
-        prints("Error: Maximum files reached\n");
+    char leaf[MAX_NAME];
+    FSNode* dir = wexfs_lookup_parent(fs_cwd(), dest_name, leaf);
+    if (!dir) {
+        fs_error("Invalid path", dest_name);
+        return;
+    }
+
+    // Копия ссылается на те же блоки, данные копируются только при записи
+    int err;
+    if (!wexfs_clone(src, dir, leaf, &err)) {
+        fs_error(wexfs_strerror(err), dest_name);
         return;
     }
 
-    char full_path[MAX_PATH];
-    if (strcmp(current_dir, "/") == 0) {
-        if (strlen(dest_name) >= MAX_NAME) {
-            prints("Error: Destination name too long: ");
-            prints(dest_name);
-            newline();
-            return;
-        }
-        strcpy(full_path, dest_name);
-    } else {
-        if (strlen(current_dir) + strlen(dest_name) + 1 >= MAX_PATH) {
-            prints("Error: Destination path too long: ");
-            prints(dest_name);
-            newline();
-            return;
-        }
-        strcpy(full_path, current_dir);
-        strcat(full_path, dest_name);
-    }
-
-    strcpy(fs_cache[fs_count].name, full_path);
-    fs_cache[fs_count].is_dir = 0;
-    strcpy(fs_cache[fs_count].content, src->content);
-    fs_cache[fs_count].next_sector = 0;
-    fs_cache[fs_count].size = src->size;
-    fs_count++;
-    fs_mark_dirty();
-    fs_save_to_disk();
     prints("File copied to '");
     prints(dest_name);
     prints("'\n");
 }
 
-int folder_size(const char* folder_path) {
-    int total = 0;
-    char path_with_slash[MAX_PATH];
-    strcpy(path_with_slash, folder_path);
-    if (folder_path[strlen(folder_path) - 1] != '/') {
-        strcat(path_with_slash, "/");
+/* Move or rename; a directory destination receives the source by its own name */
+void fs_move(const char* src_name, const char* dest_name) {
+    FSNode* node = wexfs_lookup_at(fs_cwd(), src_name);
+    if (!node) {
+        fs_error("File or directory not found", src_name);
+        return;
+    }
+    if (node == wexfs_root()) {
+        prints("Error: Cannot move the root directory\n");
+        return;
     }
 
-    for (int i = 0; i < fs_count; i++) {
-        FSNode* node = &fs_cache[i];
-        if (!node->is_dir && strstr(node->name, path_with_slash) == node->name) {
-            total += node->size;
+    char leaf[MAX_NAME];
+    FSNode* dir = wexfs_lookup_at(fs_cwd(), dest_name);
+    if (dir && dir->is_dir && dir != node) {
+        strcpy(leaf, node->name);
+    } else {
+        dir = wexfs_lookup_parent(fs_cwd(), dest_name, leaf);
+        if (!dir) {
+            fs_error("Invalid path", dest_name);
+            return;
         }
     }
-    return total;
+
+    // Текущий каталог хранится строкой, поэтому после переноса пересчитываем путь
+    FSNode* cwd = fs_cwd();
+    int err = wexfs_rename(node, dir, leaf);
+    if (err != WEXFS_OK) {
+        fs_error(wexfs_strerror(err), dest_name);
+        return;
+    }
+    char path[MAX_PATH];
+    if (wexfs_path(cwd, path, MAX_PATH - 1) >= 0) {
+        strcpy(current_dir, path);
+        if (cwd->parent) strcat(current_dir, "/");
+    }
+
+    prints("'");
+    prints(src_name);
+    prints("' moved to '");
+    prints(dest_name);
+    prints("'\n");
 }
 
-void fs_size(const char* name) {
-    FSNode* node = NULL;
-    for (int i = 0; i < fs_count; i++) {
-        if (strcmp(fs_cache[i].name, name) == 0) {
-            node = &fs_cache[i];
-            break;
-        }
+/* Byte count for the size commands; itoa is signed, so 2 GB and up
+ * (clones can add up past the volume size) are shown in KB. */
+void print_bytes(unsigned long long bytes) {
+    char buf[16];
+    if (bytes >= 0x80000000ull) {
+        itoa((int)(bytes >> 10), buf, 10);
+        prints(buf);
+        prints(" KB");
+    } else {
+        itoa((int)bytes, buf, 10);
+        prints(buf);
+        prints(" Bytes");
     }
+}
 
+void fs_size(const char* name) {
+    FSNode* node = wexfs_lookup_at(fs_cwd(), name);
     if (!node) {
         prints("Error: File or folder not found: ");
         prints(name);
@@ -657,139 +338,203 @@ void fs_size(const char* name) {
         return;
     }
 
-    int size;
     if (node->is_dir) {
-        size = folder_size(node->name);
+        // Totals are kept up to date by WexFS, no walk needed
+        char count[12];
         prints("Folder size: ");
+        print_bytes(node->tree_bytes);
+        prints(" in ");
+        itoa(node->tree_files, count, 10);
+        prints(count);
+        prints(node->tree_files == 1 ? " file\n" : " files\n");
     } else {
-        size = node->size;
         prints("File size: ");
+        print_bytes(node->di.size);
+        newline();
+    }
+}
+
+
+/* Patterns with a '/' are matched against whole paths */
+static void find_paths(const char* pattern) {
+    // Depth-first over sorted directories; the path grows and shrinks
+    // with the walk instead of being rebuilt for every object
+    int depth_max = 16;
+    int depth = 0;
+    WexDir* stack = (WexDir*)kmalloc(depth_max * sizeof(WexDir));
+    int* mark = (int*)kmalloc(depth_max * sizeof(int));
+    char path[MAX_PATH];
+    if (!stack || !mark) {
+        kfree(stack);
+        kfree(mark);
+        prints("Error: Out of memory\n");
+        return;
     }
+    wexfs_opendir(wexfs_root(), WEXFS_DIR_SORTED, &stack[0]);
+    mark[0] = 0;
+    path[0] = '\0';
 
-    char size_str[16];
-    itoa(size, size_str, 10);
-    prints(size_str);
-    prints(" Bytes\n");
+    while (depth >= 0) {
+        FSNode* node = wexfs_readdir(&stack[depth]);
+        if (!node) {
+            depth--;
+            continue;
+        }
+        int len = mark[depth];
+        int name_len = strlen(node->name);
+        if (len + name_len + 2 > MAX_PATH) continue;
+        path[len] = '/';
+        strcpy(path + len + 1, node->name);
+        if (strstr(path, pattern) != NULL) {
+            prints(path);
+            if (node->is_dir) prints("/");
+            newline();
+        }
+        if (!node->is_dir || !node->children) continue;
+
+        if (depth + 1 == depth_max) {
+            WexDir* grown = (WexDir*)krealloc(stack, depth_max * 2 * sizeof(WexDir));
+            int* grown_mark = grown ? (int*)krealloc(mark, depth_max * 2 * sizeof(int)) : NULL;
+            if (grown) stack = grown;
+            if (!grown_mark) continue;
+            mark = grown_mark;
+            depth_max *= 2;
+        }
+        depth++;
+        wexfs_opendir(node, WEXFS_DIR_SORTED, &stack[depth]);
+        mark[depth] = len + 1 + name_len;
+    }
+    kfree(stack);
+    kfree(mark);
 }
 
+/* find <name|glob> - objects whose name contains the text or matches the
+ * glob (find *.cfg); looked up through the name index */
 void find_command(const char* pattern) {
     prints("Searching for: ");
     prints(pattern);
     newline();
-    for(int i = 0; i < fs_count; i++) {
-        if(strstr(fs_cache[i].name, pattern) != NULL) {
-            prints(fs_cache[i].name);
-            if(fs_cache[i].is_dir) prints("/");
-            newline();
+
+    for (const char* p = pattern; *p; p++) {
+        if (*p == '/') {
+            find_paths(pattern);
+            return;
         }
     }
+
+    FSNode** hits = (FSNode**)kmalloc(fs_count * sizeof(FSNode*));
+    if (!hits) {
+        prints("Error: Out of memory\n");
+        return;
+    }
+    int count = wexfs_find(pattern, 0, hits, fs_count);
+    char path[MAX_PATH];
+    for (int i = 0; i < count; i++) {
+        if (wexfs_path(hits[i], path, MAX_PATH) < 0) continue;
+        prints("/");
+        prints(path);
+        if (hits[i]->is_dir) prints("/");
+        newline();
+    }
+    kfree(hits);
 }
 
-void pwd_command() { 
-    prints(current_dir); 
-    newline(); 
+void pwd_command() {
+    prints(current_dir);
+    newline();
 }
 
 void fs_format(void) {
     prints("WARNING: This will erase ALL files and directories!\n");
     prints("Are you sure you want to continue? (y/N): ");
-    
+
     char confirm = keyboard_getchar();
     putchar(confirm);
     newline();
-    
+
     if (confirm == 'y' || confirm == 'Y') {
         prints("Formatting filesystem...\n");
-        
-        fs_count = 1;
-        strcpy(fs_cache[0].name, "/");
-        fs_cache[0].is_dir = 1;
-        fs_cache[0].content[0] = '\0';
-        fs_cache[0].next_sector = 0;
-        fs_cache[0].size = 0;
-        
+
+        int err = wexfs_format(0);
+
+        // Сбрасываем текущую директорию
         strcpy(current_dir, "/");
-        
-        fs_mark_dirty();
-        fs_save_to_disk();
-        
-        prints("Filesystem formatted successfully.\n");
+
+        if (err == WEXFS_OK) {
+            prints("Filesystem formatted successfully.\n");
+        } else {
+            prints("Format failed: ");
+            prints(wexfs_strerror(err));
+            newline();
+        }
     } else {
         prints("Format cancelled.\n");
     }
 }
 
+
 /* Function implementations */
-void fs_check_integrity(void) {
+/* Run a full check in one go, printing each phase as it starts;
+ * returns the number of errors. */
+int fs_check_integrity(u32 flags) {
+    static const char* phases[] = {
+        "Phase 1: Checking names and directory links...\n",
+        "Phase 2: Checking block pointers and checksums...\n",
+        "Phase 3: Checking free space and reference counts...\n",
+    };
+
     prints("Checking filesystem integrity...\n");
     prints("Filesystem: WexFS\n");
-    prints("Version: 1.0\n");
+    prints("Version: 2.0\n");
     prints("======================================\n");
-    
-    int errors_found = 0;
-    int warnings_found = 0;
-    
-    // Проверка на дубликаты
-    prints("Phase 1: Checking for duplicates...\n");
-    for (int i = 0; i < fs_count; i++) {
-        for (int j = i + 1; j < fs_count; j++) {
-            if (strcmp(fs_cache[i].name, fs_cache[j].name) == 0) {
-                prints("ERROR: Duplicate filename: ");
-                prints(fs_cache[i].name);
-                newline();
-                errors_found++;
-            }
-        }
+
+    WexFsck ck;
+    int rc = wexfs_fsck_begin(&ck, flags | WEXFS_FSCK_VERBOSE);
+    if (rc != WEXFS_OK) {
+        prints("Error: ");
+        prints(wexfs_strerror(rc));
+        newline();
+        return 1;
     }
-    
-    // Проверка размера контента
-    prints("Phase 2: Checking file sizes...\n");
-    for (int i = 0; i < fs_count; i++) {
-        if (!fs_cache[i].is_dir) {
-            if (fs_cache[i].size > sizeof(fs_cache[i].content)) {
-                prints("ERROR: File size exceeds content buffer: ");
-                prints(fs_cache[i].name);
-                newline();
-                prints("  File size: ");
-                char size_str[20];
-                itoa(fs_cache[i].size, size_str, 10);
-                prints(size_str);
-                prints(", Max allowed: ");
-                itoa(sizeof(fs_cache[i].content), size_str, 10);
-                prints(size_str);
-                newline();
-                errors_found++;
-            }
+    u32 shown = WEXFS_FSCK_DONE;
+    while (rc == 0) {
+        if (ck.phase != shown && ck.phase < WEXFS_FSCK_DONE) {
+            shown = ck.phase;
+            prints(phases[shown]);
         }
+        rc = wexfs_fsck_step(&ck, 0xFFFFFFFF);
     }
-    
-    // Проверка максимального количества файлов
-    prints("Phase 3: Checking filesystem limits...\n");
-    if (fs_count >= MAX_FILES) {
-        prints("WARNING: Filesystem at maximum capacity (");
-        char max_str[10];
-        itoa(MAX_FILES, max_str, 10);
-        prints(max_str);
-        prints(" files)\n");
+
+    int errors_found = ck.errors;
+    int warnings_found = ck.warnings;
+    if (wexfs_csum_errors) {
+        char count[12];
+        itoa(wexfs_csum_errors, count, 10);
+        prints("ERROR: Checksum mismatches since mount: ");
+        prints(count);
+        newline();
+        errors_found++;
+    }
+    if (wexfs_free_blocks < wexfs_sb.total_blocks / 100) {
+        prints("WARNING: Less than 1% of the volume is free\n");
         warnings_found++;
     }
-    
-    // Статистика
-    prints("Phase 4: Generating statistics...\n");
+
     int total_files = 0;
     int total_dirs = 0;
-    
-    for (int i = 0; i < fs_count; i++) {
-        if (fs_cache[i].is_dir) {
+    for (u32 ino = 0; ino < fs_node_slots; ino++) {
+        FSNode* node = fs_nodes[ino];
+        if (!node) continue;
+        if (node->is_dir) {
             total_dirs++;
         } else {
             total_files++;
         }
     }
-    
+
     prints("======================================\n");
     prints("Filesystem check completed.\n");
-    
+
     char buf[20];
     itoa(total_files, buf, 10);
     prints("Files: "); prints(buf); newline();
@@ -797,158 +542,313 @@ void fs_check_integrity(void) {
     prints("Directories: "); prints(buf); newline();
     itoa(fs_count, buf, 10);
     prints("Total objects: "); prints(buf); newline();
-    itoa(MAX_FILES - fs_count, buf, 10);
-    prints("Free slots: "); prints(buf); newline();
-    
+    itoa(ck.blocks, buf, 10);
+    prints("Blocks verified: "); prints(buf); newline();
+    itoa(wexfs_free_blocks, buf, 10);
+    prints("Free blocks: "); prints(buf);
+    itoa(wexfs_sb.total_blocks, buf, 10);
+    prints(" of "); prints(buf); newline();
+
     if (errors_found > 0) {
         itoa(errors_found, buf, 10);
         prints("Errors found: "); prints(buf); newline();
-        prints("Run 'format' to fix filesystem errors.\n");
     } else {
         prints("No errors found.\n");
     }
-    
     if (warnings_found > 0) {
         itoa(warnings_found, buf, 10);
         prints("Warnings: "); prints(buf); newline();
     }
-    
+    if (ck.repaired > 0) {
+        itoa(ck.repaired, buf, 10);
+        prints("Repaired: "); prints(buf); newline();
+    }
+
     prints("Filesystem is ");
     if (errors_found == 0) {
         prints("OK");
+    } else if (flags & WEXFS_FSCK_REPAIR) {
+        prints("REPAIRED");
     } else {
         prints("CORRUPTED");
     }
     prints(".\n");
+    wexfs_fsck_end(&ck);
+    return errors_found;
 }
-void fsck_command(void) {
-    prints("Filesystem Consistency Check\n");
-    prints("============================\n");
-    prints("This utility will check WexFS filesystem for errors\n");
-    prints("and report any inconsistencies.\n\n");
-    
-    prints("Continue? (y/N): ");
-    
+
+/* fsck - offline check, with repair when problems are found */
+void fsck_command(const char* arg) {
+    (void)arg;
+    if (fs_check_integrity(0) == 0) return;
+
+    prints("\nRepair the filesystem? (y/N): ");
     char confirm = keyboard_getchar();
     putchar(confirm);
     newline();
-    
     if (confirm == 'y' || confirm == 'Y') {
-        fs_check_integrity();
+        fs_check_integrity(WEXFS_FSCK_REPAIR);
     } else {
-        prints("Operation cancelled.\n");
+        prints("Repair cancelled.\n");
     }
 }
 
-void fs_cat(const char* filename) {
-    if (filename == NULL || strlen(filename) == 0) {
-        prints("Usage: cat <filename>\n");
+/* defrag [analyze] - offline defragmentation. Nothing else has the
+ * volume open here, so directories are renumbered as well. */
+void defrag_command(const char* arg) {
+    static const char* phases[] = {
+        "Phase 1: Packing the inode table...\n",
+        "Phase 2: Moving fragmented files...\n",
+    };
+    int analyze = arg && strcasecmp(arg, "analyze") == 0;
+    if (arg && *arg && !analyze) {
+        prints("Usage: defrag [analyze]\n");
         return;
     }
 
-    FSNode* file = fs_find_file(filename);
-    if (!file) {
-        prints("Error: File not found: ");
-        prints(filename);
+    WexDefrag df;
+    int rc = wexfs_defrag_begin(&df, analyze ? WEXFS_DEFRAG_ANALYZE : WEXFS_DEFRAG_OFFLINE);
+    u32 shown = WEXFS_DEFRAG_DONE;
+    u32 shown_pct = 0;
+    char buf[16];
+    while (rc == 0) {
+        if (df.phase != shown && df.phase < WEXFS_DEFRAG_DONE) {
+            shown = df.phase;
+            shown_pct = 0;
+            prints(phases[shown]);
+        }
+        u32 pct = wexfs_defrag_progress(&df);
+        if (df.phase == WEXFS_DEFRAG_FILES && pct >= shown_pct + 10) {
+            shown_pct = pct - pct % 10;
+            itoa(shown_pct, buf, 10);
+            prints("  ");
+            prints(buf);
+            prints("%\n");
+        }
+        rc = wexfs_defrag_step(&df, 256);
+    }
+    if (rc < 0) {
+        prints("Error: ");
+        prints(wexfs_strerror(rc));
         newline();
+        wexfs_defrag_end(&df);
         return;
     }
 
-    if (file->is_dir) {
-        prints("Error: '");
-        prints(filename);
-        prints("' is a directory\n");
+    prints("Files checked: ");
+    itoa(df.objects, buf, 10); prints(buf);
+    prints("\nFragmented: ");
+    itoa(df.fragmented, buf, 10); prints(buf);
+    if (!analyze) {
+        prints("\nMoved: ");
+        itoa(df.moved, buf, 10); prints(buf);
+        prints(" files, ");
+        itoa(df.blocks, buf, 10); prints(buf);
+        prints(" blocks\nInodes renumbered: ");
+        itoa(df.renumbered, buf, 10); prints(buf);
+        prints("\nInode table blocks freed: ");
+        itoa(df.freed, buf, 10); prints(buf);
+    }
+    prints("\nSkipped: ");
+    itoa(df.skipped, buf, 10); prints(buf);
+    newline();
+    wexfs_defrag_end(&df);
+}
+
+/* snapshot [list|create|restore|delete <name>] - roll the system disk
+ * back to a snapshot taken before an update. The files it replaces are
+ * kept as snapshot <name>~. */
+void snapshot_command(char* args) {
+    char buf[16];
+    char* cmd;
+    char* name;
+    split_args(args, &cmd, &name);
+    if (!*cmd || strcasecmp(cmd, "list") == 0) {
+        WexSnapshot* list = (WexSnapshot*)kmalloc(WEXFS_MAX_SNAPSHOTS * sizeof(WexSnapshot));
+        if (!list) {
+            prints("Error: Out of memory\n");
+            return;
+        }
+        int count = wexfs_snapshot_list(list, WEXFS_MAX_SNAPSHOTS);
+        if (count == 0) prints("No snapshots\n");
+        for (int i = 0; i < count; i++) {
+            prints("  ");
+            prints(list[i].name);
+            for (int s = strlen(list[i].name); s < WEXFS_SNAP_NAME; s++) putchar(' ');
+            itoa(list[i].objects, buf, 10);
+            prints(buf);
+            prints(" objects\n");
+        }
+        kfree(list);
         return;
     }
-
-    if (file->size > 0) {
-        prints(file->content);
+    if (!name || !*name) {
+        prints("Usage: snapshot [list|create <name>|restore <name>|delete <name>]\n");
+        return;
+    }
+    int err;
+    if (strcasecmp(cmd, "create") == 0) {
+        err = wexfs_snapshot_create(name);
+    } else if (strcasecmp(cmd, "delete") == 0) {
+        err = wexfs_snapshot_delete(name);
+    } else if (strcasecmp(cmd, "restore") == 0) {
+        prints("WARNING: All files will be replaced by snapshot '");
+        prints(name);
+        prints("'!\nAre you sure you want to continue? (y/N): ");
+        char confirm = keyboard_getchar();
+        putchar(confirm);
         newline();
+        if (confirm != 'y' && confirm != 'Y') {
+            prints("Restore cancelled.\n");
+            return;
+        }
+        err = wexfs_snapshot_restore(name);
+        strcpy(current_dir, "/");
+        if (err == WEXFS_OK) {
+            prints("Restored. The previous files are kept as snapshot '");
+            prints(name);
+            prints("~'.\n");
+        }
     } else {
-        prints("File is empty\n");
+        prints("Usage: snapshot [list|create <name>|restore <name>|delete <name>]\n");
+        return;
     }
+    if (err != WEXFS_OK) fs_error(wexfs_strerror(err), name);
 }
 
-/* String functions */
-void memcpy(void* dst, void* src, int len) {
-    char* d = (char*)dst;
-    char* s = (char*)src;
-    while (len--) *d++ = *s++;
+/* The second disk (primary slave) as the backup target; 0 if there is none */
+static int backup_disk(BackupDev* dev) {
+    dev->sectors = ata_slave_identify();
+    dev->read = ata_slave_read;
+    dev->write = ata_slave_write;
+    dev->flush = ata_slave_flush;
+    if (!dev->sectors) prints("Error: No second disk (primary slave) with a backup\n");
+    return dev->sectors != 0;
 }
 
-int strcmp(const char* a, const char* b) {
-    while(*a && *b && *a == *b) { a++; b++; }
-    return (unsigned char)*a - (unsigned char)*b;
-}
-
-int strlen(const char* s) {
-    const char* p = s;
-    while(*p) p++;
-    return p - s;
-}
-
-void strcpy(char* dst, const char* src) {
-    while((*dst++ = *src++));
-}
-
-char* strchr(const char* s, int c) {
-    while(*s) {
-        if(*s == c) return (char*)s;
-        s++;
+/* backup [full] - copy what changed since the last backup to the second disk */
+void backup_command(char* args) {
+    char buf[16];
+    BackupDev dev;
+    if (!backup_disk(&dev)) return;
+    if (*args && strcasecmp(args, "full") != 0) {
+        prints("Usage: backup [full]\n");
+        return;
     }
-    return NULL;
-}
-
-char* strstr(const char* haystack, const char* needle) {
-    if(!*needle) return (char*)haystack;
-    for(const char* p = haystack; *p; p++) {
-        const char* h = p, *n = needle;
-        while(*h && *n && *h == *n) { h++; n++; }
-        if(!*n) return (char*)p;
+    BackupResult res;
+    int err = backup_run(&dev, *args ? BACKUP_FULL : 0, &res);
+    if (err != WEXFS_OK) {
+        fs_error(wexfs_strerror(err), "backup");
+        return;
     }
-    return NULL;
+    prints(res.full ? "Full backup, session " : "Incremental backup, session ");
+    itoa(res.session, buf, 10);
+    prints(buf);
+    prints(": ");
+    itoa(res.files, buf, 10);
+    prints(buf);
+    prints(" files copied, ");
+    itoa(res.sectors / 2, buf, 10);
+    prints(buf);
+    prints(" KB written\n");
 }
 
-char* strcat(char* dest, const char* src) {
-    char* ptr = dest;
-    while(*ptr) ptr++;
-    while((*ptr++ = *src++));
-    return dest;
+/* restore [dir] - bring back the last backup from the second disk. With
+ * a directory it is recreated there; without one the system disk is
+ * formatted and restored as a whole. */
+void restore_command(char* args) {
+    char buf[16];
+    BackupDev dev;
+    if (!backup_disk(&dev)) return;
+    BackupHeader hdr;
+    int err = backup_header(&dev, &hdr);
+    if (err == WEXFS_OK && !hdr.sessions) err = WEXFS_ENOENT;
+    if (err != WEXFS_OK) {
+        prints("Error: The second disk holds no backup\n");
+        return;
+    }
+    if (!*args) {
+        prints("WARNING: The system disk will be formatted and restored from the backup!\n");
+        prints("Are you sure you want to continue? (y/N): ");
+        char confirm = keyboard_getchar();
+        putchar(confirm);
+        newline();
+        if (confirm != 'y' && confirm != 'Y') {
+            prints("Restore cancelled.\n");
+            return;
+        }
+        err = wexfs_format(0);
+        strcpy(current_dir, "/");
+        if (err != WEXFS_OK) {
+            fs_error(wexfs_strerror(err), "format");
+            return;
+        }
+        args = "/";
+    }
+    // A directory of the system disk, from the current one
+    FSNode* base = wexfs_lookup_at(fs_cwd(), args);
+    if (!base) base = wexfs_create_path(fs_cwd(), args, WEXFS_DIR, &err);
+    if (!base) {
+        fs_error(wexfs_strerror(err), args);
+        return;
+    }
+    BackupResult res;
+    prints("Restoring...\n");
+    err = backup_restore(&dev, base, &res);
+    prints("Restored ");
+    itoa(res.objects, buf, 10);
+    prints(buf);
+    prints(" objects, ");
+    itoa((u32)(res.bytes / 1024), buf, 10);
+    prints(buf);
+    prints(" KB\n");
+    if (res.failed) {
+        itoa(res.failed, buf, 10);
+        prints(buf);
+        prints(" could not be restored\n");
+    }
+    if (err != WEXFS_OK) fs_error(wexfs_strerror(err), args);
 }
 
-char* strrchr(const char* s, int c) {
-    const char* last = NULL;
-    while(*s) {
-        if(*s == c) last = s;
-        s++;
+void fs_cat(const char* filename) {
+    if (filename == NULL || strlen(filename) == 0) {
+        prints("Usage: cat <filename>\n");
+        return;
     }
-    return (char*)last;
-}
 
-int atoi(const char* s) {
-    int r = 0;
-    while(*s >= '0' && *s <= '9') {
-        r = r * 10 + (*s - '0');
-        s++;
+    int fd = wexfs_open(fs_cwd(), filename, WEXFS_O_READ);
+    if (fd == WEXFS_EISDIR) {
+        prints("Error: '");
+        prints(filename);
+        prints("' is a directory\n");
+        return;
+    }
+    if (fd < 0) {
+        prints("Error: File not found: ");
+        prints(filename);
+        newline();
+        return;
     }
-    return r;
-}
 
-void itoa(int value, char* str, int base) {
-    char* ptr = str, *ptr1 = str, tmp_char;
-    int tmp_value;
-    do {
-        tmp_value = value;
-        value /= base;
-        *ptr++ = "zyxwvutsrqponmlkjihgfedcba9876543210123456789abcdefghijklmnopqrstuvwxyz"[35 + (tmp_value - value * base)];
-    } while (value);
-    if (tmp_value < 0) *ptr++ = '-';
-    *ptr-- = '\0';
-    while(ptr1 < ptr) {
-        tmp_char = *ptr;
-        *ptr-- = *ptr1;
-        *ptr1++ = tmp_char;
+    const char* data;
+    int got;
+    u32 total = 0;
+    while ((got = wexfs_map(fd, total, WEXFS_BLOCK_SIZE, WEXFS_MAP_READ, (void**)&data)) > 0) {
+        for (int i = 0; i < got; i++) {
+            if (data[i]) putchar(data[i]);
+        }
+        wexfs_unmap(data);
+        total += got;
+    }
+    if (got < 0) {
+        newline();
+        fs_error(wexfs_strerror(got), filename);
+    } else if (total > 0) {
+        newline();
+    } else {
+        prints("File is empty\n");
     }
+    wexfs_close(fd);
 }
 
 /* VGA output */
@@ -1168,20 +1068,6 @@ fs_rm("SystemRoot/config/pass.cfg");
 prints("The password has been deleted! Or absent.");
 }
 
-/* Case-insensitive string comparison */
-int strcasecmp(const char* a, const char* b) {
-    while (*a && *b) {
-        char ca = *a;
-        char cb = *b;
-        if (ca >= 'a' && ca <= 'z') ca = ca - 'a' + 'A';
-        if (cb >= 'a' && cb <= 'z') cb = cb - 'a' + 'A';
-        if (ca != cb) return ca - cb;
-        a++;
-        b++;
-    }
-    return (unsigned char)*a - (unsigned char)*b;
-}
-
 void info_sys() {
 	unsigned char old_color = text_color;
     text_color = 0x0A;
@@ -1224,7 +1110,8 @@ void show_help() {
         "touch",    "copy",       "cat",      "fsck",
         "format",   "size",       "history",  "exit",
         "writer",   "removepass", "drivers",  "pwd",
-        "find", NULL
+        "find",     "mv",         "defrag",   "snapshot",
+        "backup",   "restore",    NULL
     };
     
     prints("Recovery Mode Commands:\n");
@@ -1285,8 +1172,8 @@ void split_args(char* args, char** arg1, char** arg2) {
 
 /* Writer text editor */
 void writer_command(const char* filename) {
-    FSNode* file = fs_find_file(filename);
-    if (!file) {
+    int fd = wexfs_open(fs_cwd(), filename, WEXFS_O_RDWR);
+    if (fd < 0) {
         prints("Error: File not found: ");
         prints(filename);
         newline();
@@ -1294,9 +1181,12 @@ void writer_command(const char* filename) {
     }
     
     char content[4096];  // Увеличили буфер до 4096
-    strcpy(content, file->content);
-    int content_len = strlen(content);
+    int content_len = wexfs_fread(fd, content, sizeof(content) - 1);
+    if (content_len < 0) content_len = 0;
+    content[content_len] = '\0';
+    content_len = strlen(content);
     int cursor_pos = content_len;
+    int dirty_from = content_len;   // только изменённый хвост пишется на диск
     
     unsigned char old_color = text_color;
     int exit_editor = 0;
@@ -1362,6 +1252,7 @@ void writer_command(const char* filename) {
                 
             case '\n': // Enter
                 if (content_len < 4095) {  // Обновили лимит
+                    if (cursor_pos < dirty_from) dirty_from = cursor_pos;
                     for (int i = content_len; i > cursor_pos; i--) {
                         content[i] = content[i-1];
                     }
@@ -1398,6 +1289,7 @@ void writer_command(const char* filename) {
                 
             case '\b': // Backspace
                 if (cursor_pos > 0 && content_len > 0) {
+                    if (cursor_pos - 1 < dirty_from) dirty_from = cursor_pos - 1;
                     for (int i = cursor_pos - 1; i < content_len; i++) {
                         content[i] = content[i+1];
                     }
@@ -1438,6 +1330,7 @@ void writer_command(const char* filename) {
                 
             default: // Обычные символы
                 if (c >= 32 && c <= 126 && content_len < 4095) {  // Обновили лимит
+                    if (cursor_pos < dirty_from) dirty_from = cursor_pos;
                     for (int i = content_len; i > cursor_pos; i--) {
                         content[i] = content[i-1];
                     }
@@ -1476,11 +1369,10 @@ void writer_command(const char* filename) {
     
     // Сохранение файла
     if (save_file) {
-        if (content_len <= sizeof(file->content)) {
-            strcpy(file->content, content);
-            file->size = content_len;
-            fs_mark_dirty();
-            fs_save_to_disk();
+        int err = wexfs_seek(fd, dirty_from, WEXFS_SEEK_SET);
+        if (err >= 0 && content_len > dirty_from) err = wexfs_fwrite(fd, content + dirty_from, content_len - dirty_from);
+        if (err >= 0) err = wexfs_ftruncate(fd, content_len);
+        if (err >= 0) {
             prints("\nFile saved: ");
             prints(filename);
             
@@ -1491,9 +1383,12 @@ void writer_command(const char* filename) {
             prints("/4096 bytes)");
             newline();
         } else {
-            prints("\nError: File content too large\n");
+            prints("\nError: ");
+            prints(wexfs_strerror(err));
+            newline();
         }
     }
+    wexfs_close(fd);
     
     text_color = old_color;
     clear_screen();
@@ -1532,7 +1427,11 @@ void run_command(char* line) {
     else if(strcasecmp(line, "clear") == 0) clear_screen();
     else if(strcasecmp(line, "ls") == 0) fs_ls();
     else if(strcasecmp(line, "format") == 0) fs_format();
-    else if(strcasecmp(line, "fsck") == 0) fsck_command();
+    else if(strcasecmp(line, "fsck") == 0) { while(*p == ' ') p++; fsck_command(p); }
+    else if(strcasecmp(line, "defrag") == 0) { while(*p == ' ') p++; defrag_command(p); }
+    else if(strcasecmp(line, "snapshot") == 0) { while(*p == ' ') p++; snapshot_command(p); }
+    else if(strcasecmp(line, "backup") == 0) { while(*p == ' ') p++; backup_command(p); }
+    else if(strcasecmp(line, "restore") == 0) { while(*p == ' ') p++; restore_command(p); }
 	else if(strcasecmp(line, "drivers") == 0) info_sys();
 	else if(strcasecmp(line, "removepass") == 0) recovery_pass();
 	else if(strcasecmp(line, "writer") == 0) { while(*p == ' ') p++; if(*p) writer_command(p); else prints("Usage: writer <filename>\n"); }
@@ -1550,6 +1449,18 @@ else if(strcasecmp(line, "find") == 0) {
     if(*p) find_command(p);
     else prints("Usage: find <pattern>\n");
 }
+    else if(strcasecmp(line, "mv") == 0) {
+        while(*p == ' ') p++;
+        if(*p) {
+            char* src;
+            char* dest;
+            split_args(p, &src, &dest);
+            if (dest) fs_move(src, dest);
+            else prints("Usage: mv <src> <dest>\n");
+        } else {
+            prints("Usage: mv <src> <dest>\n");
+        }
+    }
     else if(strcasecmp(line, "copy") == 0) {
         while(*p == ' ') p++;
         if(*p) {
@@ -0,0 +1,143 @@
+/* Substring search for grep, strstr and the WexFS name index */
+#include "search.h"
+
+typedef unsigned int u32;
+typedef unsigned char u8;
+
+static int sse2_state = -1;     /* -1 = not probed yet */
+
+static inline u8 fold(u8 c) {
+    return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+int search_sse2_available(void) {
+    if (sse2_state >= 0) return sse2_state;
+
+    // CPUID.01H:EDX bit 24 = FXSR, bit 26 = SSE2
+    u32 a = 1, b, c, d;
+    __asm__ volatile("cpuid" : "+a"(a), "=b"(b), "=c"(c), "=d"(d));
+    sse2_state = ((d >> 24) & 1) && ((d >> 26) & 1);
+    if (!sse2_state) return 0;
+
+#ifndef WEXOS_HOST
+    // SSE instructions fault until the OS says it saves their state:
+    // CR4.OSFXSR and OSXMMEXCPT on, CR0.EM off, CR0.MP on. Nothing here
+    // switches tasks, so there is no state to save.
+    u32 cr0, cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (!(cr4 & 0x200)) {
+        __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+        cr0 = (cr0 & ~0x4u) | 0x2u;
+        cr4 |= 0x600;
+        __asm__ volatile("mov %0, %%cr0" : : "r"(cr0));
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
+    }
+#endif
+    return 1;
+}
+
+/* First i < n with p[i] == x or p[i] == y, 16 bytes per step */
+__attribute__((target("sse2")))
+static int scan_sse2(const u8* p, u32 n, u8 x, u8 y) {
+    u8 vx[16], vy[16];
+    for (int i = 0; i < 16; i++) {
+        vx[i] = x;
+        vy[i] = y;
+    }
+    u32 i = 0;
+    for (; i + 16 <= n; i += 16) {
+        u32 mask;
+        __asm__("movdqu %1, %%xmm0\n\t"
+                "movdqu %2, %%xmm1\n\t"
+                "movdqu %3, %%xmm2\n\t"
+                "pcmpeqb %%xmm0, %%xmm1\n\t"
+                "pcmpeqb %%xmm0, %%xmm2\n\t"
+                "por %%xmm2, %%xmm1\n\t"
+                "pmovmskb %%xmm1, %0"
+                : "=r"(mask)
+                : "m"(*(const u8(*)[16])(p + i)), "m"(vx), "m"(vy)
+                : "xmm0", "xmm1", "xmm2");
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++) {
+        if (p[i] == x || p[i] == y) return i;
+    }
+    return -1;
+}
+
+static int scan_bytes(const u8* p, u32 n, u8 x, u8 y) {
+    if (n >= 16 && search_sse2_available()) return scan_sse2(p, n, x, y);
+    for (u32 i = 0; i < n; i++) {
+        if (p[i] == x || p[i] == y) return i;
+    }
+    return -1;
+}
+
+static int same(const u8* t, const u8* p, u32 len, int icase) {
+    if (icase) {
+        for (u32 i = 0; i < len; i++) {
+            if (fold(t[i]) != fold(p[i])) return 0;
+        }
+    } else {
+        for (u32 i = 0; i < len; i++) {
+            if (t[i] != p[i]) return 0;
+        }
+    }
+    return 1;
+}
+
+void search_init(Searcher* s, const char* pat, u32 len, u32 flags) {
+    s->pat = (const u8*)pat;
+    s->len = len;
+    s->flags = flags;
+    if (len < SEARCH_BMH_MIN) return;
+
+    u8 whole = len > 255 ? 255 : len;
+    for (int c = 0; c < 256; c++) s->shift[c] = whole;
+    for (u32 i = 0; i + 1 < len; i++) {
+        u32 d = len - 1 - i;
+        u8 c = (flags & SEARCH_ICASE) ? fold(s->pat[i]) : s->pat[i];
+        s->shift[c] = d > 255 ? 255 : d;
+    }
+}
+
+int search_find(const Searcher* s, const void* text, u32 n) {
+    const u8* t = (const u8*)text;
+    const u8* pat = s->pat;
+    u32 len = s->len;
+    int icase = s->flags & SEARCH_ICASE;
+    if (len == 0) return 0;
+    if (len > n) return -1;
+
+    if (len < SEARCH_BMH_MIN) {
+        u8 x = pat[0];
+        u8 y = x;
+        if (icase) {
+            x = fold(x);
+            y = (x >= 'a' && x <= 'z') ? x - 32 : x;
+        }
+        u32 pos = 0;
+        while (pos + len <= n) {
+            int at = scan_bytes(t + pos, n - len + 1 - pos, x, y);
+            if (at < 0) return -1;
+            pos += at;
+            if (same(t + pos + 1, pat + 1, len - 1, icase)) return pos;
+            pos++;
+        }
+        return -1;
+    }
+
+    u32 last = len - 1;
+    u8 tail = icase ? fold(pat[last]) : pat[last];
+    for (u32 pos = 0; pos + len <= n; ) {
+        u8 c = t[pos + last];
+        if (icase) c = fold(c);
+        if (c == tail && same(t + pos, pat, last, icase)) return pos;
+        pos += s->shift[c];
+    }
+    return -1;
+}
+
+int search_byte(const void* text, u32 len, u8 c) {
+    return scan_bytes((const u8*)text, len, c, c);
+}
@@ -0,0 +1,30 @@
+#ifndef WEXOS_SEARCH_H
+#define WEXOS_SEARCH_H
+
+/* Substring search. Patterns of SEARCH_BMH_MIN bytes or more use
+ * Boyer-Moore-Horspool; shorter ones scan for their first byte 16 bytes
+ * at a time with SSE2 (pcmpeqb/pmovmskb) when the CPU has it, and check
+ * the rest of the pattern only where that byte occurs. */
+#define SEARCH_ICASE 0x1        /* ASCII letters match either case */
+#define SEARCH_BMH_MIN 4
+
+typedef struct {
+    const unsigned char* pat;
+    unsigned int len;
+    unsigned int flags;
+    unsigned char shift[256];   /* BMH window shift by the window's last byte */
+} Searcher;
+
+/* The pattern is not copied and must outlive the searcher */
+void search_init(Searcher* s, const char* pat, unsigned int len, unsigned int flags);
+
+/* Offset of the first match in text[0..len), or -1 */
+int search_find(const Searcher* s, const void* text, unsigned int len);
+
+/* Offset of the first byte equal to c, or -1 */
+int search_byte(const void* text, unsigned int len, unsigned char c);
+
+/* Detects SSE2 and, on first use, enables it (CR0/CR4) for the vector scan */
+int search_sse2_available(void);
+
+#endif
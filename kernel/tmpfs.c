@@ -0,0 +1,647 @@
+/* tmpfs: files in heap pages, for /tmp */
+#include "tmpfs.h"
+#include "heap.h"
+
+struct TmpVolume;
+
+typedef struct TmpNode {
+    char* name;
+    int type;                   /* VFS_FILE or VFS_DIR */
+    u32 ino;
+    u32 size;
+    u32 stamp;                  /* dirs: changes when an entry comes or goes */
+    struct TmpNode* parent;     /* NULL for the root and removed nodes */
+    struct TmpNode* children;   /* sorted by name */
+    struct TmpNode* next;
+    u8** pages;                 /* files: NULL slots are holes */
+    u32 slots;
+    const u8* image;            /* data still in a boot image, used in place
+                                   until the first change copies it */
+    u32 opens;                  /* handles and listings */
+    int gone;                   /* removed; freed when the last user closes */
+    struct TmpVolume* vol;
+} TmpNode;
+
+typedef struct TmpVolume {
+    TmpNode* root;
+    u32 id;
+    u32 limit;                  /* bytes */
+    u32 used;                   /* pages and names charged */
+    u32 nodes;
+    u32 next_ino;
+} TmpVolume;
+
+typedef struct {
+    TmpNode* node;
+    u32 offset;
+    u32 flags;
+} TmpFile;
+
+typedef struct {
+    TmpNode* dir;
+    char last[MAX_NAME];        /* name returned last, "" before the first */
+} TmpDir;
+
+static TmpFile tmp_files[TMPFS_MAX_OPEN];
+static u32 tmp_stamp_seq = 0;
+static u32 tmp_volumes = 0;
+static u8 zero_page[TMPFS_PAGE_SIZE];
+
+/* ---------- Nodes ---------- */
+
+static int name_cmp(const char* a, const char* name, int len) {
+    for (int i = 0; i < len; i++) {
+        if (a[i] != name[i]) return (u8)a[i] - (u8)name[i];
+    }
+    return (u8)a[len];
+}
+
+static int charge(TmpVolume* vol, u32 bytes) {
+    if (bytes > vol->limit - vol->used) return WEXFS_ENOSPC;
+    vol->used += bytes;
+    return WEXFS_OK;
+}
+
+static TmpNode* child_find(TmpNode* dir, const char* name, int len) {
+    for (TmpNode* c = dir->children; c; c = c->next) {
+        int cmp = name_cmp(c->name, name, len);
+        if (cmp == 0) return c;
+        if (cmp > 0) break;
+    }
+    return NULL;
+}
+
+static void child_link(TmpNode* dir, TmpNode* node) {
+    TmpNode** pp = &dir->children;
+    while (*pp && name_cmp((*pp)->name, node->name, strlen(node->name)) < 0) pp = &(*pp)->next;
+    node->next = *pp;
+    *pp = node;
+    node->parent = dir;
+    dir->stamp = ++tmp_stamp_seq;
+}
+
+static void child_unlink(TmpNode* node) {
+    TmpNode* dir = node->parent;
+    TmpNode** pp = &dir->children;
+    while (*pp != node) pp = &(*pp)->next;
+    *pp = node->next;
+    node->next = NULL;
+    node->parent = NULL;
+    dir->stamp = ++tmp_stamp_seq;
+}
+
+static int check_name(const char* name, int len) {
+    if (len == 0 || (len == 1 && name[0] == '.') ||
+        (len == 2 && name[0] == '.' && name[1] == '.')) return WEXFS_EINVAL;
+    if (len >= MAX_NAME) return WEXFS_ENAMETOOLONG;
+    for (int i = 0; i < len; i++) {
+        if (name[i] == '/') return WEXFS_EINVAL;
+    }
+    return WEXFS_OK;
+}
+
+static TmpNode* node_new(TmpVolume* vol, const char* name, int type, int* err) {
+    *err = charge(vol, TMPFS_NODE_COST);
+    if (*err != WEXFS_OK) return NULL;
+    int len = strlen(name);
+    TmpNode* node = (TmpNode*)kcalloc(1, sizeof(TmpNode));
+    char* copy = (char*)kmalloc(len + 1);
+    if (!node || !copy) {
+        kfree(node);
+        kfree(copy);
+        vol->used -= TMPFS_NODE_COST;
+        *err = WEXFS_ENOMEM;
+        return NULL;
+    }
+    memcpy(copy, (void*)name, len + 1);
+    node->name = copy;
+    node->type = type;
+    node->ino = vol->next_ino++;
+    node->stamp = ++tmp_stamp_seq;
+    node->vol = vol;
+    vol->nodes++;
+    return node;
+}
+
+/* Drop the pages from `first` on */
+static void pages_free(TmpNode* node, u32 first) {
+    for (u32 i = first; i < node->slots; i++) {
+        if (node->pages[i]) {
+            kfree(node->pages[i]);
+            node->pages[i] = NULL;
+            node->vol->used -= TMPFS_PAGE_SIZE;
+        }
+    }
+}
+
+static void node_free(TmpNode* node) {
+    pages_free(node, 0);
+    kfree(node->pages);
+    kfree(node->name);
+    kfree(node);
+}
+
+/* Take `node` and everything below it out of the volume. Nodes still
+ * open stay allocated, marked gone, until their last user closes. */
+static void node_drop(TmpNode* node) {
+    while (node->children) {
+        TmpNode* c = node->children;
+        node->children = c->next;
+        c->parent = NULL;
+        node_drop(c);
+    }
+    TmpVolume* vol = node->vol;
+    pages_free(node, 0);
+    node->image = NULL;
+    vol->used -= TMPFS_NODE_COST;
+    vol->nodes--;
+    node->gone = 1;
+    if (!node->opens) node_free(node);
+}
+
+static void node_release(TmpNode* node) {
+    if (--node->opens == 0 && node->gone) node_free(node);
+}
+
+static void tree_count(TmpNode* node, unsigned long long* bytes, u32* files) {
+    for (TmpNode* c = node->children; c; c = c->next) {
+        if (c->type == VFS_DIR) {
+            tree_count(c, bytes, files);
+        } else {
+            *bytes += c->size;
+            (*files)++;
+        }
+    }
+}
+
+static void fill(TmpNode* node, VfsInode* out) {
+    out->ino = node->ino;
+    out->type = node->type;
+    out->size = node->size;
+    out->priv = node;
+}
+
+static void stat_node(TmpNode* node, VfsStat* st) {
+    st->type = node->type;
+    st->ino = node->ino;
+    st->size = node->size;
+    st->tree_bytes = node->size;
+    st->tree_files = 1;
+    st->flags = 0;
+    if (node->type == VFS_DIR) {
+        st->tree_bytes = 0;
+        st->tree_files = 0;
+        tree_count(node, &st->tree_bytes, &st->tree_files);
+    }
+}
+
+/* ---------- File data ---------- */
+
+static int slots_grow(TmpNode* node, u32 count) {
+    if (count <= node->slots) return WEXFS_OK;
+    u32 n = node->slots ? node->slots : 4;
+    while (n < count) n *= 2;
+    u8** pages = (u8**)krealloc(node->pages, n * sizeof(u8*));
+    if (!pages) return WEXFS_ENOMEM;
+    memset(pages + node->slots, 0, (n - node->slots) * sizeof(u8*));
+    node->pages = pages;
+    node->slots = n;
+    return WEXFS_OK;
+}
+
+static u8* page_get(TmpNode* node, u32 index) {
+    if (node->pages[index]) return node->pages[index];
+    if (charge(node->vol, TMPFS_PAGE_SIZE) != WEXFS_OK) return NULL;
+    u8* page = (u8*)kcalloc(1, TMPFS_PAGE_SIZE);
+    if (!page) {
+        node->vol->used -= TMPFS_PAGE_SIZE;
+        return NULL;
+    }
+    node->pages[index] = page;
+    return page;
+}
+
+/* Give an image-backed file pages of its own before it changes */
+static int unshare(TmpNode* node) {
+    if (!node->image) return WEXFS_OK;
+    u32 count = (node->size + TMPFS_PAGE_SIZE - 1) / TMPFS_PAGE_SIZE;
+    int err = slots_grow(node, count);
+    if (err != WEXFS_OK) return err;
+    for (u32 i = 0; i < count; i++) {
+        u8* page = page_get(node, i);
+        if (!page) {
+            pages_free(node, 0);
+            return WEXFS_ENOSPC;
+        }
+        u32 n = node->size - i * TMPFS_PAGE_SIZE;
+        memcpy(page, (void*)(node->image + i * TMPFS_PAGE_SIZE), n < TMPFS_PAGE_SIZE ? n : TMPFS_PAGE_SIZE);
+    }
+    node->image = NULL;
+    return WEXFS_OK;
+}
+
+static int data_read(TmpNode* node, u32 offset, u8* buf, u32 len) {
+    if (offset >= node->size) return 0;
+    if (len > node->size - offset) len = node->size - offset;
+    u32 done = 0;
+    while (done < len) {
+        u32 pos = offset + done;
+        u32 in_page = pos % TMPFS_PAGE_SIZE;
+        u32 n = TMPFS_PAGE_SIZE - in_page;
+        if (n > len - done) n = len - done;
+        u8* page = node->image ? (u8*)node->image + pos - in_page : node->pages[pos / TMPFS_PAGE_SIZE];
+        if (page) memcpy(buf + done, page + in_page, n);
+        else memset(buf + done, 0, n);
+        done += n;
+    }
+    return done;
+}
+
+/* Bytes written, or the error when nothing could be */
+static int data_write(TmpNode* node, u32 offset, const u8* buf, u32 len) {
+    if (len == 0) return 0;
+    if (offset + len < offset || offset + len > 0x7FFFFFFF) return WEXFS_EFBIG;
+    int err = unshare(node);
+    if (err != WEXFS_OK) return err;
+    err = slots_grow(node, (offset + len + TMPFS_PAGE_SIZE - 1) / TMPFS_PAGE_SIZE);
+    if (err != WEXFS_OK) return err;
+
+    u32 done = 0;
+    while (done < len) {
+        u32 pos = offset + done;
+        u32 in_page = pos % TMPFS_PAGE_SIZE;
+        u32 n = TMPFS_PAGE_SIZE - in_page;
+        if (n > len - done) n = len - done;
+        u8* page = page_get(node, pos / TMPFS_PAGE_SIZE);
+        if (!page) break;
+        memcpy(page + in_page, (void*)(buf + done), n);
+        done += n;
+    }
+    if (offset + done > node->size) node->size = offset + done;
+    return done ? (int)done : WEXFS_ENOSPC;
+}
+
+static int data_truncate(TmpNode* node, u32 size) {
+    if (size > 0x7FFFFFFF) return WEXFS_EFBIG;
+    if (node->image && size <= node->size) {
+        // A shorter view of the image needs no copy
+        node->size = size;
+        return WEXFS_OK;
+    }
+    int err = unshare(node);
+    if (err != WEXFS_OK) return err;
+    if (size < node->size) {
+        u32 keep = (size + TMPFS_PAGE_SIZE - 1) / TMPFS_PAGE_SIZE;
+        pages_free(node, keep);
+        // The cut-off tail of the last page reads as zeros if the file grows again
+        if (size % TMPFS_PAGE_SIZE && node->pages[keep - 1]) {
+            u32 tail = size % TMPFS_PAGE_SIZE;
+            memset(node->pages[keep - 1] + tail, 0, TMPFS_PAGE_SIZE - tail);
+        }
+    } else if (size > node->size) {
+        err = slots_grow(node, (size + TMPFS_PAGE_SIZE - 1) / TMPFS_PAGE_SIZE);
+        if (err != WEXFS_OK) return err;
+    }
+    node->size = size;
+    return WEXFS_OK;
+}
+
+/* ---------- Volume ---------- */
+
+/* "size=<n>[k|m]" */
+static int parse_size(const char* source, u32* out) {
+    *out = TMPFS_DEFAULT_SIZE;
+    if (!source || !source[0]) return WEXFS_OK;
+    const char* p = source;
+    const char* key = "size=";
+    while (*key) {
+        if (*p++ != *key++) return WEXFS_EINVAL;
+    }
+    u32 n = 0;
+    if (*p < '0' || *p > '9') return WEXFS_EINVAL;
+    while (*p >= '0' && *p <= '9') {
+        if (n > 0x7FFFFFFF / 10) return WEXFS_EINVAL;
+        n = n * 10 + (*p++ - '0');
+    }
+    u32 unit = 1;
+    if (*p == 'k' || *p == 'K') unit = 1024;
+    else if (*p == 'm' || *p == 'M') unit = 1024 * 1024;
+    if (unit > 1) p++;
+    if (*p || n > 0x7FFFFFFF / unit || n * unit < TMPFS_NODE_COST) return WEXFS_EINVAL;
+    *out = n * unit;
+    return WEXFS_OK;
+}
+
+static int tmp_mount(VfsMount* mnt, const char* source) {
+    u32 limit;
+    int err = parse_size(source, &limit);
+    if (err != WEXFS_OK) return err;
+    TmpVolume* vol = (TmpVolume*)kcalloc(1, sizeof(TmpVolume));
+    if (!vol) return WEXFS_ENOMEM;
+    vol->id = ++tmp_volumes;
+    vol->limit = limit;
+    vol->next_ino = 1;
+    vol->root = node_new(vol, "/", VFS_DIR, &err);
+    if (!vol->root) {
+        kfree(vol);
+        return err;
+    }
+    mnt->priv = vol;
+    return WEXFS_OK;
+}
+
+static void tmp_umount(VfsMount* mnt) {
+    TmpVolume* vol = (TmpVolume*)mnt->priv;
+    node_drop(vol->root);
+    kfree(vol);
+    mnt->priv = NULL;
+}
+
+static int tmp_root(VfsMount* mnt, VfsInode* out) {
+    fill(((TmpVolume*)mnt->priv)->root, out);
+    return WEXFS_OK;
+}
+
+static u32 tmp_generation(VfsMount* mnt) {
+    return ((TmpVolume*)mnt->priv)->id;
+}
+
+static int tmp_statfs(VfsMount* mnt, VfsStatfs* st) {
+    TmpVolume* vol = (TmpVolume*)mnt->priv;
+    st->total_bytes = vol->limit;
+    st->free_bytes = vol->limit - vol->used;
+    st->objects = vol->nodes;
+    return WEXFS_OK;
+}
+
+/* ---------- Names ---------- */
+
+static u32 tmp_stamp(VfsInode* dir) {
+    return ((TmpNode*)dir->priv)->stamp;
+}
+
+static int tmp_lookup(VfsInode* dir, const char* name, int len, VfsInode* out) {
+    TmpNode* d = (TmpNode*)dir->priv;
+    if (d->type != VFS_DIR) return WEXFS_ENOTDIR;
+    TmpNode* node = child_find(d, name, len);
+    if (!node) return WEXFS_ENOENT;
+    fill(node, out);
+    return WEXFS_OK;
+}
+
+static int tmp_create(VfsInode* dir, const char* name, int type, VfsInode* out) {
+    TmpNode* d = (TmpNode*)dir->priv;
+    if (d->type != VFS_DIR) return WEXFS_ENOTDIR;
+    int len = strlen(name);
+    int err = check_name(name, len);
+    if (err != WEXFS_OK) return err;
+    if (child_find(d, name, len)) return WEXFS_EEXIST;
+    TmpNode* node = node_new(d->vol, name, type, &err);
+    if (!node) return err;
+    child_link(d, node);
+    fill(node, out);
+    return WEXFS_OK;
+}
+
+static int tmp_remove(VfsInode* in) {
+    TmpNode* node = (TmpNode*)in->priv;
+    if (!node->parent) return WEXFS_EINVAL;
+    child_unlink(node);
+    node_drop(node);
+    return WEXFS_OK;
+}
+
+static int tmp_rename(VfsInode* in, VfsInode* new_dir, const char* name) {
+    TmpNode* node = (TmpNode*)in->priv;
+    TmpNode* dir = (TmpNode*)new_dir->priv;
+    if (!node->parent) return WEXFS_EINVAL;
+    if (dir->type != VFS_DIR) return WEXFS_ENOTDIR;
+    int len = strlen(name);
+    int err = check_name(name, len);
+    if (err != WEXFS_OK) return err;
+
+    // A directory cannot move below itself
+    for (TmpNode* d = dir; d; d = d->parent) {
+        if (d == node) return WEXFS_EINVAL;
+    }
+    TmpNode* existing = child_find(dir, name, len);
+    if (existing == node) return WEXFS_OK;
+    if (existing) return WEXFS_EEXIST;
+
+    char* copy = (char*)kmalloc(len + 1);
+    if (!copy) return WEXFS_ENOMEM;
+    memcpy(copy, (void*)name, len + 1);
+    child_unlink(node);
+    kfree(node->name);
+    node->name = copy;
+    child_link(dir, node);
+    return WEXFS_OK;
+}
+
+int tmpfs_add(VfsMount* mnt, const char* path, int type, const void* data, u32 size) {
+    TmpVolume* vol = (TmpVolume*)mnt->priv;
+    TmpNode* dir = vol->root;
+    char name[MAX_NAME];
+    while (1) {
+        while (*path == '/') path++;
+        const char* s = path;
+        while (*path && *path != '/') path++;
+        int len = path - s;
+        while (*path == '/') path++;
+        int last = !*path;
+        if (len == 0 || (len == 1 && s[0] == '.')) {
+            if (last) return type == VFS_DIR ? WEXFS_OK : WEXFS_EINVAL;
+            continue;
+        }
+        int err = check_name(s, len);
+        if (err != WEXFS_OK) return err;
+        memcpy(name, (void*)s, len);
+        name[len] = '\0';
+
+        int want = last ? type : VFS_DIR;
+        TmpNode* node = child_find(dir, name, len);
+        if (!node) {
+            node = node_new(vol, name, want, &err);
+            if (!node) return err;
+            child_link(dir, node);
+        } else if (node->type != want) {
+            return last ? WEXFS_EEXIST : WEXFS_ENOTDIR;
+        }
+        if (last) {
+            // A later copy of the same file in the archive wins
+            if (type == VFS_FILE) {
+                pages_free(node, 0);
+                node->image = (const u8*)data;
+                node->size = size;
+            }
+            return WEXFS_OK;
+        }
+        dir = node;
+    }
+}
+
+static int tmp_stat(VfsInode* in, VfsStat* st) {
+    stat_node((TmpNode*)in->priv, st);
+    return WEXFS_OK;
+}
+
+/* ---------- Files ---------- */
+
+static TmpFile* file_get(int fh) {
+    if (fh < 0 || fh >= TMPFS_MAX_OPEN || !tmp_files[fh].node) return NULL;
+    if (tmp_files[fh].node->gone) return NULL;
+    return &tmp_files[fh];
+}
+
+static int tmp_open(VfsInode* in, u32 flags) {
+    TmpNode* node = (TmpNode*)in->priv;
+    if (!(flags & VFS_O_RDWR)) return WEXFS_EINVAL;
+    if (node->type == VFS_DIR) return WEXFS_EISDIR;
+    int fh = 0;
+    while (fh < TMPFS_MAX_OPEN && tmp_files[fh].node) fh++;
+    if (fh == TMPFS_MAX_OPEN) return WEXFS_ENOMEM;
+    if ((flags & VFS_O_TRUNC) && (flags & VFS_O_WRITE)) data_truncate(node, 0);
+
+    tmp_files[fh].node = node;
+    tmp_files[fh].offset = 0;
+    tmp_files[fh].flags = flags;
+    node->opens++;
+    return fh;
+}
+
+static int tmp_read(int fh, void* buf, u32 len) {
+    TmpFile* f = file_get(fh);
+    if (!f || !(f->flags & VFS_O_READ)) return WEXFS_EBADF;
+    int got = data_read(f->node, f->offset, (u8*)buf, len);
+    f->offset += got;
+    return got;
+}
+
+static int tmp_write(int fh, const void* buf, u32 len) {
+    TmpFile* f = file_get(fh);
+    if (!f || !(f->flags & VFS_O_WRITE)) return WEXFS_EBADF;
+    if (f->flags & VFS_O_APPEND) f->offset = f->node->size;
+    int done = data_write(f->node, f->offset, (const u8*)buf, len);
+    if (done > 0) f->offset += done;
+    return done;
+}
+
+static int tmp_seek(int fh, int offset, int whence) {
+    TmpFile* f = file_get(fh);
+    if (!f) return WEXFS_EBADF;
+    long long pos = offset;
+    if (whence == VFS_SEEK_CUR) pos += f->offset;
+    else if (whence == VFS_SEEK_END) pos += f->node->size;
+    else if (whence != VFS_SEEK_SET) return WEXFS_EINVAL;
+    if (pos < 0 || pos > 0x7FFFFFFF) return WEXFS_EINVAL;
+    f->offset = (u32)pos;
+    return (int)pos;
+}
+
+static int tmp_truncate(int fh, u32 size) {
+    TmpFile* f = file_get(fh);
+    if (!f || !(f->flags & VFS_O_WRITE)) return WEXFS_EBADF;
+    return data_truncate(f->node, size);
+}
+
+static int tmp_fstat(int fh, VfsStat* st) {
+    TmpFile* f = file_get(fh);
+    if (!f) return WEXFS_EBADF;
+    stat_node(f->node, st);
+    return WEXFS_OK;
+}
+
+static int tmp_close(int fh) {
+    if (fh < 0 || fh >= TMPFS_MAX_OPEN || !tmp_files[fh].node) return WEXFS_EBADF;
+    node_release(tmp_files[fh].node);
+    tmp_files[fh].node = NULL;
+    return WEXFS_OK;
+}
+
+/* The page itself: the data already lives in memory */
+static int tmp_map(int fh, u32 offset, u32 len, void** out) {
+    TmpFile* f = file_get(fh);
+    *out = NULL;
+    if (!f || !(f->flags & VFS_O_READ)) return WEXFS_EBADF;
+    TmpNode* node = f->node;
+    if (offset >= node->size || len == 0) return 0;
+    u32 in_page = offset % TMPFS_PAGE_SIZE;
+    if (len > node->size - offset) len = node->size - offset;
+    if (len > TMPFS_PAGE_SIZE - in_page) len = TMPFS_PAGE_SIZE - in_page;
+    u8* page = node->image ? (u8*)node->image + offset - in_page : node->pages[offset / TMPFS_PAGE_SIZE];
+    *out = (page ? page : zero_page) + in_page;
+    return len;
+}
+
+static void tmp_unmap(const void* ptr) {
+}
+
+/* ---------- Directories ---------- */
+
+static int tmp_opendir(VfsInode* in, VfsDir* d) {
+    TmpNode* dir = (TmpNode*)in->priv;
+    if (dir->type != VFS_DIR) return WEXFS_ENOTDIR;
+    TmpDir* t = (TmpDir*)kmalloc(sizeof(TmpDir));
+    if (!t) return WEXFS_ENOMEM;
+    t->dir = dir;
+    t->last[0] = '\0';
+    dir->opens++;
+    d->priv = t;
+    return WEXFS_OK;
+}
+
+/* Resumes after the last name returned, so entries may come and go
+ * between calls */
+static int tmp_readdir(VfsDir* d, VfsDirent* out) {
+    TmpDir* t = (TmpDir*)d->priv;
+    TmpNode* c = t->dir->children;
+    if (t->last[0]) {
+        int len = strlen(t->last);
+        while (c && name_cmp(c->name, t->last, len) <= 0) c = c->next;
+    }
+    if (!c) return 0;
+    strcpy(t->last, c->name);
+    VfsStat st;
+    stat_node(c, &st);
+    out->name = t->last;
+    out->type = c->type;
+    out->ino = c->ino;
+    out->size = c->size;
+    out->tree_bytes = st.tree_bytes;
+    out->tree_files = st.tree_files;
+    return 1;
+}
+
+static void tmp_closedir(VfsDir* d) {
+    TmpDir* t = (TmpDir*)d->priv;
+    node_release(t->dir);
+    kfree(t);
+    d->priv = NULL;
+}
+
+const VfsOps tmpfs_vfs_ops = {
+    .name = "tmpfs",
+    .mount = tmp_mount,
+    .umount = tmp_umount,
+    .root = tmp_root,
+    .generation = tmp_generation,
+    .statfs = tmp_statfs,
+    .stamp = tmp_stamp,
+    .lookup = tmp_lookup,
+    .create = tmp_create,
+    .remove = tmp_remove,
+    .rename = tmp_rename,
+    .stat = tmp_stat,
+    .open = tmp_open,
+    .read = tmp_read,
+    .write = tmp_write,
+    .seek = tmp_seek,
+    .truncate = tmp_truncate,
+    .fstat = tmp_fstat,
+    .close = tmp_close,
+    .map = tmp_map,
+    .unmap = tmp_unmap,
+    .opendir = tmp_opendir,
+    .readdir = tmp_readdir,
+    .closedir = tmp_closedir,
+};
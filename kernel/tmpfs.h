@@ -0,0 +1,28 @@
+#ifndef WEXOS_TMPFS_H
+#define WEXOS_TMPFS_H
+
+#include "vfs.h"
+
+/*
+ * tmpfs: a VFS driver that keeps files in kernel heap pages and never
+ * touches a disk. Everything in it is gone when it is unmounted or the
+ * machine restarts. Each mount is its own volume, capped by the size
+ * given as its source: "size=<n>[k|m]", for example "size=4m"; an
+ * empty source means TMPFS_DEFAULT_SIZE. File data is counted in
+ * whole pages and every name costs TMPFS_NODE_COST against the cap.
+ */
+#define TMPFS_PAGE_SIZE 4096
+#define TMPFS_DEFAULT_SIZE (4u * 1024 * 1024)
+#define TMPFS_NODE_COST 128
+#define TMPFS_MAX_OPEN 32
+
+extern const VfsOps tmpfs_vfs_ops;
+
+/* Put a directory, or a file whose data stays where it is (a boot
+ * image), on the tmpfs mounted as `mnt`, making missing directories.
+ * `path` is relative to the volume's root. The file's bytes are used in
+ * place and not charged to the volume until the first change copies
+ * them, so `data` must outlive the mount. */
+int tmpfs_add(VfsMount* mnt, const char* path, int type, const void* data, u32 size);
+
+#endif
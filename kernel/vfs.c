@@ -0,0 +1,962 @@
+/* Virtual filesystem: mount table, inode and dentry caches, path walk */
+#include "vfs.h"
+#include "heap.h"
+
+VfsStats vfs_stats;
+
+static const VfsOps* fstypes[VFS_MAX_FSTYPES];
+static VfsMount mounts[VFS_MAX_MOUNTS];
+static VfsMount* root_mount = NULL;
+
+static VfsDentry* dcache[VFS_DCACHE_HASH];
+static VfsDentry lru;               /* list head: lru.lru_next is the most recent */
+static VfsInode* icache[VFS_ICACHE_HASH];
+
+typedef struct {
+    VfsMount* mnt;
+    int fh;                         /* driver handle */
+    u32 generation;                 /* driver generation at open */
+    u8* bounce;                     /* vfs_map copy for drivers without map */
+    int used;
+} VfsFile;
+
+static VfsFile files[VFS_MAX_OPEN];
+static char cwd[MAX_PATH] = "/";
+
+/* Walk flags */
+#define WALK_PARENT 0x1     /* stop at the directory of the last component */
+#define WALK_MKDIRS 0x2     /* create missing directories on the way */
+
+void vfs_init(void) {
+    memset(&vfs_stats, 0, sizeof(vfs_stats));
+    memset(mounts, 0, sizeof(mounts));
+    memset(files, 0, sizeof(files));
+    memset(dcache, 0, sizeof(dcache));
+    memset(icache, 0, sizeof(icache));
+    memset(fstypes, 0, sizeof(fstypes));
+    lru.lru_next = lru.lru_prev = &lru;
+    root_mount = NULL;
+    strcpy(cwd, "/");
+}
+
+int vfs_register(const VfsOps* ops) {
+    for (int i = 0; i < VFS_MAX_FSTYPES; i++) {
+        if (!fstypes[i]) {
+            fstypes[i] = ops;
+            return WEXFS_OK;
+        }
+    }
+    return WEXFS_ENOMEM;
+}
+
+const char* vfs_strerror(int err) {
+    switch (err) {
+        case VFS_EXDEV: return "Cannot move between volumes";
+        case VFS_EBUSY: return "Mount point busy";
+        case VFS_EROFS: return "Read-only volume";
+        case VFS_ENOSYS: return "Not supported by this filesystem";
+        case VFS_ENODEV: return "Unknown filesystem type";
+    }
+    return wexfs_strerror(err);
+}
+
+/* ---------- Inode cache ---------- */
+
+static u32 inode_bucket(VfsMount* mnt, u32 ino) {
+    return ((ino * 2654435761u) ^ (u32)(unsigned long)mnt) & (VFS_ICACHE_HASH - 1);
+}
+
+static void inode_unhash(VfsInode* in) {
+    VfsInode** pp = &icache[inode_bucket(in->mnt, in->ino)];
+    while (*pp && *pp != in) pp = &(*pp)->hash_next;
+    if (*pp) *pp = in->hash_next;
+    in->hash_next = NULL;
+}
+
+/* The shared inode for what a driver lookup found, with a reference */
+static VfsInode* iget(VfsMount* mnt, const VfsInode* found) {
+    u32 b = inode_bucket(mnt, found->ino);
+    for (VfsInode* in = icache[b]; in; in = in->hash_next) {
+        if (in->mnt != mnt || in->ino != found->ino) continue;
+        if (in->priv == found->priv) {
+            in->type = found->type;
+            in->size = found->size;
+            in->refs++;
+            return in;
+        }
+        // The number now belongs to another object; the names still
+        // holding the old one drop it when they are revalidated
+        inode_unhash(in);
+        break;
+    }
+
+    VfsInode* in = (VfsInode*)kmalloc(sizeof(VfsInode));
+    if (!in) return NULL;
+    *in = *found;
+    in->mnt = mnt;
+    in->refs = 1;
+    in->hash_next = icache[b];
+    icache[b] = in;
+    vfs_stats.inodes++;
+    return in;
+}
+
+static void iput(VfsInode* in) {
+    if (!in || --in->refs) return;
+    inode_unhash(in);
+    kfree(in);
+    vfs_stats.inodes--;
+}
+
+/* ---------- Dentry cache ---------- */
+
+static u32 name_bucket(VfsDentry* parent, const char* name, int len) {
+    u32 h = (u32)(unsigned long)parent * 2654435761u;
+    for (int i = 0; i < len; i++) h = (h ^ (u8)name[i]) * 16777619u;
+    return h & (VFS_DCACHE_HASH - 1);
+}
+
+static int name_is(const char* a, const char* name, int len) {
+    for (int i = 0; i < len; i++) {
+        if (a[i] != name[i]) return 0;
+    }
+    return a[len] == '\0';
+}
+
+static void lru_unlink(VfsDentry* d) {
+    d->lru_prev->lru_next = d->lru_next;
+    d->lru_next->lru_prev = d->lru_prev;
+}
+
+static void lru_front(VfsDentry* d) {
+    d->lru_next = lru.lru_next;
+    d->lru_prev = &lru;
+    lru.lru_next->lru_prev = d;
+    lru.lru_next = d;
+}
+
+static void d_set_inode(VfsDentry* d, VfsInode* in) {
+    iput(d->inode);
+    d->inode = in;
+}
+
+/* Only names in a directory are hashed and aged; a mount's root is
+ * owned by its mount. */
+static void d_free(VfsDentry* d) {
+    if (d->parent) {
+        VfsDentry** pp = &dcache[name_bucket(d->parent, d->name, strlen(d->name))];
+        while (*pp != d) pp = &(*pp)->hash_next;
+        *pp = d->hash_next;
+        lru_unlink(d);
+        d->parent->children--;
+    }
+    d_set_inode(d, NULL);
+    kfree(d->name);
+    kfree(d);
+    vfs_stats.dentries--;
+}
+
+/* Drop the least recently used names nobody holds, up to a bounded
+ * number of candidates so one allocation never scans the whole cache. */
+static void d_shrink(void) {
+    VfsDentry* d = lru.lru_prev;
+    for (int scanned = 0; d != &lru && scanned < 64; scanned++) {
+        VfsDentry* prev = d->lru_prev;
+        if (!d->refs && !d->children && !d->mounted) {
+            d_free(d);
+            vfs_stats.evictions++;
+            if (vfs_stats.dentries < VFS_DCACHE_MAX) return;
+        }
+        d = prev;
+    }
+}
+
+static VfsDentry* d_alloc(VfsDentry* parent, VfsMount* mnt, const char* name, int len) {
+    if (parent && vfs_stats.dentries >= VFS_DCACHE_MAX) d_shrink();
+    VfsDentry* d = (VfsDentry*)kcalloc(1, sizeof(VfsDentry));
+    if (!d) return NULL;
+    d->name = (char*)kmalloc(len + 1);
+    if (!d->name) {
+        kfree(d);
+        return NULL;
+    }
+    memcpy(d->name, (void*)name, len);
+    d->name[len] = '\0';
+    d->parent = parent;
+    d->mnt = mnt;
+    if (parent) {
+        u32 b = name_bucket(parent, name, len);
+        d->hash_next = dcache[b];
+        dcache[b] = d;
+        lru_front(d);
+        parent->children++;
+    }
+    vfs_stats.dentries++;
+    return d;
+}
+
+static VfsDentry* d_get(VfsDentry* d) {
+    d->refs++;
+    return d;
+}
+
+static void d_put(VfsDentry* d) {
+    if (d) d->refs--;
+}
+
+/* The cached entry for `name` in `dir` if the directory has not changed
+ * since it was cached, otherwise the driver's answer (which refreshes
+ * the entry). NULL only on an error other than "not found". */
+static VfsDentry* d_lookup(VfsDentry* dir, const char* name, int len, int* err) {
+    const VfsOps* ops = dir->mnt->ops;
+    u32 stamp = ops->stamp(dir->inode);
+    VfsDentry* d = dcache[name_bucket(dir, name, len)];
+    while (d && (d->parent != dir || !name_is(d->name, name, len))) d = d->hash_next;
+
+    vfs_stats.lookups++;
+    if (d && d->stamp == stamp) {
+        vfs_stats.hits++;
+        if (!d->inode) vfs_stats.negative_hits++;
+        lru_unlink(d);
+        lru_front(d);
+        return d;
+    }
+
+    vfs_stats.misses++;
+    VfsInode found;
+    VfsInode* in = NULL;
+    int rc = ops->lookup(dir->inode, name, len, &found);
+    if (rc == WEXFS_OK) {
+        in = iget(dir->mnt, &found);
+        if (!in) rc = WEXFS_ENOMEM;
+    }
+    if (rc != WEXFS_OK && rc != WEXFS_ENOENT) {
+        *err = rc;
+        return NULL;
+    }
+    if (!d) {
+        d = d_alloc(dir, dir->mnt, name, len);
+        if (!d) {
+            iput(in);
+            *err = WEXFS_ENOMEM;
+            return NULL;
+        }
+    } else {
+        lru_unlink(d);
+        lru_front(d);
+    }
+    d_set_inode(d, in);
+    d->stamp = stamp;
+    return d;
+}
+
+/* Make `d`, a negative name in `dir`, into a new object */
+static int d_make(VfsDentry* dir, VfsDentry* d, int type) {
+    if (dir->mnt->flags & VFS_MNT_RDONLY) return VFS_EROFS;
+    const VfsOps* ops = dir->mnt->ops;
+    VfsInode found;
+    int rc = ops->create(dir->inode, d->name, type, &found);
+    if (rc != WEXFS_OK) return rc;
+    VfsInode* in = iget(dir->mnt, &found);
+    if (!in) return WEXFS_ENOMEM;
+    d_set_inode(d, in);
+    d->stamp = ops->stamp(dir->inode);
+    return WEXFS_OK;
+}
+
+/* The name that stands for `d` in a path: from a mount's root that is
+ * the directory it covers. NULL at the top of the namespace. */
+static VfsDentry* d_named(VfsDentry* d) {
+    while (!d->parent) {
+        if (!d->mnt->covered) return NULL;
+        d = d->mnt->covered;
+    }
+    return d;
+}
+
+static int d_path(VfsDentry* d, char* out, int max) {
+    int len = 0;
+    for (VfsDentry* x = d_named(d); x; x = d_named(x->parent)) len += strlen(x->name) + 1;
+    if (len + 2 > max) return WEXFS_ENAMETOOLONG;
+    if (len == 0) {
+        strcpy(out, "/");
+        return 1;
+    }
+    out[len] = '\0';
+    int pos = len;
+    for (VfsDentry* x = d_named(d); x; x = d_named(x->parent)) {
+        int n = strlen(x->name);
+        pos -= n;
+        memcpy(out + pos, x->name, n);
+        out[--pos] = '/';
+    }
+    return len;
+}
+
+/* Is `d` `top` or somewhere below it, across mounts? */
+static int d_below(VfsDentry* d, VfsDentry* top) {
+    while (d) {
+        if (d == top) return 1;
+        if (d->parent) d = d->parent;
+        else d = d->mnt->covered;
+    }
+    return 0;
+}
+
+/* ---------- Path walk ---------- */
+
+/* A mount's root, looked up again after the driver replaced its
+ * objects (WexFS after a format). A volume without a root fails here. */
+static int mnt_check(VfsMount* m) {
+    u32 gen = m->ops->generation(m);
+    if (gen == m->generation && m->root->inode) return WEXFS_OK;
+    VfsInode found;
+    int rc = m->ops->root(m, &found);
+    if (rc != WEXFS_OK) return rc;
+    VfsInode* in = iget(m, &found);
+    if (!in) return WEXFS_ENOMEM;
+    d_set_inode(m->root, in);
+    m->generation = gen;
+    return WEXFS_OK;
+}
+
+/* Step onto whatever is mounted on `d`; takes over the reference */
+static VfsDentry* d_follow(VfsDentry* d, int* err) {
+    while (d->mounted) {
+        VfsMount* m = d->mounted;
+        int rc = mnt_check(m);
+        if (rc != WEXFS_OK) {
+            d_put(d);
+            *err = rc;
+            return NULL;
+        }
+        d_put(d);
+        d = d_get(m->root);
+    }
+    return d;
+}
+
+/* Resolve `p` from `cur` (whose reference it takes over). The result is
+ * a positive dentry with a reference, or with WALK_PARENT the directory
+ * of the last component, whose name goes to `leaf` ("" when the path
+ * ends in "/", "." or ".."). */
+static VfsDentry* walk_from(VfsDentry* cur, const char* p, u32 flags, char* leaf, int* err) {
+    if (leaf) leaf[0] = '\0';
+    while (1) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        const char* s = p;
+        while (*p && *p != '/') p++;
+        int len = p - s;
+        const char* rest = p;
+        while (*rest == '/') rest++;
+        int last = *rest == '\0';
+
+        if (cur->inode->type != VFS_DIR) {
+            *err = WEXFS_ENOTDIR;
+            goto fail;
+        }
+        if (len == 1 && s[0] == '.') continue;
+        if (len == 2 && s[0] == '.' && s[1] == '.') {
+            VfsDentry* up = cur;
+            while (!up->parent && up->mnt->covered) up = up->mnt->covered;
+            if (up->parent) up = up->parent;
+            d_get(up);
+            d_put(cur);
+            cur = d_follow(up, err);
+            if (!cur) return NULL;
+            continue;
+        }
+        if (len >= MAX_NAME) {
+            *err = WEXFS_ENAMETOOLONG;
+            goto fail;
+        }
+        if (last && (flags & WALK_PARENT)) {
+            memcpy(leaf, (void*)s, len);
+            leaf[len] = '\0';
+            return cur;
+        }
+
+        VfsDentry* next = d_lookup(cur, s, len, err);
+        if (!next) goto fail;
+        if (!next->inode && !next->mounted) {
+            *err = WEXFS_ENOENT;
+            if (!(flags & WALK_MKDIRS) || (*err = d_make(cur, next, VFS_DIR)) != WEXFS_OK) goto fail;
+        }
+        d_get(next);
+        d_put(cur);
+        cur = d_follow(next, err);
+        if (!cur) return NULL;
+    }
+    return cur;
+
+fail:
+    d_put(cur);
+    return NULL;
+}
+
+static VfsDentry* walk(const char* path, u32 flags, char* leaf, int* err) {
+    if (!root_mount) {
+        *err = WEXFS_ENOENT;
+        return NULL;
+    }
+    if (strlen(path) >= MAX_PATH) {
+        *err = WEXFS_ENAMETOOLONG;
+        return NULL;
+    }
+    int rc = mnt_check(root_mount);
+    if (rc != WEXFS_OK) {
+        *err = rc;
+        return NULL;
+    }
+
+    VfsDentry* start = d_get(root_mount->root);
+    if (path[0] != '/') {
+        // The working directory may have gone away; start over at the root
+        VfsDentry* dir = walk_from(d_get(start), cwd, 0, NULL, err);
+        if (dir && dir->inode->type == VFS_DIR) {
+            d_put(start);
+            start = dir;
+        } else {
+            d_put(dir);
+            strcpy(cwd, "/");
+        }
+    }
+    return walk_from(start, path, flags, leaf, err);
+}
+
+/* ---------- Mount table ---------- */
+
+int vfs_mount(const char* fstype, const char* source, const char* path, u32 flags) {
+    const VfsOps* ops = NULL;
+    for (int i = 0; i < VFS_MAX_FSTYPES; i++) {
+        if (fstypes[i] && strcmp(fstypes[i]->name, fstype) == 0) ops = fstypes[i];
+    }
+    if (!ops) return VFS_ENODEV;
+
+    VfsMount* m = NULL;
+    for (int i = 0; i < VFS_MAX_MOUNTS && !m; i++) {
+        if (!mounts[i].used) m = &mounts[i];
+    }
+    if (!m) return WEXFS_ENOMEM;
+
+    int err;
+    VfsDentry* covered = NULL;
+    if (!root_mount) {
+        if (strcmp(path, "/") != 0) return WEXFS_ENOENT;
+    } else {
+        covered = walk(path, 0, NULL, &err);
+        if (!covered) return err;
+        // One mount per directory, and never on a mount's root
+        err = covered->inode->type != VFS_DIR ? WEXFS_ENOTDIR : !covered->parent ? VFS_EBUSY : WEXFS_OK;
+        if (err != WEXFS_OK) {
+            d_put(covered);
+            return err;
+        }
+    }
+
+    memset(m, 0, sizeof(VfsMount));
+    m->ops = ops;
+    m->flags = flags;
+    m->covered = covered;
+    strcpy(m->path, "/");
+    if (covered) d_path(covered, m->path, MAX_PATH);
+    int len = source ? strlen(source) : 0;
+    if (len >= (int)sizeof(m->source)) len = sizeof(m->source) - 1;
+    memcpy(m->source, (void*)(source ? source : ""), len);
+    m->source[len] = '\0';
+
+    m->root = d_alloc(NULL, m, "/", 1);
+    err = m->root ? ops->mount(m, source) : WEXFS_ENOMEM;
+    if (err != WEXFS_OK) {
+        if (m->root) d_free(m->root);
+        d_put(covered);
+        return err;
+    }
+    d_get(m->root);
+    m->generation = ops->generation(m);
+    // A volume with no root yet (unformatted) still mounts; walks into
+    // it fail until the driver has one
+    mnt_check(m);
+    m->used = 1;
+    if (covered) covered->mounted = m;
+    else root_mount = m;
+    return WEXFS_OK;
+}
+
+int vfs_umount(const char* path) {
+    int err;
+    VfsDentry* d = walk(path, 0, NULL, &err);
+    if (!d) return err;
+    VfsMount* m = d->mnt;
+    d_put(d);
+    if (d->parent) return WEXFS_EINVAL;
+    if (m == root_mount || m->open_files) return VFS_EBUSY;
+    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
+        if (mounts[i].used && &mounts[i] != m && d_below(mounts[i].covered, m->root)) return VFS_EBUSY;
+    }
+    d = walk(cwd, 0, NULL, &err);
+    int inside = d && d_below(d, m->root);
+    d_put(d);
+    if (inside) return VFS_EBUSY;
+
+    // Everything cached below the root goes with the mount; parents may
+    // be freed before their children, so unhook all of them first
+    VfsDentry* gone = NULL;
+    for (int b = 0; b < VFS_DCACHE_HASH; b++) {
+        VfsDentry** pp = &dcache[b];
+        while (*pp) {
+            VfsDentry* x = *pp;
+            if (x->mnt != m) {
+                pp = &x->hash_next;
+                continue;
+            }
+            *pp = x->hash_next;
+            lru_unlink(x);
+            x->hash_next = gone;
+            gone = x;
+        }
+    }
+    while (gone) {
+        VfsDentry* next = gone->hash_next;
+        gone->parent = NULL;
+        d_free(gone);
+        gone = next;
+    }
+
+    m->ops->umount(m);
+    d_free(m->root);
+    m->covered->mounted = NULL;
+    d_put(m->covered);
+    m->used = 0;
+    return WEXFS_OK;
+}
+
+VfsMount* vfs_mount_at(int n) {
+    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
+        if (mounts[i].used && n-- == 0) return &mounts[i];
+    }
+    return NULL;
+}
+
+/* ---------- Names ---------- */
+
+int vfs_stat(const char* path, VfsStat* st) {
+    int err;
+    VfsDentry* d = walk(path, 0, NULL, &err);
+    if (!d) return err;
+    err = d->mnt->ops->stat(d->inode, st);
+    d_put(d);
+    return err;
+}
+
+int vfs_create(const char* path, int type) {
+    char leaf[MAX_NAME];
+    int err;
+    VfsDentry* dir = walk(path, WALK_PARENT, leaf, &err);
+    if (!dir) return err;
+    VfsDentry* d = leaf[0] ? d_lookup(dir, leaf, strlen(leaf), &err) : dir;
+    // A mount point that vanished below its mount (a format) can be made
+    // again as a directory; the mount stays on top of it
+    if (d && (d->inode || (d->mounted && type != VFS_DIR))) err = WEXFS_EEXIST;
+    else if (d) err = d_make(dir, d, type);
+    d_put(dir);
+    return err;
+}
+
+/* Names that are busy as mount points, or hold one below them */
+static int d_busy(VfsDentry* d) {
+    if (d->mounted) return 1;
+    for (int i = 0; i < VFS_MAX_MOUNTS; i++) {
+        if (mounts[i].used && mounts[i].covered && d_below(mounts[i].covered, d)) return 1;
+    }
+    return 0;
+}
+
+int vfs_remove(const char* path) {
+    char leaf[MAX_NAME];
+    int err;
+    VfsDentry* dir = walk(path, WALK_PARENT, leaf, &err);
+    if (!dir) return err;
+    VfsDentry* d = leaf[0] ? d_lookup(dir, leaf, strlen(leaf), &err) : NULL;
+    if (!leaf[0]) err = WEXFS_EINVAL;
+    else if (d && d_busy(d)) err = VFS_EBUSY;
+    else if (d && !d->inode) err = WEXFS_ENOENT;
+    else if (d && (dir->mnt->flags & VFS_MNT_RDONLY)) err = VFS_EROFS;
+    else if (d) {
+        const VfsOps* ops = dir->mnt->ops;
+        err = ops->remove(d->inode);
+        if (err == WEXFS_OK) {
+            d_set_inode(d, NULL);
+            d->stamp = ops->stamp(dir->inode);
+        }
+    }
+    d_put(dir);
+    return err;
+}
+
+int vfs_rename(const char* from, const char* to) {
+    char leaf[MAX_NAME];
+    int err;
+    VfsDentry* src_dir = walk(from, WALK_PARENT, leaf, &err);
+    if (!src_dir) return err;
+    err = WEXFS_OK;
+    VfsDentry* src = leaf[0] ? d_lookup(src_dir, leaf, strlen(leaf), &err) : NULL;
+    if (!leaf[0]) err = WEXFS_EINVAL;
+    else if (src && d_busy(src)) err = VFS_EBUSY;
+    else if (src && !src->inode) err = WEXFS_ENOENT;
+    if (!src || !src->inode || err != WEXFS_OK) {
+        d_put(src_dir);
+        return err;
+    }
+    d_get(src);
+
+    VfsDentry* dst_dir = walk(to, WALK_PARENT, leaf, &err);
+    if (dst_dir) {
+        VfsDentry* dst = leaf[0] ? d_lookup(dst_dir, leaf, strlen(leaf), &err) : NULL;
+        if (!leaf[0]) err = WEXFS_EINVAL;
+        else if (dst_dir->mnt != src->mnt) err = VFS_EXDEV;
+        else if (dst && dst->mounted) err = VFS_EBUSY;
+        else if (dst && (dst_dir->mnt->flags & VFS_MNT_RDONLY)) err = VFS_EROFS;
+        else if (dst) {
+            // Both directories get new stamps, so their cached names are
+            // checked again on the next walk
+            err = dst_dir->mnt->ops->rename(src->inode, dst_dir->inode, leaf);
+        }
+        d_put(dst_dir);
+    }
+    d_put(src);
+    d_put(src_dir);
+    return err;
+}
+
+int vfs_realpath(const char* path, char* out, int max) {
+    int err;
+    VfsDentry* d = walk(path, 0, NULL, &err);
+    if (!d) return err;
+    err = d_path(d, out, max);
+    d_put(d);
+    return err < 0 ? err : WEXFS_OK;
+}
+
+int vfs_chdir(const char* path) {
+    int err;
+    VfsDentry* d = walk(path, 0, NULL, &err);
+    if (!d) return err;
+    err = d->inode->type == VFS_DIR ? d_path(d, cwd, MAX_PATH) : WEXFS_ENOTDIR;
+    d_put(d);
+    return err < 0 ? err : WEXFS_OK;
+}
+
+void vfs_getcwd(char* out, int max) {
+    int err;
+    VfsDentry* d = walk(cwd, 0, NULL, &err);
+    if (!d || d->inode->type != VFS_DIR) strcpy(cwd, "/");
+    d_put(d);
+    int len = strlen(cwd);
+    if (len >= max) len = max - 1;
+    memcpy(out, cwd, len);
+    out[len] = '\0';
+}
+
+/* ---------- Files ---------- */
+
+static VfsFile* file_get(int fd) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !files[fd].used) return NULL;
+    return &files[fd];
+}
+
+int vfs_open(const char* path, u32 flags) {
+    if (!(flags & VFS_O_RDWR)) return WEXFS_EINVAL;
+    int fd = 0;
+    while (fd < VFS_MAX_OPEN && files[fd].used) fd++;
+    if (fd == VFS_MAX_OPEN) return WEXFS_ENOMEM;
+
+    int err;
+    VfsDentry* d;
+    if (flags & VFS_O_CREATE) {
+        char leaf[MAX_NAME];
+        VfsDentry* dir = walk(path, WALK_PARENT | WALK_MKDIRS, leaf, &err);
+        if (!dir) return err;
+        d = leaf[0] ? d_lookup(dir, leaf, strlen(leaf), &err) : dir;
+        if (d && !d->inode && !d->mounted) {
+            err = d_make(dir, d, VFS_FILE);
+            if (err != WEXFS_OK) d = NULL;
+        }
+        if (d) d = d_follow(d_get(d), &err);
+        d_put(dir);
+    } else {
+        d = walk(path, 0, NULL, &err);
+    }
+    if (!d) return err;
+
+    VfsMount* m = d->mnt;
+    if (d->inode->type == VFS_DIR) err = WEXFS_EISDIR;
+    else if ((flags & VFS_O_WRITE) && (m->flags & VFS_MNT_RDONLY)) err = VFS_EROFS;
+    else err = m->ops->open(d->inode, flags & ~VFS_O_CREATE);
+    d_put(d);
+    if (err < 0) return err;
+
+    files[fd].mnt = m;
+    files[fd].fh = err;
+    files[fd].generation = m->ops->generation(m);
+    files[fd].bounce = NULL;
+    files[fd].used = 1;
+    m->open_files++;
+    return fd;
+}
+
+/* A handle from before its volume was rebuilt must not reach a driver
+ * handle that has since been given to another file */
+static VfsFile* file_live(int fd) {
+    VfsFile* f = file_get(fd);
+    if (f && f->generation != f->mnt->ops->generation(f->mnt)) return NULL;
+    return f;
+}
+
+int vfs_read(int fd, void* buf, u32 len) {
+    VfsFile* f = file_live(fd);
+    return f ? f->mnt->ops->read(f->fh, buf, len) : WEXFS_EBADF;
+}
+
+int vfs_write(int fd, const void* buf, u32 len) {
+    VfsFile* f = file_live(fd);
+    return f ? f->mnt->ops->write(f->fh, buf, len) : WEXFS_EBADF;
+}
+
+int vfs_seek(int fd, int offset, int whence) {
+    VfsFile* f = file_live(fd);
+    return f ? f->mnt->ops->seek(f->fh, offset, whence) : WEXFS_EBADF;
+}
+
+int vfs_truncate(int fd, u32 size) {
+    VfsFile* f = file_live(fd);
+    return f ? f->mnt->ops->truncate(f->fh, size) : WEXFS_EBADF;
+}
+
+int vfs_fstat(int fd, VfsStat* st) {
+    VfsFile* f = file_live(fd);
+    return f ? f->mnt->ops->fstat(f->fh, st) : WEXFS_EBADF;
+}
+
+int vfs_close(int fd) {
+    VfsFile* f = file_get(fd);
+    if (!f) return WEXFS_EBADF;
+    if (f->generation == f->mnt->ops->generation(f->mnt)) f->mnt->ops->close(f->fh);
+    f->mnt->open_files--;
+    kfree(f->bounce);
+    f->used = 0;
+    return WEXFS_OK;
+}
+
+int vfs_map(int fd, u32 offset, u32 len, const void** out) {
+    VfsFile* f = file_live(fd);
+    if (!f) return WEXFS_EBADF;
+    const VfsOps* ops = f->mnt->ops;
+    if (ops->map) return ops->map(f->fh, offset, len, (void**)out);
+
+    if (!f->bounce) f->bounce = (u8*)kmalloc(WEXFS_BLOCK_SIZE);
+    if (!f->bounce) return WEXFS_ENOMEM;
+    u32 room = WEXFS_BLOCK_SIZE - (offset & (WEXFS_BLOCK_SIZE - 1));
+    if (len > room) len = room;
+    int pos = ops->seek(f->fh, 0, VFS_SEEK_CUR);
+    if (pos < 0) return pos;
+    int got = ops->seek(f->fh, offset, VFS_SEEK_SET);
+    if (got >= 0) got = ops->read(f->fh, f->bounce, len);
+    ops->seek(f->fh, pos, VFS_SEEK_SET);
+    *out = f->bounce;
+    return got;
+}
+
+void vfs_unmap(int fd, const void* ptr) {
+    VfsFile* f = file_get(fd);
+    if (f && ptr != f->bounce && f->mnt->ops->unmap) f->mnt->ops->unmap(ptr);
+}
+
+/* ---------- Directories ---------- */
+
+int vfs_opendir(const char* path, VfsDir* d) {
+    int err;
+    VfsDentry* dir = walk(path, 0, NULL, &err);
+    d->mnt = NULL;
+    d->priv = NULL;
+    if (!dir) return err;
+    err = WEXFS_ENOTDIR;
+    if (dir->inode->type == VFS_DIR) {
+        d->mnt = dir->mnt;
+        err = dir->mnt->ops->opendir(dir->inode, d);
+        if (err != WEXFS_OK) d->mnt = NULL;
+    }
+    d_put(dir);
+    return err;
+}
+
+int vfs_readdir(VfsDir* d, VfsDirent* out) {
+    return d->mnt ? d->mnt->ops->readdir(d, out) : 0;
+}
+
+void vfs_closedir(VfsDir* d) {
+    if (d->mnt) d->mnt->ops->closedir(d);
+    d->mnt = NULL;
+}
+
+FSNode* vfs_wexfs_node(const char* path) {
+    int err;
+    VfsDentry* d = walk(path, 0, NULL, &err);
+    FSNode* node = d && d->mnt->ops == &wexfs_vfs_ops ? (FSNode*)d->inode->priv : NULL;
+    d_put(d);
+    return node;
+}
+
+/* ---------- WexFS driver ---------- */
+
+/* The volume itself (wexfs_mount/wexfs_format) belongs to the kernel;
+ * the driver only exposes it, once. */
+static int wex_mounted = 0;
+
+static void wex_fill(FSNode* node, VfsInode* out) {
+    out->ino = node->ino;
+    out->type = node->is_dir ? VFS_DIR : VFS_FILE;
+    out->size = node->di.size;
+    out->priv = node;
+}
+
+static void wex_stat_node(FSNode* node, VfsStat* st) {
+    st->type = node->is_dir ? VFS_DIR : VFS_FILE;
+    st->ino = node->ino;
+    st->size = node->di.size;
+    st->tree_bytes = node->is_dir ? node->tree_bytes : node->di.size;
+    st->tree_files = node->is_dir ? node->tree_files : 1;
+    st->flags = node->di.flags;
+}
+
+static int wex_mount(VfsMount* mnt, const char* source) {
+    if (wex_mounted) return VFS_EBUSY;
+    wex_mounted = 1;
+    return WEXFS_OK;
+}
+
+static void wex_umount(VfsMount* mnt) {
+    wex_mounted = 0;
+}
+
+static int wex_root(VfsMount* mnt, VfsInode* out) {
+    FSNode* root = wexfs_root();
+    if (!root) return WEXFS_EIO;
+    wex_fill(root, out);
+    return WEXFS_OK;
+}
+
+static u32 wex_generation(VfsMount* mnt) {
+    return wexfs_volume;
+}
+
+static int wex_statfs(VfsMount* mnt, VfsStatfs* st) {
+    st->total_bytes = (unsigned long long)wexfs_sb.total_blocks * WEXFS_BLOCK_SIZE;
+    st->free_bytes = (unsigned long long)wexfs_free_blocks * WEXFS_BLOCK_SIZE;
+    st->objects = fs_count;
+    return WEXFS_OK;
+}
+
+static u32 wex_stamp(VfsInode* dir) {
+    return ((FSNode*)dir->priv)->stamp;
+}
+
+static int wex_lookup(VfsInode* dir, const char* name, int len, VfsInode* out) {
+    FSNode* node = wexfs_lookup_child((FSNode*)dir->priv, name, len);
+    if (!node) return WEXFS_ENOENT;
+    wex_fill(node, out);
+    return WEXFS_OK;
+}
+
+static int wex_create(VfsInode* dir, const char* name, int type, VfsInode* out) {
+    int err;
+    FSNode* node = wexfs_create((FSNode*)dir->priv, name, type, &err);
+    if (!node) return err;
+    wex_fill(node, out);
+    return WEXFS_OK;
+}
+
+static int wex_remove(VfsInode* node) {
+    return wexfs_remove((FSNode*)node->priv);
+}
+
+static int wex_rename(VfsInode* node, VfsInode* new_dir, const char* name) {
+    return wexfs_rename((FSNode*)node->priv, (FSNode*)new_dir->priv, name);
+}
+
+static int wex_stat(VfsInode* node, VfsStat* st) {
+    wex_stat_node((FSNode*)node->priv, st);
+    return WEXFS_OK;
+}
+
+static int wex_open(VfsInode* node, u32 flags) {
+    return wexfs_open((FSNode*)node->priv, "", flags);
+}
+
+static int wex_fstat(int fh, VfsStat* st) {
+    FSNode* node = wexfs_fnode(fh);
+    if (!node) return WEXFS_EBADF;
+    wex_stat_node(node, st);
+    return WEXFS_OK;
+}
+
+static int wex_map(int fh, u32 offset, u32 len, void** out) {
+    return wexfs_map(fh, offset, len, WEXFS_MAP_READ, out);
+}
+
+static int wex_opendir(VfsInode* dir, VfsDir* d) {
+    WexDir* w = (WexDir*)kmalloc(sizeof(WexDir));
+    if (!w) return WEXFS_ENOMEM;
+    int rc = wexfs_opendir((FSNode*)dir->priv, WEXFS_DIR_SORTED, w);
+    if (rc != WEXFS_OK) {
+        kfree(w);
+        return rc;
+    }
+    d->priv = w;
+    return WEXFS_OK;
+}
+
+static int wex_readdir(VfsDir* d, VfsDirent* out) {
+    FSNode* node = wexfs_readdir((WexDir*)d->priv);
+    if (!node) return 0;
+    out->name = node->name;
+    out->type = node->is_dir ? VFS_DIR : VFS_FILE;
+    out->ino = node->ino;
+    out->size = node->di.size;
+    out->tree_bytes = node->is_dir ? node->tree_bytes : node->di.size;
+    out->tree_files = node->is_dir ? node->tree_files : 1;
+    return 1;
+}
+
+static void wex_closedir(VfsDir* d) {
+    kfree(d->priv);
+    d->priv = NULL;
+}
+
+const VfsOps wexfs_vfs_ops = {
+    .name = "wexfs",
+    .mount = wex_mount,
+    .umount = wex_umount,
+    .root = wex_root,
+    .generation = wex_generation,
+    .statfs = wex_statfs,
+    .stamp = wex_stamp,
+    .lookup = wex_lookup,
+    .create = wex_create,
+    .remove = wex_remove,
+    .rename = wex_rename,
+    .stat = wex_stat,
+    .open = wex_open,
+    .read = wexfs_fread,
+    .write = wexfs_fwrite,
+    .seek = wexfs_seek,
+    .truncate = wexfs_ftruncate,
+    .fstat = wex_fstat,
+    .close = wexfs_close,
+    .map = wex_map,
+    .unmap = wexfs_unmap,
+    .opendir = wex_opendir,
+    .readdir = wex_readdir,
+    .closedir = wex_closedir,
+};
@@ -0,0 +1,220 @@
+#ifndef WEXOS_VFS_H
+#define WEXOS_VFS_H
+
+#include "wexfs.h"
+
+/*
+ * Virtual filesystem: one namespace over any number of mounted volumes.
+ *
+ *   mount table   each mount puts a driver's root directory over a
+ *                 directory of another mount; "/" is mounted first
+ *   inodes        generic objects filled in by the drivers, cached by
+ *                 (mount, inode number) and shared by all their names
+ *   dentries      cached (directory, name) -> inode results, including
+ *                 negative ones for names that do not exist, so a
+ *                 repeated lookup costs one hash probe per component
+ *
+ * Every directory has a driver stamp that changes whenever an entry is
+ * added to or removed from it. A cached name is used only while its
+ * directory still has the stamp the name was cached under, so changes
+ * made below the VFS (log rotation, fsck repairs, defrag) are noticed
+ * on the next lookup. Paths without a leading '/' start at the VFS
+ * working directory; "." and ".." are resolved by the walk, and ".."
+ * from a mount's root leaves the mount.
+ */
+#define VFS_MAX_MOUNTS 8
+#define VFS_MAX_OPEN 32
+#define VFS_MAX_FSTYPES 8
+#define VFS_DCACHE_MAX 1024     /* unused dentries kept before the LRU ones go */
+#define VFS_DCACHE_HASH 1024    /* buckets, power of two */
+#define VFS_ICACHE_HASH 256     /* buckets, power of two */
+
+#define VFS_FILE WEXFS_FILE
+#define VFS_DIR  WEXFS_DIR
+
+/* Errors: the WEXFS_E* codes, plus */
+#define VFS_EXDEV  -12          /* rename across mounts */
+#define VFS_EBUSY  -13          /* mount point or mounted volume in use */
+#define VFS_EROFS  -14          /* read-only mount */
+#define VFS_ENOSYS -15          /* the driver does not support it */
+#define VFS_ENODEV -16          /* unknown filesystem type */
+
+/* Open flags and seek origins are those of WexFS */
+#define VFS_O_READ   WEXFS_O_READ
+#define VFS_O_WRITE  WEXFS_O_WRITE
+#define VFS_O_RDWR   WEXFS_O_RDWR
+#define VFS_O_CREATE WEXFS_O_CREATE     /* make the file and missing parents */
+#define VFS_O_TRUNC  WEXFS_O_TRUNC
+#define VFS_O_APPEND WEXFS_O_APPEND
+
+#define VFS_SEEK_SET WEXFS_SEEK_SET
+#define VFS_SEEK_CUR WEXFS_SEEK_CUR
+#define VFS_SEEK_END WEXFS_SEEK_END
+
+/* Mount flags */
+#define VFS_MNT_RDONLY 0x1
+
+struct VfsMount;
+
+typedef struct VfsInode {
+    struct VfsMount* mnt;
+    u32 ino;
+    int type;                   /* VFS_FILE or VFS_DIR */
+    u32 size;                   /* as of the last lookup or stat */
+    void* priv;                 /* driver object */
+    u32 refs;                   /* dentries using it */
+    struct VfsInode* hash_next;
+} VfsInode;
+
+typedef struct VfsDentry {
+    char* name;
+    struct VfsDentry* parent;   /* NULL for a mount's root */
+    struct VfsMount* mnt;       /* mount the name belongs to */
+    VfsInode* inode;            /* NULL: negative, the name does not exist */
+    struct VfsMount* mounted;   /* mount covering this directory */
+    u32 stamp;                  /* parent's driver stamp when cached */
+    u32 children;               /* cached names below this one */
+    u32 refs;                   /* walks and mounts holding it */
+    struct VfsDentry* hash_next;
+    struct VfsDentry* lru_prev;
+    struct VfsDentry* lru_next;
+} VfsDentry;
+
+typedef struct {
+    int type;
+    u32 ino;
+    u32 size;
+    unsigned long long tree_bytes;  /* dirs: bytes below, if the driver counts them */
+    u32 tree_files;                 /* dirs: files below */
+    u32 flags;                      /* driver specific */
+} VfsStat;
+
+typedef struct {
+    unsigned long long total_bytes;
+    unsigned long long free_bytes;
+    u32 objects;
+} VfsStatfs;
+
+typedef struct {
+    const char* name;           /* valid until the next readdir */
+    int type;
+    u32 ino;
+    u32 size;
+    unsigned long long tree_bytes;
+    u32 tree_files;
+} VfsDirent;
+
+/* Directory listings come in strcmp order */
+typedef struct {
+    struct VfsMount* mnt;
+    void* priv;
+} VfsDir;
+
+/*
+ * Filesystem driver. Inode operations get objects found by an earlier
+ * lookup on the same mount and are only called while the names leading
+ * to them are valid. File operations work on driver handles (>= 0),
+ * which must fail with WEXFS_EBADF once their file is gone. `map` and
+ * `find` may be NULL.
+ */
+typedef struct VfsOps {
+    const char* name;
+    int (*mount)(struct VfsMount* mnt, const char* source);
+    void (*umount)(struct VfsMount* mnt);
+    int (*root)(struct VfsMount* mnt, VfsInode* out);
+    u32 (*generation)(struct VfsMount* mnt);     /* changes when all objects are replaced */
+    int (*statfs)(struct VfsMount* mnt, VfsStatfs* st);
+
+    u32 (*stamp)(VfsInode* dir);
+    int (*lookup)(VfsInode* dir, const char* name, int len, VfsInode* out);
+    int (*create)(VfsInode* dir, const char* name, int type, VfsInode* out);
+    int (*remove)(VfsInode* node);               /* directories with everything below */
+    int (*rename)(VfsInode* node, VfsInode* new_dir, const char* name);
+    int (*stat)(VfsInode* node, VfsStat* st);
+
+    int (*open)(VfsInode* node, u32 flags);       /* handle or error */
+    int (*read)(int fh, void* buf, u32 len);
+    int (*write)(int fh, const void* buf, u32 len);
+    int (*seek)(int fh, int offset, int whence);
+    int (*truncate)(int fh, u32 size);
+    int (*fstat)(int fh, VfsStat* st);
+    int (*close)(int fh);
+    int (*map)(int fh, u32 offset, u32 len, void** out);
+    void (*unmap)(const void* ptr);
+
+    int (*opendir)(VfsInode* dir, VfsDir* d);
+    int (*readdir)(VfsDir* d, VfsDirent* out);   /* 1, or 0 after the last */
+    void (*closedir)(VfsDir* d);
+} VfsOps;
+
+typedef struct VfsMount {
+    const VfsOps* ops;
+    VfsDentry* root;
+    VfsDentry* covered;         /* NULL for "/" */
+    char path[MAX_PATH];
+    char source[32];
+    u32 flags;                  /* VFS_MNT_* */
+    u32 generation;             /* driver generation `root` belongs to */
+    u32 open_files;
+    void* priv;                 /* driver volume state */
+    int used;
+} VfsMount;
+
+typedef struct {
+    u32 lookups;                /* path components resolved */
+    u32 hits;                   /* served from the dentry cache */
+    u32 negative_hits;          /* of those, names known not to exist */
+    u32 misses;                 /* asked the driver */
+    u32 evictions;
+    u32 dentries;               /* cached now */
+    u32 inodes;
+} VfsStats;
+
+extern VfsStats vfs_stats;
+extern const VfsOps wexfs_vfs_ops;
+
+void vfs_init(void);
+int vfs_register(const VfsOps* ops);
+const char* vfs_strerror(int err);
+
+/* Mount table. vfs_mount_at returns the n-th live mount, or NULL. */
+int vfs_mount(const char* fstype, const char* source, const char* path, u32 flags);
+int vfs_umount(const char* path);
+VfsMount* vfs_mount_at(int n);
+
+/* Names */
+int vfs_stat(const char* path, VfsStat* st);
+int vfs_create(const char* path, int type);
+int vfs_remove(const char* path);
+int vfs_rename(const char* from, const char* to);
+int vfs_realpath(const char* path, char* out, int max);
+int vfs_chdir(const char* path);
+void vfs_getcwd(char* out, int max);
+
+/* Files */
+int vfs_open(const char* path, u32 flags);
+int vfs_read(int fd, void* buf, u32 len);
+int vfs_write(int fd, const void* buf, u32 len);
+int vfs_seek(int fd, int offset, int whence);
+int vfs_truncate(int fd, u32 size);
+int vfs_fstat(int fd, VfsStat* st);
+int vfs_close(int fd);
+
+/* A read-only view of the file from `offset`, at most `len` bytes and
+ * never past a 4 KB boundary: straight into the driver's cache where it
+ * has one, otherwise a copy. Returns the byte count, 0 at the end of
+ * the file, or an error; release with vfs_unmap. */
+int vfs_map(int fd, u32 offset, u32 len, const void** out);
+void vfs_unmap(int fd, const void* ptr);
+
+/* Directories */
+int vfs_opendir(const char* path, VfsDir* d);
+int vfs_readdir(VfsDir* d, VfsDirent* out);
+void vfs_closedir(VfsDir* d);
+
+/* The WexFS object behind `path`, or NULL when it is on another kind of
+ * volume; for commands that use WexFS features (clones, compression,
+ * log files, the name index). */
+FSNode* vfs_wexfs_node(const char* path);
+
+#endif
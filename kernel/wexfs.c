@@ -0,0 +1,3859 @@
+/* WexFS v2 - block/inode filesystem shared by kernel, recovery and installer */
+#include "wexfs.h"
+#include "heap.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "search.h"
+#include "io.h"
+
+WexSuper wexfs_sb;
+FSNode** fs_nodes = NULL;
+u32 fs_node_slots = 0;
+int fs_count = 0;
+u32 wexfs_free_blocks = 0;
+u32 wexfs_csum_errors = 0;
+u32 wexfs_generation = 0;
+u32 wexfs_volume = 0;
+
+static u32 stamp_seq = 0;       /* FSNode.stamp; not reset with the volume */
+
+static u8* fs_bitmap = NULL;
+static u32 bitmap_hint = 0;
+static u32 bitmap_dirty_lo = 0xFFFFFFFF;
+static u32 bitmap_dirty_hi = 0;
+
+static u8* fs_refs = NULL;      /* extra owners per block, see wexfs.h */
+static u32 refs_dirty_lo = 0xFFFFFFFF;
+static u32 refs_dirty_hi = 0;
+
+static u32* fs_csums = NULL;    /* CRC32C per block, see wexfs.h */
+static u32 csums_dirty_lo = 0xFFFFFFFF;
+static u32 csums_dirty_hi = 0;
+
+/* Content index for dedup: direct-mapped by block hash, with a reverse
+ * slot per block residue so a freed block can be dropped in O(1). */
+typedef struct {
+    u32 hash;
+    u32 blk;                    /* 0 = empty */
+} DedupSlot;
+
+#define DEDUP_NONE 0xFFFF
+static DedupSlot* dedup_slots = NULL;
+static u16* dedup_back = NULL;
+
+static FSNode** fs_hash = NULL;
+static u32 fs_hash_size = 0;
+
+/* Open files; node == NULL marks a free slot */
+typedef struct {
+    FSNode* node;
+    u32 offset;
+    u32 flags;
+} WexFile;
+
+static WexFile fs_files[WEXFS_MAX_OPEN];
+
+static u32 ino_hint = WEXFS_ROOT_INO;
+static u32 inode_pending = 0xFFFFFFFF;
+
+/* Scratch buffers; the kernel is single threaded so one set is enough */
+static u8 dirbuf[WEXFS_BLOCK_SIZE];
+static u32 dirbuf_blk = 0;      /* directory block currently held in dirbuf */
+static u8 databuf[WEXFS_BLOCK_SIZE];
+static u8 cmpbuf[WEXFS_BLOCK_SIZE];
+static u8 zbuf[WEXFS_BLOCK_SIZE];       /* last decompressed block */
+static u32 zbuf_blk = 0;
+static u32 ptrbuf[WEXFS_PTRS_PER_BLOCK];
+static u32 ptrbuf2[WEXFS_PTRS_PER_BLOCK];
+
+/* Open transaction: sectors staged in memory until wexfs_tx_commit() */
+static int tx_active = 0;
+static int tx_split = 0;        /* outgrew a record, part went out early */
+static u32 tx_count = 0;
+static u32 tx_lba[WEXFS_JOURNAL_MAX];
+static u8* tx_data = NULL;
+static u32 journal_seq = 0;
+
+/* Blocks handed out by wexfs_map(). A slot with no pins may be reused;
+ * blk == 0 means it holds nothing another mapping can share. */
+#define MAP_STALE 0x1           /* block rewritten while pinned */
+#define MAP_PRIVATE 0x2         /* caller's own copy, never shared */
+
+typedef struct {
+    u32 blk;
+    u32 pins;
+    u32 flags;
+    u32 used;
+    u8* data;
+} MapSlot;
+
+static MapSlot map_slots[WEXFS_MAP_SLOTS];
+static u32 map_clock = 0;
+
+/* Two most recently used indirect blocks, so sequential access does not
+ * re-read the same pointer block for every data block. */
+static u32 meta_blk[2] = {0, 0};
+static u32 meta_buf[2][WEXFS_PTRS_PER_BLOCK];
+static int meta_next = 0;
+
+/* ---------- Journal ---------- */
+
+/* Updates that must land together (rename) are staged in memory, written
+ * to the journal area followed by a one-sector commit header, and only
+ * then copied home. Mount replays a committed journal, so a crash leaves
+ * either the complete old state or the complete new one. */
+
+static u32 journal_lba(void) {
+    return FS_SECTOR_START + wexfs_sb.journal_start * WEXFS_SECTORS_PER_BLOCK;
+}
+
+static u32 journal_checksum(const WexJournalHeader* h, const u8* data) {
+    u32 sum = 2166136261u ^ h->sequence ^ h->count;
+    for (u32 i = 0; i < h->count; i++) sum = (sum ^ h->lba[i]) * 16777619u;
+    for (u32 i = 0; i < h->count * SECTOR_SIZE; i++) sum = (sum ^ data[i]) * 16777619u;
+    return sum;
+}
+
+static void dev_read(u32 lba, u8* buf) {
+    if (tx_active) {
+        for (u32 i = 0; i < tx_count; i++) {
+            if (tx_lba[i] == lba) {
+                memcpy(buf, tx_data + i * SECTOR_SIZE, SECTOR_SIZE);
+                return;
+            }
+        }
+    }
+    ata_read_sector(lba, buf);
+}
+
+static void tx_write_home(void) {
+    for (u32 i = 0; i < tx_count; i++) {
+        ata_write_sector(tx_lba[i], tx_data + i * SECTOR_SIZE);
+    }
+}
+
+/* Journal the staged sectors, then write them in place. */
+static void tx_flush(void) {
+    if (tx_count == 0) return;
+    if (wexfs_sb.journal_blocks == 0) {
+        tx_write_home();
+        tx_count = 0;
+        return;
+    }
+
+    u32 base = journal_lba();
+    for (u32 i = 0; i < tx_count; i++) {
+        ata_write_sector(base + 1 + i, tx_data + i * SECTOR_SIZE);
+    }
+
+    WexJournalHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = WEXFS_JOURNAL_MAGIC;
+    h.sequence = ++journal_seq;
+    h.count = tx_count;
+    memcpy(h.lba, tx_lba, tx_count * sizeof(u32));
+    h.checksum = journal_checksum(&h, tx_data);
+    ata_write_sector(base, (u8*)&h);        // commit point
+
+    tx_write_home();
+
+    h.magic = 0;
+    ata_write_sector(base, (u8*)&h);
+    tx_count = 0;
+}
+
+static void dev_write(u32 lba, u8* buf) {
+    if (!tx_active) {
+        ata_write_sector(lba, buf);
+        return;
+    }
+    u32 i = 0;
+    while (i < tx_count && tx_lba[i] != lba) i++;
+    if (i == tx_count) {
+        // Too big for one journal record: commit what we have and go on,
+        // and let wexfs_tx_commit tell the caller
+        if (tx_count == WEXFS_JOURNAL_MAX) {
+            tx_flush();
+            tx_split = 1;
+        }
+        i = tx_count++;
+        tx_lba[i] = lba;
+    }
+    memcpy(tx_data + i * SECTOR_SIZE, buf, SECTOR_SIZE);
+}
+
+int wexfs_tx_begin(void) {
+    if (tx_active) return WEXFS_EINVAL;
+    if (!tx_data) {
+        tx_data = (u8*)kmalloc(WEXFS_JOURNAL_MAX * SECTOR_SIZE);
+        if (!tx_data) return WEXFS_ENOMEM;
+    }
+    tx_active = 1;
+    tx_split = 0;
+    tx_count = 0;
+    return WEXFS_OK;
+}
+
+int wexfs_tx_commit(void) {
+    if (!tx_active) return WEXFS_OK;
+    tx_flush();
+    tx_active = 0;
+    return tx_split ? WEXFS_EFBIG : WEXFS_OK;
+}
+
+/* Finish an interrupted commit: copy a complete journal record home. */
+static void journal_replay(void) {
+    if (wexfs_sb.journal_blocks == 0) return;
+    u32 base = journal_lba();
+    WexJournalHeader h;
+    ata_read_sector(base, (u8*)&h);
+    if (h.magic != WEXFS_JOURNAL_MAGIC || h.count == 0 || h.count > WEXFS_JOURNAL_MAX) return;
+
+    u8* data = (u8*)kmalloc(h.count * SECTOR_SIZE);
+    if (!data) return;
+    for (u32 i = 0; i < h.count; i++) {
+        ata_read_sector(base + 1 + i, data + i * SECTOR_SIZE);
+    }
+    if (journal_checksum(&h, data) == h.checksum) {
+        for (u32 i = 0; i < h.count; i++) {
+            ata_write_sector(h.lba[i], data + i * SECTOR_SIZE);
+        }
+        prints("WexFS: journal replayed\n");
+    }
+    kfree(data);
+
+    journal_seq = h.sequence;
+    h.magic = 0;
+    ata_write_sector(base, (u8*)&h);
+}
+
+/* ---------- Block I/O ---------- */
+
+static u32 blk_lba(u32 blk) {
+    return FS_SECTOR_START + blk * WEXFS_SECTORS_PER_BLOCK;
+}
+
+static void print_u32(u32 value) {
+    char buf[12];
+    int pos = 11;
+    buf[pos] = '\0';
+    do {
+        buf[--pos] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    prints(buf + pos);
+}
+
+static u32 block_crc(const void* buf, u32 len) {
+    u32 crc = crc32c(0, buf, len);
+    return crc ? crc : 1;       // 0 marks a block without a checksum
+}
+
+static void csum_touch(u32 blk) {
+    u32 sector = blk / (SECTOR_SIZE / 4);
+    if (sector < csums_dirty_lo) csums_dirty_lo = sector;
+    if (sector > csums_dirty_hi) csums_dirty_hi = sector;
+}
+
+static void csum_set(u32 blk, const void* buf, u32 len) {
+    if (!fs_csums || blk >= wexfs_sb.total_blocks) return;
+    fs_csums[blk] = block_crc(buf, len);
+    csum_touch(blk);
+}
+
+/* Check `len` bytes just read from `blk`; a mismatch is reported once
+ * per read and counted in wexfs_csum_errors. */
+static int csum_match(u32 blk, const void* buf, u32 len) {
+    if (!fs_csums || blk >= wexfs_sb.total_blocks || !fs_csums[blk]) return 1;
+    return fs_csums[blk] == block_crc(buf, len);
+}
+
+static int csum_ok(u32 blk, const void* buf, u32 len) {
+    if (csum_match(blk, buf, len)) return 1;
+    wexfs_csum_errors++;
+    prints("WexFS: checksum mismatch in block ");
+    print_u32(blk);
+    prints("\n");
+    return 0;
+}
+
+static void meta_forget(u32 blk) {
+    if (meta_blk[0] == blk) meta_blk[0] = 0;
+    if (meta_blk[1] == blk) meta_blk[1] = 0;
+}
+
+static void blk_read(u32 blk, void* buf) {
+    u32 lba = blk_lba(blk);
+    for (int s = 0; s < WEXFS_SECTORS_PER_BLOCK; s++) {
+        dev_read(lba + s, (u8*)buf + s * SECTOR_SIZE);
+    }
+}
+
+/* Drop cached plain contents of a block that is rewritten or freed. A
+ * pinned mapping keeps the old contents until it is unmapped. */
+static void cache_forget(u32 blk) {
+    if (blk == zbuf_blk) zbuf_blk = 0;
+    for (int i = 0; i < WEXFS_MAP_SLOTS; i++) {
+        MapSlot* slot = &map_slots[i];
+        if (slot->blk != blk || (slot->flags & MAP_PRIVATE)) continue;
+        if (slot->pins) slot->flags |= MAP_STALE;
+        else slot->blk = 0;
+    }
+}
+
+static void blk_write(u32 blk, const void* buf) {
+    u32 lba = blk_lba(blk);
+    meta_forget(blk);
+    if (blk == dirbuf_blk && buf != dirbuf) dirbuf_blk = 0;
+    cache_forget(blk);
+    for (int s = 0; s < WEXFS_SECTORS_PER_BLOCK; s++) {
+        dev_write(lba + s, (u8*)buf + s * SECTOR_SIZE);
+    }
+    csum_set(blk, buf, WEXFS_BLOCK_SIZE);
+}
+
+/* Write back only the sectors of `buf` that overlap [off, off+len).
+ * `buf` must hold the whole block: the checksum covers all of it. */
+static void blk_write_range(u32 blk, const void* buf, u32 off, u32 len) {
+    if (len == 0) return;
+    u32 lba = blk_lba(blk);
+    u32 first = off / SECTOR_SIZE;
+    u32 last = (off + len - 1) / SECTOR_SIZE;
+    meta_forget(blk);
+    cache_forget(blk);
+    for (u32 s = first; s <= last; s++) {
+        dev_write(lba + s, (u8*)buf + s * SECTOR_SIZE);
+    }
+    csum_set(blk, buf, WEXFS_BLOCK_SIZE);
+}
+
+/* Write the first `sectors` sectors of a compressed block. */
+static void blk_write_packed(u32 blk, const void* buf, u32 sectors) {
+    u32 lba = blk_lba(blk);
+    meta_forget(blk);
+    cache_forget(blk);
+    for (u32 s = 0; s < sectors; s++) {
+        dev_write(lba + s, (u8*)buf + s * SECTOR_SIZE);
+    }
+    csum_set(blk, buf, sectors * SECTOR_SIZE);
+}
+
+static void blk_zero(u32 blk) {
+    memset(databuf, 0, WEXFS_BLOCK_SIZE);
+    blk_write(blk, databuf);
+}
+
+static u32* meta_read(u32 blk) {
+    if (meta_blk[0] == blk) return meta_buf[0];
+    if (meta_blk[1] == blk) return meta_buf[1];
+    int slot = meta_next;
+    meta_next ^= 1;
+    blk_read(blk, meta_buf[slot]);
+    // A damaged pointer block is treated as a hole rather than followed
+    if (!csum_ok(blk, meta_buf[slot], WEXFS_BLOCK_SIZE)) memset(meta_buf[slot], 0, WEXFS_BLOCK_SIZE);
+    meta_blk[slot] = blk;
+    return meta_buf[slot];
+}
+
+/* Store one pointer slot of an indirect block, writing a single sector. */
+static void meta_store(u32 blk, u32 index, u32 value) {
+    u32* ptrs = meta_read(blk);
+    ptrs[index] = value;
+    u32 lba = blk_lba(blk) + (index * 4) / SECTOR_SIZE;
+    dev_write(lba, (u8*)ptrs + ((index * 4) / SECTOR_SIZE) * SECTOR_SIZE);
+    csum_set(blk, ptrs, WEXFS_BLOCK_SIZE);
+}
+
+static void super_sync(void) {
+    dev_write(FS_SECTOR_START, (u8*)&wexfs_sb);
+}
+
+/* ---------- Content index ---------- */
+
+static u32 dedup_hash(const u8* data) {
+    const u32* w = (const u32*)data;
+    u32 h = 2166136261u;
+    for (u32 i = 0; i < WEXFS_BLOCK_SIZE / 4; i++) h = (h ^ w[i]) * 16777619u;
+    return h;
+}
+
+static void dedup_evict(u32 residue) {
+    u16 slot = dedup_back[residue];
+    if (slot == DEDUP_NONE) return;
+    dedup_slots[slot].blk = 0;
+    dedup_back[residue] = DEDUP_NONE;
+}
+
+static void dedup_forget(u32 blk) {
+    if (!dedup_slots) return;
+    u32 r = blk & (WEXFS_DEDUP_SLOTS - 1);
+    if (dedup_back[r] != DEDUP_NONE && dedup_slots[dedup_back[r]].blk == blk) dedup_evict(r);
+}
+
+static void dedup_insert(u32 hash, u32 blk) {
+    if (!dedup_slots) {
+        dedup_slots = (DedupSlot*)kcalloc(WEXFS_DEDUP_SLOTS, sizeof(DedupSlot));
+        dedup_back = (u16*)kmalloc(WEXFS_DEDUP_SLOTS * sizeof(u16));
+        if (!dedup_slots || !dedup_back) {
+            kfree(dedup_slots);
+            kfree(dedup_back);
+            dedup_slots = NULL;
+            dedup_back = NULL;
+            return;
+        }
+        for (u32 i = 0; i < WEXFS_DEDUP_SLOTS; i++) dedup_back[i] = DEDUP_NONE;
+    }
+
+    u32 r = blk & (WEXFS_DEDUP_SLOTS - 1);
+    u32 c = hash & (WEXFS_DEDUP_SLOTS - 1);
+    dedup_evict(r);
+    if (dedup_slots[c].blk) dedup_back[dedup_slots[c].blk & (WEXFS_DEDUP_SLOTS - 1)] = DEDUP_NONE;
+    dedup_slots[c].hash = hash;
+    dedup_slots[c].blk = blk;
+    dedup_back[r] = (u16)c;
+}
+
+/* A block already holding exactly `data`, or 0. Hash hits are compared
+ * byte for byte, so a collision never merges different content. */
+static u32 dedup_find(u32 hash, const u8* data) {
+    if (!dedup_slots) return 0;
+    DedupSlot* slot = &dedup_slots[hash & (WEXFS_DEDUP_SLOTS - 1)];
+    if (!slot->blk || slot->hash != hash) return 0;
+    blk_read(slot->blk, cmpbuf);
+    for (u32 i = 0; i < WEXFS_BLOCK_SIZE; i++) {
+        if (cmpbuf[i] != data[i]) return 0;
+    }
+    return slot->blk;
+}
+
+/* ---------- Free-block bitmap ---------- */
+
+static int bitmap_test(u32 blk) {
+    return fs_bitmap[blk >> 3] & (1 << (blk & 7));
+}
+
+static void bitmap_touch(u32 blk) {
+    u32 sector = (blk >> 3) / SECTOR_SIZE;
+    if (sector < bitmap_dirty_lo) bitmap_dirty_lo = sector;
+    if (sector > bitmap_dirty_hi) bitmap_dirty_hi = sector;
+}
+
+static void bitmap_sync(void) {
+    if (bitmap_dirty_lo > bitmap_dirty_hi) return;
+    u32 lba = blk_lba(wexfs_sb.bitmap_start);
+    for (u32 s = bitmap_dirty_lo; s <= bitmap_dirty_hi; s++) {
+        dev_write(lba + s, fs_bitmap + s * SECTOR_SIZE);
+    }
+    bitmap_dirty_lo = 0xFFFFFFFF;
+    bitmap_dirty_hi = 0;
+}
+
+static void bitmap_set(u32 blk) {
+    fs_bitmap[blk >> 3] |= (u8)(1 << (blk & 7));
+    bitmap_touch(blk);
+    wexfs_free_blocks--;
+}
+
+static void wexfs_free_block(u32 blk) {
+    if (blk == 0 || blk >= wexfs_sb.total_blocks || !bitmap_test(blk)) return;
+    fs_bitmap[blk >> 3] &= (u8)~(1 << (blk & 7));
+    bitmap_touch(blk);
+    meta_forget(blk);
+    dedup_forget(blk);
+    if (blk == dirbuf_blk) dirbuf_blk = 0;
+    cache_forget(blk);
+    wexfs_free_blocks++;
+    if (blk < bitmap_hint) bitmap_hint = blk;
+}
+
+static u32 wexfs_alloc_block(void) {
+    u32 words = (wexfs_sb.total_blocks + 31) / 32;
+    u32* map = (u32*)fs_bitmap;
+    u32 w = bitmap_hint / 32;
+    if (w >= words) w = 0;
+
+    // Skip full words 32 blocks at a time
+    for (u32 n = 0; n < words; n++, w++) {
+        if (w >= words) w = 0;
+        if (map[w] == 0xFFFFFFFF) continue;
+        for (u32 bit = 0; bit < 32; bit++) {
+            u32 blk = w * 32 + bit;
+            if (!bitmap_test(blk)) {
+                bitmap_set(blk);
+                bitmap_hint = blk + 1;
+                return blk;
+            }
+        }
+    }
+    return 0;
+}
+
+/* First-fit search for `count` contiguous free blocks. */
+static u32 wexfs_alloc_run(u32 count) {
+    u32* map = (u32*)fs_bitmap;
+    u32 run = 0;
+    for (u32 blk = 1; blk < wexfs_sb.total_blocks; blk++) {
+        if ((blk & 31) == 0 && map[blk / 32] == 0xFFFFFFFF) {
+            run = 0;
+            blk += 31;
+            continue;
+        }
+        if (bitmap_test(blk)) {
+            run = 0;
+            continue;
+        }
+        if (++run == count) {
+            u32 start = blk + 1 - count;
+            for (u32 b = start; b <= blk; b++) bitmap_set(b);
+            return start;
+        }
+    }
+    return 0;
+}
+
+/* Reserve the journal area; also upgrades volumes made without one. */
+static int journal_create(void) {
+    u32 start = wexfs_alloc_run(WEXFS_JOURNAL_BLOCKS);
+    if (!start) return WEXFS_ENOSPC;
+    wexfs_sb.journal_start = start;
+    wexfs_sb.journal_blocks = WEXFS_JOURNAL_BLOCKS;
+
+    WexJournalHeader h;
+    memset(&h, 0, sizeof(h));
+    ata_write_sector(journal_lba(), (u8*)&h);
+    bitmap_sync();
+    super_sync();
+    return WEXFS_OK;
+}
+
+/* ---------- Shared blocks ---------- */
+
+/* A data block may be owned by several files (clones, dedup). The table
+ * counts owners beyond the first, so a zeroed table is the unshared state
+ * and blocks are only freed when their last owner lets go. */
+
+static int refs_create(void) {
+    u32 count = (wexfs_sb.total_blocks + WEXFS_BLOCK_SIZE - 1) / WEXFS_BLOCK_SIZE;
+    u32 start = wexfs_alloc_run(count);
+    if (!start) return WEXFS_ENOSPC;
+    fs_refs = (u8*)kcalloc(count * WEXFS_BLOCK_SIZE, 1);
+    if (!fs_refs) {
+        for (u32 b = start; b < start + count; b++) wexfs_free_block(b);
+        bitmap_sync();
+        return WEXFS_ENOMEM;
+    }
+    for (u32 b = start; b < start + count; b++) blk_zero(b);
+    wexfs_sb.refcount_start = start;
+    wexfs_sb.refcount_blocks = count;
+    bitmap_sync();
+    super_sync();
+    return WEXFS_OK;
+}
+
+static void refs_touch(u32 blk) {
+    u32 sector = blk / SECTOR_SIZE;
+    if (sector < refs_dirty_lo) refs_dirty_lo = sector;
+    if (sector > refs_dirty_hi) refs_dirty_hi = sector;
+}
+
+static void refs_sync(void) {
+    if (refs_dirty_lo > refs_dirty_hi) return;
+    u32 lba = blk_lba(wexfs_sb.refcount_start);
+    for (u32 s = refs_dirty_lo; s <= refs_dirty_hi; s++) {
+        dev_write(lba + s, fs_refs + s * SECTOR_SIZE);
+    }
+    refs_dirty_lo = 0xFFFFFFFF;
+    refs_dirty_hi = 0;
+}
+
+static int block_shared(u32 blk) {
+    return fs_refs && fs_refs[blk];
+}
+
+/* Add an owner; fails when the volume has no table or the count is full. */
+static int block_ref(u32 blk) {
+    if (!fs_refs || fs_refs[blk] == WEXFS_REF_MAX) return 0;
+    fs_refs[blk]++;
+    refs_touch(blk);
+    return 1;
+}
+
+/* Drop an owner of a data block, freeing it with the last one. */
+static void block_put(u32 blk) {
+    if (blk == 0 || blk >= wexfs_sb.total_blocks) return;
+    if (block_shared(blk)) {
+        fs_refs[blk]--;
+        refs_touch(blk);
+        return;
+    }
+    wexfs_free_block(blk);
+}
+
+u32 wexfs_shared_blocks(void) {
+    u32 saved = 0;
+    if (!fs_refs) return 0;
+    for (u32 b = 0; b < wexfs_sb.total_blocks; b++) saved += fs_refs[b];
+    return saved;
+}
+
+void wexfs_set_dedup(int on) {
+    if (on) wexfs_sb.features |= WEXFS_FEAT_DEDUP;
+    else wexfs_sb.features &= ~WEXFS_FEAT_DEDUP;
+    super_sync();
+}
+
+/* ---------- Checksums ---------- */
+
+static int csums_create(void) {
+    u32 count = (wexfs_sb.total_blocks * 4 + WEXFS_BLOCK_SIZE - 1) / WEXFS_BLOCK_SIZE;
+    u32 start = wexfs_alloc_run(count);
+    if (!start) return WEXFS_ENOSPC;
+    for (u32 b = start; b < start + count; b++) blk_zero(b);
+    fs_csums = (u32*)kcalloc(count * WEXFS_BLOCK_SIZE, 1);
+    if (!fs_csums) {
+        for (u32 b = start; b < start + count; b++) wexfs_free_block(b);
+        bitmap_sync();
+        return WEXFS_ENOMEM;
+    }
+    wexfs_sb.csum_start = start;
+    wexfs_sb.csum_blocks = count;
+    bitmap_sync();
+    super_sync();
+    return WEXFS_OK;
+}
+
+static void csums_sync(void) {
+    if (csums_dirty_lo > csums_dirty_hi) return;
+    u32 lba = blk_lba(wexfs_sb.csum_start);
+    for (u32 s = csums_dirty_lo; s <= csums_dirty_hi; s++) {
+        dev_write(lba + s, (u8*)fs_csums + s * SECTOR_SIZE);
+    }
+    csums_dirty_lo = 0xFFFFFFFF;
+    csums_dirty_hi = 0;
+}
+
+static u32 inode_crc(const WexInode* di) {
+    WexInode copy = *di;
+    copy.csum = 0;
+    return block_crc(&copy, sizeof(WexInode));
+}
+
+/* ---------- Inode table ---------- */
+
+/* Sector holding `ino` in a table made of `count` extents; 0 past its end */
+static u32 itable_lba(const WexExtent* itable, u32 count, u32 ino) {
+    u32 base = 0;
+    for (u32 i = 0; i < count && i < WEXFS_MAX_EXTENTS; i++) {
+        u32 n = itable[i].count * WEXFS_INODES_PER_BLOCK;
+        if (ino < base + n) {
+            u32 idx = ino - base;
+            return blk_lba(itable[i].start + idx / WEXFS_INODES_PER_BLOCK)
+                   + (idx % WEXFS_INODES_PER_BLOCK) / WEXFS_INODES_PER_SECTOR;
+        }
+        base += n;
+    }
+    return 0;
+}
+
+static u32 inode_lba(u32 ino) {
+    return itable_lba(wexfs_sb.itable, wexfs_sb.extent_count, ino);
+}
+
+/* Rebuild the sector holding `ino` from the in-memory copies; free
+ * slots are written as zeroes, so no read-modify-write is needed. */
+static void inode_write_sector(u32 ino) {
+    WexInode sector[WEXFS_INODES_PER_SECTOR];
+    u32 first = ino & ~(WEXFS_INODES_PER_SECTOR - 1);
+    for (u32 i = 0; i < WEXFS_INODES_PER_SECTOR; i++) {
+        u32 slot = first + i;
+        if (slot < fs_node_slots && fs_nodes[slot]) {
+            sector[i] = fs_nodes[slot]->di;
+            sector[i].csum = inode_crc(&sector[i]);
+        } else {
+            memset(&sector[i], 0, sizeof(WexInode));
+        }
+    }
+    u32 lba = inode_lba(first);
+    if (lba) dev_write(lba, (u8*)sector);
+}
+
+static void inode_flush(void) {
+    if (inode_pending != 0xFFFFFFFF) {
+        inode_write_sector(inode_pending);
+        inode_pending = 0xFFFFFFFF;
+    }
+}
+
+/* Queue the inode's sector; consecutive updates to one sector coalesce. */
+static void inode_queue(u32 ino) {
+    u32 sector = ino & ~(WEXFS_INODES_PER_SECTOR - 1);
+    if (inode_pending != sector) {
+        inode_flush();
+        inode_pending = sector;
+    }
+}
+
+/* Queue an updated inode. It gets the next change number, which is how
+ * a backup finds what changed since the last one. */
+static void inode_dirty(u32 ino) {
+    if (ino < fs_node_slots && fs_nodes[ino]) fs_nodes[ino]->di.change = ++wexfs_sb.change;
+    inode_queue(ino);
+}
+
+static void op_done(void) {
+    wexfs_generation++;
+    inode_flush();
+    bitmap_sync();
+    if (fs_refs) refs_sync();
+    if (fs_csums) csums_sync();
+}
+
+static int node_slots_reserve(u32 ino) {
+    if (ino < fs_node_slots) return WEXFS_OK;
+    u32 slots = fs_node_slots ? fs_node_slots : 64;
+    while (slots <= ino) slots *= 2;
+    FSNode** grown = (FSNode**)krealloc(fs_nodes, slots * sizeof(FSNode*));
+    if (!grown) return WEXFS_ENOMEM;
+    for (u32 i = fs_node_slots; i < slots; i++) grown[i] = NULL;
+    fs_nodes = grown;
+    fs_node_slots = slots;
+    return WEXFS_OK;
+}
+
+/* Add an extent to the inode table, doubling its size each time. */
+static int itable_grow(void) {
+    u32 want = wexfs_sb.inode_capacity / WEXFS_INODES_PER_BLOCK;
+    if (want < WEXFS_MIN_ITABLE_BLOCKS) want = WEXFS_MIN_ITABLE_BLOCKS;
+
+    u32 start = 0;
+    while (want > 0) {
+        start = wexfs_alloc_run(want);
+        if (start) break;
+        want /= 2;
+    }
+    if (!start) return WEXFS_ENOSPC;
+
+    WexExtent* last = wexfs_sb.extent_count ? &wexfs_sb.itable[wexfs_sb.extent_count - 1] : NULL;
+    if (last && last->start + last->count == start) {
+        last->count += want;
+    } else if (wexfs_sb.extent_count < WEXFS_MAX_EXTENTS) {
+        wexfs_sb.itable[wexfs_sb.extent_count].start = start;
+        wexfs_sb.itable[wexfs_sb.extent_count].count = want;
+        wexfs_sb.extent_count++;
+    } else {
+        for (u32 b = start; b < start + want; b++) wexfs_free_block(b);
+        bitmap_sync();
+        return WEXFS_ENOSPC;
+    }
+
+    for (u32 b = start; b < start + want; b++) blk_zero(b);
+    wexfs_sb.inode_capacity += want * WEXFS_INODES_PER_BLOCK;
+    bitmap_sync();
+    super_sync();
+    return WEXFS_OK;
+}
+
+static u32 ino_alloc(void) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        u32 ino = ino_hint > WEXFS_ROOT_INO ? ino_hint : WEXFS_ROOT_INO;
+        for (; ino < wexfs_sb.inode_capacity; ino++) {
+            if (ino >= fs_node_slots || !fs_nodes[ino]) {
+                ino_hint = ino + 1;
+                if (ino >= wexfs_sb.inode_hwm) {
+                    wexfs_sb.inode_hwm = (ino / WEXFS_INODES_PER_BLOCK + 1) * WEXFS_INODES_PER_BLOCK;
+                    super_sync();
+                }
+                return ino;
+            }
+        }
+        if (itable_grow() != WEXFS_OK) return 0;
+    }
+    return 0;
+}
+
+/* ---------- Name hash ---------- */
+
+static u32 name_hash(u32 parent, const char* name, int len) {
+    u32 h = 2166136261u ^ parent;
+    for (int i = 0; i < len; i++) {
+        h ^= (u8)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int name_eq(const char* stored, const char* name, int len) {
+    for (int i = 0; i < len; i++) {
+        if (stored[i] != name[i]) return 0;
+    }
+    return stored[len] == '\0';
+}
+
+static void hash_insert(FSNode* node) {
+    u32 h = name_hash(node->parent->ino, node->name, strlen(node->name)) & (fs_hash_size - 1);
+    node->hash_next = fs_hash[h];
+    fs_hash[h] = node;
+}
+
+static void hash_remove(FSNode* node) {
+    u32 h = name_hash(node->parent->ino, node->name, strlen(node->name)) & (fs_hash_size - 1);
+    FSNode** link = &fs_hash[h];
+    while (*link) {
+        if (*link == node) {
+            *link = node->hash_next;
+            node->hash_next = NULL;
+            return;
+        }
+        link = &(*link)->hash_next;
+    }
+}
+
+static int hash_reserve(u32 count) {
+    if (count < fs_hash_size) return WEXFS_OK;
+    u32 size = fs_hash_size ? fs_hash_size : 256;
+    while (size <= count) size *= 2;
+    FSNode** table = (FSNode**)kcalloc(size, sizeof(FSNode*));
+    if (!table) return WEXFS_ENOMEM;
+
+    FSNode** old = fs_hash;
+    u32 old_size = fs_hash_size;
+    fs_hash = table;
+    fs_hash_size = size;
+    for (u32 i = 0; i < old_size; i++) {
+        FSNode* n = old[i];
+        while (n) {
+            FSNode* next = n->hash_next;
+            hash_insert(n);
+            n = next;
+        }
+    }
+    kfree(old);
+    return WEXFS_OK;
+}
+
+/* ---------- Name index ---------- */
+
+/* Every three-character substring of every name maps to the inodes whose
+ * name contains it. A substring search only looks at the inodes listed
+ * under the rarest trigram of the pattern. */
+#define TRI_BUCKETS 4096
+
+typedef struct TriList {
+    u32 key;
+    u32 count;
+    u32 cap;
+    u32* inos;
+    struct TriList* next;
+} TriList;
+
+static TriList* tri_table[TRI_BUCKETS];
+static int tri_broken = 0;      /* an update failed: searches scan instead */
+
+static u32 tri_key(const char* p) {
+    return (u8)p[0] | ((u8)p[1] << 8) | ((u8)p[2] << 16);
+}
+
+static TriList* tri_get(u32 key, int create) {
+    u32 h = (key * 2654435761u) >> 20;
+    TriList* list = tri_table[h];
+    while (list && list->key != key) list = list->next;
+    if (list || !create) return list;
+    list = (TriList*)kcalloc(1, sizeof(TriList));
+    if (!list) return NULL;
+    list->key = key;
+    list->next = tri_table[h];
+    tri_table[h] = list;
+    return list;
+}
+
+static void tri_update(FSNode* node, int add) {
+    const char* name = node->name;
+    int len = strlen(name);
+    for (int i = 0; i + 3 <= len; i++) {
+        // A trigram that occurs twice in one name is listed once
+        u32 key = tri_key(name + i);
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) seen = tri_key(name + j) == key;
+        if (seen) continue;
+
+        TriList* list = tri_get(key, add);
+        if (!list) {
+            if (add) tri_broken = 1;
+            continue;
+        }
+        if (!add) {
+            // Recent entries are the likeliest to go, search from the end
+            u32 k = list->count;
+            while (k && list->inos[k - 1] != node->ino) k--;
+            if (k) list->inos[k - 1] = list->inos[--list->count];
+            continue;
+        }
+        if (list->count == list->cap) {
+            u32 cap = list->cap ? list->cap * 2 : 4;
+            u32* grown = (u32*)krealloc(list->inos, cap * sizeof(u32));
+            if (!grown) {
+                tri_broken = 1;
+                continue;
+            }
+            list->inos = grown;
+            list->cap = cap;
+        }
+        list->inos[list->count++] = node->ino;
+    }
+}
+
+static void tri_reset(void) {
+    for (int h = 0; h < TRI_BUCKETS; h++) {
+        while (tri_table[h]) {
+            TriList* next = tri_table[h]->next;
+            kfree(tri_table[h]->inos);
+            kfree(tri_table[h]);
+            tri_table[h] = next;
+        }
+    }
+    tri_broken = 0;
+}
+
+int wexfs_glob_match(const char* pattern, const char* name) {
+    const char* star = NULL;
+    const char* retry = NULL;
+    while (*name) {
+        if (*pattern == '?' || (*pattern == *name && *pattern != '*')) {
+            pattern++;
+            name++;
+        } else if (*pattern == '*') {
+            star = pattern++;
+            retry = name;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++retry;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+int wexfs_find(const char* pattern, u32 flags, FSNode** out, u32 max) {
+    int glob = 0;
+    for (const char* p = pattern; *p; p++) {
+        if (*p == '*' || *p == '?') glob = 1;
+    }
+
+    // Candidates come from the longest literal run of the pattern
+    const char* lit = pattern;
+    int lit_len = 0;
+    for (const char* p = pattern; *p; ) {
+        const char* start = p;
+        while (*p && !(glob && (*p == '*' || *p == '?'))) p++;
+        if (p - start > lit_len) {
+            lit = start;
+            lit_len = p - start;
+        }
+        if (*p) p++;
+    }
+
+    Searcher text;
+    search_init(&text, lit, lit_len, 0);
+    u32 found = 0;
+    if (!(flags & WEXFS_FIND_SCAN) && !tri_broken && lit_len >= 3) {
+        TriList* best = NULL;
+        for (int i = 0; i + 3 <= lit_len; i++) {
+            TriList* list = tri_get(tri_key(lit + i), 0);
+            if (!list || !list->count) return 0;
+            if (!best || list->count < best->count) best = list;
+        }
+        for (u32 i = 0; i < best->count; i++) {
+            FSNode* node = fs_nodes[best->inos[i]];
+            int hit = glob ? wexfs_glob_match(pattern, node->name) : search_find(&text, node->name, strlen(node->name)) >= 0;
+            if (!hit) continue;
+            if (found < max) out[found] = node;
+            found++;
+        }
+        return found;
+    }
+
+    for (u32 ino = 0; ino < fs_node_slots; ino++) {
+        FSNode* node = fs_nodes[ino];
+        if (!node || !node->parent) continue;
+        int hit = glob ? wexfs_glob_match(pattern, node->name) : search_find(&text, node->name, strlen(node->name)) >= 0;
+        if (!hit) continue;
+        if (found < max) out[found] = node;
+        found++;
+    }
+    return found;
+}
+
+/* ---------- In-memory tree ---------- */
+
+/* Every directory holds the byte and file totals of its subtree. A
+ * change is added to each directory on the way up to the root, so it
+ * costs the depth of the tree and reading a total costs nothing. */
+static void tree_account(FSNode* dir, long long bytes, int files) {
+    for (; dir; dir = dir->parent) {
+        dir->tree_bytes += bytes;
+        dir->tree_files += files;
+    }
+}
+
+static void tree_account_node(FSNode* dir, FSNode* node, int sign) {
+    if (node->is_dir) tree_account(dir, sign * (long long)node->tree_bytes, sign * (int)node->tree_files);
+    else tree_account(dir, sign * (long long)node->di.size, sign);
+}
+
+/* Set a file's size and carry the difference up the tree. */
+static void node_resize(FSNode* node, u32 size) {
+    if (node->parent) tree_account(node->parent, (long long)size - node->di.size, 0);
+    node->di.size = size;
+}
+
+static void tree_link(FSNode* dir, FSNode* node) {
+    if (dir->last_child && strcmp(dir->last_child->name, node->name) > 0) dir->unsorted = 1;
+    node->parent = dir;
+    node->next_sibling = NULL;
+    node->prev_sibling = dir->last_child;
+    if (dir->last_child) dir->last_child->next_sibling = node;
+    else dir->children = node;
+    dir->last_child = node;
+    dir->child_count++;
+    dir->stamp = ++stamp_seq;
+    hash_insert(node);
+    tri_update(node, 1);
+    tree_account_node(dir, node, 1);
+}
+
+static void tree_unlink(FSNode* node) {
+    FSNode* dir = node->parent;
+    tree_account_node(dir, node, -1);
+    hash_remove(node);
+    tri_update(node, 0);
+    if (node->prev_sibling) node->prev_sibling->next_sibling = node->next_sibling;
+    else dir->children = node->next_sibling;
+    if (node->next_sibling) node->next_sibling->prev_sibling = node->prev_sibling;
+    else dir->last_child = node->prev_sibling;
+    node->next_sibling = node->prev_sibling = NULL;
+    node->parent = NULL;
+    dir->child_count--;
+    dir->stamp = ++stamp_seq;
+}
+
+static FSNode* node_new(u32 ino, const char* name, int len) {
+    if (node_slots_reserve(ino) != WEXFS_OK) return NULL;
+    if (hash_reserve(fs_count + 1) != WEXFS_OK) return NULL;
+    FSNode* node = (FSNode*)kcalloc(1, sizeof(FSNode));
+    if (!node) return NULL;
+    node->name = (char*)kmalloc(len + 1);
+    if (!node->name) {
+        kfree(node);
+        return NULL;
+    }
+    memcpy(node->name, (void*)name, len);
+    node->name[len] = '\0';
+    node->ino = ino;
+    node->stamp = ++stamp_seq;
+    fs_nodes[ino] = node;
+    fs_count++;
+    return node;
+}
+
+static void node_free(FSNode* node) {
+    // Handles to a removed file fail from now on instead of dangling
+    for (int fd = 0; fd < WEXFS_MAX_OPEN; fd++) {
+        if (fs_files[fd].node == node) fs_files[fd].node = NULL;
+    }
+    fs_nodes[node->ino] = NULL;
+    if (node->ino < ino_hint) ino_hint = node->ino;
+    fs_count--;
+    kfree(node->name);
+    kfree(node);
+}
+
+static void volume_reset(void) {
+    memset(fs_files, 0, sizeof(fs_files));
+    for (u32 i = 0; i < fs_node_slots; i++) {
+        if (fs_nodes[i]) {
+            kfree(fs_nodes[i]->name);
+            kfree(fs_nodes[i]);
+        }
+    }
+    kfree(fs_nodes);
+    kfree(fs_hash);
+    tri_reset();
+    kfree(fs_bitmap);
+    kfree(fs_refs);
+    kfree(fs_csums);
+    kfree(dedup_slots);
+    kfree(dedup_back);
+    fs_nodes = NULL;
+    fs_node_slots = 0;
+    fs_hash = NULL;
+    fs_hash_size = 0;
+    fs_bitmap = NULL;
+    fs_refs = NULL;
+    fs_csums = NULL;
+    wexfs_csum_errors = 0;
+    wexfs_generation++;
+    wexfs_volume++;
+    csums_dirty_lo = 0xFFFFFFFF;
+    csums_dirty_hi = 0;
+    dedup_slots = NULL;
+    dedup_back = NULL;
+    refs_dirty_lo = 0xFFFFFFFF;
+    refs_dirty_hi = 0;
+    fs_count = 0;
+    ino_hint = WEXFS_ROOT_INO;
+    inode_pending = 0xFFFFFFFF;
+    bitmap_hint = 0;
+    bitmap_dirty_lo = 0xFFFFFFFF;
+    bitmap_dirty_hi = 0;
+    meta_blk[0] = meta_blk[1] = 0;
+    dirbuf_blk = 0;
+    zbuf_blk = 0;
+    for (int i = 0; i < WEXFS_MAP_SLOTS; i++) {
+        // Mappings still pinned keep their data; the rest is dropped
+        if (map_slots[i].pins) map_slots[i].flags |= MAP_STALE;
+        else map_slots[i].blk = 0;
+    }
+}
+
+/* ---------- Block mapping ---------- */
+
+/* Map logical block `lblk` of a node to a physical block. With `alloc`
+ * set, missing data and indirect blocks are allocated; new indirect
+ * blocks are zeroed, data blocks are left for the caller to fill.
+ * A non-zero `data` replaces the data block pointer instead. */
+static u32 bmap_map(FSNode* node, u32 lblk, int alloc, u32 data) {
+    u32* slot;
+    if (lblk < WEXFS_NDIRECT) {
+        slot = &node->di.blocks[lblk];
+        if (data) {
+            *slot = data;
+            inode_dirty(node->ino);
+        } else if (!*slot && alloc) {
+            *slot = wexfs_alloc_block();
+            if (*slot) inode_dirty(node->ino);
+        }
+        return *slot;
+    }
+    lblk -= WEXFS_NDIRECT;
+
+    u32 top;
+    u32 index;
+    if (lblk < WEXFS_PTRS_PER_BLOCK) {
+        slot = &node->di.blocks[WEXFS_IND];
+        index = lblk;
+    } else {
+        lblk -= WEXFS_PTRS_PER_BLOCK;
+        if (lblk >= WEXFS_PTRS_PER_BLOCK * WEXFS_PTRS_PER_BLOCK) return 0;
+        slot = &node->di.blocks[WEXFS_DIND];
+        index = lblk / WEXFS_PTRS_PER_BLOCK;
+    }
+
+    if (!*slot) {
+        if (!alloc) return 0;
+        *slot = wexfs_alloc_block();
+        if (!*slot) return 0;
+        blk_zero(*slot);
+        inode_dirty(node->ino);
+    }
+    top = *slot;
+
+    u32 next = meta_read(top)[index];
+    if (data && slot == &node->di.blocks[WEXFS_IND]) {
+        meta_store(top, index, data);
+        return data;
+    }
+    if (!next && alloc) {
+        next = wexfs_alloc_block();
+        if (!next) return 0;
+        if (slot == &node->di.blocks[WEXFS_DIND]) blk_zero(next);
+        meta_store(top, index, next);
+    }
+    if (!next || slot == &node->di.blocks[WEXFS_IND]) return next;
+
+    // Second level of the double-indirect tree
+    index = lblk % WEXFS_PTRS_PER_BLOCK;
+    if (data) {
+        meta_store(next, index, data);
+        return data;
+    }
+    u32 pb = meta_read(next)[index];
+    if (!pb && alloc) {
+        pb = wexfs_alloc_block();
+        if (!pb) return 0;
+        meta_store(next, index, pb);
+    }
+    return pb;
+}
+
+/* Physical block of `lblk`; bmap_map() also returns the compression tag. */
+static u32 bmap(FSNode* node, u32 lblk, int alloc) {
+    return WEXFS_PTR_BLOCK(bmap_map(node, lblk, alloc, 0));
+}
+
+/* Point logical block `lblk` at a block holding `data`, replacing `old`:
+ * an identical indexed block when dedup is on, `old` itself when this
+ * file is its only owner, otherwise a freshly written block. */
+static u32 block_store(FSNode* node, u32 lblk, const u8* data, u32 old) {
+    int dedup = (wexfs_sb.features & WEXFS_FEAT_DEDUP) && fs_refs;
+    u32 hash = dedup ? dedup_hash(data) : 0;
+    u32 pb = dedup ? dedup_find(hash, data) : 0;
+
+    if (pb && pb == old) return old;
+    if (pb && block_ref(pb)) {
+        refs_sync();                // the new owner is on disk before the pointer
+    } else if (old && !block_shared(old)) {
+        blk_write(old, data);
+        if (dedup) dedup_insert(hash, old);
+        return old;
+    } else {
+        pb = wexfs_alloc_block();
+        if (!pb) return 0;
+        blk_write(pb, data);
+        if (dedup) dedup_insert(hash, pb);
+    }
+
+    if (!bmap_map(node, lblk, 1, pb)) {
+        block_put(pb);
+        return 0;
+    }
+    if (old) block_put(old);
+    return pb;
+}
+
+/* Read the plain content of the data block behind a tagged pointer into
+ * `out`, verified against its checksum and decompressed. */
+static int block_decode(u32 ptr, u8* out) {
+    u32 pb = WEXFS_PTR_BLOCK(ptr);
+    u32 sectors = WEXFS_PTR_SECTORS(ptr);
+    if (!sectors) {
+        blk_read(pb, out);
+        if (!csum_ok(pb, out, WEXFS_BLOCK_SIZE)) return WEXFS_EIO;
+        return WEXFS_OK;
+    }
+    for (u32 s = 0; s < sectors; s++) {
+        dev_read(blk_lba(pb) + s, cmpbuf + s * SECTOR_SIZE);
+    }
+    if (!csum_ok(pb, cmpbuf, sectors * SECTOR_SIZE)) return WEXFS_EIO;
+    if (lz_decompress(cmpbuf, sectors * SECTOR_SIZE, out, WEXFS_BLOCK_SIZE) != WEXFS_BLOCK_SIZE) {
+        return WEXFS_EIO;
+    }
+    return WEXFS_OK;
+}
+
+static MapSlot* map_find(u32 blk) {
+    for (int i = 0; i < WEXFS_MAP_SLOTS; i++) {
+        MapSlot* slot = &map_slots[i];
+        if (slot->blk == blk && !(slot->flags & (MAP_STALE | MAP_PRIVATE))) return slot;
+    }
+    return NULL;
+}
+
+/* Bring a data block's plain content into zbuf, unless a mapping
+ * already holds it. */
+static int block_get(u32 ptr) {
+    u32 pb = WEXFS_PTR_BLOCK(ptr);
+    if (pb == zbuf_blk) return WEXFS_OK;
+    zbuf_blk = 0;
+    MapSlot* slot = map_find(pb);
+    if (slot) {
+        memcpy(zbuf, slot->data, WEXFS_BLOCK_SIZE);
+    } else {
+        int rc = block_decode(ptr, zbuf);
+        if (rc != WEXFS_OK) return rc;
+    }
+    zbuf_blk = pb;
+    return WEXFS_OK;
+}
+
+static int block_load(u32 ptr, u8* out) {
+    int rc = block_get(ptr);
+    if (rc == WEXFS_OK) memcpy(out, zbuf, WEXFS_BLOCK_SIZE);
+    return rc;
+}
+
+/* Store databuf as logical block `lblk` of a compressed file, replacing
+ * the tagged pointer `ptr`. Only the sectors holding the compressed
+ * form are written; a block that saves no sector is stored plain. */
+static u32 zblock_store(FSNode* node, u32 lblk, u32 ptr) {
+    u32 old = WEXFS_PTR_BLOCK(ptr);
+    u32 sectors = WEXFS_SECTORS_PER_BLOCK;
+    if (node->di.flags & WEXFS_INODE_COMPRESS) {
+        int clen = lz_compress(databuf, WEXFS_BLOCK_SIZE, cmpbuf, WEXFS_BLOCK_SIZE - SECTOR_SIZE);
+        if (clen > 0) {
+            sectors = (clen + SECTOR_SIZE - 1) / SECTOR_SIZE;
+            memset(cmpbuf + clen, 0, sectors * SECTOR_SIZE - clen);
+        }
+    }
+
+    u32 pb = (old && !block_shared(old)) ? old : wexfs_alloc_block();
+    if (!pb) return 0;
+    dedup_forget(pb);
+    if (sectors < WEXFS_SECTORS_PER_BLOCK) {
+        blk_write_packed(pb, cmpbuf, sectors);
+    } else {
+        blk_write(pb, databuf);
+        sectors = 0;
+    }
+    memcpy(zbuf, databuf, WEXFS_BLOCK_SIZE);
+    zbuf_blk = pb;
+
+    u32 tagged = pb | (sectors << 28);
+    if (tagged != ptr && !bmap_map(node, lblk, 1, tagged)) {
+        if (pb != old) block_put(pb);
+        return 0;
+    }
+    if (old && pb != old) block_put(old);
+    return pb;
+}
+
+/* Free every pointer in `blk` from `from` on; returns 1 if the block
+ * itself became empty and was released. */
+static int free_ptr_block(u32 blk, u32 from, int depth) {
+    u32* ptrs = depth ? ptrbuf2 : ptrbuf;
+    blk_read(blk, ptrs);
+    meta_forget(blk);
+    int changed = 0;
+    for (u32 i = from; i < WEXFS_PTRS_PER_BLOCK; i++) {
+        if (!ptrs[i]) continue;
+        if (depth) {
+            free_ptr_block(ptrs[i], 0, 0);
+        } else {
+            block_put(WEXFS_PTR_BLOCK(ptrs[i]));
+        }
+        ptrs[i] = 0;
+        changed = 1;
+    }
+    if (from == 0) {
+        wexfs_free_block(blk);
+        return 1;
+    }
+    if (changed) blk_write(blk, ptrs);
+    return 0;
+}
+
+/* Release all data beyond logical block `keep`. */
+static void free_blocks_from(FSNode* node, u32 keep) {
+    if (node->di.flags & WEXFS_INODE_INLINE) return;
+    for (u32 i = keep; i < WEXFS_NDIRECT; i++) {
+        if (node->di.blocks[i]) {
+            block_put(WEXFS_PTR_BLOCK(node->di.blocks[i]));
+            node->di.blocks[i] = 0;
+        }
+    }
+
+    u32 base = WEXFS_NDIRECT;
+    if (node->di.blocks[WEXFS_IND]) {
+        u32 from = keep > base ? keep - base : 0;
+        if (from < WEXFS_PTRS_PER_BLOCK && free_ptr_block(node->di.blocks[WEXFS_IND], from, 0)) {
+            node->di.blocks[WEXFS_IND] = 0;
+        }
+    }
+
+    base += WEXFS_PTRS_PER_BLOCK;
+    if (node->di.blocks[WEXFS_DIND]) {
+        u32 from = keep > base ? keep - base : 0;
+        u32 dind = node->di.blocks[WEXFS_DIND];
+        if (from == 0) {
+            free_ptr_block(dind, 0, 1);
+            node->di.blocks[WEXFS_DIND] = 0;
+        } else {
+            u32 outer = from / WEXFS_PTRS_PER_BLOCK;
+            u32 inner = from % WEXFS_PTRS_PER_BLOCK;
+            blk_read(dind, ptrbuf2);
+            if (inner && ptrbuf2[outer]) {
+                free_ptr_block(ptrbuf2[outer], inner, 0);
+                blk_read(dind, ptrbuf2);
+                outer++;
+            }
+            // Nothing kept in the first chunk: the whole block goes
+            if (outer < WEXFS_PTRS_PER_BLOCK && free_ptr_block(dind, outer, 1)) {
+                node->di.blocks[WEXFS_DIND] = 0;
+            }
+        }
+    }
+    inode_dirty(node->ino);
+}
+
+/* ---------- Directory entries ---------- */
+
+/* Directory updates go through dirbuf, so it stays a valid copy of the
+ * last directory block touched and repeated inserts skip the re-read. */
+static void dir_block_read(u32 pb) {
+    if (pb == dirbuf_blk) return;
+    blk_read(pb, dirbuf);
+    csum_ok(pb, dirbuf, WEXFS_BLOCK_SIZE);      // entries are still bounds-checked
+    dirbuf_blk = pb;
+}
+
+static int dirent_try_block(FSNode* dir, FSNode* child, u32 lblk) {
+    u32 pb = bmap(dir, lblk, 0);
+    if (!pb) return 0;
+    int len = strlen(child->name);
+    u32 need = WEXFS_DIRENT_SIZE(len);
+
+    dir_block_read(pb);
+    u32 off = 0;
+    while (off < WEXFS_BLOCK_SIZE) {
+        WexDirent* e = (WexDirent*)(dirbuf + off);
+        if (e->rec_len < 8 || off + e->rec_len > WEXFS_BLOCK_SIZE) return 0;
+        u32 used = e->ino ? WEXFS_DIRENT_SIZE(e->name_len) : 0;
+        if (e->rec_len - used >= need) {
+            u32 new_off = off + used;
+            u32 new_rec = e->rec_len - used;
+            if (used) e->rec_len = used;
+
+            WexDirent* n = (WexDirent*)(dirbuf + new_off);
+            n->ino = child->ino;
+            n->rec_len = new_rec;
+            n->name_len = len;
+            n->type = child->is_dir ? WEXFS_DIR : WEXFS_FILE;
+            memcpy(n->name, child->name, len);
+
+            blk_write_range(pb, dirbuf, off, new_off + need - off);
+            child->dirent_block = pb;
+            child->dirent_lblk = lblk;
+            child->dirent_off = new_off;
+            dir->dir_hint = lblk;
+            return 1;
+        }
+        off += e->rec_len;
+    }
+    return 0;
+}
+
+static int dirent_add(FSNode* dir, FSNode* child) {
+    u32 nblocks = dir->di.size / WEXFS_BLOCK_SIZE;
+    if (dir->dir_hint < nblocks && dirent_try_block(dir, child, dir->dir_hint)) return WEXFS_OK;
+    if (nblocks && dir->dir_hint != nblocks - 1 && dirent_try_block(dir, child, nblocks - 1)) {
+        return WEXFS_OK;
+    }
+
+    u32 pb = bmap(dir, nblocks, 1);
+    if (!pb) return WEXFS_ENOSPC;
+
+    // A fresh block holds a single entry spanning all of it. It is
+    // written whole so the checksum matches what is on disk.
+    int len = strlen(child->name);
+    memset(dirbuf, 0, WEXFS_BLOCK_SIZE);
+    WexDirent* n = (WexDirent*)dirbuf;
+    n->ino = child->ino;
+    n->rec_len = WEXFS_BLOCK_SIZE;
+    n->name_len = len;
+    n->type = child->is_dir ? WEXFS_DIR : WEXFS_FILE;
+    memcpy(n->name, child->name, len);
+    blk_write(pb, dirbuf);
+    dirbuf_blk = pb;
+
+    child->dirent_block = pb;
+    child->dirent_lblk = nblocks;
+    child->dirent_off = 0;
+    dir->dir_hint = nblocks;
+    dir->di.size += WEXFS_BLOCK_SIZE;
+    inode_dirty(dir->ino);
+    return WEXFS_OK;
+}
+
+/* Drop the entry at (pb, off); `lblk` is its logical block in `dir`. */
+static void dirent_remove_at(FSNode* dir, u32 pb, u32 off, u32 lblk) {
+    dir_block_read(pb);
+
+    if (off == 0) {
+        ((WexDirent*)dirbuf)->ino = 0;
+        blk_write_range(pb, dirbuf, 0, 8);
+    } else {
+        // Merge the record into its predecessor
+        u32 prev = 0;
+        while (prev + ((WexDirent*)(dirbuf + prev))->rec_len < off) {
+            u16 rl = ((WexDirent*)(dirbuf + prev))->rec_len;
+            if (rl < 8) break;
+            prev += rl;
+        }
+        WexDirent* p = (WexDirent*)(dirbuf + prev);
+        p->rec_len += ((WexDirent*)(dirbuf + off))->rec_len;
+        blk_write_range(pb, dirbuf, prev, 8);
+    }
+    if (dir && lblk < dir->dir_hint) dir->dir_hint = lblk;
+}
+
+static void dirent_remove(FSNode* child) {
+    dirent_remove_at(child->parent, child->dirent_block, child->dirent_off, child->dirent_lblk);
+}
+
+/* ---------- Volume ---------- */
+
+FSNode* wexfs_root(void) {
+    if (wexfs_sb.root_ino < fs_node_slots) return fs_nodes[wexfs_sb.root_ino];
+    return NULL;
+}
+
+const char* wexfs_strerror(int err) {
+    switch (err) {
+        case WEXFS_OK: return "Success";
+        case WEXFS_ENOENT: return "No such file or directory";
+        case WEXFS_EEXIST: return "Name already exists";
+        case WEXFS_ENOSPC: return "No space left on volume";
+        case WEXFS_ENOTDIR: return "Not a directory";
+        case WEXFS_EISDIR: return "Is a directory";
+        case WEXFS_ENAMETOOLONG: return "Name too long";
+        case WEXFS_EINVAL: return "Invalid argument";
+        case WEXFS_ENOMEM: return "Out of memory";
+        case WEXFS_EFBIG: return "File too large";
+        case WEXFS_EIO: return "Damaged data";
+        case WEXFS_EBADF: return "Bad file handle";
+    }
+    return "Unknown error";
+}
+
+/* Time stamp counter bits, spread: two formats never run at the same
+ * cycle, not even on identical machines */
+static u32 volume_id_new(void) {
+    unsigned long long t = rdtsc();
+    u32 id = crc32c(0, &t, sizeof(t));
+    return id ? id : 1;
+}
+
+int wexfs_format(u32 total_blocks) {
+    if (total_blocks == 0) {
+        u32 sectors = ata_identify();
+        if (sectors > FS_SECTOR_START) {
+            total_blocks = (sectors - FS_SECTOR_START) / WEXFS_SECTORS_PER_BLOCK;
+        }
+        if (total_blocks < 64) total_blocks = WEXFS_DEFAULT_BLOCKS;
+    }
+    if (total_blocks > WEXFS_MAX_BLOCKS) total_blocks = WEXFS_MAX_BLOCKS;
+
+    volume_reset();
+    memset(&wexfs_sb, 0, sizeof(wexfs_sb));
+    wexfs_sb.magic = WEXFS_MAGIC;
+    wexfs_sb.version = WEXFS_VERSION;
+    wexfs_sb.block_size = WEXFS_BLOCK_SIZE;
+    wexfs_sb.total_blocks = total_blocks;
+    wexfs_sb.bitmap_start = 1;
+    wexfs_sb.bitmap_blocks = (total_blocks + WEXFS_BLOCK_SIZE * 8 - 1) / (WEXFS_BLOCK_SIZE * 8);
+    wexfs_sb.root_ino = WEXFS_ROOT_INO;
+    wexfs_sb.volume_id = volume_id_new();
+
+    u32 bitmap_bytes = wexfs_sb.bitmap_blocks * WEXFS_BLOCK_SIZE;
+    fs_bitmap = (u8*)kcalloc(bitmap_bytes, 1);
+    if (!fs_bitmap) return WEXFS_ENOMEM;
+
+    // Superblock, bitmap and the tail past the end of the volume are
+    // permanently allocated.
+    wexfs_free_blocks = bitmap_bytes * 8;
+    for (u32 b = 0; b <= wexfs_sb.bitmap_blocks; b++) bitmap_set(b);
+    for (u32 b = total_blocks; b < bitmap_bytes * 8; b++) bitmap_set(b);
+    for (u32 i = 0; i < wexfs_sb.bitmap_blocks; i++) {
+        blk_write(wexfs_sb.bitmap_start + i, fs_bitmap + i * WEXFS_BLOCK_SIZE);
+    }
+    bitmap_dirty_lo = 0xFFFFFFFF;
+    bitmap_dirty_hi = 0;
+
+    int err = journal_create();
+    if (err != WEXFS_OK) return err;
+    err = refs_create();
+    if (err != WEXFS_OK) return err;
+    err = csums_create();
+    if (err != WEXFS_OK) return err;
+    err = itable_grow();
+    if (err != WEXFS_OK) return err;
+
+    FSNode* root = node_new(WEXFS_ROOT_INO, "/", 1);
+    if (!root) return WEXFS_ENOMEM;
+    root->is_dir = 1;
+    root->di.mode = WEXFS_DIR;
+    root->di.nlink = 1;
+    wexfs_sb.inode_hwm = WEXFS_INODES_PER_BLOCK;
+    ino_hint = WEXFS_ROOT_INO + 1;
+
+    inode_dirty(root->ino);
+    op_done();
+    super_sync();
+    return WEXFS_OK;
+}
+
+/* v1 stored a chain of 11-sector FSNode records holding full paths. */
+typedef struct {
+    char name[MAX_PATH];
+    int is_dir;
+    char content[4096];
+    u32 next_sector;
+    u32 size;
+} WexV1Node;
+
+#define WEXFS_V1_SECTORS 11
+#define WEXFS_V1_MAX 64
+
+static int wexfs_migrate_v1(void) {
+    u8* raw = (u8*)kmalloc(WEXFS_V1_SECTORS * SECTOR_SIZE);
+    WexV1Node* nodes = (WexV1Node*)kmalloc(WEXFS_V1_MAX * sizeof(WexV1Node));
+    if (!raw || !nodes) {
+        kfree(raw);
+        kfree(nodes);
+        return WEXFS_ENOMEM;
+    }
+
+    // Follow the chain exactly like the v1 loader did
+    int count = 0;
+    u32 sector = FS_SECTOR_START;
+    while (sector != 0 && count < WEXFS_V1_MAX) {
+        for (int j = 0; j < WEXFS_V1_SECTORS; j++) {
+            ata_read_sector(sector + j, raw + j * SECTOR_SIZE);
+        }
+        memcpy(&nodes[count], raw, sizeof(WexV1Node));
+        sector = nodes[count].next_sector;
+        count++;
+    }
+
+    int err = wexfs_format(0);
+    if (err == WEXFS_OK) {
+        for (int i = 0; i < count; i++) {
+            WexV1Node* n = &nodes[i];
+            n->name[MAX_PATH - 1] = '\0';
+            if (strcmp(n->name, "/") == 0 || n->name[0] == '\0') continue;
+            u32 size = n->size > sizeof(n->content) ? sizeof(n->content) : n->size;
+            int err;
+            FSNode* node = wexfs_create_path(wexfs_root(), n->name, n->is_dir ? WEXFS_DIR : WEXFS_FILE, &err);
+            if (node && !n->is_dir && node->di.size == 0 && size) wexfs_write(node, 0, n->content, size);
+        }
+        prints("WexFS: volume converted to v2\n");
+    }
+
+    kfree(raw);
+    kfree(nodes);
+    return err;
+}
+
+static void mount_attach_dir(FSNode* dir, FSNode** queue, u32* tail) {
+    u32 nblocks = dir->di.size / WEXFS_BLOCK_SIZE;
+    for (u32 lblk = 0; lblk < nblocks; lblk++) {
+        u32 pb = bmap(dir, lblk, 0);
+        if (!pb) continue;
+        dir_block_read(pb);
+
+        u32 off = 0;
+        while (off < WEXFS_BLOCK_SIZE) {
+            WexDirent* e = (WexDirent*)(dirbuf + off);
+            if (e->rec_len < 8 || off + e->rec_len > WEXFS_BLOCK_SIZE) break;
+            if (e->ino && e->ino < fs_node_slots && fs_nodes[e->ino]) {
+                FSNode* child = fs_nodes[e->ino];
+                // Ignore entries that would link an object twice
+                if (!child->parent && child->ino != wexfs_sb.root_ino) {
+                    char* name = (char*)kmalloc(e->name_len + 1);
+                    if (name) {
+                        memcpy(name, e->name, e->name_len);
+                        name[e->name_len] = '\0';
+                        kfree(child->name);
+                        child->name = name;
+                        child->dirent_block = pb;
+                        child->dirent_lblk = lblk;
+                        child->dirent_off = off;
+                        tree_link(dir, child);
+                        if (child->is_dir) queue[(*tail)++] = child;
+                    }
+                }
+            }
+            off += e->rec_len;
+        }
+    }
+    dir->dir_hint = nblocks ? nblocks - 1 : 0;
+}
+
+/* Nothing was ever written to the first block of the volume */
+static int volume_blank(void) {
+    u32 sector[SECTOR_SIZE / 4];
+    for (u32 i = 0; i < WEXFS_SECTORS_PER_BLOCK; i++) {
+        ata_read_sector(FS_SECTOR_START + i, (u8*)sector);
+        for (u32 w = 0; w < SECTOR_SIZE / 4; w++) {
+            if (sector[w]) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Leave no half-loaded volume behind: with the superblock cleared there
+ * is no root, and every call fails cleanly until format or a mount that
+ * works. The disk itself is not touched. */
+static int mount_fail(int err) {
+    volume_reset();
+    memset(&wexfs_sb, 0, sizeof(wexfs_sb));
+    wexfs_free_blocks = 0;
+    return err;
+}
+
+int wexfs_mount(void) {
+    ata_read_sector(FS_SECTOR_START, (u8*)&wexfs_sb);
+
+    if (wexfs_sb.magic != WEXFS_MAGIC || wexfs_sb.version != WEXFS_VERSION) {
+        char* v1_name = (char*)&wexfs_sb;
+        if (v1_name[0] == '/' && v1_name[1] == '\0') return wexfs_migrate_v1();
+        // Only a disk that was never written is formatted here; anything
+        // else may be a damaged volume and is left for fsck or format
+        if (volume_blank()) return wexfs_format(0);
+        return mount_fail(WEXFS_EINVAL);
+    }
+
+    // The journal may hold a newer superblock
+    journal_replay();
+    ata_read_sector(FS_SECTOR_START, (u8*)&wexfs_sb);
+
+    volume_reset();
+    u32 bitmap_bytes = wexfs_sb.bitmap_blocks * WEXFS_BLOCK_SIZE;
+    fs_bitmap = (u8*)kmalloc(bitmap_bytes);
+    if (!fs_bitmap) return WEXFS_ENOMEM;
+    for (u32 i = 0; i < wexfs_sb.bitmap_blocks; i++) {
+        blk_read(wexfs_sb.bitmap_start + i, fs_bitmap + i * WEXFS_BLOCK_SIZE);
+    }
+    wexfs_free_blocks = 0;
+    for (u32 b = 0; b < wexfs_sb.total_blocks; b++) {
+        if (!bitmap_test(b)) wexfs_free_blocks++;
+    }
+    if (wexfs_sb.journal_blocks == 0) journal_create();
+    if (wexfs_sb.refcount_blocks) {
+        fs_refs = (u8*)kmalloc(wexfs_sb.refcount_blocks * WEXFS_BLOCK_SIZE);
+        if (!fs_refs) return WEXFS_ENOMEM;
+        for (u32 i = 0; i < wexfs_sb.refcount_blocks; i++) {
+            blk_read(wexfs_sb.refcount_start + i, fs_refs + i * WEXFS_BLOCK_SIZE);
+        }
+    } else {
+        refs_create();      // without a table, copies fall back to duplicating data
+    }
+    if (wexfs_sb.csum_blocks) {
+        fs_csums = (u32*)kmalloc(wexfs_sb.csum_blocks * WEXFS_BLOCK_SIZE);
+        if (!fs_csums) return WEXFS_ENOMEM;
+        for (u32 i = 0; i < wexfs_sb.csum_blocks; i++) {
+            blk_read(wexfs_sb.csum_start + i, (u8*)fs_csums + i * WEXFS_BLOCK_SIZE);
+        }
+    } else {
+        csums_create();     // existing blocks gain checksums as they are rewritten
+    }
+
+    // Load every used inode below the high-water mark
+    WexInode sector[WEXFS_INODES_PER_SECTOR];
+    u32 hwm = wexfs_sb.inode_hwm;
+    if (hwm > wexfs_sb.inode_capacity) hwm = wexfs_sb.inode_capacity;
+    for (u32 first = 0; first < hwm; first += WEXFS_INODES_PER_SECTOR) {
+        dev_read(inode_lba(first), (u8*)sector);
+        for (u32 i = 0; i < WEXFS_INODES_PER_SECTOR; i++) {
+            u32 ino = first + i;
+            if (ino == 0 || sector[i].mode == WEXFS_FREE) continue;
+            if (sector[i].csum && sector[i].csum != inode_crc(&sector[i])) {
+                wexfs_csum_errors++;
+                prints("WexFS: checksum mismatch in inode ");
+                print_u32(ino);
+                prints("\n");
+            }
+            FSNode* node = node_new(ino, "?", 1);
+            if (!node) return WEXFS_ENOMEM;
+            node->di = sector[i];
+            // Change numbers handed out after the superblock was last
+            // written survive in the inodes
+            if (sector[i].change > wexfs_sb.change) wexfs_sb.change = sector[i].change;
+            node->is_dir = (sector[i].mode == WEXFS_DIR);
+        }
+    }
+
+    FSNode* root = wexfs_root();
+    if (!root || !root->is_dir) return mount_fail(WEXFS_EIO);
+    root->name[0] = '/';
+
+    // Breadth-first walk of the directory blocks names every object
+    FSNode** queue = (FSNode**)kmalloc((fs_count + 1) * sizeof(FSNode*));
+    if (!queue) return WEXFS_ENOMEM;
+    u32 head = 0, tail = 0;
+    queue[tail++] = root;
+    while (head < tail) {
+        mount_attach_dir(queue[head++], queue, &tail);
+    }
+    kfree(queue);
+
+    ino_hint = WEXFS_ROOT_INO + 1;
+    return WEXFS_OK;
+}
+
+/* ---------- Lookup ---------- */
+
+FSNode* wexfs_lookup_child(FSNode* dir, const char* name, int len) {
+    if (!dir || !dir->is_dir || !fs_hash) return NULL;
+    u32 h = name_hash(dir->ino, name, len) & (fs_hash_size - 1);
+    for (FSNode* n = fs_hash[h]; n; n = n->hash_next) {
+        if (n->parent == dir && name_eq(n->name, name, len)) return n;
+    }
+    return NULL;
+}
+
+FSNode* wexfs_lookup_at(FSNode* base, const char* path) {
+    FSNode* cur = (path[0] == '/' || !base) ? wexfs_root() : base;
+    const char* p = path;
+    while (cur && *p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        const char* s = p;
+        while (*p && *p != '/') p++;
+        int len = p - s;
+
+        if (len == 1 && s[0] == '.') continue;
+        if (len == 2 && s[0] == '.' && s[1] == '.') {
+            if (cur->parent) cur = cur->parent;
+            continue;
+        }
+        cur = wexfs_lookup_child(cur, s, len);
+    }
+    return cur;
+}
+
+FSNode* wexfs_lookup(const char* path) {
+    return wexfs_lookup_at(wexfs_root(), path);
+}
+
+/* Split `path` into its parent directory and final component. */
+FSNode* wexfs_lookup_parent(FSNode* base, const char* path, char* leaf) {
+    char dir_path[MAX_PATH];
+    int len = strlen(path);
+    if (len >= MAX_PATH) return NULL;
+    while (len > 1 && path[len - 1] == '/') len--;
+
+    int cut = len;
+    while (cut > 0 && path[cut - 1] != '/') cut--;
+    int leaf_len = len - cut;
+    if (leaf_len == 0 || leaf_len >= MAX_NAME) return NULL;
+    memcpy(leaf, (void*)(path + cut), leaf_len);
+    leaf[leaf_len] = '\0';
+
+    memcpy(dir_path, (void*)path, cut);
+    dir_path[cut] = '\0';
+    if (cut == 0) return base ? base : wexfs_root();
+    return wexfs_lookup_at(base, dir_path);
+}
+
+/* Full path of a node without the leading slash, like v1 names. */
+int wexfs_path(FSNode* node, char* buf, int max) {
+    if (!node || max < 2) return WEXFS_EINVAL;
+    if (!node->parent) {
+        strcpy(buf, "/");
+        return 1;
+    }
+
+    int total = 0;
+    for (FSNode* n = node; n->parent; n = n->parent) {
+        total += strlen(n->name) + (n != node ? 1 : 0);
+    }
+    if (total >= max) return WEXFS_ENAMETOOLONG;
+
+    int pos = total;
+    buf[pos] = '\0';
+    for (FSNode* n = node; n->parent; n = n->parent) {
+        int len = strlen(n->name);
+        if (n != node) buf[--pos] = '/';
+        pos -= len;
+        memcpy(buf + pos, n->name, len);
+    }
+    return total;
+}
+
+/* ---------- Objects ---------- */
+
+FSNode* wexfs_create(FSNode* dir, const char* name, int type, int* err) {
+    int len = strlen(name);
+    *err = WEXFS_OK;
+    if (!dir || !dir->is_dir) {
+        *err = WEXFS_ENOTDIR;
+        return NULL;
+    }
+    if (len == 0 || (len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')) {
+        *err = WEXFS_EINVAL;
+        return NULL;
+    }
+    if (len >= MAX_NAME) {
+        *err = WEXFS_ENAMETOOLONG;
+        return NULL;
+    }
+    for (int i = 0; i < len; i++) {
+        if (name[i] == '/') {
+            *err = WEXFS_EINVAL;
+            return NULL;
+        }
+    }
+    if (wexfs_lookup_child(dir, name, len)) {
+        *err = WEXFS_EEXIST;
+        return NULL;
+    }
+
+    u32 ino = ino_alloc();
+    if (!ino) {
+        *err = WEXFS_ENOSPC;
+        return NULL;
+    }
+    FSNode* node = node_new(ino, name, len);
+    if (!node) {
+        *err = WEXFS_ENOMEM;
+        return NULL;
+    }
+    node->is_dir = (type == WEXFS_DIR);
+    node->di.mode = type;
+    node->di.flags = node->is_dir ? 0 : WEXFS_INODE_INLINE;
+    node->di.flags |= dir->di.flags & WEXFS_INODE_COMPRESS;
+    node->di.parent = dir->ino;
+    node->di.nlink = 1;
+
+    // Inode first, then the entry: a crash in between leaves an orphan
+    // inode that fsck can reclaim, never a dangling name.
+    inode_dirty(ino);
+    inode_flush();
+    int rc = dirent_add(dir, node);
+    if (rc != WEXFS_OK) {
+        node_free(node);
+        inode_dirty(ino);
+        op_done();
+        *err = rc;
+        return NULL;
+    }
+    tree_link(dir, node);
+    op_done();
+    return node;
+}
+
+/* Like wexfs_create, but makes missing parents and returns an existing
+ * object of the right type instead of failing (mkdir -p). */
+FSNode* wexfs_create_path(FSNode* base, const char* path, int type, int* err) {
+    FSNode* dir = (path[0] == '/' || !base) ? wexfs_root() : base;
+    const char* p = path;
+    *err = WEXFS_OK;
+
+    while (*p == '/') p++;
+    if (!*p) {
+        *err = WEXFS_EINVAL;
+        return NULL;
+    }
+    while (*p) {
+        const char* s = p;
+        while (*p && *p != '/') p++;
+        int len = p - s;
+        while (*p == '/') p++;
+        if (len >= MAX_NAME) {
+            *err = WEXFS_ENAMETOOLONG;
+            return NULL;
+        }
+
+        int last = (*p == '\0');
+        int want = last ? type : WEXFS_DIR;
+        FSNode* next;
+        if (len == 2 && s[0] == '.' && s[1] == '.') {
+            next = dir->parent ? dir->parent : dir;
+        } else if (len == 1 && s[0] == '.') {
+            next = dir;
+        } else {
+            next = wexfs_lookup_child(dir, s, len);
+            if (!next) {
+                char name[MAX_NAME];
+                memcpy(name, (void*)s, len);
+                name[len] = '\0';
+                next = wexfs_create(dir, name, want, err);
+                if (!next) return NULL;
+            }
+        }
+        if (next->is_dir != (want == WEXFS_DIR)) {
+            *err = next->is_dir ? WEXFS_EISDIR : WEXFS_ENOTDIR;
+            return NULL;
+        }
+        dir = next;
+    }
+    return dir;
+}
+
+static void free_subtree(FSNode* node) {
+    while (node->children) {
+        FSNode* child = node->children;
+        tree_unlink(child);
+        free_subtree(child);
+    }
+    free_blocks_from(node, 0);
+    u32 ino = node->ino;
+    node_free(node);
+    inode_dirty(ino);
+}
+
+int wexfs_remove(FSNode* node) {
+    if (!node || !node->parent) return WEXFS_EINVAL;
+    dirent_remove(node);
+    tree_unlink(node);
+    free_subtree(node);
+    op_done();
+    return WEXFS_OK;
+}
+
+/* Move `node` to `new_dir` under `new_name`. Only the two directory
+ * entries and the node's inode change, whatever the size of the
+ * subtree, and the update goes through the journal as one unit. */
+int wexfs_rename(FSNode* node, FSNode* new_dir, const char* new_name) {
+    if (!node || !node->parent || !new_dir) return WEXFS_EINVAL;
+    if (!new_dir->is_dir) return WEXFS_ENOTDIR;
+
+    int len = strlen(new_name);
+    if (len == 0 || (len == 1 && new_name[0] == '.') ||
+        (len == 2 && new_name[0] == '.' && new_name[1] == '.')) return WEXFS_EINVAL;
+    if (len >= MAX_NAME) return WEXFS_ENAMETOOLONG;
+    for (int i = 0; i < len; i++) {
+        if (new_name[i] == '/') return WEXFS_EINVAL;
+    }
+
+    // A directory cannot move below itself
+    for (FSNode* d = new_dir; d; d = d->parent) {
+        if (d == node) return WEXFS_EINVAL;
+    }
+
+    FSNode* existing = wexfs_lookup_child(new_dir, new_name, len);
+    if (existing == node) return WEXFS_OK;
+    if (existing) return WEXFS_EEXIST;
+
+    char* name = (char*)kmalloc(len + 1);
+    if (!name) return WEXFS_ENOMEM;
+    memcpy(name, (void*)new_name, len);
+    name[len] = '\0';
+
+    int err = wexfs_tx_begin();
+    if (err != WEXFS_OK) {
+        kfree(name);
+        return err;
+    }
+
+    FSNode* old_dir = node->parent;
+    u32 old_block = node->dirent_block;
+    u32 old_off = node->dirent_off;
+    u32 old_lblk = node->dirent_lblk;
+    char* old_name = node->name;
+
+    // New entry first: if the target directory is full nothing changes
+    node->name = name;
+    err = dirent_add(new_dir, node);
+    if (err != WEXFS_OK) {
+        node->name = old_name;
+        node->dirent_block = old_block;
+        node->dirent_off = old_off;
+        node->dirent_lblk = old_lblk;
+        kfree(name);
+        op_done();
+        wexfs_tx_commit();
+        return err;
+    }
+    dirent_remove_at(old_dir, old_block, old_off, old_lblk);
+
+    node->name = old_name;
+    tree_unlink(node);
+    node->name = name;
+    kfree(old_name);
+    tree_link(new_dir, node);
+
+    node->di.parent = new_dir->ino;
+    inode_dirty(node->ino);
+    op_done();
+    wexfs_tx_commit();
+    return WEXFS_OK;
+}
+
+/* Move inline data out to a data block before the file outgrows it. */
+static int inline_promote(FSNode* node) {
+    u8 data[WEXFS_INLINE_MAX];
+    memcpy(data, node->di.inline_data, WEXFS_INLINE_MAX);
+    memset(node->di.inline_data, 0, WEXFS_INLINE_MAX);
+    node->di.flags &= ~WEXFS_INODE_INLINE;
+    inode_dirty(node->ino);
+    if (node->di.size == 0) return WEXFS_OK;
+
+    memset(databuf, 0, WEXFS_BLOCK_SIZE);
+    memcpy(databuf, data, WEXFS_INLINE_MAX);
+    u32 stored = (node->di.flags & WEXFS_INODE_COMPRESS) ? zblock_store(node, 0, 0)
+                                                          : block_store(node, 0, databuf, 0);
+    if (!stored) {
+        memcpy(node->di.inline_data, data, WEXFS_INLINE_MAX);
+        node->di.flags |= WEXFS_INODE_INLINE;
+        return WEXFS_ENOSPC;
+    }
+    return WEXFS_OK;
+}
+
+/* Read up to `max` whole blocks from `lblk` on with one disk command
+ * when they are plain and next to each other on disk, straight into
+ * `out`. Returns the blocks read and verified; 0 leaves the first block
+ * to the cached path. Inside a transaction sectors may still be staged,
+ * so the single-sector path is used. */
+static u32 read_run(FSNode* node, u32 lblk, u32 max, u8* out) {
+    if (tx_active || max < 2) return 0;
+    u32 pb = bmap_map(node, lblk, 0, 0);
+    if (!pb || WEXFS_PTR_SECTORS(pb)) return 0;
+    u32 n = 1;
+    if (max > WEXFS_READ_RUN) max = WEXFS_READ_RUN;
+    while (n < max && bmap_map(node, lblk + n, 0, 0) == pb + n) n++;
+    if (n < 2) return 0;
+
+    ata_read_sectors(blk_lba(pb), n * WEXFS_SECTORS_PER_BLOCK, out);
+    for (u32 i = 0; i < n; i++) {
+        // A bad block is read again below and reported there
+        if (!csum_match(pb + i, out + i * WEXFS_BLOCK_SIZE, WEXFS_BLOCK_SIZE)) return i;
+    }
+    return n;
+}
+
+int wexfs_read(FSNode* node, u32 offset, void* buf, u32 len) {
+    if (node->is_dir) return WEXFS_EISDIR;
+    if (offset >= node->di.size) return 0;
+    if (len > node->di.size - offset) len = node->di.size - offset;
+    if (node->di.flags & WEXFS_INODE_INLINE) {
+        memcpy(buf, node->di.inline_data + offset, len);
+        return len;
+    }
+
+    u8* out = (u8*)buf;
+    u32 done = 0;
+    while (done < len) {
+        u32 pos = offset + done;
+        u32 lblk = pos / WEXFS_BLOCK_SIZE;
+        u32 boff = pos % WEXFS_BLOCK_SIZE;
+        u32 chunk = WEXFS_BLOCK_SIZE - boff;
+        if (chunk > len - done) chunk = len - done;
+
+        if (boff == 0) {
+            u32 n = read_run(node, lblk, (len - done) / WEXFS_BLOCK_SIZE, out + done);
+            if (n) {
+                done += n * WEXFS_BLOCK_SIZE;
+                continue;
+            }
+        }
+
+        u32 ptr = bmap_map(node, lblk, 0, 0);
+        u32 pb = WEXFS_PTR_BLOCK(ptr);
+        if (!pb) {
+            memset(out + done, 0, chunk);
+        } else {
+            // Whole blocks are read so the checksum can be verified; the
+            // block stays in zbuf for the next small read.
+            if (block_get(ptr) != WEXFS_OK) {
+                if (done == 0) return WEXFS_EIO;
+                break;
+            }
+            memcpy(out + done, zbuf + boff, chunk);
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+int wexfs_write(FSNode* node, u32 offset, const void* buf, u32 len) {
+    if (node->is_dir) return WEXFS_EISDIR;
+    if (offset + len < offset) return WEXFS_EFBIG;
+    if (node->di.flags & WEXFS_INODE_INLINE) {
+        if (offset + len <= WEXFS_INLINE_MAX) {
+            // Bytes past the end are kept zero, so a gap reads as zeroes
+            memcpy(node->di.inline_data + offset, (void*)buf, len);
+            if (offset + len > node->di.size) node_resize(node, offset + len);
+            inode_dirty(node->ino);
+            op_done();
+            return len;
+        }
+        int rc = inline_promote(node);
+        if (rc != WEXFS_OK) {
+            op_done();
+            return rc;
+        }
+    }
+
+    const u8* in = (const u8*)buf;
+    u32 done = 0;
+    int err = WEXFS_OK;
+    while (done < len) {
+        u32 pos = offset + done;
+        u32 lblk = pos / WEXFS_BLOCK_SIZE;
+        u32 boff = pos % WEXFS_BLOCK_SIZE;
+        u32 chunk = WEXFS_BLOCK_SIZE - boff;
+        if (chunk > len - done) chunk = len - done;
+
+        u32 ptr = bmap_map(node, lblk, 0, 0);
+        u32 pb = WEXFS_PTR_BLOCK(ptr);
+        int packed = WEXFS_PTR_SECTORS(ptr) || (node->di.flags & WEXFS_INODE_COMPRESS);
+        int dedup = (wexfs_sb.features & WEXFS_FEAT_DEDUP) && chunk == WEXFS_BLOCK_SIZE;
+        if (!pb || packed || block_shared(pb) || dedup) {
+            // New blocks are written whole so the unused tail reads as
+            // zero; a shared block is copied before its first change.
+            if (!pb) {
+                memset(databuf, 0, WEXFS_BLOCK_SIZE);
+            } else if (chunk < WEXFS_BLOCK_SIZE && block_load(ptr, databuf) != WEXFS_OK) {
+                err = WEXFS_EIO;
+                break;
+            }
+            memcpy(databuf + boff, (void*)(in + done), chunk);
+            u32 stored = packed ? zblock_store(node, lblk, ptr) : block_store(node, lblk, databuf, pb);
+            if (!stored) {
+                err = lblk >= WEXFS_NDIRECT + WEXFS_PTRS_PER_BLOCK * (WEXFS_PTRS_PER_BLOCK + 1)
+                      ? WEXFS_EFBIG : WEXFS_ENOSPC;
+                break;
+            }
+        } else {
+            // Private plain block: only the touched sectors are written,
+            // but the checksum needs the rest of the block in memory.
+            if (chunk < WEXFS_BLOCK_SIZE && block_load(ptr, databuf) != WEXFS_OK) {
+                err = WEXFS_EIO;
+                break;
+            }
+            dedup_forget(pb);
+            memcpy(databuf + boff, (void*)(in + done), chunk);
+            blk_write_range(pb, databuf, boff, chunk);
+            memcpy(zbuf, databuf, WEXFS_BLOCK_SIZE);
+            zbuf_blk = pb;
+        }
+        done += chunk;
+    }
+
+    if (offset + done > node->di.size) {
+        node_resize(node, offset + done);
+        inode_dirty(node->ino);
+    } else if (done && node->di.change <= wexfs_sb.frozen) {
+        // Overwritten in place: a snapshot or backup may hold the old
+        // data under the current change number
+        inode_dirty(node->ino);
+    }
+    op_done();
+    if (done == 0 && err != WEXFS_OK) return err;
+    return done;
+}
+
+int wexfs_truncate(FSNode* node, u32 size) {
+    if (node->is_dir) return WEXFS_EISDIR;
+    if (node->di.flags & WEXFS_INODE_INLINE) {
+        if (size <= WEXFS_INLINE_MAX) {
+            if (size < node->di.size) memset(node->di.inline_data + size, 0, node->di.size - size);
+        } else {
+            int rc = inline_promote(node);
+            if (rc != WEXFS_OK) {
+                op_done();
+                return rc;
+            }
+        }
+    } else if (size < node->di.size) {
+        u32 keep = (size + WEXFS_BLOCK_SIZE - 1) / WEXFS_BLOCK_SIZE;
+        free_blocks_from(node, keep);
+
+        // Zero the tail of the last partial block so a later extension
+        // reads zeroes instead of stale data.
+        u32 boff = size % WEXFS_BLOCK_SIZE;
+        u32 lblk = size / WEXFS_BLOCK_SIZE;
+        u32 ptr = boff ? bmap_map(node, lblk, 0, 0) : 0;
+        u32 pb = WEXFS_PTR_BLOCK(ptr);
+        if (pb) {
+            if (block_load(ptr, databuf) != WEXFS_OK) memset(databuf, 0, WEXFS_BLOCK_SIZE);
+            memset(databuf + boff, 0, WEXFS_BLOCK_SIZE - boff);
+            if (WEXFS_PTR_SECTORS(ptr) || (node->di.flags & WEXFS_INODE_COMPRESS)) {
+                zblock_store(node, lblk, ptr);
+            } else if (block_shared(pb)) {
+                block_store(node, lblk, databuf, pb);
+            } else {
+                dedup_forget(pb);
+                blk_write_range(pb, databuf, boff, WEXFS_BLOCK_SIZE - boff);
+            }
+        }
+    }
+    node_resize(node, size);
+    inode_dirty(node->ino);
+    op_done();
+    return WEXFS_OK;
+}
+
+/* Replace the whole content of a file, reusing its blocks in place.
+ * Content small enough to be inline moves back into the inode. */
+int wexfs_write_file(FSNode* node, const void* buf, u32 len) {
+    if (node->is_dir) return WEXFS_EISDIR;
+    if (len <= WEXFS_INLINE_MAX) {
+        if (!(node->di.flags & WEXFS_INODE_INLINE)) {
+            free_blocks_from(node, 0);
+            node->di.flags |= WEXFS_INODE_INLINE;
+        }
+        memset(node->di.inline_data, 0, WEXFS_INLINE_MAX);
+        memcpy(node->di.inline_data, (void*)buf, len);
+        node_resize(node, len);
+        inode_dirty(node->ino);
+        op_done();
+        return WEXFS_OK;
+    }
+    if (len) {
+        int rc = wexfs_write(node, 0, buf, len);
+        if (rc < 0) return rc;
+        if ((u32)rc < len) return WEXFS_ENOSPC;
+    }
+    return wexfs_truncate(node, len);
+}
+
+/* ---------- Directory iteration ---------- */
+
+/* Merge sort of a directory's child list by name, O(n log n). */
+static void dir_sort(FSNode* dir) {
+    FSNode* list = dir->children;
+    for (u32 width = 1; ; width *= 2) {
+        FSNode* head = NULL;
+        FSNode* tail = NULL;
+        u32 merges = 0;
+        FSNode* a = list;
+        while (a) {
+            merges++;
+            FSNode* b = a;
+            u32 na = 0;
+            while (b && na < width) {
+                b = b->next_sibling;
+                na++;
+            }
+            u32 nb = width;
+            while (na || (nb && b)) {
+                FSNode* take;
+                if (!na) {
+                    take = b;
+                    b = b->next_sibling;
+                    nb--;
+                } else if (!nb || !b || strcmp(a->name, b->name) <= 0) {
+                    take = a;
+                    a = a->next_sibling;
+                    na--;
+                } else {
+                    take = b;
+                    b = b->next_sibling;
+                    nb--;
+                }
+                if (tail) tail->next_sibling = take;
+                else head = take;
+                tail = take;
+            }
+            a = b;
+        }
+        if (tail) tail->next_sibling = NULL;
+        list = head;
+        if (merges <= 1) break;
+    }
+
+    FSNode* prev = NULL;
+    for (FSNode* n = list; n; n = n->next_sibling) {
+        n->prev_sibling = prev;
+        prev = n;
+    }
+    dir->children = list;
+    dir->last_child = prev;
+    dir->unsorted = 0;
+}
+
+int wexfs_opendir(FSNode* dir, u32 flags, WexDir* d) {
+    if (!dir) return WEXFS_ENOENT;
+    if (!dir->is_dir) return WEXFS_ENOTDIR;
+    if ((flags & WEXFS_DIR_SORTED) && dir->unsorted) dir_sort(dir);
+    d->dir = dir;
+    d->ino = dir->ino;
+    d->next = dir->children;
+    d->flags = flags;
+    d->generation = wexfs_generation;
+    d->last[0] = '\0';
+    return WEXFS_OK;
+}
+
+/* Continue after `after`: straight from its node while it is still in
+ * the directory, otherwise (sorted only) at the first larger name. */
+void wexfs_seekdir(WexDir* d, const char* after) {
+    FSNode* dir = d->dir;
+    d->generation = wexfs_generation;
+    if (!after || !*after) {
+        d->last[0] = '\0';
+        d->next = dir->children;
+        return;
+    }
+    if (after != d->last) strcpy(d->last, after);
+    int sorted = d->flags & WEXFS_DIR_SORTED;
+    if (sorted && dir->unsorted) dir_sort(dir);
+    FSNode* at = wexfs_lookup_child(dir, d->last, strlen(d->last));
+    if (at) {
+        d->next = at->next_sibling;
+        return;
+    }
+    d->next = NULL;
+    if (!sorted) return;
+    for (FSNode* n = dir->children; n; n = n->next_sibling) {
+        if (strcmp(n->name, d->last) > 0) {
+            d->next = n;
+            return;
+        }
+    }
+}
+
+FSNode* wexfs_readdir(WexDir* d) {
+    // Anything may have been removed or renamed since the last call
+    if (d->generation != wexfs_generation) {
+        if (d->ino >= fs_node_slots || fs_nodes[d->ino] != d->dir) {
+            d->next = NULL;
+            return NULL;
+        }
+        if (d->last[0]) wexfs_seekdir(d, d->last);
+        else wexfs_opendir(d->dir, d->flags, d);
+    }
+    FSNode* node = d->next;
+    if (!node) return NULL;
+    d->next = node->next_sibling;
+    strcpy(d->last, node->name);
+    return node;
+}
+
+/* ---------- Log files ---------- */
+
+/* "<name>.<gen>" into out; 0 if it does not fit a directory entry. */
+static int log_name(const char* name, u32 gen, char* out) {
+    char num[12];
+    int pos = 11;
+    num[pos] = '\0';
+    do {
+        num[--pos] = '0' + gen % 10;
+        gen /= 10;
+    } while (gen);
+    int len = strlen(name);
+    if (len + 1 + (11 - pos) >= MAX_NAME) return 0;
+    memcpy(out, (void*)name, len);
+    out[len] = '.';
+    strcpy(out + len + 1, num + pos);
+    return 1;
+}
+
+/* Move the log's data to name.1 and leave the log empty. Older
+ * generations are renamed first, the oldest one is removed. Each step
+ * is a transaction of its own, so none may be open yet: that is checked
+ * before anything changes. */
+static int log_rotate(FSNode* node) {
+    FSNode* dir = node->parent;
+    char name[MAX_NAME];
+    char next[MAX_NAME];
+    u32 keep = node->di.log_keep ? node->di.log_keep : 1;
+    if (!dir || tx_active) return WEXFS_EINVAL;
+    if (!log_name(node->name, keep, name)) return WEXFS_ENAMETOOLONG;
+
+    FSNode* gen = wexfs_lookup_child(dir, name, strlen(name));
+    if (gen) {
+        int rc = wexfs_remove(gen);
+        if (rc != WEXFS_OK) return rc;
+    }
+    for (u32 k = keep; k > 1; k--) {
+        log_name(node->name, k - 1, name);
+        gen = wexfs_lookup_child(dir, name, strlen(name));
+        if (!gen) continue;
+        log_name(node->name, k, next);
+        int rc = wexfs_rename(gen, dir, next);
+        if (rc != WEXFS_OK) return rc;
+    }
+
+    int rc = wexfs_tx_begin();
+    if (rc != WEXFS_OK) return rc;
+    log_name(node->name, 1, name);
+    gen = wexfs_create(dir, name, WEXFS_FILE, &rc);
+    if (!gen) {
+        wexfs_tx_commit();
+        return rc;
+    }
+    // The blocks change owner, nothing is copied
+    memcpy(gen->di.inline_data, node->di.inline_data, WEXFS_INLINE_MAX);
+    gen->di.flags = node->di.flags & (WEXFS_INODE_INLINE | WEXFS_INODE_COMPRESS);
+    node_resize(gen, node->di.size);
+    memset(node->di.inline_data, 0, WEXFS_INLINE_MAX);
+    node->di.flags |= WEXFS_INODE_INLINE;
+    node_resize(node, 0);
+    inode_dirty(gen->ino);
+    inode_dirty(node->ino);
+    op_done();
+    wexfs_tx_commit();
+    return WEXFS_OK;
+}
+
+int wexfs_set_log(FSNode* node, u32 max_size, u32 keep) {
+    if (node->is_dir) return WEXFS_EISDIR;
+    if (!max_size || !keep || keep > 99) return WEXFS_EINVAL;
+    node->di.flags |= WEXFS_INODE_LOG;
+    node->di.log_max = max_size;
+    node->di.log_keep = keep;
+    inode_dirty(node->ino);
+    op_done();
+    return WEXFS_OK;
+}
+
+int wexfs_append(FSNode* node, const void* buf, u32 len) {
+    if (node->is_dir) return WEXFS_EISDIR;
+    if ((node->di.flags & WEXFS_INODE_LOG) && node->di.size &&
+        node->di.size + len > node->di.log_max) {
+        // Not inside a caller's transaction: nothing is rotated then
+        int rc = log_rotate(node);
+        if (rc != WEXFS_OK) return rc;
+    }
+    // Inside a caller's transaction the append simply joins it
+    if (tx_active) return wexfs_write(node, node->di.size, buf, len);
+    u32 done = 0;
+    while (done < len) {
+        u32 n = len - done < WEXFS_APPEND_RECORD ? len - done : WEXFS_APPEND_RECORD;
+        int rc = wexfs_tx_begin();
+        if (rc != WEXFS_OK) return done ? (int)done : rc;
+        rc = wexfs_write(node, node->di.size, (const u8*)buf + done, n);
+        wexfs_tx_commit();
+        if (rc < 0) return done ? (int)done : rc;
+        done += rc;
+        if ((u32)rc < n) break;
+    }
+    return done;
+}
+
+/* ---------- File handles ---------- */
+
+static WexFile* file_get(int fd) {
+    if (fd < 0 || fd >= WEXFS_MAX_OPEN || !fs_files[fd].node) return NULL;
+    return &fs_files[fd];
+}
+
+int wexfs_open(FSNode* base, const char* path, u32 flags) {
+    if (!(flags & WEXFS_O_RDWR)) return WEXFS_EINVAL;
+    int fd = 0;
+    while (fd < WEXFS_MAX_OPEN && fs_files[fd].node) fd++;
+    if (fd == WEXFS_MAX_OPEN) return WEXFS_ENOMEM;
+
+    FSNode* node = wexfs_lookup_at(base, path);
+    if (!node) {
+        if (!(flags & WEXFS_O_CREATE)) return WEXFS_ENOENT;
+        int err;
+        node = wexfs_create_path(base, path, WEXFS_FILE, &err);
+        if (!node) return err;
+    }
+    if (node->is_dir) return WEXFS_EISDIR;
+    if ((flags & WEXFS_O_TRUNC) && (flags & WEXFS_O_WRITE) && node->di.size) {
+        int err = wexfs_truncate(node, 0);
+        if (err != WEXFS_OK) return err;
+    }
+
+    fs_files[fd].node = node;
+    fs_files[fd].offset = 0;
+    fs_files[fd].flags = flags;
+    return fd;
+}
+
+int wexfs_fread(int fd, void* buf, u32 len) {
+    WexFile* f = file_get(fd);
+    if (!f || !(f->flags & WEXFS_O_READ)) return WEXFS_EBADF;
+    int got = wexfs_read(f->node, f->offset, buf, len);
+    if (got > 0) f->offset += got;
+    return got;
+}
+
+int wexfs_fwrite(int fd, const void* buf, u32 len) {
+    WexFile* f = file_get(fd);
+    if (!f || !(f->flags & WEXFS_O_WRITE)) return WEXFS_EBADF;
+    if (f->flags & WEXFS_O_APPEND) {
+        int done = wexfs_append(f->node, buf, len);
+        f->offset = f->node->di.size;
+        return done;
+    }
+    int done = wexfs_write(f->node, f->offset, buf, len);
+    if (done > 0) f->offset += done;
+    return done;
+}
+
+int wexfs_seek(int fd, int offset, int whence) {
+    WexFile* f = file_get(fd);
+    if (!f) return WEXFS_EBADF;
+    long long pos = offset;
+    if (whence == WEXFS_SEEK_CUR) pos += f->offset;
+    else if (whence == WEXFS_SEEK_END) pos += f->node->di.size;
+    else if (whence != WEXFS_SEEK_SET) return WEXFS_EINVAL;
+    if (pos < 0 || pos > 0x7FFFFFFF) return WEXFS_EINVAL;
+    f->offset = (u32)pos;
+    return (int)pos;
+}
+
+int wexfs_ftruncate(int fd, u32 size) {
+    WexFile* f = file_get(fd);
+    if (!f || !(f->flags & WEXFS_O_WRITE)) return WEXFS_EBADF;
+    return wexfs_truncate(f->node, size);
+}
+
+FSNode* wexfs_fnode(int fd) {
+    WexFile* f = file_get(fd);
+    return f ? f->node : NULL;
+}
+
+int wexfs_close(int fd) {
+    WexFile* f = file_get(fd);
+    if (!f) return WEXFS_EBADF;
+    f->node = NULL;
+    return WEXFS_OK;
+}
+
+/* ---------- Mapped access ---------- */
+
+/* Least recently used slot nobody has pinned. */
+static MapSlot* map_victim(void) {
+    MapSlot* best = NULL;
+    for (int i = 0; i < WEXFS_MAP_SLOTS; i++) {
+        MapSlot* slot = &map_slots[i];
+        if (slot->pins) continue;
+        if (!best || !slot->blk || (best->blk && slot->used < best->used)) best = slot;
+    }
+    if (best && !best->data) best->data = (u8*)kmalloc(WEXFS_BLOCK_SIZE);
+    if (best && !best->data) return NULL;
+    return best;
+}
+
+int wexfs_map(int fd, u32 offset, u32 len, u32 flags, void** out) {
+    WexFile* f = file_get(fd);
+    *out = NULL;
+    if (!f || !(f->flags & WEXFS_O_READ)) return WEXFS_EBADF;
+    FSNode* node = f->node;
+    if (offset >= node->di.size || len == 0) return 0;
+    u32 boff = offset % WEXFS_BLOCK_SIZE;
+    if (len > node->di.size - offset) len = node->di.size - offset;
+    if (len > WEXFS_BLOCK_SIZE - boff) len = WEXFS_BLOCK_SIZE - boff;
+
+    int inline_data = node->di.flags & WEXFS_INODE_INLINE;
+    u32 ptr = inline_data ? 0 : bmap_map(node, offset / WEXFS_BLOCK_SIZE, 0, 0);
+    u32 pb = WEXFS_PTR_BLOCK(ptr);
+    int private_copy = (flags & WEXFS_MAP_PRIVATE) || !pb;
+
+    MapSlot* cached = pb ? map_find(pb) : NULL;
+    MapSlot* slot = private_copy ? NULL : cached;
+    if (!slot) {
+        slot = map_victim();
+        if (!slot) return WEXFS_ENOMEM;
+        slot->blk = 0;
+        slot->flags = 0;
+        if (cached) {
+            memcpy(slot->data, cached->data, WEXFS_BLOCK_SIZE);
+        } else if (pb) {
+            int rc = block_decode(ptr, slot->data);
+            if (rc != WEXFS_OK) return rc;
+        } else {
+            // Inline data and holes are copied; they have no block to share
+            memset(slot->data, 0, WEXFS_BLOCK_SIZE);
+            if (inline_data) memcpy(slot->data, node->di.inline_data, WEXFS_INLINE_MAX);
+        }
+        slot->blk = private_copy ? 0 : pb;
+        slot->flags = private_copy ? MAP_PRIVATE : 0;
+    }
+    slot->pins++;
+    slot->used = ++map_clock;
+    *out = slot->data + boff;
+    return len;
+}
+
+void wexfs_unmap(const void* ptr) {
+    const u8* p = (const u8*)ptr;
+    for (int i = 0; i < WEXFS_MAP_SLOTS; i++) {
+        MapSlot* slot = &map_slots[i];
+        if (!slot->pins || p < slot->data || p >= slot->data + WEXFS_BLOCK_SIZE) continue;
+        if (--slot->pins == 0 && (slot->flags & (MAP_STALE | MAP_PRIVATE))) {
+            slot->blk = 0;
+            slot->flags = 0;
+        }
+        return;
+    }
+}
+
+int wexfs_set_compress(FSNode* node, int on) {
+    if (!node) return WEXFS_EINVAL;
+    if (on) node->di.flags |= WEXFS_INODE_COMPRESS;
+    else node->di.flags &= ~WEXFS_INODE_COMPRESS;
+    inode_dirty(node->ino);
+    op_done();
+    return WEXFS_OK;
+}
+
+void wexfs_backup_mark(u32 backup_mark, u32 frozen) {
+    wexfs_sb.backup_mark = backup_mark;
+    wexfs_sb.frozen = frozen;
+    super_sync();
+}
+
+u32 wexfs_volume_id(void) {
+    if (!wexfs_sb.volume_id) {
+        wexfs_sb.volume_id = volume_id_new();
+        super_sync();
+    }
+    return wexfs_sb.volume_id;
+}
+
+/* Give a clone its own copy of the data block at `ptr`, sharing it when the
+ * owner count allows and duplicating it otherwise. */
+static u32 clone_data_block(u32 ptr, int* err) {
+    u32 pb = WEXFS_PTR_BLOCK(ptr);
+    if (block_ref(pb)) return ptr;
+    u32 copy = wexfs_alloc_block();
+    if (!copy) {
+        *err = WEXFS_ENOSPC;
+        return 0;
+    }
+    blk_read(pb, databuf);
+    blk_write(copy, databuf);
+    if (fs_csums) {
+        // A compressed block's checksum covers only its used sectors
+        fs_csums[copy] = fs_csums[pb];
+        csum_touch(copy);
+    }
+    return copy | (ptr & ~WEXFS_PTR_BLOCK(ptr));
+}
+
+/* Directory blocks are rewritten in place, so they are never shared */
+static u32 clone_dir_block(u32 ptr, int* err) {
+    u32 copy = wexfs_alloc_block();
+    if (!copy) {
+        *err = WEXFS_ENOSPC;
+        return 0;
+    }
+    blk_read(WEXFS_PTR_BLOCK(ptr), databuf);
+    blk_write(copy, databuf);
+    return copy;
+}
+
+/* Indirect blocks are never shared: each clone gets its own pointer
+ * tree that refers to the shared data blocks, or with `dir` to copies
+ * of the directory blocks. */
+static u32 clone_ptr_block(u32 blk, int depth, int dir, int* err) {
+    u32* ptrs = depth ? ptrbuf2 : ptrbuf;
+    u32 copy = wexfs_alloc_block();
+    if (!copy) {
+        *err = WEXFS_ENOSPC;
+        return 0;
+    }
+    blk_read(blk, ptrs);
+    for (u32 i = 0; i < WEXFS_PTRS_PER_BLOCK; i++) {
+        if (!ptrs[i]) continue;
+        if (*err != WEXFS_OK) ptrs[i] = 0;
+        else if (depth) ptrs[i] = clone_ptr_block(ptrs[i], 0, dir, err);
+        else if (dir) ptrs[i] = clone_dir_block(ptrs[i], err);
+        else ptrs[i] = clone_data_block(ptrs[i], err);
+    }
+    blk_write(copy, ptrs);
+    return copy;
+}
+
+/* Copy a file as a new name over the same data blocks. The cost is one
+ * pointer block per 4 MB, not the data; blocks diverge on write. */
+FSNode* wexfs_clone(FSNode* src, FSNode* dir, const char* name, int* err) {
+    if (!src || src->is_dir) {
+        *err = WEXFS_EISDIR;
+        return NULL;
+    }
+    FSNode* node = wexfs_create(dir, name, WEXFS_FILE, err);
+    if (!node) return NULL;
+    if (src->di.flags & WEXFS_INODE_INLINE) {
+        memcpy(node->di.inline_data, src->di.inline_data, WEXFS_INLINE_MAX);
+        node_resize(node, src->di.size);
+        inode_dirty(node->ino);
+        op_done();
+        return node;
+    }
+    node->di.flags &= ~WEXFS_INODE_INLINE;
+    node->di.flags |= src->di.flags & WEXFS_INODE_COMPRESS;
+
+    for (u32 i = 0; i < WEXFS_NDIRECT && *err == WEXFS_OK; i++) {
+        if (src->di.blocks[i]) node->di.blocks[i] = clone_data_block(src->di.blocks[i], err);
+    }
+    if (src->di.blocks[WEXFS_IND] && *err == WEXFS_OK) {
+        node->di.blocks[WEXFS_IND] = clone_ptr_block(src->di.blocks[WEXFS_IND], 0, 0, err);
+    }
+    if (src->di.blocks[WEXFS_DIND] && *err == WEXFS_OK) {
+        node->di.blocks[WEXFS_DIND] = clone_ptr_block(src->di.blocks[WEXFS_DIND], 1, 0, err);
+    }
+    node_resize(node, src->di.size);
+
+    // Owner counts reach the disk before the inode that relies on them;
+    // a crash in between only leaks the extra counts.
+    if (fs_refs) refs_sync();
+    inode_dirty(node->ino);
+    op_done();
+
+    if (*err != WEXFS_OK) {
+        int rc = *err;
+        wexfs_remove(node);
+        *err = rc;
+        return NULL;
+    }
+    return node;
+}
+
+/* ---------- Snapshots ---------- */
+
+/* A snapshot is a second inode table. Everything the volume rewrites in
+ * place - inode table, directory blocks, pointer blocks - is copied when
+ * it is taken; file data is only given one more owner. The table of
+ * snapshots is written last, so a crash while one is made or deleted
+ * leaves at worst blocks that fsck finds leaked. */
+
+static int snap_read(u32 slot, WexSnapshot* s) {
+    if (!wexfs_sb.snap_block || slot >= WEXFS_MAX_SNAPSHOTS) return 0;
+    dev_read(blk_lba(wexfs_sb.snap_block) + slot, (u8*)s);
+    s->name[WEXFS_SNAP_NAME - 1] = '\0';
+    return s->magic == WEXFS_SNAP_MAGIC;
+}
+
+static void snap_write(u32 slot, WexSnapshot* s) {
+    dev_write(blk_lba(wexfs_sb.snap_block) + slot, (u8*)s);
+}
+
+static int snap_find(const char* name, WexSnapshot* s) {
+    for (u32 slot = 0; slot < WEXFS_MAX_SNAPSHOTS; slot++) {
+        if (snap_read(slot, s) && strcmp(s->name, name) == 0) return slot;
+    }
+    return -1;
+}
+
+static u32 snap_sequence(void) {
+    WexSnapshot s;
+    u32 next = 1;
+    for (u32 slot = 0; slot < WEXFS_MAX_SNAPSHOTS; slot++) {
+        if (snap_read(slot, &s) && s.sequence >= next) next = s.sequence + 1;
+    }
+    return next;
+}
+
+/* Give a copied inode its own directory and pointer blocks and an owner
+ * share of its data. After an error the pointers not taken are cleared,
+ * so the inode still names exactly what has to be released. */
+static void snap_copy_inode(WexInode* di, int* err) {
+    if (di->flags & WEXFS_INODE_INLINE) return;
+    int dir = di->mode == WEXFS_DIR;
+    for (u32 i = 0; i < WEXFS_NBLOCKS; i++) {
+        if (!di->blocks[i]) continue;
+        if (*err != WEXFS_OK) di->blocks[i] = 0;
+        else if (i == WEXFS_IND) di->blocks[i] = clone_ptr_block(di->blocks[i], 0, dir, err);
+        else if (i == WEXFS_DIND) di->blocks[i] = clone_ptr_block(di->blocks[i], 1, dir, err);
+        else if (dir) di->blocks[i] = clone_dir_block(di->blocks[i], err);
+        else di->blocks[i] = clone_data_block(di->blocks[i], err);
+    }
+}
+
+static void snap_release_inode(const WexInode* di) {
+    if (di->mode == WEXFS_FREE || (di->flags & WEXFS_INODE_INLINE)) return;
+    for (u32 i = 0; i < WEXFS_NDIRECT; i++) block_put(WEXFS_PTR_BLOCK(di->blocks[i]));
+    for (int depth = 0; depth < 2; depth++) {
+        u32 blk = di->blocks[WEXFS_IND + depth];
+        if (blk && blk < wexfs_sb.total_blocks) free_ptr_block(blk, 0, depth);
+    }
+}
+
+/* Drop everything a snapshot holds: its inodes' blocks, then its table. */
+static void snap_release(const WexSnapshot* s) {
+    WexInode sector[WEXFS_INODES_PER_SECTOR];
+    u32 hwm = s->inode_hwm < s->inode_capacity ? s->inode_hwm : s->inode_capacity;
+    for (u32 first = 0; first < hwm; first += WEXFS_INODES_PER_SECTOR) {
+        u32 lba = itable_lba(s->itable, s->extent_count, first);
+        if (!lba) break;
+        dev_read(lba, (u8*)sector);
+        for (u32 i = 0; i < WEXFS_INODES_PER_SECTOR; i++) {
+            if (first + i) snap_release_inode(&sector[i]);
+        }
+    }
+    for (u32 i = 0; i < s->extent_count && i < WEXFS_MAX_EXTENTS; i++) {
+        for (u32 b = 0; b < s->itable[i].count; b++) wexfs_free_block(s->itable[i].start + b);
+    }
+}
+
+/* Room for `count` inode table blocks, in as few extents as the free
+ * space allows. */
+static int snap_alloc_itable(WexSnapshot* s, u32 count) {
+    while (count) {
+        u32 want = count;
+        u32 start = 0;
+        while (want > 0) {
+            start = wexfs_alloc_run(want);
+            if (start) break;
+            want /= 2;
+        }
+        if (!start || s->extent_count == WEXFS_MAX_EXTENTS) {
+            if (start) {
+                for (u32 b = start; b < start + want; b++) wexfs_free_block(b);
+            }
+            return WEXFS_ENOSPC;
+        }
+        s->itable[s->extent_count].start = start;
+        s->itable[s->extent_count].count = want;
+        s->extent_count++;
+        s->inode_capacity += want * WEXFS_INODES_PER_BLOCK;
+        count -= want;
+    }
+    return WEXFS_OK;
+}
+
+int wexfs_snapshot_create(const char* name) {
+    int len = strlen(name);
+    if (len == 0) return WEXFS_EINVAL;
+    if (len >= WEXFS_SNAP_NAME) return WEXFS_ENAMETOOLONG;
+    if (!fs_refs) return WEXFS_ENOSPC;      // without owner counts the data would be copied
+    WexSnapshot s;
+    if (snap_find(name, &s) >= 0) return WEXFS_EEXIST;
+
+    u32 free_before = wexfs_free_blocks;
+    if (!wexfs_sb.snap_block) {
+        u32 blk = wexfs_alloc_block();
+        if (!blk) return WEXFS_ENOSPC;
+        memset(databuf, 0, WEXFS_BLOCK_SIZE);
+        for (u32 i = 0; i < WEXFS_SECTORS_PER_BLOCK; i++) dev_write(blk_lba(blk) + i, databuf);
+        wexfs_sb.snap_block = blk;
+        bitmap_sync();
+        super_sync();
+    }
+    int slot = 0;
+    while (slot < WEXFS_MAX_SNAPSHOTS && snap_read(slot, &s)) slot++;
+    if (slot == WEXFS_MAX_SNAPSHOTS) return WEXFS_ENOSPC;
+
+    memset(&s, 0, sizeof(s));
+    s.magic = WEXFS_SNAP_MAGIC;
+    s.sequence = snap_sequence();
+    strcpy(s.name, name);
+    s.root_ino = wexfs_sb.root_ino;
+    s.inode_hwm = wexfs_sb.inode_hwm;
+    int err = snap_alloc_itable(&s, (s.inode_hwm + WEXFS_INODES_PER_BLOCK - 1) / WEXFS_INODES_PER_BLOCK);
+    WexInode* table = (WexInode*)kmalloc(WEXFS_BLOCK_SIZE);
+    if (!table && err == WEXFS_OK) err = WEXFS_ENOMEM;
+
+    // Blocks past an error are still written, zeroed, so the table can
+    // be released like a complete one.
+    u32 ino = 0;
+    for (u32 e = 0; e < s.extent_count; e++) {
+        for (u32 b = 0; b < s.itable[e].count; b++) {
+            if (!table) break;
+            for (u32 i = 0; i < WEXFS_INODES_PER_BLOCK; i++, ino++) {
+                FSNode* node = ino && ino < fs_node_slots && ino < s.inode_hwm ? fs_nodes[ino] : NULL;
+                if (!node || err != WEXFS_OK) {
+                    memset(&table[i], 0, sizeof(WexInode));
+                    continue;
+                }
+                table[i] = node->di;
+                snap_copy_inode(&table[i], &err);
+                table[i].csum = inode_crc(&table[i]);
+                s.objects++;
+            }
+            blk_write(s.itable[e].start + b, table);
+        }
+    }
+    int written = table != NULL;
+    kfree(table);
+
+    if (err != WEXFS_OK) {
+        if (!written) s.inode_hwm = 0;      // only the table itself to free
+        snap_release(&s);
+        op_done();
+        return err;
+    }
+    // Owner counts and copies reach the disk before the record naming them
+    op_done();
+    if (wexfs_sb.frozen < wexfs_sb.change) {
+        wexfs_sb.frozen = wexfs_sb.change;
+        super_sync();
+    }
+    s.blocks = free_before - wexfs_free_blocks;
+    snap_write(slot, &s);
+    return WEXFS_OK;
+}
+
+/* Swap the live tree with the snapshot: the superblock and the record
+ * change in one journal record, then the volume is mounted again. */
+int wexfs_snapshot_restore(const char* name) {
+    WexSnapshot s;
+    WexSnapshot undo;
+    int slot = snap_find(name, &s);
+    if (slot < 0) return WEXFS_ENOENT;
+    int len = strlen(name);
+    if (len > WEXFS_SNAP_NAME - 2) len = WEXFS_SNAP_NAME - 2;
+    memset(&undo, 0, sizeof(undo));
+    memcpy(undo.name, (void*)name, len);
+    undo.name[len] = '~';
+    WexSnapshot other;
+    if (snap_find(undo.name, &other) >= 0) return WEXFS_EEXIST;
+
+    // A table without a root directory would not mount
+    WexInode sector[WEXFS_INODES_PER_SECTOR];
+    u32 lba = s.root_ino < s.inode_hwm ? itable_lba(s.itable, s.extent_count, s.root_ino) : 0;
+    if (!lba) return WEXFS_EIO;
+    dev_read(lba, (u8*)sector);
+    if (sector[s.root_ino % WEXFS_INODES_PER_SECTOR].mode != WEXFS_DIR) return WEXFS_EIO;
+
+    op_done();
+    undo.magic = WEXFS_SNAP_MAGIC;
+    undo.sequence = snap_sequence();
+    undo.objects = fs_count;
+    undo.inode_capacity = wexfs_sb.inode_capacity;
+    undo.inode_hwm = wexfs_sb.inode_hwm;
+    undo.root_ino = wexfs_sb.root_ino;
+    undo.extent_count = wexfs_sb.extent_count;
+    memcpy(undo.itable, wexfs_sb.itable, sizeof(undo.itable));
+
+    int err = wexfs_tx_begin();
+    if (err != WEXFS_OK) return err;
+    wexfs_sb.inode_capacity = s.inode_capacity;
+    wexfs_sb.inode_hwm = s.inode_hwm;
+    wexfs_sb.root_ino = s.root_ino;
+    wexfs_sb.extent_count = s.extent_count;
+    memcpy(wexfs_sb.itable, s.itable, sizeof(wexfs_sb.itable));
+    super_sync();
+    snap_write(slot, &undo);
+    wexfs_tx_commit();
+    return wexfs_mount();
+}
+
+int wexfs_snapshot_delete(const char* name) {
+    WexSnapshot s;
+    WexSnapshot none;
+    int slot = snap_find(name, &s);
+    if (slot < 0) return WEXFS_ENOENT;
+    memset(&none, 0, sizeof(none));
+    snap_write(slot, &none);
+    snap_release(&s);
+    op_done();
+    return WEXFS_OK;
+}
+
+int wexfs_snapshot_list(WexSnapshot* out, u32 max) {
+    u32 count = 0;
+    WexSnapshot s;
+    for (u32 slot = 0; slot < WEXFS_MAX_SNAPSHOTS; slot++) {
+        if (!snap_read(slot, &s)) continue;
+        // Insertion by sequence; there are only a few
+        u32 pos = count < max ? count : max;
+        while (pos > 0 && out[pos - 1].sequence > s.sequence) {
+            if (pos < max) out[pos] = out[pos - 1];
+            pos--;
+        }
+        if (pos < max) out[pos] = s;
+        count++;
+    }
+    return count;
+}
+
+/* ---------- Consistency check ---------- */
+
+/* The check rebuilds the block ownership map from the inodes and compares
+ * it with the bitmap and the refcount table. Every pass is linear: names
+ * are checked through the name hash, each inode and block is visited
+ * once, and the walk can stop after any pointer and resume later. */
+
+#define FSCK_META 0xFFFF        /* owners[] mark of superblock, bitmap, tables */
+#define FSCK_EXCL 0x8000        /* pointer and directory blocks: one owner only */
+#define FSCK_MAX_OWNERS 0x7FFF
+#define FSCK_READ_COST 8        /* budget units per block read */
+
+static FSNode fsck_snode;       /* snapshot inode being walked */
+
+static int fsck_error(WexFsck* ck, const char* what, FSNode* node, u32 blk) {
+    ck->errors++;
+    if (ck->flags & WEXFS_FSCK_VERBOSE) {
+        prints("fsck: ");
+        prints(what);
+        FSNode* top = node;
+        while (top && top->parent) top = top->parent;
+        if (node == &fsck_snode) {
+            prints(": snapshot inode ");
+            print_u32(node->ino);
+        } else if (node && top->ino == wexfs_sb.root_ino) {
+            char path[MAX_PATH];
+            wexfs_path(node, path, MAX_PATH);
+            prints(path[0] == '/' ? ": " : ": /");
+            prints(path);
+        } else if (node) {
+            prints(": inode ");
+            print_u32(node->ino);
+        }
+        if (blk) {
+            prints(", block ");
+            print_u32(blk);
+        }
+        prints("\n");
+    }
+    return ck->flags & WEXFS_FSCK_REPAIR;
+}
+
+static void fsck_mark_meta(WexFsck* ck, u32 start, u32 count) {
+    for (u32 b = start; b < start + count && b < ck->total; b++) ck->owners[b] = FSCK_META;
+}
+
+static int fsck_reset(WexFsck* ck) {
+    if (ck->total != wexfs_sb.total_blocks) {
+        kfree(ck->owners);
+        ck->total = wexfs_sb.total_blocks;
+        ck->owners = (u16*)kmalloc(ck->total * sizeof(u16));
+        if (!ck->owners) return WEXFS_ENOMEM;
+    }
+    memset(ck->owners, 0, ck->total * sizeof(u16));
+    fsck_mark_meta(ck, 0, 1);
+    fsck_mark_meta(ck, wexfs_sb.bitmap_start, wexfs_sb.bitmap_blocks);
+    fsck_mark_meta(ck, wexfs_sb.journal_start, wexfs_sb.journal_blocks);
+    fsck_mark_meta(ck, wexfs_sb.refcount_start, wexfs_sb.refcount_blocks);
+    fsck_mark_meta(ck, wexfs_sb.csum_start, wexfs_sb.csum_blocks);
+    for (u32 i = 0; i < wexfs_sb.extent_count && i < WEXFS_MAX_EXTENTS; i++) {
+        fsck_mark_meta(ck, wexfs_sb.itable[i].start, wexfs_sb.itable[i].count);
+    }
+    if (wexfs_sb.snap_block) fsck_mark_meta(ck, wexfs_sb.snap_block, 1);
+    WexSnapshot s;
+    for (u32 slot = 0; slot < WEXFS_MAX_SNAPSHOTS; slot++) {
+        if (!snap_read(slot, &s)) continue;
+        for (u32 i = 0; i < s.extent_count && i < WEXFS_MAX_EXTENTS; i++) {
+            fsck_mark_meta(ck, s.itable[i].start, s.itable[i].count);
+        }
+    }
+
+    ck->phase = WEXFS_FSCK_TREE;
+    ck->pos = 0;
+    ck->lblk = 0;
+    ck->snap = 0;
+    ck->objects = 0;
+    ck->blocks = 0;
+    ck->errors = 0;
+    ck->warnings = 0;
+    ck->repaired = 0;
+    ck->unmarked = 0;
+    ck->leaked = 0;
+    ck->bad_refs = 0;
+    ck->generation = wexfs_generation;
+    return WEXFS_OK;
+}
+
+int wexfs_fsck_begin(WexFsck* ck, u32 flags) {
+    memset(ck, 0, sizeof(WexFsck));
+    ck->flags = flags;
+    if (!wexfs_root()) return WEXFS_EIO;    // nothing mounted to check
+    ck->buf = (u8*)kmalloc(WEXFS_BLOCK_SIZE);
+    if (!ck->buf) return WEXFS_ENOMEM;
+    int err = fsck_reset(ck);
+    if (err != WEXFS_OK) wexfs_fsck_end(ck);
+    return err;
+}
+
+void wexfs_fsck_end(WexFsck* ck) {
+    kfree(ck->owners);
+    kfree(ck->buf);
+    ck->owners = NULL;
+    ck->buf = NULL;
+    ck->total = 0;
+}
+
+/* Names, parent links and entry counts of one object. */
+static void fsck_check_node(WexFsck* ck, FSNode* node) {
+    ck->objects++;
+    if (node->parent) {
+        FSNode* dir = node->parent;
+        if (wexfs_lookup_child(dir, node->name, strlen(node->name)) != node &&
+            fsck_error(ck, "duplicate name", node, 0)) {
+            char name[MAX_NAME];
+            char num[12];
+            int len = strlen(node->name);
+            if (len > MAX_NAME - 13) len = MAX_NAME - 13;
+            memcpy(name, node->name, len);
+            name[len] = '~';
+            int pos = 11;
+            num[pos] = '\0';
+            u32 v = node->ino;
+            do {
+                num[--pos] = '0' + v % 10;
+                v /= 10;
+            } while (v);
+            strcpy(name + len + 1, num + pos);
+            if (wexfs_rename(node, dir, name) == WEXFS_OK) ck->repaired++;
+        }
+        if (node->di.parent != dir->ino && fsck_error(ck, "wrong parent link", node, 0)) {
+            node->di.parent = dir->ino;
+            inode_dirty(node->ino);
+            ck->repaired++;
+        }
+    } else if (node->ino != wexfs_sb.root_ino) {
+        fsck_error(ck, "orphan", node, 0);      // adopted at the end of the phase
+    }
+
+    if (node->is_dir) {
+        u32 children = 0;
+        for (FSNode* child = node->children; child; child = child->next_sibling) children++;
+        if (children != node->child_count && fsck_error(ck, "wrong entry count", node, 0)) {
+            node->child_count = children;
+            ck->repaired++;
+        }
+    }
+    if ((node->di.flags & WEXFS_INODE_INLINE) && node->di.size > WEXFS_INLINE_MAX &&
+        fsck_error(ck, "inline size too large", node, 0)) {
+        node_resize(node, WEXFS_INLINE_MAX);
+        inode_dirty(node->ino);
+        ck->repaired++;
+    }
+}
+
+/* Put unreachable objects under /lost+found. Each orphan is traced up
+ * to the outermost orphaned directory, which is adopted together with
+ * everything its entries name; empty files left by an interrupted
+ * create are simply freed. */
+static void fsck_adopt_orphans(WexFsck* ck) {
+    FSNode* root = wexfs_root();
+    FSNode* lost = NULL;
+    for (u32 ino = 0; ino < fs_node_slots; ino++) {
+        FSNode* node = fs_nodes[ino];
+        if (!node || node->parent || node == root) continue;
+
+        FSNode* top = node;
+        for (int depth = 0; depth < fs_count; depth++) {
+            u32 p = top->di.parent;
+            if (p >= fs_node_slots || !fs_nodes[p] || fs_nodes[p] == node) break;
+            FSNode* up = fs_nodes[p];
+            if (up->parent || up == root || !up->is_dir) break;
+            top = up;
+        }
+
+        if (top == node && !node->is_dir && node->di.size == 0) {
+            free_subtree(node);
+            op_done();
+            ck->repaired++;
+            continue;
+        }
+
+        if (!lost) {
+            int err;
+            lost = wexfs_lookup_child(root, "lost+found", 10);
+            if (!lost) lost = wexfs_create(root, "lost+found", WEXFS_DIR, &err);
+            if (!lost || !lost->is_dir) return;
+        }
+
+        char name[16];
+        char* p = name + sizeof(name) - 1;
+        u32 v = top->ino;
+        *p = '\0';
+        do {
+            *--p = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        *--p = '#';
+        char* copy = (char*)kmalloc(strlen(p) + 1);
+        if (!copy) return;
+        strcpy(copy, p);
+        kfree(top->name);
+        top->name = copy;
+        if (dirent_add(lost, top) != WEXFS_OK) return;
+        tree_link(lost, top);
+        top->di.parent = lost->ino;
+        inode_dirty(top->ino);
+
+        if (top->is_dir) {
+            FSNode** queue = (FSNode**)kmalloc((fs_count + 1) * sizeof(FSNode*));
+            if (queue) {
+                u32 head = 0, tail = 0;
+                queue[tail++] = top;
+                while (head < tail) mount_attach_dir(queue[head++], queue, &tail);
+                kfree(queue);
+            }
+        }
+        op_done();
+        ck->repaired++;
+    }
+}
+
+/* Read a block the way it is stored and compare it with its checksum. */
+static int fsck_verify(WexFsck* ck, FSNode* node, u32 ptr) {
+    u32 blk = WEXFS_PTR_BLOCK(ptr);
+    u32 sectors = WEXFS_PTR_SECTORS(ptr);
+    if (!sectors) sectors = WEXFS_SECTORS_PER_BLOCK;
+    ck->blocks++;
+    if (!fs_csums || !fs_csums[blk]) return 1;
+    u32 lba = blk_lba(blk);
+    for (u32 s = 0; s < sectors; s++) dev_read(lba + s, ck->buf + s * SECTOR_SIZE);
+    if (block_crc(ck->buf, sectors * SECTOR_SIZE) == fs_csums[blk]) return 1;
+    fsck_error(ck, "checksum mismatch", node, blk);
+    return 0;
+}
+
+#define FSCK_FILE_DATA 0
+#define FSCK_DIR_DATA 1
+#define FSCK_POINTERS 2
+
+/* Record one pointer of the object being walked. Returns 0 when the
+ * pointer must not be followed; in repair mode the caller clears it.
+ * File data with a bad checksum is only reported: it cannot be rebuilt,
+ * and the report names the file so it can be restored. */
+static int fsck_claim(WexFsck* ck, FSNode* node, u32 ptr, int kind, u32* budget) {
+    u32 blk = WEXFS_PTR_BLOCK(ptr);
+    if (blk == 0 || blk >= ck->total || ck->owners[blk] == FSCK_META ||
+        WEXFS_PTR_SECTORS(ptr) > WEXFS_SECTORS_PER_BLOCK ||
+        (kind == FSCK_POINTERS && WEXFS_PTR_SECTORS(ptr))) {
+        fsck_error(ck, "bad block pointer", node, blk);
+        return 0;
+    }
+    // Only file data may be shared; pointer and directory blocks have one owner
+    u16 own = ck->owners[blk];
+    if (own && (kind != FSCK_FILE_DATA || (own & FSCK_EXCL))) {
+        fsck_error(ck, "block claimed twice", node, blk);
+        return 0;
+    }
+    if (own) {
+        if (own < FSCK_MAX_OWNERS) ck->owners[blk]++;
+        return 1;
+    }
+    ck->owners[blk] = kind == FSCK_FILE_DATA ? 1 : (FSCK_EXCL | 1);
+    *budget = *budget > FSCK_READ_COST ? *budget - FSCK_READ_COST : 0;
+    return fsck_verify(ck, node, ptr) || kind != FSCK_POINTERS;
+}
+
+/* Walk the object's pointers from logical block ck->lblk on; returns 1
+ * once its whole pointer tree has been visited. */
+static int fsck_walk(WexFsck* ck, FSNode* node, u32* budget) {
+    u32* b = node->di.blocks;
+    int kind = node->is_dir ? FSCK_DIR_DATA : FSCK_FILE_DATA;
+    int repair = ck->flags & WEXFS_FSCK_REPAIR;
+
+    while (*budget) {
+        (*budget)--;
+        u32 lblk = ck->lblk;
+        if (lblk < WEXFS_NDIRECT) {
+            if (b[lblk] && !fsck_claim(ck, node, b[lblk], kind, budget) && repair) {
+                b[lblk] = 0;
+                inode_dirty(node->ino);
+                ck->repaired++;
+            }
+            ck->lblk++;
+            continue;
+        }
+
+        lblk -= WEXFS_NDIRECT;
+        if (lblk < WEXFS_PTRS_PER_BLOCK) {
+            u32 ind = b[WEXFS_IND];
+            if (lblk == 0 && ind && !fsck_claim(ck, node, ind, FSCK_POINTERS, budget)) {
+                if (repair) {
+                    b[WEXFS_IND] = 0;
+                    inode_dirty(node->ino);
+                    ck->repaired++;
+                }
+                ind = 0;
+            }
+            if (!ind) {
+                ck->lblk = WEXFS_NDIRECT + WEXFS_PTRS_PER_BLOCK;
+                continue;
+            }
+            u32 ptr = meta_read(ind)[lblk];
+            if (ptr && !fsck_claim(ck, node, ptr, kind, budget) && repair) {
+                meta_store(ind, lblk, 0);
+                ck->repaired++;
+            }
+            ck->lblk++;
+            continue;
+        }
+
+        lblk -= WEXFS_PTRS_PER_BLOCK;
+        u32 outer = lblk / WEXFS_PTRS_PER_BLOCK;
+        u32 inner = lblk % WEXFS_PTRS_PER_BLOCK;
+        u32 dind = b[WEXFS_DIND];
+        if (outer >= WEXFS_PTRS_PER_BLOCK || !dind) return 1;
+        if (lblk == 0 && !fsck_claim(ck, node, dind, FSCK_POINTERS, budget)) {
+            if (repair) {
+                b[WEXFS_DIND] = 0;
+                inode_dirty(node->ino);
+                ck->repaired++;
+            }
+            return 1;
+        }
+        u32 mid = meta_read(dind)[outer];
+        if (inner == 0 && mid && !fsck_claim(ck, node, mid, FSCK_POINTERS, budget)) {
+            if (repair) {
+                meta_store(dind, outer, 0);
+                ck->repaired++;
+            }
+            mid = 0;
+        }
+        if (!mid) {
+            ck->lblk += WEXFS_PTRS_PER_BLOCK - inner;
+            continue;
+        }
+        u32 ptr = meta_read(mid)[inner];
+        if (ptr && !fsck_claim(ck, node, ptr, kind, budget) && repair) {
+            meta_store(mid, inner, 0);
+            ck->repaired++;
+        }
+        ck->lblk++;
+    }
+    return 0;
+}
+
+/* Walk the next snapshot inode, read from its own table, the same way.
+ * Nothing in a snapshot is repaired: its blocks are only counted, so the
+ * space phase sees every owner. Returns 1 after the last snapshot. */
+static int fsck_snap_walk(WexFsck* ck, u32* budget) {
+    WexSnapshot s;
+    for (; ck->snap <= WEXFS_MAX_SNAPSHOTS; ck->snap++, ck->pos = 0) {
+        if (!snap_read(ck->snap - 1, &s)) continue;
+        u32 hwm = s.inode_hwm < s.inode_capacity ? s.inode_hwm : s.inode_capacity;
+        if (ck->pos == 0) ck->pos = 1;
+        if (ck->pos >= hwm) continue;
+
+        WexInode sector[WEXFS_INODES_PER_SECTOR];
+        u32 lba = itable_lba(s.itable, s.extent_count, ck->pos);
+        if (lba) dev_read(lba, (u8*)sector);
+        else memset(sector, 0, sizeof(sector));
+        FSNode* node = &fsck_snode;
+        node->ino = ck->pos;
+        node->di = sector[ck->pos % WEXFS_INODES_PER_SECTOR];
+        node->is_dir = node->di.mode == WEXFS_DIR;
+
+        u32 flags = ck->flags;
+        ck->flags &= ~WEXFS_FSCK_REPAIR;
+        int done = node->di.mode == WEXFS_FREE || (node->di.flags & WEXFS_INODE_INLINE) ||
+                   fsck_walk(ck, node, budget);
+        ck->flags = flags;
+        if (done) {
+            if (*budget) (*budget)--;
+            ck->pos++;
+            ck->lblk = 0;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* Compare the ownership map with the bitmap and the refcount table. */
+static void fsck_check_block(WexFsck* ck, u32 blk) {
+    u16 own = ck->owners[blk];
+    int repair = ck->flags & WEXFS_FSCK_REPAIR;
+    if (own && !bitmap_test(blk)) {
+        ck->errors++;
+        ck->unmarked++;
+        if (repair) {
+            bitmap_set(blk);
+            ck->repaired++;
+        }
+    } else if (!own && blk && bitmap_test(blk)) {
+        ck->warnings++;
+        ck->leaked++;
+        if (repair) {
+            wexfs_free_block(blk);
+            ck->repaired++;
+        }
+    }
+    if (!fs_refs) return;
+
+    u32 expect = 0;
+    if (own && own != FSCK_META) {
+        expect = (own & ~FSCK_EXCL) - 1;
+        if (expect > WEXFS_REF_MAX) expect = WEXFS_REF_MAX;
+    }
+    if (fs_refs[blk] != expect) {
+        ck->errors++;
+        ck->bad_refs++;
+        if (repair) {
+            fs_refs[blk] = (u8)expect;
+            refs_touch(blk);
+            ck->repaired++;
+        }
+    }
+}
+
+static void fsck_summary(WexFsck* ck, u32 count, const char* what) {
+    if (!count || !(ck->flags & WEXFS_FSCK_VERBOSE)) return;
+    prints("fsck: ");
+    print_u32(count);
+    prints(what);
+}
+
+/* Run the check for about `budget` units (one per pointer or block
+ * looked at, more for each block read). A read-only check starts over
+ * when the volume changed since the previous step. Returns 1 when the
+ * check is complete, 0 when more steps are needed. */
+int wexfs_fsck_step(WexFsck* ck, u32 budget) {
+    if (!ck->owners) return WEXFS_EINVAL;
+    if (ck->phase == WEXFS_FSCK_DONE) return 1;
+    if (ck->generation != wexfs_generation) {
+        int err = fsck_reset(ck);
+        if (err != WEXFS_OK) return err;
+        ck->restarts++;
+    }
+
+    u32 phase = ck->phase;
+    while (budget && ck->phase == phase) {
+        if (phase == WEXFS_FSCK_TREE) {
+            if (ck->pos >= fs_node_slots) {
+                if (ck->flags & WEXFS_FSCK_REPAIR) fsck_adopt_orphans(ck);
+                ck->phase = WEXFS_FSCK_BLOCKS;
+                ck->pos = 0;
+                break;
+            }
+            budget--;
+            FSNode* node = fs_nodes[ck->pos++];
+            if (node) fsck_check_node(ck, node);
+        } else if (phase == WEXFS_FSCK_BLOCKS) {
+            if (ck->snap) {
+                if (fsck_snap_walk(ck, &budget)) {
+                    ck->phase = WEXFS_FSCK_SPACE;
+                    ck->pos = 0;
+                }
+                continue;
+            }
+            if (ck->pos >= fs_node_slots) {
+                ck->snap = 1;
+                ck->pos = 0;
+                ck->lblk = 0;
+                continue;
+            }
+            FSNode* node = fs_nodes[ck->pos];
+            if (!node || (node->di.flags & WEXFS_INODE_INLINE) || fsck_walk(ck, node, &budget)) {
+                if (budget) budget--;
+                ck->pos++;
+                ck->lblk = 0;
+            }
+        } else {
+            if (ck->pos >= ck->total) {
+                fsck_summary(ck, ck->unmarked, " blocks in use but marked free\n");
+                fsck_summary(ck, ck->leaked, " blocks marked used but unreferenced\n");
+                fsck_summary(ck, ck->bad_refs, " wrong block reference counts\n");
+                ck->phase = WEXFS_FSCK_DONE;
+                break;
+            }
+            budget--;
+            fsck_check_block(ck, ck->pos++);
+        }
+    }
+
+    if (ck->flags & WEXFS_FSCK_REPAIR) {
+        op_done();
+        ck->generation = wexfs_generation;
+    }
+    return ck->phase == WEXFS_FSCK_DONE;
+}
+
+/* ---------- Defragmentation ---------- */
+
+/* A file is moved by copying its blocks to a free run while it stays in
+ * use, then pointing the inode at the copy and freeing the old blocks in
+ * one transaction. Until it commits the run is unreferenced on disk, so
+ * a crash loses nothing but the copy. The inode sector is the first
+ * write; old blocks whose bitmap sectors do not fit the same journal
+ * record are freed in the next one, where a crash only leaks them. */
+
+#define DEFRAG_PTR 0xF0000000   /* old[] mark of a pointer block; data
+                                   pointers never carry 15 sectors */
+
+static int defrag_push(WexDefrag* df, u32 ptr) {
+    u32 blk = WEXFS_PTR_BLOCK(ptr);
+    if (blk == 0 || blk >= wexfs_sb.total_blocks) return 0;
+    if ((ptr & DEFRAG_PTR) != DEFRAG_PTR && block_shared(blk)) return 0;
+    if (df->count == df->cap) {
+        u32 cap = df->cap ? df->cap * 2 : 64;
+        u32* grown = (u32*)krealloc(df->old, cap * sizeof(u32));
+        if (!grown) return 0;
+        df->old = grown;
+        df->cap = cap;
+    }
+    df->old[df->count++] = ptr;
+    return 1;
+}
+
+static int defrag_collect_ptrs(WexDefrag* df, u32 blk, int depth, u32* budget) {
+    u32* ptrs = depth ? ptrbuf2 : ptrbuf;
+    if (*budget) (*budget)--;
+    if (blk >= wexfs_sb.total_blocks) return 0;
+    blk_read(blk, ptrs);
+    if (!csum_ok(blk, ptrs, WEXFS_BLOCK_SIZE) || !defrag_push(df, blk | DEFRAG_PTR)) return 0;
+    for (u32 i = 0; i < WEXFS_PTRS_PER_BLOCK; i++) {
+        if (!ptrs[i]) continue;
+        if (depth) {
+            if (!defrag_collect_ptrs(df, ptrs[i], 0, budget)) return 0;
+        } else if (!defrag_push(df, ptrs[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* List the blocks of `node` in the order a sequential read visits them:
+ * direct blocks, then each pointer block followed by what it points to.
+ * Returns 0 for a file that cannot move (shared or damaged blocks). */
+static int defrag_collect(WexDefrag* df, FSNode* node, u32* budget) {
+    df->count = 0;
+    for (u32 i = 0; i < WEXFS_NDIRECT; i++) {
+        if (node->di.blocks[i] && !defrag_push(df, node->di.blocks[i])) return 0;
+    }
+    if (node->di.blocks[WEXFS_IND] && !defrag_collect_ptrs(df, node->di.blocks[WEXFS_IND], 0, budget)) {
+        return 0;
+    }
+    if (node->di.blocks[WEXFS_DIND] && !defrag_collect_ptrs(df, node->di.blocks[WEXFS_DIND], 1, budget)) {
+        return 0;
+    }
+    return 1;
+}
+
+static int defrag_contiguous(WexDefrag* df) {
+    for (u32 k = 1; k < df->count; k++) {
+        if (WEXFS_PTR_BLOCK(df->old[k]) != WEXFS_PTR_BLOCK(df->old[k - 1]) + 1) return 0;
+    }
+    return 1;
+}
+
+/* Give back the run of a copy that will not be committed. */
+static void defrag_drop(WexDefrag* df) {
+    if (!df->run) return;
+    for (u32 k = 0; k < df->count; k++) wexfs_free_block(df->run + k);
+    df->run = 0;
+    op_done();
+}
+
+/* Copy data block k of the list to its place in the run, as stored:
+ * compressed blocks keep their sectors and checksum. Pointer blocks are
+ * written by defrag_relink once every target is known. */
+static int defrag_copy(WexDefrag* df, u32 k) {
+    u32 ptr = df->old[k];
+    if ((ptr & DEFRAG_PTR) == DEFRAG_PTR) return 1;
+    u32 from = WEXFS_PTR_BLOCK(ptr);
+    u32 sectors = WEXFS_PTR_SECTORS(ptr);
+    u32 n = sectors ? sectors : WEXFS_SECTORS_PER_BLOCK;
+    ata_read_sectors(blk_lba(from), n, df->buf);
+    if (!csum_ok(from, df->buf, n * SECTOR_SIZE)) return 0;
+    if (sectors) blk_write_packed(df->run + k, df->buf, sectors);
+    else blk_write(df->run + k, df->buf);
+    return 1;
+}
+
+/* Write the copy of pointer block `blk` at run position *k; its entries
+ * take the positions that follow, in the order defrag_collect listed. */
+static u32 defrag_relink(WexDefrag* df, u32 blk, int depth, u32* k) {
+    u32* ptrs = depth ? ptrbuf2 : ptrbuf;
+    u32 self = df->run + (*k)++;
+    blk_read(blk, ptrs);
+    for (u32 i = 0; i < WEXFS_PTRS_PER_BLOCK; i++) {
+        if (!ptrs[i]) continue;
+        if (depth) ptrs[i] = defrag_relink(df, ptrs[i], 0, k);
+        else ptrs[i] = (df->run + (*k)++) | (WEXFS_PTR_SECTORS(ptrs[i]) << 28);
+    }
+    blk_write(self, ptrs);
+    return self;
+}
+
+static int defrag_commit(WexDefrag* df, FSNode* node) {
+    u32 blocks[WEXFS_NBLOCKS];
+    u32 k = 0;
+    for (u32 i = 0; i < WEXFS_NDIRECT; i++) {
+        u32 ptr = node->di.blocks[i];
+        blocks[i] = ptr ? (df->run + k++) | (WEXFS_PTR_SECTORS(ptr) << 28) : 0;
+    }
+    blocks[WEXFS_IND] = node->di.blocks[WEXFS_IND] ? defrag_relink(df, node->di.blocks[WEXFS_IND], 0, &k) : 0;
+    blocks[WEXFS_DIND] = node->di.blocks[WEXFS_DIND] ? defrag_relink(df, node->di.blocks[WEXFS_DIND], 1, &k) : 0;
+
+    // Checksums of the copy go out before anything points at it
+    if (fs_csums) csums_sync();
+    if (wexfs_tx_begin() != WEXFS_OK) return 0;
+    memcpy(node->di.blocks, blocks, sizeof(blocks));
+    inode_dirty(node->ino);
+    for (k = 0; k < df->count; k++) wexfs_free_block(WEXFS_PTR_BLOCK(df->old[k]));
+    for (FSNode* child = node->children; child; child = child->next_sibling) {
+        child->dirent_block = bmap(node, child->dirent_lblk, 0);
+    }
+    df->run = 0;
+    op_done();
+    wexfs_tx_commit();
+    return 1;
+}
+
+/* Look at the file at df->pos; returns 1 when it needs moving and a run
+ * has been reserved for it. */
+static int defrag_start(WexDefrag* df, FSNode* node, u32* budget) {
+    df->objects++;
+    if (!defrag_collect(df, node, budget)) {
+        df->skipped++;
+        return 0;
+    }
+    if (df->count < 2 || defrag_contiguous(df)) return 0;
+    df->fragmented++;
+    if (df->flags & WEXFS_DEFRAG_ANALYZE) return 0;
+    df->run = wexfs_alloc_run(df->count);
+    if (!df->run) {
+        df->skipped++;
+        return 0;
+    }
+    df->copied = 0;
+    return 1;
+}
+
+/* Whether renumbering `node` fits one journal record: its children's
+ * inode sectors, plus the two slots, the parent's entry and its
+ * checksum sector */
+static int defrag_renumber_fits(FSNode* node) {
+    u32 seen[WEXFS_JOURNAL_MAX];
+    u32 count = 0;
+    for (FSNode* child = node->children; child; child = child->next_sibling) {
+        u32 sector = child->ino / WEXFS_INODES_PER_SECTOR;
+        u32 i = 0;
+        while (i < count && seen[i] != sector) i++;
+        if (i < count) continue;
+        if (count + 4 >= WEXFS_JOURNAL_MAX) return 0;
+        seen[count++] = sector;
+    }
+    return 1;
+}
+
+/* Give `node` the free inode slot `to`. The parent's entry, the inode
+ * table and, for a directory, the parent field of each child change in
+ * one journal record; defrag_renumber_fits must hold. A child's move to
+ * a new parent number is no change of its own, so it keeps its change
+ * number and the next backup does not copy it again. */
+static int defrag_renumber(FSNode* node, u32 to) {
+    if (wexfs_tx_begin() != WEXFS_OK) return 0;
+    u32 from = node->ino;
+    dir_block_read(node->dirent_block);
+    ((WexDirent*)(dirbuf + node->dirent_off))->ino = to;
+    blk_write_range(node->dirent_block, dirbuf, node->dirent_off, 4);
+
+    // Children are hashed under their parent's inode number
+    tri_update(node, 0);
+    for (FSNode* child = node->children; child; child = child->next_sibling) hash_remove(child);
+    fs_nodes[from] = NULL;
+    fs_nodes[to] = node;
+    node->ino = to;
+    node->parent->stamp = ++stamp_seq;
+    tri_update(node, 1);
+    for (FSNode* child = node->children; child; child = child->next_sibling) {
+        hash_insert(child);
+        child->di.parent = to;
+        inode_queue(child->ino);
+    }
+    inode_queue(from);
+    inode_dirty(to);
+    if (from < ino_hint) ino_hint = from;
+    op_done();
+    wexfs_tx_commit();
+    return 1;
+}
+
+/* Move the highest movable object into the lowest free slot below it;
+ * 0 once no object sits above a free slot. */
+static int defrag_inode_step(WexDefrag* df) {
+    if (df->pos >= fs_node_slots) df->pos = fs_node_slots - 1;
+    while (df->low < df->pos && fs_nodes[df->low]) df->low++;
+    while (df->pos > df->low) {
+        FSNode* node = fs_nodes[df->pos];
+        if (node && node->parent && node->ino != wexfs_sb.root_ino &&
+            (!node->is_dir || ((df->flags & WEXFS_DEFRAG_OFFLINE) && defrag_renumber_fits(node)))) break;
+        df->pos--;
+    }
+    if (df->pos <= df->low) return 0;
+    if (!defrag_renumber(fs_nodes[df->pos], df->low)) return 0;
+    df->renumbered++;
+    return 1;
+}
+
+/* Lower the inode high-water mark to the last live inode and release
+ * the itable blocks above it. */
+static void defrag_itable_trim(WexDefrag* df) {
+    u32 top = WEXFS_ROOT_INO;
+    for (u32 i = fs_node_slots; i-- > 0; ) {
+        if (fs_nodes[i]) {
+            top = i;
+            break;
+        }
+    }
+    u32 hwm = (top / WEXFS_INODES_PER_BLOCK + 1) * WEXFS_INODES_PER_BLOCK;
+    if (hwm > wexfs_sb.inode_hwm) hwm = wexfs_sb.inode_hwm;
+    if (wexfs_tx_begin() != WEXFS_OK) return;
+    wexfs_sb.inode_hwm = hwm;
+
+    u32 base = wexfs_sb.inode_capacity;
+    while (wexfs_sb.extent_count) {
+        WexExtent* last = &wexfs_sb.itable[wexfs_sb.extent_count - 1];
+        base -= last->count * WEXFS_INODES_PER_BLOCK;
+        u32 keep = hwm > base ? (hwm - base) / WEXFS_INODES_PER_BLOCK : 0;
+        if (wexfs_sb.extent_count == 1 && keep < WEXFS_MIN_ITABLE_BLOCKS) keep = WEXFS_MIN_ITABLE_BLOCKS;
+        if (keep >= last->count) break;
+        for (u32 b = last->start + keep; b < last->start + last->count; b++) wexfs_free_block(b);
+        df->freed += last->count - keep;
+        wexfs_sb.inode_capacity -= (last->count - keep) * WEXFS_INODES_PER_BLOCK;
+        last->count = keep;
+        if (keep) break;
+        wexfs_sb.extent_count--;
+    }
+    super_sync();
+    op_done();
+    wexfs_tx_commit();
+}
+
+int wexfs_defrag_begin(WexDefrag* df, u32 flags) {
+    memset(df, 0, sizeof(WexDefrag));
+    df->flags = flags;
+    df->buf = (u8*)kmalloc(WEXFS_BLOCK_SIZE);
+    if (!df->buf) return WEXFS_ENOMEM;
+    if (flags & WEXFS_DEFRAG_ANALYZE) {
+        df->phase = WEXFS_DEFRAG_FILES;
+    } else {
+        df->phase = WEXFS_DEFRAG_INODES;
+        df->pos = fs_node_slots ? fs_node_slots - 1 : 0;
+    }
+    df->low = WEXFS_ROOT_INO;
+    return WEXFS_OK;
+}
+
+void wexfs_defrag_end(WexDefrag* df) {
+    defrag_drop(df);
+    kfree(df->old);
+    kfree(df->buf);
+    df->old = NULL;
+    df->buf = NULL;
+    df->cap = 0;
+    df->count = 0;
+}
+
+u32 wexfs_defrag_progress(const WexDefrag* df) {
+    if (df->phase == WEXFS_DEFRAG_DONE) return 100;
+    if (df->phase == WEXFS_DEFRAG_INODES || !fs_node_slots) return 0;
+    return df->pos * 100 / fs_node_slots;
+}
+
+/* Run for about `budget` units: one per object looked at, pointer
+ * block read or block copied. Returns 1 when done, 0 when more steps
+ * are needed. */
+int wexfs_defrag_step(WexDefrag* df, u32 budget) {
+    if (!df->buf) return WEXFS_EINVAL;
+    if (df->run && df->generation != wexfs_generation) {
+        // The file may have changed under the copy
+        defrag_drop(df);
+        df->restarts++;
+        df->retry = 1;
+    }
+
+    while (budget && df->phase != WEXFS_DEFRAG_DONE) {
+        if (df->phase == WEXFS_DEFRAG_INODES) {
+            budget--;
+            if (!defrag_inode_step(df)) {
+                defrag_itable_trim(df);
+                df->phase = WEXFS_DEFRAG_FILES;
+                df->pos = 0;
+            }
+            continue;
+        }
+        if (df->pos >= fs_node_slots) {
+            df->phase = WEXFS_DEFRAG_DONE;
+            break;
+        }
+
+        FSNode* node = fs_nodes[df->pos];
+        if (!df->run) {
+            budget--;
+            if (!node || (node->di.flags & WEXFS_INODE_INLINE) || !defrag_start(df, node, &budget)) {
+                df->pos++;
+                df->retry = 0;
+                continue;
+            }
+        }
+
+        // A file that already started over is finished in this step
+        while (df->copied < df->count && (budget || df->retry)) {
+            if (!defrag_copy(df, df->copied)) {
+                defrag_drop(df);
+                df->skipped++;
+                break;
+            }
+            df->copied++;
+            if (budget) budget--;
+        }
+        if (df->run && df->copied < df->count) break;
+        if (df->run) {
+            if (defrag_commit(df, node)) {
+                df->moved++;
+                df->blocks += df->count;
+            } else {
+                defrag_drop(df);
+                df->skipped++;
+            }
+        }
+        df->pos++;
+        df->retry = 0;
+    }
+
+    df->generation = wexfs_generation;
+    return df->phase == WEXFS_DEFRAG_DONE;
+}
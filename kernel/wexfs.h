@@ -0,0 +1,482 @@
+#ifndef WEXOS_WEXFS_H
+#define WEXOS_WEXFS_H
+
+typedef unsigned int u32;
+typedef unsigned short u16;
+typedef unsigned char u8;
+
+#ifndef NULL
+#define NULL ((void*)0)
+#endif
+#ifndef MAX_NAME
+#define MAX_NAME 256
+#endif
+#ifndef MAX_PATH
+#define MAX_PATH 1024
+#endif
+#ifndef SECTOR_SIZE
+#define SECTOR_SIZE 512
+#endif
+#ifndef FS_SECTOR_START
+#define FS_SECTOR_START 1
+#endif
+
+/*
+ * WexFS v2 on-disk layout (block = 4 KB, block 0 starts at FS_SECTOR_START):
+ *
+ *   block 0            superblock
+ *   block 1..          free-block bitmap (1 bit per block)
+ *   journal            WEXFS_JOURNAL_BLOCKS blocks: commit header sector
+ *                      followed by the sectors of one pending update
+ *   refcounts          one byte per block: extra owners of a shared data
+ *                      block (0 = owned by a single file)
+ *   checksums          CRC32C per block of file, directory and pointer
+ *                      blocks (0 = not recorded)
+ *   itable extents     inode table, grown on demand; extents are listed
+ *                      in the superblock and allocated from the bitmap
+ *   snapshot table     one block of WexSnapshot records, made with the
+ *                      first snapshot
+ *   everything else    file data, directory blocks, indirect blocks
+ *
+ * Directories are ordinary files holding variable-length WexDirent
+ * records, so an object costs one 128-byte inode plus its name.
+ */
+#define WEXFS_MAGIC 0x32584557          /* "WEX2" */
+#define WEXFS_VERSION 2
+#define WEXFS_BLOCK_SIZE 4096
+#define WEXFS_SECTORS_PER_BLOCK (WEXFS_BLOCK_SIZE / SECTOR_SIZE)
+#define WEXFS_INODE_SIZE 128
+#define WEXFS_INODES_PER_BLOCK (WEXFS_BLOCK_SIZE / WEXFS_INODE_SIZE)
+#define WEXFS_INODES_PER_SECTOR (SECTOR_SIZE / WEXFS_INODE_SIZE)
+#define WEXFS_PTRS_PER_BLOCK (WEXFS_BLOCK_SIZE / 4)
+#define WEXFS_NDIRECT 12
+#define WEXFS_IND WEXFS_NDIRECT
+#define WEXFS_DIND (WEXFS_NDIRECT + 1)
+#define WEXFS_NBLOCKS (WEXFS_NDIRECT + 2)
+#define WEXFS_MAX_EXTENTS 32
+#define WEXFS_ROOT_INO 1
+#define WEXFS_MIN_ITABLE_BLOCKS 4
+#define WEXFS_DEFAULT_BLOCKS 16384      /* 64 MB when IDENTIFY fails */
+#define WEXFS_MAX_BLOCKS (1u << 20)     /* 4 GB */
+#define WEXFS_JOURNAL_MAGIC 0x4C4E524A  /* "JRNL" */
+#define WEXFS_JOURNAL_BLOCKS 16
+#define WEXFS_JOURNAL_MAX 120           /* sectors per journal record */
+#define WEXFS_APPEND_RECORD 16384       /* append bytes per record, well inside one */
+#define WEXFS_REF_MAX 255               /* saturated blocks are copied instead */
+#define WEXFS_DEDUP_SLOTS 8192          /* in-memory content hash index */
+#define WEXFS_MAX_OPEN 32               /* open file handles */
+#define WEXFS_MAP_SLOTS 8               /* blocks that can be mapped at once */
+#define WEXFS_READ_RUN 16               /* blocks per multi-sector read */
+
+/* Files up to this size keep their data in the inode itself */
+#define WEXFS_INLINE_MAX 96
+
+/* Inode flags */
+#define WEXFS_INODE_INLINE 0x0001
+#define WEXFS_INODE_COMPRESS 0x0002     /* new blocks are LZ compressed; on a
+                                           directory, inherited by new entries */
+#define WEXFS_INODE_LOG 0x0004          /* size-capped log, see wexfs_set_log */
+
+/* Data block pointers of compressed blocks carry the number of sectors
+ * the compressed block occupies in their top bits (0 = plain block). */
+#define WEXFS_PTR_BLOCK(p) ((p) & 0x0FFFFFFF)
+#define WEXFS_PTR_SECTORS(p) ((p) >> 28)
+
+/* Superblock feature flags */
+#define WEXFS_FEAT_DEDUP 0x0001         /* share identical blocks on write */
+
+#define WEXFS_FREE 0
+#define WEXFS_FILE 1
+#define WEXFS_DIR  2
+
+/* Error codes returned by the wexfs_* API */
+#define WEXFS_OK            0
+#define WEXFS_ENOENT       -1
+#define WEXFS_EEXIST       -2
+#define WEXFS_ENOSPC       -3
+#define WEXFS_ENOTDIR      -4
+#define WEXFS_EISDIR       -5
+#define WEXFS_ENAMETOOLONG -6
+#define WEXFS_EINVAL       -7
+#define WEXFS_ENOMEM       -8
+#define WEXFS_EFBIG        -9
+#define WEXFS_EIO         -10
+#define WEXFS_EBADF       -11
+
+typedef struct {
+    u32 start;
+    u32 count;
+} WexExtent;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 block_size;
+    u32 total_blocks;
+    u32 bitmap_start;
+    u32 bitmap_blocks;
+    u32 inode_capacity;     /* slots in all itable extents */
+    u32 inode_hwm;          /* no slot at or above this is in use */
+    u32 root_ino;
+    u32 extent_count;
+    WexExtent itable[WEXFS_MAX_EXTENTS];
+    u32 journal_start;
+    u32 journal_blocks;     /* 0 on volumes made before the journal */
+    u32 refcount_start;
+    u32 refcount_blocks;    /* 0 on volumes made before shared blocks */
+    u32 features;           /* WEXFS_FEAT_* */
+    u32 csum_start;
+    u32 csum_blocks;        /* 0 on volumes made before checksums */
+    u32 snap_block;         /* WexSnapshot table, 0 until the first snapshot */
+    u32 change;             /* last change number given to an inode */
+    u32 frozen;             /* numbers up to here may be held by a snapshot or backup */
+    u32 backup_mark;        /* counter when the last backup was committed */
+    u32 volume_id;          /* made at format, never 0; 0 on older volumes */
+    u32 reserved[42];
+} WexSuper;                 /* exactly one sector */
+
+typedef struct {
+    u32 magic;              /* WEXFS_JOURNAL_MAGIC while a record is live */
+    u32 sequence;
+    u32 count;
+    u32 checksum;           /* over sequence, count, lba[] and the data */
+    u32 lba[WEXFS_JOURNAL_MAX];
+    u32 reserved[4];
+} WexJournalHeader;         /* exactly one sector */
+
+typedef struct {
+    u16 mode;
+    u16 flags;              /* WEXFS_INODE_* */
+    u32 size;
+    u32 parent;
+    u32 nlink;
+    union {
+        u32 blocks[WEXFS_NBLOCKS];
+        u8 inline_data[WEXFS_INLINE_MAX];   /* with WEXFS_INODE_INLINE */
+    };
+    u32 log_max;            /* WEXFS_INODE_LOG: rotate before passing this */
+    u32 log_keep;           /* WEXFS_INODE_LOG: rotated generations kept */
+    u32 change;             /* volume change number of its last update */
+    u32 csum;               /* CRC32C of the inode with this field zero */
+} WexInode;
+
+typedef struct {
+    u32 ino;
+    u16 rec_len;
+    u8 name_len;
+    u8 type;
+    char name[];
+} WexDirent;
+
+#define WEXFS_DIRENT_SIZE(len) ((8 + (len) + 3) & ~3)
+
+/* In-memory object: the on-disk inode plus its place in the tree. */
+typedef struct FSNode {
+    u32 ino;
+    WexInode di;
+    char* name;
+    struct FSNode* parent;
+    struct FSNode* children;
+    struct FSNode* next_sibling;
+    struct FSNode* prev_sibling;
+    struct FSNode* hash_next;
+    u32 dirent_block;       /* physical block holding our entry */
+    u32 dirent_off;
+    u32 dirent_lblk;
+    u32 dir_hint;           /* dirs: logical block to try for new entries */
+    struct FSNode* last_child;
+    u32 child_count;
+    int is_dir;
+    unsigned long long tree_bytes;  /* dirs: total size of the files below */
+    u32 tree_files;                 /* dirs: number of files below */
+    int unsorted;                   /* dirs: children not in name order */
+    u32 stamp;                      /* dirs: new value whenever an entry is added,
+                                       removed or renumbered; never reused */
+} FSNode;
+
+/* Volume state shared with the shell commands */
+extern WexSuper wexfs_sb;
+extern FSNode** fs_nodes;        /* indexed by inode number */
+extern u32 fs_node_slots;
+extern int fs_count;             /* live objects, root included */
+extern u32 wexfs_free_blocks;
+extern u32 wexfs_csum_errors;    /* checksum mismatches seen since boot */
+extern u32 wexfs_generation;     /* bumped by every change to the volume */
+extern u32 wexfs_volume;         /* bumped whenever the in-memory tree is rebuilt */
+
+/* Provided by the core library (ata.c, klib.c; tools/host.c on the
+ * host), except prints, which each boot image has for its own screen */
+void ata_read_sector(u32 lba, u8* buffer);
+void ata_read_sectors(u32 lba, u32 count, u8* buffer);     /* count <= 256, one command */
+void ata_write_sector(u32 lba, u8* buffer);
+u32 ata_identify(void);
+void memcpy(void* dst, void* src, int len);
+void memset(void* ptr, int value, int num);
+int strcmp(const char* a, const char* b);
+int strlen(const char* s);
+void strcpy(char* dst, const char* src);
+void prints(const char* s);
+
+/* Volume. wexfs_mount formats a blank disk (first block all zeros) and
+ * converts a v1 one; any other disk it cannot use is left as it is, with
+ * WEXFS_EINVAL for no superblock and WEXFS_EIO for no root directory. */
+int wexfs_mount(void);
+int wexfs_format(u32 total_blocks);
+FSNode* wexfs_root(void);
+const char* wexfs_strerror(int err);
+
+/* Names and paths */
+FSNode* wexfs_lookup_child(FSNode* dir, const char* name, int len);
+FSNode* wexfs_lookup_at(FSNode* base, const char* path);
+FSNode* wexfs_lookup(const char* path);
+FSNode* wexfs_lookup_parent(FSNode* base, const char* path, char* leaf);
+int wexfs_path(FSNode* node, char* buf, int max);
+
+/* Name search over every object on the volume. A pattern with * or ?
+ * is a glob over the whole name, anything else a substring of it.
+ * Names are indexed by trigram, so a pattern with three literal
+ * characters in a row only checks the objects that share its rarest
+ * trigram. Fills up to `max` objects and returns how many matched. */
+#define WEXFS_FIND_SCAN 0x0001          /* skip the index, check every name */
+
+int wexfs_find(const char* pattern, u32 flags, FSNode** out, u32 max);
+int wexfs_glob_match(const char* pattern, const char* name);
+
+/* Objects */
+FSNode* wexfs_create(FSNode* dir, const char* name, int type, int* err);
+FSNode* wexfs_create_path(FSNode* base, const char* path, int type, int* err);
+int wexfs_remove(FSNode* node);
+int wexfs_rename(FSNode* node, FSNode* new_dir, const char* new_name);
+int wexfs_read(FSNode* node, u32 offset, void* buf, u32 len);
+int wexfs_write(FSNode* node, u32 offset, const void* buf, u32 len);
+int wexfs_truncate(FSNode* node, u32 size);
+int wexfs_write_file(FSNode* node, const void* buf, u32 len);
+
+/* Directory iteration. Entries come in creation order, or with
+ * WEXFS_DIR_SORTED in strcmp order: the child list is sorted once and
+ * stays sorted while new names arrive in order. The cursor remembers the
+ * last entry returned, so a listing can stop after a page and continue
+ * later (wexfs_seekdir, or simply the next wexfs_readdir) at O(page)
+ * cost, even if the volume changed in between. */
+#define WEXFS_DIR_SORTED 0x0001
+
+typedef struct {
+    FSNode* dir;
+    u32 ino;                /* of dir, to notice it was removed */
+    FSNode* next;           /* returned by the next readdir */
+    u32 flags;
+    u32 generation;         /* volume generation `next` belongs to */
+    char last[MAX_NAME];    /* name of the entry returned last */
+} WexDir;
+
+int wexfs_opendir(FSNode* dir, u32 flags, WexDir* d);
+FSNode* wexfs_readdir(WexDir* d);               /* NULL after the last */
+void wexfs_seekdir(WexDir* d, const char* after);
+
+/* Log files. An append is one journal record holding the touched tail
+ * sectors and the inode with its new size, so a crash keeps either the
+ * old end of the file or the whole new line; a longer one than
+ * WEXFS_APPEND_RECORD bytes goes in one record per such piece. A file marked as a log is
+ * rotated before an append would take it past max_size: its data moves
+ * to name.1 (older generations shift up to name.<keep>) without being
+ * copied, and the log itself keeps its inode and open handles. Inside a
+ * caller's transaction the append joins it, but a rotation cannot:
+ * WEXFS_EINVAL then, with nothing changed. */
+int wexfs_append(FSNode* node, const void* buf, u32 len);
+int wexfs_set_log(FSNode* node, u32 max_size, u32 keep);
+
+/* File handles: a resolved file plus a position, so repeated reads and
+ * writes skip the path lookup and move only the bytes asked for. A
+ * handle to a file that gets removed fails with WEXFS_EBADF. */
+#define WEXFS_O_READ   0x01
+#define WEXFS_O_WRITE  0x02
+#define WEXFS_O_RDWR   (WEXFS_O_READ | WEXFS_O_WRITE)
+#define WEXFS_O_CREATE 0x04     /* make the file and missing parents */
+#define WEXFS_O_TRUNC  0x08
+#define WEXFS_O_APPEND 0x10     /* every write goes through wexfs_append */
+
+#define WEXFS_SEEK_SET 0
+#define WEXFS_SEEK_CUR 1
+#define WEXFS_SEEK_END 2
+
+int wexfs_open(FSNode* base, const char* path, u32 flags);     /* fd or error */
+int wexfs_fread(int fd, void* buf, u32 len);
+int wexfs_fwrite(int fd, const void* buf, u32 len);
+int wexfs_seek(int fd, int offset, int whence);                /* new offset */
+int wexfs_ftruncate(int fd, u32 size);
+FSNode* wexfs_fnode(int fd);
+int wexfs_close(int fd);
+
+/* Mapped access: a pointer straight into the block cache, valid until
+ * wexfs_unmap. Returns how many bytes at *out belong to the file (a
+ * mapping never crosses a 4 KB block), 0 at the end of the file, or an
+ * error. Shared mappings are read-only and keep the contents they had
+ * when mapped; WEXFS_MAP_PRIVATE gives a copy the caller may change
+ * without touching the file. */
+#define WEXFS_MAP_READ    0x0
+#define WEXFS_MAP_PRIVATE 0x1
+
+int wexfs_map(int fd, u32 offset, u32 len, u32 flags, void** out);
+void wexfs_unmap(const void* ptr);
+
+/* Shared blocks: a clone points at the source's data blocks and each
+ * side gets a private copy of a block on its first write to it. */
+FSNode* wexfs_clone(FSNode* src, FSNode* dir, const char* name, int* err);
+void wexfs_set_dedup(int on);
+u32 wexfs_shared_blocks(void);
+
+/* Snapshots: a frozen copy of the whole tree under a name. Taking one
+ * copies the inode table, directory blocks and pointer blocks and adds
+ * an owner to every file data block, so the data itself is shared and
+ * the live side copies a block on its first write to it, as after a
+ * clone. Restoring swaps the live inode table with the snapshot's in one
+ * journal record and remounts; the tree it replaced stays behind as the
+ * snapshot "<name>~", so a restore can itself be undone. */
+#define WEXFS_SNAP_MAGIC 0x50414E53     /* "SNAP" */
+#define WEXFS_SNAP_NAME 32
+#define WEXFS_MAX_SNAPSHOTS (WEXFS_BLOCK_SIZE / SECTOR_SIZE)
+
+typedef struct {
+    u32 magic;              /* WEXFS_SNAP_MAGIC in a used slot */
+    u32 sequence;           /* order of creation */
+    char name[WEXFS_SNAP_NAME];
+    u32 objects;
+    u32 blocks;             /* taken when it was made: table, directories, pointers */
+    u32 inode_capacity;
+    u32 inode_hwm;
+    u32 root_ino;
+    u32 extent_count;
+    WexExtent itable[WEXFS_MAX_EXTENTS];
+    u32 reserved[48];
+} WexSnapshot;              /* exactly one sector */
+
+int wexfs_snapshot_create(const char* name);
+int wexfs_snapshot_restore(const char* name);
+int wexfs_snapshot_delete(const char* name);
+int wexfs_snapshot_list(WexSnapshot* out, u32 max);    /* oldest first; count */
+
+/* Change numbers. Every inode update takes the next number from the
+ * volume's counter, so an incremental backup (kernel/backup.c) only
+ * copies objects whose number is not the one in its last catalog. A
+ * file overwritten in place takes a new number only when its old one may
+ * already name other contents elsewhere: at or below `frozen`, which a
+ * snapshot raises to the counter and a backup in progress to
+ * WEXFS_CHANGE_ALL. wexfs_backup_mark stores both marks. */
+#define WEXFS_CHANGE_ALL 0xFFFFFFFF
+
+void wexfs_backup_mark(u32 backup_mark, u32 frozen);
+
+/* The id that tells this volume from others with the same counters,
+ * such as copies of one mkwexfs image; a volume formatted before ids
+ * gets one here */
+u32 wexfs_volume_id(void);
+
+/* Compression attribute; existing blocks are converted as they are rewritten */
+int wexfs_set_compress(FSNode* node, int on);
+
+/* Consistency check, run in bounded steps so it can share the CPU:
+ *
+ *   tree     names (through the name hash), parent links, entry counts,
+ *            orphans
+ *   blocks   every block pointer is range checked and claimed in an
+ *            ownership map; each block is read once and its checksum
+ *            verified
+ *   space    the ownership map against the bitmap and refcount table
+ *
+ * With WEXFS_FSCK_REPAIR problems are fixed as they are found: duplicate
+ * names get a ~ino suffix, orphans move to /lost+found, bad pointers are
+ * cleared and the bitmap and refcounts are rewritten from the map.
+ * Snapshot trees are walked after the live one; their blocks count as
+ * owners but problems in them are only reported. */
+#define WEXFS_FSCK_REPAIR  0x0001
+#define WEXFS_FSCK_VERBOSE 0x0002      /* print each problem */
+
+#define WEXFS_FSCK_TREE   0
+#define WEXFS_FSCK_BLOCKS 1
+#define WEXFS_FSCK_SPACE  2
+#define WEXFS_FSCK_DONE   3
+
+typedef struct {
+    u32 flags;
+    u32 phase;
+    u32 pos;                /* inode or block the phase continues at */
+    u32 lblk;               /* position inside the object being walked */
+    u32 snap;               /* blocks: 1 + slot of the snapshot walked, 0 = live tree */
+    u32 generation;         /* volume generation the results belong to */
+    u32 total;
+    u16* owners;            /* pointers found per block */
+    u8* buf;
+    u32 objects;
+    u32 blocks;             /* blocks read and verified */
+    u32 errors;
+    u32 warnings;
+    u32 repaired;
+    u32 restarts;           /* times a read-only check started over */
+    u32 unmarked;           /* in use but free in the bitmap */
+    u32 leaked;             /* allocated but unreferenced */
+    u32 bad_refs;
+} WexFsck;
+
+int wexfs_fsck_begin(WexFsck* ck, u32 flags);
+int wexfs_fsck_step(WexFsck* ck, u32 budget);    /* 1 = done, 0 = more */
+void wexfs_fsck_end(WexFsck* ck);
+
+/* Defragmentation, in bounded steps like the check:
+ *
+ *   inodes   objects move down into the lowest free inode slots and
+ *            itable blocks left unused at the end are released, so the
+ *            table mount has to read shrinks to the live inodes
+ *   files    a fragmented file's data and pointer blocks are copied to
+ *            one free run, in the order a sequential read visits them,
+ *            and the inode switches over in one journal record
+ *
+ * Files sharing blocks with a clone stay where they are. The copy of a
+ * large file may span several steps; if the volume changes in between,
+ * that file starts over. Online, only files are renumbered, since an
+ * open directory listing remembers its directory's inode; offline, a
+ * directory whose children's inodes would not fit one journal record
+ * stays where it is. */
+#define WEXFS_DEFRAG_ANALYZE 0x0001    /* count fragmented files, move nothing */
+#define WEXFS_DEFRAG_OFFLINE 0x0002    /* nothing else uses the volume */
+
+#define WEXFS_DEFRAG_INODES 0
+#define WEXFS_DEFRAG_FILES  1
+#define WEXFS_DEFRAG_DONE   2
+
+typedef struct {
+    u32 flags;
+    u32 phase;
+    u32 pos;                /* inode the phase continues at */
+    u32 low;                /* inodes: no free slot below this */
+    u32 generation;         /* volume generation of the copy in progress */
+    u32* old;               /* file being moved: its blocks in read order */
+    u32 count;
+    u32 cap;
+    u32 run;                /* first block of its new place, 0 = none */
+    u32 copied;
+    int retry;              /* the file started over: finish it in one step */
+    u8* buf;
+    u32 objects;            /* files looked at */
+    u32 fragmented;
+    u32 moved;
+    u32 blocks;             /* blocks copied */
+    u32 skipped;            /* shared, damaged, or no run large enough */
+    u32 renumbered;
+    u32 freed;              /* itable blocks released */
+    u32 restarts;
+} WexDefrag;
+
+int wexfs_defrag_begin(WexDefrag* df, u32 flags);
+int wexfs_defrag_step(WexDefrag* df, u32 budget);  /* 1 = done, 0 = more */
+void wexfs_defrag_end(WexDefrag* df);
+u32 wexfs_defrag_progress(const WexDefrag* df);    /* percent */
+
+/* Journaled transactions: sector writes between begin and commit reach
+ * the disk all together or not at all, as long as they fit one journal
+ * record of WEXFS_JOURNAL_MAX sectors. Past that each record is whole but
+ * a crash may keep only the first ones, and the commit returns
+ * WEXFS_EFBIG; callers that cannot accept that split the work. */
+int wexfs_tx_begin(void);
+int wexfs_tx_commit(void);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * disk-replay - replay a disk I/O trace on simulated drives
+ *
+ *   disk-replay [-m model]... [-z] [-v] trace
+ *
+ * The trace comes from the kernel's iotrace command (copy it out of the
+ * disk image with wexfs-dump -x) or from wexfs-test -t. Every command is
+ * sent to each model in turn, one at a time like the kernel's driver
+ * does, with the time the system spent between commands in the trace
+ * kept as think time; -z drops it and sends the commands back to back.
+ * A flush at the end destages what is left in the write cache.
+ *
+ * One line per model, so policies can be compared side by side:
+ *
+ *   disk-replay -m hdd -m hdd,ra=0 -m hdd,destage=fifo -m hdd,cache=0 boot.trace
+ *
+ * Models are described in tools/disksim.h; the default is hdd. -v also
+ * prints each model's parameters and where its time went.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "disksim.h"
+
+#define MAX_MODELS 16
+
+static DiskTraceRecord* trace = NULL;
+static u32 trace_count = 0;
+
+static int load(const char* file) {
+    FILE* f = fopen(file, "r");
+    if (!f) {
+        fprintf(stderr, "disk-replay: cannot open %s\n", file);
+        return 0;
+    }
+    u32 cap = 0, lineno = 0;
+    DiskTraceRecord r;
+    int rc;
+    while ((rc = disksim_trace_read(f, &r, &lineno)) == 1) {
+        if (trace_count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            trace = (DiskTraceRecord*)realloc(trace, cap * sizeof(DiskTraceRecord));
+            if (!trace) {
+                fprintf(stderr, "disk-replay: out of memory\n");
+                fclose(f);
+                return 0;
+            }
+        }
+        trace[trace_count++] = r;
+    }
+    fclose(f);
+    if (rc < 0) {
+        fprintf(stderr, "disk-replay: %s:%u: not a trace line\n", file, lineno);
+        return 0;
+    }
+    return 1;
+}
+
+static void summary(const char* file) {
+    u32 reads = 0, writes = 0;
+    unsigned long long rsect = 0, wsect = 0;
+    double recorded = 0;
+    u32 end = 0;
+    for (u32 i = 0; i < trace_count; i++) {
+        DiskTraceRecord* r = &trace[i];
+        if (r->write) writes++, wsect += r->count;
+        else reads++, rsect += r->count;
+        recorded += r->length_us;
+        if (r->lba + r->count > end) end = r->lba + r->count;
+    }
+    double span = trace_count ? trace[trace_count - 1].start_us + trace[trace_count - 1].length_us - trace[0].start_us : 0;
+    printf("%s: %u commands over %.1f ms, %.1f ms of them in the disk\n", file, trace_count, span / 1000,
+           recorded / 1000);
+    printf("  %u reads, %llu KB; %u writes, %llu KB; highest LBA %u\n\n", reads, rsect / 2, writes, wsect / 2,
+           end ? end - 1 : 0);
+}
+
+static void replay(const DiskModel* m, int think, int verbose) {
+    u32 end = 0;
+    for (u32 i = 0; i < trace_count; i++) {
+        if (trace[i].lba + trace[i].count > end) end = trace[i].lba + trace[i].count;
+    }
+    DiskSim s;
+    disksim_init(&s, m, end);
+    double read_sum = 0, write_sum = 0;
+    for (u32 i = 0; i < trace_count; i++) {
+        double gap = 0;
+        if (think && i) gap = trace[i].start_us - (trace[i - 1].start_us + trace[i - 1].length_us);
+        double lat = disksim_command(&s, gap > 0 ? gap : 0, trace[i].write, trace[i].lba, trace[i].count);
+        if (trace[i].write) write_sum += lat;
+        else read_sum += lat;
+    }
+    double io = read_sum + write_sum;
+    disksim_flush(&s);
+
+    DiskSimStats* st = &s.st;
+    printf("%-24s %9.1f %9.1f %5.0f%% %7.0f %7.0f %7.0f %7.0f %6u %6u %6u %8.1f\n", m->name, s.now / 1000, io / 1000,
+           s.now > 0 ? st->busy_us * 100 / s.now : 0,
+           st->reads ? read_sum / st->reads : 0, disksim_percentile(&s, 0, 99),
+           st->writes ? write_sum / st->writes : 0, disksim_percentile(&s, 1, 99),
+           st->seeks, st->readahead_hits, st->cache_stalls, st->drain_us / 1000);
+    if (verbose) {
+        printf("  ");
+        disk_model_print(&s.m, stdout);
+        printf("  media: %.1f ms seeking (%llu sectors on average), %.1f ms rotating, %.1f ms transferring\n",
+               st->seek_us / 1000, st->seeks ? st->seek_sectors / st->seeks : 0, st->rotate_us / 1000,
+               st->transfer_us / 1000);
+        printf("  %u of %u writes went to the write cache\n\n", st->cached_writes, st->writes);
+    }
+    disksim_free(&s);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: disk-replay [-m model]... [-z] [-v] trace\n"
+                    "  -m model  <preset>[,key=value...], see tools/disksim.h; default hdd\n"
+                    "  -z        no think time, commands back to back\n"
+                    "  -v        model parameters and where the time went\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    DiskModel models[MAX_MODELS];
+    u32 model_count = 0;
+    int think = 1, verbose = 0;
+    const char* file = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            if (model_count == MAX_MODELS) usage();
+            const char* err = disk_model_parse(&models[model_count++], argv[++i]);
+            if (err) {
+                fprintf(stderr, "disk-replay: %s\n", err);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "-z") == 0) {
+            think = 0;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else if (argv[i][0] != '-' && !file) {
+            file = argv[i];
+        } else {
+            usage();
+        }
+    }
+    if (!file) usage();
+    if (!model_count) disk_model_parse(&models[model_count++], "hdd");
+    if (!load(file)) return 1;
+
+    summary(file);
+    printf("%-24s %9s %9s %6s %7s %7s %7s %7s %6s %6s %6s %8s\n", "model", "total ms", "io ms", "busy",
+           "read us", "p99", "write us", "p99", "seeks", "ra hit", "stalls", "flush ms");
+    for (u32 i = 0; i < model_count; i++) replay(&models[i], think, verbose);
+    free(trace);
+    return 0;
+}
@@ -0,0 +1,352 @@
+/* Simulated disk timing for the host tools, see disksim.h */
+#include <stdlib.h>
+#include <math.h>
+#include "disksim.h"
+
+/* The bus is PIO mode 4, what the kernel's ATA driver uses */
+static const DiskModel presets[] = {
+    /* name     size overhead seekmin seekmax  rpm  media  bus  cache  ra  elevator */
+    { "hdd",    0,   100,     800,    15000,  7200, 120,  16.6, 8192, 256, 1 },
+    { "laptop", 0,   150,     1500,   22000,  5400, 80,   16.6, 4096, 128, 1 },
+    { "ssd",    0,   60,      0,      0,      0,    250,  16.6, 0,    0,   0 },
+};
+
+/* ---------- Models ---------- */
+
+const char* disk_model_parse(DiskModel* m, const char* spec) {
+    static char bad[80];
+    char buf[128];
+    int len = strlen(spec);
+    if (len >= (int)sizeof(buf)) return "model too long";
+    strcpy(buf, spec);
+
+    char* part = buf;
+    char* next = strchr(part, ',');
+    if (next) *next++ = '\0';
+    u32 i;
+    for (i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+        if (strcmp(part, presets[i].name) == 0) break;
+    }
+    if (i == sizeof(presets) / sizeof(presets[0])) {
+        snprintf(bad, sizeof(bad), "unknown model '%s'", part);
+        return bad;
+    }
+    *m = presets[i];
+    // The name keeps the options, so a table of runs tells them apart
+    snprintf(m->name, sizeof(m->name), "%s", spec);
+
+    while ((part = next)) {
+        next = strchr(part, ',');
+        if (next) *next++ = '\0';
+        char* value = strchr(part, '=');
+        if (!value) {
+            snprintf(bad, sizeof(bad), "option '%s' has no value", part);
+            return bad;
+        }
+        *value++ = '\0';
+        char* end;
+        double v = strtod(value, &end);
+        int ok = *value && !*end && v >= 0;
+        if (strcmp(part, "size") == 0) {
+            unsigned long long bytes = host_parse_size(value);
+            m->sectors = (u32)(bytes / SECTOR_SIZE);
+            ok = bytes / SECTOR_SIZE > 0 && bytes / SECTOR_SIZE <= 0xFFFFFFFFull;
+        } else if (strcmp(part, "destage") == 0) {
+            ok = strcmp(value, "fifo") == 0 || strcmp(value, "elevator") == 0;
+            m->elevator = strcmp(value, "elevator") == 0;
+        } else if (!ok) {
+            // a number is wanted for the rest
+        } else if (strcmp(part, "overhead") == 0) {
+            m->overhead_us = v;
+        } else if (strcmp(part, "seekmin") == 0) {
+            m->seek_min_us = v;
+        } else if (strcmp(part, "seekmax") == 0) {
+            m->seek_max_us = v;
+        } else if (strcmp(part, "rpm") == 0) {
+            m->rpm = (u32)v;
+        } else if (strcmp(part, "media") == 0) {
+            m->media_mb_s = v;
+            ok = v > 0;
+        } else if (strcmp(part, "bus") == 0) {
+            m->bus_mb_s = v;
+            ok = v > 0;
+        } else if (strcmp(part, "cache") == 0) {
+            m->cache_sectors = (u32)v;
+        } else if (strcmp(part, "ra") == 0) {
+            m->readahead_sectors = (u32)v;
+        } else {
+            snprintf(bad, sizeof(bad), "unknown option '%s'", part);
+            return bad;
+        }
+        if (!ok) {
+            snprintf(bad, sizeof(bad), "bad value for %s: '%s'", part, value);
+            return bad;
+        }
+    }
+    if (m->seek_max_us < m->seek_min_us) m->seek_max_us = m->seek_min_us;
+    return 0;
+}
+
+void disk_model_print(const DiskModel* m, FILE* f) {
+    fprintf(f, "%s: ", m->name);
+    if (m->rpm) fprintf(f, "%u rpm, seek %.1f-%.1f ms, ", m->rpm, m->seek_min_us / 1000, m->seek_max_us / 1000);
+    else fprintf(f, "no seek, ");
+    fprintf(f, "media %.0f MB/s, bus %.1f MB/s, %.0f us/command", m->media_mb_s, m->bus_mb_s, m->overhead_us);
+    if (m->cache_sectors) {
+        fprintf(f, ", %u KB write cache (%s)", m->cache_sectors / 2, m->elevator ? "elevator" : "fifo");
+    } else {
+        fprintf(f, ", write through");
+    }
+    if (m->readahead_sectors) fprintf(f, ", %u KB read-ahead", m->readahead_sectors / 2);
+    fprintf(f, "\n");
+}
+
+/* ---------- Drive ---------- */
+
+void disksim_init(DiskSim* s, const DiskModel* m, u32 sectors) {
+    memset(s, 0, sizeof(*s));
+    s->m = *m;
+    if (!s->m.sectors) s->m.sectors = sectors ? sectors : 1;
+    s->sector_us = SECTOR_SIZE / s->m.media_mb_s;
+    if (s->m.rpm) {
+        s->period_us = 60e6 / s->m.rpm;
+        s->track_sectors = (u32)(s->period_us / s->sector_us);
+        if (!s->track_sectors) s->track_sectors = 1;
+    }
+}
+
+void disksim_free(DiskSim* s) {
+    free(s->dirty);
+    free(s->st.read_lat);
+    free(s->st.write_lat);
+    s->dirty = NULL;
+    s->st.read_lat = s->st.write_lat = NULL;
+}
+
+/* Seek, rotation and transfer of `count` sectors at `lba`, the head
+ * free from `t` on; when it is done */
+static double media_access(DiskSim* s, double t, u32 lba, u32 count) {
+    u32 dist = lba > s->head ? lba - s->head : s->head - lba;
+    double seek = 0;
+    if (dist && dist >= s->track_sectors && s->m.seek_max_us > 0) {
+        double frac = (double)dist / s->m.sectors;
+        seek = s->m.seek_min_us + (s->m.seek_max_us - s->m.seek_min_us) * sqrt(frac > 1 ? 1 : frac);
+        s->st.seeks++;
+        s->st.seek_sectors += dist;
+    }
+    double rotate = 0;
+    if (s->period_us > 0) {
+        // Sector `lba` passes under the head at multiples of the period
+        // from lba * sector_us, so consecutive sectors follow each other
+        double wait = fmod(lba * s->sector_us - (t + seek), s->period_us);
+        rotate = wait < 0 ? wait + s->period_us : wait;
+    }
+    double transfer = count * s->sector_us;
+    s->st.seek_us += seek;
+    s->st.rotate_us += rotate;
+    s->st.transfer_us += transfer;
+    s->st.busy_us += seek + rotate + transfer;
+    s->head = lba + count;
+    return t + seek + rotate + transfer;
+}
+
+/* Next write cache extent to destage: the oldest, or the first at or
+ * after the head, wrapping to the lowest (C-LOOK) */
+static u32 destage_pick(DiskSim* s) {
+    if (!s->m.elevator) return 0;
+    u32 ahead = s->dirty_count, lowest = 0;
+    for (u32 i = 0; i < s->dirty_count; i++) {
+        u32 lba = s->dirty[i].lba;
+        if (lba >= s->head && (ahead == s->dirty_count || lba < s->dirty[ahead].lba)) ahead = i;
+        if (lba < s->dirty[lowest].lba) lowest = i;
+    }
+    return ahead < s->dirty_count ? ahead : lowest;
+}
+
+static void destage_one(DiskSim* s) {
+    u32 i = destage_pick(s);
+    DiskExtent e = s->dirty[i];
+    s->media_free = media_access(s, s->media_free, e.lba, e.count);
+    for (s->dirty_count--; i < s->dirty_count; i++) s->dirty[i] = s->dirty[i + 1];
+    s->dirty_sectors -= e.count;
+}
+
+/* How far read-ahead has got by `t` */
+static u32 readahead_at(DiskSim* s, double t) {
+    if (s->ra_end >= s->ra_limit || t <= s->ra_time) return s->ra_end;
+    double n = (t - s->ra_time) / s->sector_us;
+    return n >= s->ra_limit - s->ra_end ? s->ra_limit : s->ra_end + (u32)n;
+}
+
+/* The drive had nothing to do until `t`: read-ahead goes on until it is
+ * complete or interrupted by the command arriving at `t`, then the write
+ * cache is destaged */
+static void idle_until(DiskSim* s, double t) {
+    if (s->ra_end < s->ra_limit) {
+        u32 pos = readahead_at(s, t);
+        double busy = (pos - s->ra_end) * s->sector_us;
+        s->st.busy_us += busy;
+        s->st.transfer_us += busy;
+        s->media_free = s->ra_time + busy;
+        s->head = pos;
+        s->ra_end = s->ra_limit = pos;
+    }
+    while (s->dirty_count && s->media_free < t) destage_one(s);
+}
+
+static void record(double** lat, u32* cap, u32 n, double v) {
+    if (n >= *cap) {
+        u32 grow = *cap ? *cap * 2 : 1024;
+        double* p = (double*)realloc(*lat, grow * sizeof(double));
+        if (!p) return;
+        *lat = p;
+        *cap = grow;
+    }
+    (*lat)[n] = v;
+}
+
+static double read_command(DiskSim* s, double arrive, u32 lba, u32 count) {
+    double start = arrive + s->m.overhead_us;
+    double bus = count * SECTOR_SIZE / s->m.bus_mb_s;
+
+    // Read-ahead has it or is still reading towards it: the drive keeps
+    // going and hands the data over as it comes
+    if (lba >= s->ra_start && lba + count <= s->ra_limit) {
+        double ready = s->ra_time;
+        if (lba + count > s->ra_end) ready += (lba + count - s->ra_end) * s->sector_us;
+        s->st.readahead_hits++;
+        if (s->ra_end < s->ra_limit) {
+            u32 limit = lba + count + s->m.readahead_sectors;
+            if (limit > s->ra_limit) s->ra_limit = limit;
+        }
+        return ready > start + bus ? ready : start + bus;
+    }
+
+    idle_until(s, arrive);
+    double t = start > s->media_free ? start : s->media_free;
+    double done = media_access(s, t, lba, count);
+    s->media_free = done;
+    // PIO: the host takes the data no faster than the bus allows
+    double transfer = count * s->sector_us;
+    if (bus > transfer) done += bus - transfer;
+
+    s->ra_start = lba;
+    s->ra_end = lba + count;
+    s->ra_limit = s->ra_end + s->m.readahead_sectors;
+    s->ra_time = s->media_free;
+    return done;
+}
+
+static double write_command(DiskSim* s, double arrive, u32 lba, u32 count) {
+    double start = arrive + s->m.overhead_us;
+    double bus = count * SECTOR_SIZE / s->m.bus_mb_s;
+    idle_until(s, arrive);
+    if (lba < s->ra_limit && lba + count > s->ra_start) s->ra_start = s->ra_end = s->ra_limit = 0;
+
+    if (!s->m.cache_sectors || count > s->m.cache_sectors) {
+        double t = start + bus > s->media_free ? start + bus : s->media_free;
+        s->media_free = media_access(s, t, lba, count);
+        return s->media_free;
+    }
+
+    s->st.cached_writes++;
+    // Rewriting what the cache holds costs nothing more on the media
+    for (u32 i = 0; i < s->dirty_count; i++) {
+        if (lba >= s->dirty[i].lba && lba + count <= s->dirty[i].lba + s->dirty[i].count) return start + bus;
+    }
+    double done = start + bus;
+    if (s->dirty_sectors + count > s->m.cache_sectors) {
+        s->st.cache_stalls++;
+        if (s->media_free < arrive) s->media_free = arrive;
+        while (s->dirty_sectors + count > s->m.cache_sectors) destage_one(s);
+        if (s->media_free > done) done = s->media_free;
+    }
+    DiskExtent* last = s->dirty_count ? &s->dirty[s->dirty_count - 1] : NULL;
+    if (last && last->lba + last->count == lba) {
+        last->count += count;
+    } else {
+        if (s->dirty_count == s->dirty_cap) {
+            u32 grow = s->dirty_cap ? s->dirty_cap * 2 : 256;
+            DiskExtent* p = (DiskExtent*)realloc(s->dirty, grow * sizeof(DiskExtent));
+            if (!p) return done;
+            s->dirty = p;
+            s->dirty_cap = grow;
+        }
+        s->dirty[s->dirty_count].lba = lba;
+        s->dirty[s->dirty_count].count = count;
+        s->dirty_count++;
+    }
+    s->dirty_sectors += count;
+    return done;
+}
+
+double disksim_command(DiskSim* s, double think_us, int write, u32 lba, u32 count) {
+    double arrive = s->now + think_us;
+    double done;
+    s->st.commands++;
+    if (write) {
+        done = write_command(s, arrive, lba, count);
+        record(&s->st.write_lat, &s->st.write_cap, s->st.writes, done - arrive);
+        s->st.writes++;
+        s->st.sectors_written += count;
+    } else {
+        done = read_command(s, arrive, lba, count);
+        record(&s->st.read_lat, &s->st.read_cap, s->st.reads, done - arrive);
+        s->st.reads++;
+        s->st.sectors_read += count;
+    }
+    s->now = done;
+    return done - arrive;
+}
+
+double disksim_flush(DiskSim* s) {
+    idle_until(s, s->now);
+    if (s->media_free < s->now) s->media_free = s->now;
+    while (s->dirty_count) destage_one(s);
+    double drain = s->media_free - s->now;
+    s->st.drain_us += drain;
+    s->now = s->media_free;
+    return drain;
+}
+
+static int lat_cmp(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+double disksim_percentile(DiskSim* s, int write, double p) {
+    double* lat = write ? s->st.write_lat : s->st.read_lat;
+    u32 n = write ? s->st.writes : s->st.reads;
+    if (!n || !lat) return 0;
+    qsort(lat, n, sizeof(double), lat_cmp);
+    u32 i = (u32)(p / 100 * (n - 1) + 0.5);
+    return lat[i < n ? i : n - 1];
+}
+
+/* ---------- Traces ---------- */
+
+int disksim_trace_read(FILE* f, DiskTraceRecord* r, u32* lineno) {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        (*lineno)++;
+        char* p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || !*p) continue;
+        char op;
+        if (sscanf(p, "%lf %lf %c %u %u", &r->start_us, &r->length_us, &op, &r->lba, &r->count) != 5 ||
+            (op != 'R' && op != 'W') || !r->count) {
+            return -1;
+        }
+        r->write = op == 'W';
+        return 1;
+    }
+    return 0;
+}
+
+void disksim_trace_header(FILE* f) {
+    fprintf(f, "# wexos-iotrace 1\n# start_us length_us op lba sectors\n");
+}
+
+void disksim_trace_write(FILE* f, const DiskTraceRecord* r) {
+    fprintf(f, "%.0f %.0f %c %u %u\n", r->start_us, r->length_us, r->write ? 'W' : 'R', r->lba, r->count);
+}
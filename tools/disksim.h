@@ -0,0 +1,121 @@
+#ifndef WEXOS_TOOLS_DISKSIM_H
+#define WEXOS_TOOLS_DISKSIM_H
+
+/*
+ * Simulated disk timing for the host tools. The data still lives in the
+ * host disk (host.h); this only works out how long each command would
+ * take on a drive described by a DiskModel:
+ *
+ *   command overhead, then for the media: a seek growing with the square
+ *   root of the LBA distance, the rotation until the first sector comes
+ *   under the head, and the transfer at the media rate. Data that only
+ *   goes to or from the drive's cache moves at the bus rate.
+ *
+ * The drive has a read-ahead segment, filled after a read while the
+ * drive is idle and given up when the next command arrives, and a
+ * write-back cache that is destaged in idle time, oldest first or in
+ * one sweep across the disk (elevator). A write that finds the cache
+ * full waits for room.
+ *
+ * Commands come one at a time, as from the kernel's PIO driver: each one
+ * arrives `think` microseconds after the previous one finished.
+ *
+ * Traces are text, one command per line, as written by the kernel's
+ * iotrace command and by disksim_trace_write:
+ *
+ *   <start us> <length us> R|W <lba> <sectors>
+ */
+#include <stdio.h>
+#include "host.h"
+
+typedef struct {
+    char name[48];              /* the spec it was parsed from */
+    u32 sectors;                /* seeks are scaled to this; 0: the disk's size */
+    double overhead_us;         /* per command */
+    double seek_min_us;         /* to the next track */
+    double seek_max_us;         /* across the whole disk */
+    u32 rpm;                    /* 0: no rotation, flash */
+    double media_mb_s;          /* platters or flash, MB = 10^6 bytes */
+    double bus_mb_s;            /* host to drive cache */
+    u32 cache_sectors;          /* write-back cache; 0: write through */
+    u32 readahead_sectors;
+    int elevator;               /* destage in LBA order, not oldest first */
+} DiskModel;
+
+/* "<preset>[,key=value...]": presets hdd, laptop, ssd; keys size
+ * (bytes, k/m/g), overhead, seekmin, seekmax (us), rpm, media, bus
+ * (MB/s), cache, ra (sectors) and destage=fifo|elevator. 0 or an error
+ * message naming the bad part */
+const char* disk_model_parse(DiskModel* m, const char* spec);
+void disk_model_print(const DiskModel* m, FILE* f);
+
+typedef struct {
+    u32 commands;
+    u32 reads;
+    u32 writes;
+    unsigned long long sectors_read;
+    unsigned long long sectors_written;
+    double busy_us;             /* media busy, destaging included */
+    double seek_us;
+    double rotate_us;
+    double transfer_us;
+    u32 seeks;
+    unsigned long long seek_sectors;
+    u32 readahead_hits;
+    u32 cached_writes;
+    u32 cache_stalls;           /* writes that waited for the cache */
+    double drain_us;            /* destaging left at a flush */
+    double* read_lat;           /* per command latency, for percentiles */
+    double* write_lat;
+    u32 read_cap;
+    u32 write_cap;
+} DiskSimStats;
+
+typedef struct {
+    u32 lba;
+    u32 count;
+} DiskExtent;
+
+typedef struct {
+    DiskModel m;
+    double sector_us;           /* media time of one sector */
+    double period_us;           /* one revolution */
+    u32 track_sectors;
+    double now;                 /* the last command finished */
+    double media_free;          /* the head is done with what it was doing */
+    u32 head;                   /* LBA under the head at media_free */
+    u32 ra_start;               /* read-ahead segment: [ra_start, ra_end) */
+    u32 ra_end;                 /* read when the last read finished */
+    u32 ra_limit;               /* how far read-ahead may go */
+    double ra_time;             /* when it started from ra_end */
+    DiskExtent* dirty;          /* write cache, oldest first */
+    u32 dirty_count;
+    u32 dirty_cap;
+    u32 dirty_sectors;
+    DiskSimStats st;
+} DiskSim;
+
+/* A drive of model `m`, `sectors` big when the model does not say */
+void disksim_init(DiskSim* s, const DiskModel* m, u32 sectors);
+void disksim_free(DiskSim* s);
+/* One command; its latency in microseconds */
+double disksim_command(DiskSim* s, double think_us, int write, u32 lba, u32 count);
+/* Destage the whole write cache, as FLUSH CACHE; the time it took */
+double disksim_flush(DiskSim* s);
+/* Latency percentile `p` (0-100) of reads or writes */
+double disksim_percentile(DiskSim* s, int write, double p);
+
+typedef struct {
+    double start_us;
+    double length_us;
+    int write;
+    u32 lba;
+    u32 count;
+} DiskTraceRecord;
+
+/* The next command in a trace; 1, 0 at the end, -1 for a bad line */
+int disksim_trace_read(FILE* f, DiskTraceRecord* r, u32* lineno);
+void disksim_trace_header(FILE* f);
+void disksim_trace_write(FILE* f, const DiskTraceRecord* r);
+
+#endif
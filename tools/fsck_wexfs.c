@@ -0,0 +1,75 @@
+/*
+ * fsck.wexfs - check a WexFS disk image on the host
+ *
+ *   fsck.wexfs [-r] [-q] image
+ *
+ * Runs the kernel's three-phase check over the image. With -r problems
+ * are repaired and the image is written back; without it the file is
+ * never changed, even when the journal had a record to replay. Exit
+ * codes follow fsck(8): 0 clean, 1 errors repaired, 4 errors left,
+ * 8 the image could not be checked.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+
+static void usage(void) {
+    fprintf(stderr, "Usage: fsck.wexfs [-r] [-q] image\n"
+                    "  -r  repair problems and write the image back\n"
+                    "  -q  print only the summary\n");
+    exit(8);
+}
+
+int main(int argc, char** argv) {
+    u32 flags = WEXFS_FSCK_VERBOSE;
+    const char* image = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) flags |= WEXFS_FSCK_REPAIR;
+        else if (strcmp(argv[i], "-q") == 0) flags &= ~WEXFS_FSCK_VERBOSE;
+        else if (argv[i][0] != '-' && !image) image = argv[i];
+        else usage();
+    }
+    if (!image) usage();
+
+    int err = host_init();
+    if (err == WEXFS_OK) err = host_disk_load(image);
+    if (err == WEXFS_OK) err = wexfs_mount();
+    if (err != WEXFS_OK) {
+        fprintf(stderr, "fsck.wexfs: %s: %s\n", image, wexfs_strerror(err));
+        return 8;
+    }
+
+    WexFsck ck;
+    int rc = wexfs_fsck_begin(&ck, flags);
+    while (rc == 0) rc = wexfs_fsck_step(&ck, 0xFFFFFFFF);
+    if (rc < 0) {
+        fprintf(stderr, "fsck.wexfs: %s: %s\n", image, wexfs_strerror(rc));
+        return 8;
+    }
+
+    u32 errors = ck.errors + wexfs_csum_errors;
+    printf("%s: %u objects, %u blocks verified, %u of %u blocks free\n", image, (u32)fs_count,
+           ck.blocks, wexfs_free_blocks, wexfs_sb.total_blocks);
+    if (wexfs_csum_errors) printf("%s: %u checksum mismatches\n", image, wexfs_csum_errors);
+    if (ck.warnings) printf("%s: %u warnings\n", image, ck.warnings);
+    u32 repaired = ck.repaired;
+    wexfs_fsck_end(&ck);
+
+    if (!errors) {
+        printf("%s: clean\n", image);
+        return 0;
+    }
+    if (!(flags & WEXFS_FSCK_REPAIR)) {
+        printf("%s: %u errors, run with -r to repair\n", image, errors);
+        return 4;
+    }
+    if (repaired) {
+        err = host_disk_save(image);
+        if (err != WEXFS_OK) {
+            fprintf(stderr, "fsck.wexfs: %s: %s\n", image, wexfs_strerror(err));
+            return 8;
+        }
+    }
+    printf("%s: %u errors, %u repaired\n", image, errors, repaired);
+    return repaired >= errors ? 1 : 4;
+}
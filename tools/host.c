@@ -0,0 +1,158 @@
+/* Host environment for the core library: the disk is an image in memory or a file */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "host.h"
+#include "../kernel/heap.h"
+
+char _kernel_end[1];            /* heap.c's default start; unused, see host_init */
+
+HostDiskStats host_disk_stats;
+HostDiskHook host_disk_hook = NULL;
+
+static u8* disk = NULL;         /* image in memory, or */
+static int disk_fd = -1;        /* the image file itself */
+static u32 disk_sectors = 0;
+
+void prints(const char* s) {
+    fputs(s, stdout);
+}
+
+int host_init(void) {
+    void* heap = malloc(HOST_HEAP_SIZE);
+    if (!heap) return WEXFS_ENOMEM;
+    heap_init(heap, HOST_HEAP_SIZE);
+    return WEXFS_OK;
+}
+
+/* ---------- Disk ---------- */
+
+/* Sectors past the end read as zeros and writes to them are dropped,
+ * like a drive answering with an error the kernel does not check. */
+static void sector_read(u32 lba, u8* buffer) {
+    if (lba >= disk_sectors) {
+        memset(buffer, 0, SECTOR_SIZE);
+    } else if (disk) {
+        memcpy(buffer, disk + (unsigned long)lba * SECTOR_SIZE, SECTOR_SIZE);
+    } else if (pread(disk_fd, buffer, SECTOR_SIZE, (off_t)lba * SECTOR_SIZE) != SECTOR_SIZE) {
+        memset(buffer, 0, SECTOR_SIZE);
+    }
+}
+
+double host_clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void ata_read_sector(u32 lba, u8* buffer) {
+    double start = host_disk_hook ? host_clock_us() : 0;
+    host_disk_stats.reads++;
+    host_disk_stats.sectors_read++;
+    sector_read(lba, buffer);
+    if (host_disk_hook) host_disk_hook(0, lba, 1, start, host_clock_us());
+}
+
+static void sectors_read(u32 lba, u32 count, u8* buffer) {
+    if (disk_fd >= 0 && lba + count <= disk_sectors) {
+        // One system call, as the drive gets one command
+        if (pread(disk_fd, buffer, count * SECTOR_SIZE, (off_t)lba * SECTOR_SIZE) == (long)(count * SECTOR_SIZE)) return;
+    }
+    for (u32 i = 0; i < count; i++) sector_read(lba + i, buffer + i * SECTOR_SIZE);
+}
+
+void ata_read_sectors(u32 lba, u32 count, u8* buffer) {
+    double start = host_disk_hook ? host_clock_us() : 0;
+    host_disk_stats.reads++;
+    host_disk_stats.sectors_read += count;
+    sectors_read(lba, count, buffer);
+    if (host_disk_hook) host_disk_hook(0, lba, count, start, host_clock_us());
+}
+
+void ata_write_sector(u32 lba, u8* buffer) {
+    double start = host_disk_hook ? host_clock_us() : 0;
+    host_disk_stats.sectors_written++;
+    if (lba < disk_sectors) {
+        if (disk) memcpy(disk + (unsigned long)lba * SECTOR_SIZE, buffer, SECTOR_SIZE);
+        else if (pwrite(disk_fd, buffer, SECTOR_SIZE, (off_t)lba * SECTOR_SIZE) != SECTOR_SIZE) prints("host: write failed\n");
+    }
+    if (host_disk_hook) host_disk_hook(1, lba, 1, start, host_clock_us());
+}
+
+u32 ata_identify(void) {
+    return disk_sectors;
+}
+
+int host_disk_create(u32 sectors) {
+    host_disk_free();
+    disk = (u8*)calloc(sectors, SECTOR_SIZE);
+    if (!disk) return WEXFS_ENOMEM;
+    disk_sectors = sectors;
+    return WEXFS_OK;
+}
+
+int host_disk_load(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return WEXFS_ENOENT;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    if (size < 0 || (unsigned long)size / SECTOR_SIZE > 0xFFFFFFFFul) {
+        fclose(f);
+        return WEXFS_EFBIG;
+    }
+    int err = host_disk_create((u32)(size / SECTOR_SIZE));
+    if (err == WEXFS_OK && fread(disk, SECTOR_SIZE, disk_sectors, f) != disk_sectors) err = WEXFS_EIO;
+    fclose(f);
+    return err;
+}
+
+int host_disk_save(const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (!f) return WEXFS_EIO;
+    int err = fwrite(disk, SECTOR_SIZE, disk_sectors, f) == disk_sectors ? WEXFS_OK : WEXFS_EIO;
+    if (fclose(f) != 0) err = WEXFS_EIO;
+    return err;
+}
+
+int host_disk_open(const char* path, u32 sectors) {
+    host_disk_free();
+    disk_fd = open(path, sectors ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (disk_fd < 0) return WEXFS_ENOENT;
+    if (sectors && ftruncate(disk_fd, (off_t)sectors * SECTOR_SIZE) != 0) {
+        host_disk_free();
+        return WEXFS_ENOSPC;
+    }
+    off_t size = lseek(disk_fd, 0, SEEK_END);
+    disk_sectors = (u32)(size / SECTOR_SIZE);
+    return WEXFS_OK;
+}
+
+u32 host_disk_sectors(void) {
+    return disk_sectors;
+}
+
+/* NULL for a disk opened with host_disk_open */
+u8* host_disk_data(void) {
+    return disk;
+}
+
+void host_disk_free(void) {
+    free(disk);
+    disk = NULL;
+    if (disk_fd >= 0) close(disk_fd);
+    disk_fd = -1;
+    disk_sectors = 0;
+}
+
+unsigned long long host_parse_size(const char* s) {
+    unsigned long long v = 0;
+    if (*s < '0' || *s > '9') return 0;
+    while (*s >= '0' && *s <= '9') v = v * 10 + (*s++ - '0');
+    if (*s == 'k' || *s == 'K') v <<= 10, s++;
+    else if (*s == 'm' || *s == 'M') v <<= 20, s++;
+    else if (*s == 'g' || *s == 'G') v <<= 30, s++;
+    return *s ? 0 : v;
+}
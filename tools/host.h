@@ -0,0 +1,60 @@
+#ifndef WEXOS_TOOLS_HOST_H
+#define WEXOS_TOOLS_HOST_H
+
+/*
+ * Host environment for the core library (everything in libwexcore.a
+ * but the ATA driver) built into the tools in this directory. The disk is an image
+ * held in memory: it is read from its file in one go, every ata_* call
+ * works on the copy, and host_disk_save writes it back sequentially.
+ *
+ * The disk can also stay in its file (host_disk_open), every sector
+ * going through pread/pwrite, for tests and benchmarks that should see
+ * the cost of real I/O.
+ *
+ * Everything here is built with HOST_CFLAGS from the makefile:
+ * -DWEXOS_HOST, and host_names.h, which gives the string functions of
+ * kernel/klib.c their own names. The tools use those and do not include
+ * <string.h>.
+ */
+#include "../kernel/wexfs.h"
+#include "../kernel/klib.h"
+
+#define HOST_HEAP_SIZE (256u * 1024 * 1024)
+
+typedef struct {
+    u32 reads;              /* ata commands */
+    u32 sectors_read;
+    u32 sectors_written;
+} HostDiskStats;
+
+extern HostDiskStats host_disk_stats;
+
+/* Called after every disk command with its start and end on
+ * host_clock_us; the simulated disk and trace recorder of disksim.h
+ * hang off it */
+typedef void (*HostDiskHook)(int write, u32 lba, u32 count, double start_us, double end_us);
+extern HostDiskHook host_disk_hook;
+
+/* Monotonic host time in microseconds */
+double host_clock_us(void);
+
+/* Give the kernel heap its memory; once, before any wexfs call */
+int host_init(void);
+
+/* An all-zero disk of `sectors` sectors */
+int host_disk_create(u32 sectors);
+/* The whole image file; its size is rounded down to whole sectors */
+int host_disk_load(const char* path);
+/* Write the image out in one sequential pass */
+int host_disk_save(const char* path);
+/* Use `path` itself as the disk, resized to `sectors` and zeroed when
+ * `sectors` is not 0; closed by host_disk_free */
+int host_disk_open(const char* path, u32 sectors);
+u32 host_disk_sectors(void);
+u8* host_disk_data(void);
+void host_disk_free(void);
+
+/* Parse "<n>[k|m|g]" as bytes; 0 when malformed */
+unsigned long long host_parse_size(const char* s);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef WEXOS_TOOLS_HOST_NAMES_H
+#define WEXOS_TOOLS_HOST_NAMES_H
+
+/* Included ahead of every host source (HOST_CFLAGS): the kernel's string
+ * functions (kernel/klib.c) keep their own signatures on the host under
+ * these names, so they neither clash with nor replace the C library's. */
+#define memcpy wex_memcpy
+#define memset wex_memset
+#define strcmp wex_strcmp
+#define strcasecmp wex_strcasecmp
+#define strlen wex_strlen
+#define strcpy wex_strcpy
+#define strcat wex_strcat
+#define strchr wex_strchr
+#define strrchr wex_strrchr
+#define strstr wex_strstr
+#define atoi wex_atoi
+#define itoa wex_itoa
+
+#endif
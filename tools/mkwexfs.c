@@ -0,0 +1,319 @@
+/*
+ * mkwexfs - build a WexFS disk image on the host
+ *
+ *   mkwexfs [-s size] [-d dir] [-m manifest] image
+ *
+ * The volume is formatted in memory, filled from the host directory
+ * `dir` and then from the manifest, defragmented offline so every file
+ * lies in one run in read order, checked, and only then written to
+ * `image` in one sequential pass. The image holds the whole disk, boot
+ * sector included, and can be given to QEMU as the system drive.
+ *
+ * Manifest lines, paths relative to the volume root:
+ *
+ *   dir <path>                 a directory and its missing parents
+ *   file <path> [<host file>]  a file, empty or copied from the host
+ *                              (relative to the manifest's directory)
+ *   text <path> <text...>      a file holding the rest of the line
+ *   compress <path>            new blocks of the file or directory are
+ *                              LZ compressed; put it before the files
+ *
+ * Blank lines and lines starting with # are ignored.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "host.h"
+
+#define DEFAULT_SIZE (64ull * 1024 * 1024)
+#define LINE_MAX_LEN 4096
+
+static u32 made_files = 0;
+static u32 made_dirs = 0;
+static unsigned long long made_bytes = 0;
+
+static void fail(const char* what, const char* name, int err) {
+    fprintf(stderr, "mkwexfs: %s: %s: %s\n", what, name, wexfs_strerror(err));
+}
+
+static int read_host_file(const char* path, u8** out, u32* len) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return WEXFS_ENOENT;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    if (size < 0 || size > 0x7FFFFFFFl) {
+        fclose(f);
+        return WEXFS_EFBIG;
+    }
+    u8* buf = (u8*)malloc(size ? size : 1);
+    if (!buf) {
+        fclose(f);
+        return WEXFS_ENOMEM;
+    }
+    if (fread(buf, 1, size, f) != (unsigned long)size) {
+        free(buf);
+        fclose(f);
+        return WEXFS_EIO;
+    }
+    fclose(f);
+    *out = buf;
+    *len = (u32)size;
+    return WEXFS_OK;
+}
+
+static int add_dir(const char* path) {
+    int err;
+    if (!wexfs_create_path(wexfs_root(), path, WEXFS_DIR, &err)) {
+        fail("cannot create directory", path, err);
+        return err;
+    }
+    made_dirs++;
+    return WEXFS_OK;
+}
+
+static int add_file(const char* path, const void* data, u32 len) {
+    int err;
+    FSNode* node = wexfs_create_path(wexfs_root(), path, WEXFS_FILE, &err);
+    if (!node) {
+        fail("cannot create file", path, err);
+        return err;
+    }
+    err = wexfs_write_file(node, data, len);
+    if (err != WEXFS_OK) {
+        fail("cannot write", path, err);
+        return err;
+    }
+    made_files++;
+    made_bytes += len;
+    return WEXFS_OK;
+}
+
+static int add_host_file(const char* path, const char* host) {
+    u8* data;
+    u32 len;
+    int err = read_host_file(host, &data, &len);
+    if (err != WEXFS_OK) {
+        fail("cannot read", host, err);
+        return err;
+    }
+    err = add_file(path, data, len);
+    free(data);
+    return err;
+}
+
+/* ---------- Directory tree ---------- */
+
+static int name_cmp(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Copy the host directory `host` to `path` on the volume, names in
+ * sorted order so the same tree always gives the same image */
+static int add_tree(const char* host, const char* path) {
+    DIR* d = opendir(host);
+    if (!d) {
+        fail("cannot open directory", host, WEXFS_ENOENT);
+        return WEXFS_ENOENT;
+    }
+    char** names = NULL;
+    u32 count = 0, cap = 0;
+    struct dirent* e;
+    while ((e = readdir(d))) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            names = (char**)realloc(names, cap * sizeof(char*));
+        }
+        names[count] = (char*)malloc(strlen(e->d_name) + 1);
+        strcpy(names[count++], e->d_name);
+    }
+    closedir(d);
+    qsort(names, count, sizeof(char*), name_cmp);
+
+    int err = WEXFS_OK;
+    for (u32 i = 0; i < count && err == WEXFS_OK; i++) {
+        char src[MAX_PATH], dst[MAX_PATH];
+        snprintf(src, sizeof(src), "%s/%s", host, names[i]);
+        snprintf(dst, sizeof(dst), "%s/%s", path, names[i]);
+        struct stat st;
+        if (stat(src, &st) != 0) {
+            fail("cannot stat", src, WEXFS_ENOENT);
+            err = WEXFS_ENOENT;
+        } else if (S_ISDIR(st.st_mode)) {
+            err = add_dir(dst);
+            if (err == WEXFS_OK) err = add_tree(src, dst);
+        } else if (S_ISREG(st.st_mode)) {
+            err = add_host_file(dst, src);
+        } else {
+            fprintf(stderr, "mkwexfs: skipping %s: not a file or directory\n", src);
+        }
+    }
+    for (u32 i = 0; i < count; i++) free(names[i]);
+    free(names);
+    return err;
+}
+
+/* ---------- Manifest ---------- */
+
+/* Next space-separated word of *p, NUL terminated in place */
+static char* next_word(char** p) {
+    char* s = *p;
+    while (*s == ' ' || *s == '\t') s++;
+    if (!*s) return NULL;
+    char* w = s;
+    while (*s && *s != ' ' && *s != '\t') s++;
+    if (*s) *s++ = '\0';
+    *p = s;
+    return w;
+}
+
+static int add_manifest(const char* manifest) {
+    FILE* f = fopen(manifest, "r");
+    if (!f) {
+        fail("cannot open manifest", manifest, WEXFS_ENOENT);
+        return WEXFS_ENOENT;
+    }
+    // Host files are relative to the manifest's directory
+    char base[MAX_PATH];
+    int cut = 0;
+    for (int i = 0; manifest[i] && i < MAX_PATH - 1; i++) {
+        base[i] = manifest[i];
+        if (manifest[i] == '/') cut = i + 1;
+    }
+    base[cut] = '\0';
+
+    char line[LINE_MAX_LEN];
+    int lineno = 0;
+    int err = WEXFS_OK;
+    while (err == WEXFS_OK && fgets(line, sizeof(line), f)) {
+        lineno++;
+        int len = strlen(line);
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        char* p = line;
+        char* op = next_word(&p);
+        if (!op || op[0] == '#') continue;
+        char* path = next_word(&p);
+        if (!path) {
+            fprintf(stderr, "mkwexfs: %s:%d: missing path\n", manifest, lineno);
+            err = WEXFS_EINVAL;
+        } else if (strcmp(op, "dir") == 0) {
+            err = add_dir(path);
+        } else if (strcmp(op, "file") == 0) {
+            char* host = next_word(&p);
+            if (host) {
+                char src[MAX_PATH];
+                snprintf(src, sizeof(src), "%s%s", host[0] == '/' ? "" : base, host);
+                err = add_host_file(path, src);
+            } else {
+                err = add_file(path, "", 0);
+            }
+        } else if (strcmp(op, "text") == 0) {
+            while (*p == ' ' || *p == '\t') p++;
+            err = add_file(path, p, strlen(p));
+        } else if (strcmp(op, "compress") == 0) {
+            FSNode* node = wexfs_lookup_at(wexfs_root(), path);
+            err = node ? wexfs_set_compress(node, 1) : WEXFS_ENOENT;
+            if (err != WEXFS_OK) fail("cannot set compression", path, err);
+        } else {
+            fprintf(stderr, "mkwexfs: %s:%d: unknown entry '%s'\n", manifest, lineno, op);
+            err = WEXFS_EINVAL;
+        }
+    }
+    fclose(f);
+    return err;
+}
+
+/* ---------- Layout ---------- */
+
+/* Offline defragmentation: nothing else has the volume, so the inode
+ * table is packed and each file ends up in one run */
+static int pack(void) {
+    WexDefrag df;
+    int rc = wexfs_defrag_begin(&df, WEXFS_DEFRAG_OFFLINE);
+    while (rc == 0) rc = wexfs_defrag_step(&df, 0xFFFFFFFF);
+    if (rc > 0 && df.fragmented) {
+        printf("mkwexfs: %u fragmented files moved, %u skipped\n", df.moved, df.skipped);
+    }
+    wexfs_defrag_end(&df);
+    return rc < 0 ? rc : WEXFS_OK;
+}
+
+static int check(void) {
+    WexFsck ck;
+    int rc = wexfs_fsck_begin(&ck, WEXFS_FSCK_VERBOSE);
+    while (rc == 0) rc = wexfs_fsck_step(&ck, 0xFFFFFFFF);
+    int errors = rc < 0 ? 1 : (int)ck.errors;
+    wexfs_fsck_end(&ck);
+    return errors;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mkwexfs [-s size] [-d dir] [-m manifest] image\n"
+                    "  -s size      image size, <n>[k|m|g] (default 64m)\n"
+                    "  -d dir       copy a host directory tree into the root\n"
+                    "  -m manifest  then add the entries of a manifest\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    unsigned long long size = DEFAULT_SIZE;
+    const char* tree = NULL;
+    const char* manifest = NULL;
+    const char* image = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            size = host_parse_size(argv[++i]);
+            if (!size) usage();
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            tree = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (argv[i][0] != '-' && !image) {
+            image = argv[i];
+        } else {
+            usage();
+        }
+    }
+    if (!image) usage();
+
+    unsigned long long blocks = (size / SECTOR_SIZE - FS_SECTOR_START) / WEXFS_SECTORS_PER_BLOCK;
+    if (size / SECTOR_SIZE <= FS_SECTOR_START || blocks < 64 || blocks > WEXFS_MAX_BLOCKS) {
+        fprintf(stderr, "mkwexfs: image size must be between 256 KB and 4 GB\n");
+        return 2;
+    }
+    if (host_init() != WEXFS_OK ||
+        host_disk_create(FS_SECTOR_START + (u32)blocks * WEXFS_SECTORS_PER_BLOCK) != WEXFS_OK) {
+        fprintf(stderr, "mkwexfs: out of memory\n");
+        return 1;
+    }
+
+    int err = wexfs_format((u32)blocks);
+    if (err != WEXFS_OK) {
+        fail("cannot format", image, err);
+        return 1;
+    }
+    if (tree && add_tree(tree, "") != WEXFS_OK) return 1;
+    if (manifest && add_manifest(manifest) != WEXFS_OK) return 1;
+
+    err = pack();
+    if (err != WEXFS_OK) {
+        fail("cannot defragment", image, err);
+        return 1;
+    }
+    if (check() != 0) {
+        fprintf(stderr, "mkwexfs: %s: the new volume does not check clean\n", image);
+        return 1;
+    }
+
+    err = host_disk_save(image);
+    if (err != WEXFS_OK) {
+        fail("cannot write", image, err);
+        return 1;
+    }
+    printf("%s: %u files, %u directories, %llu bytes; %u of %u blocks used\n", image,
+           made_files, made_dirs, made_bytes, wexfs_sb.total_blocks - wexfs_free_blocks,
+           wexfs_sb.total_blocks);
+    return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * wexfs-backup - back up a WexFS disk image, or restore one, with the
+ * kernel's backup code (kernel/backup.h)
+ *
+ *   wexfs-backup [-f] [-s size] image target      back up
+ *   wexfs-backup -r [-d dir] target image         restore
+ *   wexfs-backup -i target                        show the target's header
+ *
+ * The target is a file standing in for the second disk; it is made
+ * `size` big (default 64m) when it does not exist yet. A backup is
+ * incremental when the target holds the image's last backup, and full
+ * with -f or otherwise; the image is written back either way, as the
+ * backup records itself in the superblock. A restore recreates the last
+ * session under `dir` (default the root) of an existing WexFS image,
+ * such as one fresh from mkwexfs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "host.h"
+#include "../kernel/backup.h"
+
+static int target_fd = -1;
+
+static int target_read(u32 lba, u32 count, u8* buffer) {
+    long bytes = (long)count * SECTOR_SIZE;
+    return pread(target_fd, buffer, bytes, (off_t)lba * SECTOR_SIZE) == bytes ? 0 : -1;
+}
+
+static int target_write(u32 lba, u32 count, const u8* buffer) {
+    long bytes = (long)count * SECTOR_SIZE;
+    return pwrite(target_fd, buffer, bytes, (off_t)lba * SECTOR_SIZE) == bytes ? 0 : -1;
+}
+
+static int target_flush(void) {
+    return fsync(target_fd) == 0 ? 0 : -1;
+}
+
+static int target_open(BackupDev* dev, const char* path, unsigned long long size) {
+    target_fd = open(path, O_RDWR);
+    if (target_fd < 0 && size) {
+        target_fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (target_fd >= 0 && ftruncate(target_fd, (off_t)size) != 0) return WEXFS_ENOSPC;
+    }
+    if (target_fd < 0) return WEXFS_ENOENT;
+    off_t bytes = lseek(target_fd, 0, SEEK_END);
+    dev->sectors = bytes / SECTOR_SIZE > 0xFFFFFFFFll ? 0xFFFFFFFF : (u32)(bytes / SECTOR_SIZE);
+    dev->read = target_read;
+    dev->write = target_write;
+    dev->flush = target_flush;
+    return WEXFS_OK;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: wexfs-backup [-f] [-s size] image target\n"
+                    "       wexfs-backup -r [-d dir] target image\n"
+                    "       wexfs-backup -i target\n"
+                    "  -f       full backup, the target is started over\n"
+                    "  -s size  size of a new target, bytes with k/m/g; default 64m\n"
+                    "  -r       restore the last backup into the image\n"
+                    "  -d dir   restore under this directory; default /\n"
+                    "  -i       show what the target holds\n");
+    exit(2);
+}
+
+static int info(const char* target) {
+    BackupDev dev;
+    BackupHeader hdr;
+    int err = target_open(&dev, target, 0);
+    if (err == WEXFS_OK) err = backup_header(&dev, &hdr);
+    if (err != WEXFS_OK) {
+        fprintf(stderr, "wexfs-backup: %s: %s\n", target, err == WEXFS_ENOENT ? "no backup" : wexfs_strerror(err));
+        return 1;
+    }
+    printf("%s: %u sessions, %u of %u sectors used, volume %08x\n", target, hdr.sessions, hdr.end, dev.sectors,
+           hdr.volume_id);
+    printf("  last session: change %u, %u objects, %u files copied, %u sectors written\n", hdr.change,
+           hdr.catalog_entries, hdr.session_files, hdr.session_sectors);
+    printf("  catalog: sectors %u-%u\n", hdr.catalog_lba, hdr.catalog_lba + hdr.catalog_sectors - 1);
+    if (hdr.pending) printf("  unfinished session: sectors %u-%u written\n", hdr.end, hdr.pending_end);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    u32 flags = 0;
+    int restore = 0, show = 0;
+    unsigned long long size = 64ull << 20;
+    const char* dir = "/";
+    const char* files[2] = { NULL, NULL };
+    int nfiles = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) flags |= BACKUP_FULL;
+        else if (strcmp(argv[i], "-r") == 0) restore = 1;
+        else if (strcmp(argv[i], "-i") == 0) show = 1;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) size = host_parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) dir = argv[++i];
+        else if (argv[i][0] != '-' && nfiles < 2) files[nfiles++] = argv[i];
+        else usage();
+    }
+    if (show) {
+        if (nfiles != 1 || restore) usage();
+        return info(files[0]);
+    }
+    if (nfiles != 2 || size < 2 * SECTOR_SIZE) usage();
+    const char* image = restore ? files[1] : files[0];
+    const char* target = restore ? files[0] : files[1];
+
+    BackupDev dev;
+    int err = host_init();
+    if (err == WEXFS_OK) err = host_disk_load(image);
+    if (err == WEXFS_OK) err = wexfs_mount();
+    if (err != WEXFS_OK) {
+        fprintf(stderr, "wexfs-backup: %s: %s\n", image, wexfs_strerror(err));
+        return 1;
+    }
+    err = target_open(&dev, target, restore ? 0 : size);
+    if (err != WEXFS_OK) {
+        fprintf(stderr, "wexfs-backup: %s: %s\n", target, wexfs_strerror(err));
+        return 1;
+    }
+
+    BackupResult res;
+    double start = host_clock_us();
+    if (restore) {
+        FSNode* base = wexfs_lookup(dir);
+        if (!base) base = wexfs_create_path(NULL, dir, WEXFS_DIR, &err);
+        if (base) err = backup_restore(&dev, base, &res);
+        else memset(&res, 0, sizeof(res));
+        printf("%s: %u objects, %llu bytes restored from session %u\n", image, res.objects, res.bytes, res.session);
+        if (res.failed) printf("%s: %u objects could not be restored\n", image, res.failed);
+    } else {
+        err = backup_run(&dev, flags, &res);
+        if (err == WEXFS_OK) {
+            printf("%s: %s backup, session %u%s: %u objects, %u files copied (%llu bytes), %u unchanged\n", target,
+                   res.full ? "full" : "incremental", res.session, res.resumed ? " (resumed)" : "", res.objects,
+                   res.files, res.bytes, res.reused);
+            printf("%s: %u sectors written in %.1f ms\n", target, res.sectors, (host_clock_us() - start) / 1000);
+        }
+    }
+    close(target_fd);
+    // The image changed either way: restored files, or the backup marks
+    int save = host_disk_save(image);
+    if (err != WEXFS_OK) {
+        fprintf(stderr, "wexfs-backup: %s: %s\n", restore ? image : target, wexfs_strerror(err));
+        return 1;
+    }
+    if (save != WEXFS_OK) {
+        fprintf(stderr, "wexfs-backup: %s: %s\n", image, wexfs_strerror(save));
+        return 1;
+    }
+    return 0;
+}
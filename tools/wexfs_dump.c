@@ -0,0 +1,186 @@
+/*
+ * wexfs-dump - print the layout of a WexFS disk image
+ *
+ *   wexfs-dump [-x path] image
+ *
+ * Prints the superblock, its regions and the snapshots, then every
+ * object in sorted path order with its inode, size and the block runs
+ * its data occupies (pointer blocks in brackets). A file whose data and pointer blocks do
+ * not follow each other on disk in read order is marked with its number
+ * of fragments. With -x the file at `path` is copied to standard output
+ * instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+
+static u32 runs_start = 0;
+static u32 runs_count = 0;
+static u32 next_blk = 0;        /* block that continues the file on disk */
+static u32 fragments = 0;       /* places where it does not */
+
+static void track(u32 blk) {
+    if (next_blk && blk != next_blk) fragments++;
+    next_blk = blk + 1;
+}
+
+static void run_flush(void) {
+    if (!runs_count) return;
+    if (runs_count == 1) printf(" %u", runs_start);
+    else printf(" %u+%u", runs_start, runs_count);
+    runs_count = 0;
+}
+
+static void run_add(u32 blk) {
+    track(blk);
+    if (runs_count && blk == runs_start + runs_count) {
+        runs_count++;
+        return;
+    }
+    run_flush();
+    runs_start = blk;
+    runs_count = 1;
+}
+
+static const u32* ptr_block(u32 blk) {
+    if (blk >= wexfs_sb.total_blocks) return NULL;
+    return (const u32*)(host_disk_data() + ((unsigned long)FS_SECTOR_START +
+                        (unsigned long)blk * WEXFS_SECTORS_PER_BLOCK) * SECTOR_SIZE);
+}
+
+/* Data blocks below `ptr`, `depth` levels of pointer blocks down, until
+ * `*left` logical blocks have been listed */
+static void dump_ptrs(u32 ptr, int depth, u32* left) {
+    if (!*left) return;
+    u32 blk = WEXFS_PTR_BLOCK(ptr);
+    if (depth == 0) {
+        (*left)--;
+        if (blk) run_add(blk);
+        return;
+    }
+    if (!blk) {
+        u32 span = depth == 1 ? WEXFS_PTRS_PER_BLOCK : WEXFS_PTRS_PER_BLOCK * WEXFS_PTRS_PER_BLOCK;
+        *left = *left > span ? *left - span : 0;
+        return;
+    }
+    run_flush();
+    track(blk);
+    printf(" [%u]", blk);
+    const u32* p = ptr_block(blk);
+    for (u32 i = 0; i < WEXFS_PTRS_PER_BLOCK && *left; i++) {
+        if (p) dump_ptrs(p[i], depth - 1, left);
+        else (*left)--;
+    }
+}
+
+static void dump_node(FSNode* node, const char* path) {
+    printf("%-40s %s ino %-6u size %-9u", path, node->is_dir ? "dir " : "file", node->ino, node->di.size);
+    if (node->di.flags & WEXFS_INODE_COMPRESS) printf(" compress");
+    if (node->di.flags & WEXFS_INODE_LOG) printf(" log");
+    if (node->di.flags & WEXFS_INODE_INLINE) {
+        printf(" inline\n");
+        return;
+    }
+    u32 left = (node->di.size + WEXFS_BLOCK_SIZE - 1) / WEXFS_BLOCK_SIZE;
+    next_blk = 0;
+    fragments = 0;
+    printf(" blocks");
+    for (u32 i = 0; i < WEXFS_NDIRECT; i++) dump_ptrs(node->di.blocks[i], 0, &left);
+    dump_ptrs(node->di.blocks[WEXFS_IND], 1, &left);
+    dump_ptrs(node->di.blocks[WEXFS_DIND], 2, &left);
+    run_flush();
+    if (fragments) printf(" (%u fragments)", fragments + 1);
+    printf("\n");
+}
+
+static void dump_tree(FSNode* dir, char* path) {
+    int len = strlen(path);
+    WexDir d;
+    if (wexfs_opendir(dir, WEXFS_DIR_SORTED, &d) != WEXFS_OK) return;
+    FSNode* child;
+    while ((child = wexfs_readdir(&d))) {
+        if (len + 1 + strlen(child->name) >= MAX_PATH) continue;
+        path[len] = '/';
+        strcpy(path + len + 1, child->name);
+        dump_node(child, path);
+        if (child->is_dir) dump_tree(child, path);
+        path[len] = '\0';
+    }
+}
+
+static void dump_super(void) {
+    WexSuper* sb = &wexfs_sb;
+    printf("WexFS v%u, %u blocks of %u bytes, %u free\n", sb->version, sb->total_blocks,
+           sb->block_size, wexfs_free_blocks);
+    if (sb->volume_id) printf("  volume id   %08x\n", sb->volume_id);
+    printf("  bitmap      %u+%u\n", sb->bitmap_start, sb->bitmap_blocks);
+    if (sb->journal_blocks) printf("  journal     %u+%u\n", sb->journal_start, sb->journal_blocks);
+    if (sb->refcount_blocks) printf("  refcounts   %u+%u\n", sb->refcount_start, sb->refcount_blocks);
+    if (sb->csum_blocks) printf("  checksums   %u+%u\n", sb->csum_start, sb->csum_blocks);
+    printf("  inode table");
+    for (u32 i = 0; i < sb->extent_count && i < WEXFS_MAX_EXTENTS; i++) {
+        printf(" %u+%u", sb->itable[i].start, sb->itable[i].count);
+    }
+    printf(", %u slots, %u objects\n", sb->inode_capacity, (u32)fs_count);
+    if (sb->features & WEXFS_FEAT_DEDUP) printf("  features    dedup\n");
+    printf("  changes     %u", sb->change);
+    if (sb->frozen == WEXFS_CHANGE_ALL) printf(", backup in progress");
+    else if (sb->backup_mark) printf(", last backup at %u", sb->backup_mark);
+    printf("\n");
+    WexSnapshot snaps[WEXFS_MAX_SNAPSHOTS];
+    int count = wexfs_snapshot_list(snaps, WEXFS_MAX_SNAPSHOTS);
+    if (sb->snap_block) printf("  snapshots   %u, %d taken\n", sb->snap_block, count);
+    for (int i = 0; i < count; i++) {
+        printf("    %-32s %u objects, %u blocks, inode table", snaps[i].name, snaps[i].objects, snaps[i].blocks);
+        for (u32 e = 0; e < snaps[i].extent_count && e < WEXFS_MAX_EXTENTS; e++) {
+            printf(" %u+%u", snaps[i].itable[e].start, snaps[i].itable[e].count);
+        }
+        printf("\n");
+    }
+}
+
+static int extract(const char* path) {
+    FSNode* node = wexfs_lookup(path);
+    if (!node) return WEXFS_ENOENT;
+    if (node->is_dir) return WEXFS_EISDIR;
+    static u8 buf[64 * 1024];
+    for (u32 off = 0; off < node->di.size;) {
+        int n = wexfs_read(node, off, buf, sizeof(buf));
+        if (n <= 0) return n < 0 ? n : WEXFS_EIO;
+        fwrite(buf, 1, n, stdout);
+        off += n;
+    }
+    return WEXFS_OK;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: wexfs-dump [-x path] image\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    const char* image = NULL;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) path = argv[++i];
+        else if (argv[i][0] != '-' && !image) image = argv[i];
+        else usage();
+    }
+    if (!image) usage();
+
+    int err = host_init();
+    if (err == WEXFS_OK) err = host_disk_load(image);
+    if (err == WEXFS_OK) err = wexfs_mount();
+    if (err == WEXFS_OK && path) err = extract(path);
+    if (err != WEXFS_OK) {
+        fprintf(stderr, "wexfs-dump: %s: %s\n", path ? path : image, wexfs_strerror(err));
+        return 1;
+    }
+    if (path) return 0;
+
+    dump_super();
+    char buf[MAX_PATH] = "";
+    dump_node(wexfs_root(), "/");
+    dump_tree(wexfs_root(), buf);
+    return 0;
+}
@@ -0,0 +1,1094 @@
+/*
+ * wexfs-test - WexFS model test and benchmark on the host
+ *
+ *   wexfs-test [-s seed] [-n ops] [-b baseline] [-w baseline] [-t trace]
+ *
+ * The disk is a temporary file (host_disk_open), so every sector the
+ * file system touches is a real pread/pwrite and is counted.
+ *
+ * Model test: random sequences of mkdir, create, write, truncate, read,
+ * rename, remove and lookup run against the volume and against a plain
+ * in-memory model of the tree side by side; every result and every read
+ * has to agree. Every CHECK_EVERY operations the volume is mounted again
+ * and the whole tree compared, and at the end it has to check clean.
+ * The sequences come from a fixed generator, so a failing seed fails the
+ * same way every time; -s runs just that seed. Halfway through, a
+ * snapshot is taken with a copy of the model; at the end the volume is
+ * rolled back to it and forward again, each side compared with its
+ * model, and with the snapshots deleted it has to check clean with no
+ * block left over. A mount with a damaged superblock has to fail and
+ * leave the disk as it was.
+ *
+ * Backups go to a target in memory: a full one a quarter of the way in,
+ * an incremental one a few operations later that may copy only what
+ * those changed, and a last one at the end that is cut short by a
+ * failing write and then resumed. The volume is then formatted,
+ * restored from the target and compared with the model once more.
+ *
+ * Benchmark: create, lookup, list and remove of BENCH_FILES files in one
+ * directory, on volumes of each size in bench_sizes; lookup and list do
+ * no I/O and run BENCH_PASSES times to last long enough to time. For
+ * every phase it prints ops/sec, sectors written and read per operation,
+ * and the time per operation the same commands would keep a BENCH_MODEL
+ * drive busy (disksim.h; back to back, write cache flushed at the end
+ * of the phase).
+ *
+ * With -b the numbers are compared to a baseline file: sectors/op are
+ * deterministic and may not grow by more than BENCH_SECTOR_SLACK
+ * percent, ops/sec depend on the machine and may only fall
+ * BENCH_SPEED_FACTOR times before it counts as a regression; simulated
+ * disk time is deterministic too and held to the same slack as
+ * sectors. -w writes the numbers of this run as the new baseline.
+ *
+ * -t records every disk command of the run as a trace for disk-replay.
+ *
+ * Exit code 0 when everything passed, 1 otherwise.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "disksim.h"
+#include "../kernel/backup.h"
+
+#define MODEL_MAX       512
+#define MODEL_PATH      160
+#define MODEL_FILE_MAX  (96 * 1024)
+#define MODEL_VOLUME    (16u * 1024 * 1024)
+#define MODEL_SEEDS     4
+#define MODEL_OPS       4000
+#define CHECK_EVERY     500
+#define BACKUP_SECTORS  (3 * MODEL_VOLUME / SECTOR_SIZE)
+#define BACKUP_AGAIN    20          /* operations between the first two backups */
+
+#define BENCH_FILES         2000
+#define BENCH_SECTOR_SLACK  10
+#define BENCH_SPEED_FACTOR  5
+#define BENCH_MAX           32
+#define BENCH_PASSES        20      /* of the phases that do no I/O, to be timeable */
+#define BENCH_MODEL         "hdd"
+
+static const char* bench_sizes[] = { "16m", "64m", "256m" };
+
+static int failures = 0;
+
+static void failf(const char* what, const char* path) {
+    printf("FAIL: %s: %s\n", what, path);
+    failures++;
+}
+
+/* ---------- Disk ---------- */
+
+/* A fresh volume of `bytes` on a temporary file; the file is unlinked
+ * at once and goes away with host_disk_free */
+static int volume_create(u32 bytes) {
+    char tmpl[] = "/tmp/wexfs-test.XXXXXX";
+    int fd = mkstemp(tmpl);
+    if (fd < 0) return WEXFS_EIO;
+    close(fd);
+    u32 blocks = (bytes / SECTOR_SIZE - FS_SECTOR_START) / WEXFS_SECTORS_PER_BLOCK;
+    int err = host_disk_open(tmpl, FS_SECTOR_START + blocks * WEXFS_SECTORS_PER_BLOCK);
+    unlink(tmpl);
+    if (err == WEXFS_OK) err = wexfs_format(blocks);
+    return err;
+}
+
+/* ---------- Model ---------- */
+
+typedef struct {
+    char path[MODEL_PATH];      /* absolute; "" for a free slot */
+    int is_dir;
+    u8* data;
+    u32 size;
+} ModelEntry;
+
+static ModelEntry model[MODEL_MAX];
+static u32 model_count = 0;
+static ModelEntry saved[MODEL_MAX];     /* the model when the snapshot was taken */
+static u32 saved_count = 0;
+static u32 rng_state = 1;
+static u32 name_seq = 0;
+static u8 iobuf[MODEL_FILE_MAX + 8192];
+
+/* xorshift32: the same sequence on every machine */
+static u32 rnd(u32 n) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return n ? rng_state % n : 0;
+}
+
+static void model_clear(void) {
+    for (u32 i = 0; i < MODEL_MAX; i++) {
+        free(model[i].data);
+        model[i].data = NULL;
+        model[i].path[0] = '\0';
+        free(saved[i].data);
+        saved[i].data = NULL;
+        saved[i].path[0] = '\0';
+    }
+    model_count = 0;
+    saved_count = 0;
+}
+
+static void model_save(void) {
+    for (u32 i = 0; i < MODEL_MAX; i++) {
+        free(saved[i].data);
+        saved[i] = model[i];
+        saved[i].data = NULL;
+        if (model[i].data) {
+            saved[i].data = (u8*)malloc(model[i].size ? model[i].size : 1);
+            memcpy(saved[i].data, model[i].data, model[i].size);
+        }
+    }
+    saved_count = model_count;
+}
+
+static void model_swap(void) {
+    for (u32 i = 0; i < MODEL_MAX; i++) {
+        ModelEntry e = model[i];
+        model[i] = saved[i];
+        saved[i] = e;
+    }
+    u32 n = model_count;
+    model_count = saved_count;
+    saved_count = n;
+}
+
+static ModelEntry* model_add(const char* path, int is_dir) {
+    for (u32 i = 0; i < MODEL_MAX; i++) {
+        if (model[i].path[0]) continue;
+        strcpy(model[i].path, path);
+        model[i].is_dir = is_dir;
+        model[i].data = NULL;
+        model[i].size = 0;
+        model_count++;
+        return &model[i];
+    }
+    return NULL;
+}
+
+/* A random live entry, of the given kind when `want` is not -1 */
+static ModelEntry* model_pick(int want) {
+    if (!model_count) return NULL;
+    u32 start = rnd(MODEL_MAX);
+    for (u32 i = 0; i < MODEL_MAX; i++) {
+        ModelEntry* e = &model[(start + i) % MODEL_MAX];
+        if (e->path[0] && (want < 0 || e->is_dir == want)) return e;
+    }
+    return NULL;
+}
+
+/* Is `path` `dir` itself or below it */
+static int model_under(const char* path, const char* dir) {
+    int len = strlen(dir);
+    for (int i = 0; i < len; i++) {
+        if (path[i] != dir[i]) return 0;
+    }
+    return path[len] == '\0' || path[len] == '/';
+}
+
+static int model_resize(ModelEntry* e, u32 size) {
+    if (size == e->size) return 1;
+    u8* data = (u8*)realloc(e->data, size ? size : 1);
+    if (!data) return 0;
+    if (size > e->size) memset(data + e->size, 0, size - e->size);
+    e->data = data;
+    e->size = size;
+    return 1;
+}
+
+/* Random bytes, with runs so that compressed directories see something
+ * to compress */
+static void fill(u8* buf, u32 len) {
+    for (u32 i = 0; i < len;) {
+        u32 run = 1 + rnd(64);
+        u8 v = (u8)rnd(256);
+        int same = rnd(2);
+        for (u32 j = 0; j < run && i < len; j++, i++) buf[i] = same ? v : (u8)rnd(256);
+    }
+}
+
+/* Parent directory of a new entry and its path */
+static void new_path(char* path, char kind) {
+    ModelEntry* dir = rnd(4) ? model_pick(1) : NULL;
+    const char* base = dir ? dir->path : "";
+    if (strlen(base) + 16 >= MODEL_PATH) base = "";
+    strcpy(path, base);
+    int len = strlen(path);
+    path[len++] = '/';
+    path[len++] = kind;
+    itoa(name_seq++, path + len, 10);
+}
+
+/* ---------- Operations ---------- */
+
+static void op_mkdir(void) {
+    char path[MODEL_PATH];
+    new_path(path, 'd');
+    int err;
+    if (!wexfs_create_path(wexfs_root(), path, WEXFS_DIR, &err)) {
+        failf(wexfs_strerror(err), path);
+        return;
+    }
+    model_add(path, 1);
+}
+
+static void op_create(void) {
+    char path[MODEL_PATH];
+    new_path(path, 'f');
+    int err;
+    FSNode* node = wexfs_create_path(wexfs_root(), path, WEXFS_FILE, &err);
+    if (!node) {
+        failf(wexfs_strerror(err), path);
+        return;
+    }
+    ModelEntry* e = model_add(path, 0);
+    // Mostly small files, a few that need the indirect block
+    u32 len = rnd(4) ? rnd(2048) : rnd(MODEL_FILE_MAX / 2);
+    if (!model_resize(e, len)) return;
+    fill(e->data, len);
+    err = wexfs_write_file(node, e->data, len);
+    if (err != WEXFS_OK) failf(wexfs_strerror(err), path);
+}
+
+static void op_write(ModelEntry* e, FSNode* node) {
+    u32 off = rnd(e->size + 4096);
+    u32 len = 1 + rnd(8192);
+    if (off + len > MODEL_FILE_MAX) return;
+    fill(iobuf, len);
+    int n = wexfs_write(node, off, iobuf, len);
+    if (n != (int)len) {
+        failf(n < 0 ? wexfs_strerror(n) : "short write", e->path);
+        return;
+    }
+    if (off + len > e->size && !model_resize(e, off + len)) return;
+    memcpy(e->data + off, iobuf, len);
+}
+
+static void op_truncate(ModelEntry* e, FSNode* node) {
+    u32 size = rnd(e->size * 2 + 512);
+    if (size > MODEL_FILE_MAX) size = MODEL_FILE_MAX;
+    int err = wexfs_truncate(node, size);
+    if (err != WEXFS_OK) {
+        failf(wexfs_strerror(err), e->path);
+        return;
+    }
+    model_resize(e, size);
+}
+
+/* The whole file, or a random piece of it, read back */
+static int compare(ModelEntry* e, FSNode* node, int whole) {
+    if (node->is_dir != e->is_dir) {
+        failf("wrong type", e->path);
+        return 0;
+    }
+    if (e->is_dir) return 1;
+    if (node->di.size != e->size) {
+        failf("wrong size", e->path);
+        return 0;
+    }
+    u32 off = whole ? 0 : rnd(e->size + 1);
+    u32 len = whole ? e->size : rnd(e->size - off + 1024);
+    int n = wexfs_read(node, off, iobuf, len);
+    u32 expect = off + len > e->size ? e->size - off : len;
+    if (n != (int)expect) {
+        failf(n < 0 ? wexfs_strerror(n) : "short read", e->path);
+        return 0;
+    }
+    for (u32 i = 0; i < expect; i++) {
+        if (iobuf[i] != e->data[off + i]) {
+            failf("data differs", e->path);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void op_remove(ModelEntry* e, FSNode* node) {
+    int err = wexfs_remove(node);
+    if (err != WEXFS_OK) {
+        failf(wexfs_strerror(err), e->path);
+        return;
+    }
+    char gone[MODEL_PATH];
+    strcpy(gone, e->path);
+    for (u32 i = 0; i < MODEL_MAX; i++) {
+        if (!model[i].path[0] || !model_under(model[i].path, gone)) continue;
+        free(model[i].data);
+        model[i].data = NULL;
+        model[i].path[0] = '\0';
+        model_count--;
+    }
+}
+
+/* Files move to any directory, directories get a new name in place */
+static void op_rename(ModelEntry* e, FSNode* node) {
+    char to[MODEL_PATH];
+    if (e->is_dir) {
+        strcpy(to, e->path);
+        char* slash = strrchr(to, '/');
+        slash[1] = 'd';
+        itoa(name_seq++, slash + 2, 10);
+    } else {
+        new_path(to, 'f');
+    }
+    char leaf[MAX_NAME];
+    FSNode* dir = wexfs_lookup_parent(wexfs_root(), to, leaf);
+    if (!dir) {
+        failf("no parent", to);
+        return;
+    }
+    int err = wexfs_rename(node, dir, leaf);
+    if (err != WEXFS_OK) {
+        failf(wexfs_strerror(err), e->path);
+        return;
+    }
+    char from[MODEL_PATH];
+    strcpy(from, e->path);
+    int from_len = strlen(from);
+    for (u32 i = 0; i < MODEL_MAX; i++) {
+        if (!model[i].path[0] || !model_under(model[i].path, from)) continue;
+        char moved[MODEL_PATH];
+        strcpy(moved, to);
+        if (strlen(to) + strlen(model[i].path + from_len) >= MODEL_PATH) {
+            failf("path too long for the model", model[i].path);
+            return;
+        }
+        strcat(moved, model[i].path + from_len);
+        strcpy(model[i].path, moved);
+    }
+}
+
+static void op_random(void) {
+    u32 r = rnd(100);
+    if (r < 8 || model_count < 4) {
+        if (model_count < MODEL_MAX) op_mkdir();
+        return;
+    }
+    if (r < 30) {
+        if (model_count < MODEL_MAX) op_create();
+        return;
+    }
+    if (r < 34) {
+        // Names that were never made must not be found
+        char path[MODEL_PATH];
+        new_path(path, 'x');
+        if (wexfs_lookup(path)) failf("found a name never created", path);
+        return;
+    }
+
+    ModelEntry* e = model_pick(r < 80 ? 0 : -1);
+    if (!e) return;
+    FSNode* node = wexfs_lookup(e->path);
+    if (!node) {
+        failf("lookup failed", e->path);
+        return;
+    }
+    if (r < 50) op_write(e, node);
+    else if (r < 58) op_truncate(e, node);
+    else if (r < 80) compare(e, node, 0);
+    else if (r < 92) op_rename(e, node);
+    else if (!e->is_dir || rnd(4) == 0) op_remove(e, node);
+}
+
+/* ---------- Whole tree ---------- */
+
+static u32 count_tree(FSNode* dir) {
+    u32 n = 0;
+    WexDir d;
+    if (wexfs_opendir(dir, WEXFS_DIR_SORTED, &d) != WEXFS_OK) return 0;
+    FSNode* child;
+    while ((child = wexfs_readdir(&d))) {
+        n++;
+        if (child->is_dir) n += count_tree(child);
+    }
+    return n;
+}
+
+/* Mount again, so that only what reached the disk counts, and compare
+ * every object with the model */
+static void check_tree(u32 seed, u32 op) {
+    int err = wexfs_mount();
+    if (err != WEXFS_OK) {
+        failf(wexfs_strerror(err), "mount");
+        return;
+    }
+    int before = failures;
+    for (u32 i = 0; i < MODEL_MAX; i++) {
+        if (!model[i].path[0]) continue;
+        FSNode* node = wexfs_lookup(model[i].path);
+        if (!node) failf("missing after mount", model[i].path);
+        else compare(&model[i], node, 1);
+    }
+    u32 found = count_tree(wexfs_root());
+    if (found != model_count) {
+        printf("FAIL: %u objects on the volume, %u in the model\n", found, model_count);
+        failures++;
+    }
+    if (failures != before) printf("      seed %u, after operation %u\n", seed, op);
+}
+
+static void check_fsck(u32 seed) {
+    WexFsck ck;
+    int rc = wexfs_fsck_begin(&ck, 0);
+    while (rc == 0) rc = wexfs_fsck_step(&ck, 0xFFFFFFFF);
+    if (rc < 0 || ck.errors || ck.leaked || wexfs_csum_errors) {
+        printf("FAIL: seed %u: fsck found %u errors, %u leaked blocks\n", seed,
+               rc < 0 ? 1 : ck.errors + wexfs_csum_errors, ck.leaked);
+        failures++;
+    }
+    wexfs_fsck_end(&ck);
+}
+
+/* A sparse file reaching into the double-indirect range, shrunk to a
+ * point inside its first, empty, double-indirect chunk: the chunk table
+ * itself has to go, once, and every block come back */
+static void sparse_shrink(u32 seed) {
+    const u32 dind = WEXFS_NDIRECT + WEXFS_PTRS_PER_BLOCK;    /* first logical block */
+    u32 free_before = wexfs_free_blocks;
+    int err;
+    FSNode* node = wexfs_create(wexfs_root(), "sparse", WEXFS_FILE, &err);
+    if (!node) {
+        failf(wexfs_strerror(err), "/sparse");
+        return;
+    }
+    fill(iobuf, WEXFS_BLOCK_SIZE);
+    if (wexfs_write(node, 5 * WEXFS_BLOCK_SIZE, iobuf, WEXFS_BLOCK_SIZE) != WEXFS_BLOCK_SIZE ||
+        wexfs_write(node, (dind + WEXFS_PTRS_PER_BLOCK + 3) * WEXFS_BLOCK_SIZE, iobuf, 100) != 100 ||
+        wexfs_truncate(node, (dind + 10) * WEXFS_BLOCK_SIZE) != WEXFS_OK) {
+        failf("sparse file operations", "/sparse");
+    }
+    check_fsck(seed);
+    // Blocks freed by the shrink go to another file, which a second
+    // release of the same blocks would damage
+    FSNode* other = wexfs_create(wexfs_root(), "sparse2", WEXFS_FILE, &err);
+    if (!other || wexfs_write(other, 0, iobuf, 2 * WEXFS_BLOCK_SIZE) != 2 * WEXFS_BLOCK_SIZE ||
+        wexfs_truncate(node, 2 * WEXFS_BLOCK_SIZE) != WEXFS_OK || wexfs_remove(node) != WEXFS_OK) {
+        failf("sparse file operations", "/sparse");
+    }
+    check_fsck(seed);
+    if (other && wexfs_remove(other) != WEXFS_OK) failf("remove", "/sparse2");
+    if (wexfs_free_blocks != free_before) {
+        printf("FAIL: seed %u: sparse file left %u blocks behind\n", seed, free_before - wexfs_free_blocks);
+        failures++;
+    }
+}
+
+/* A compressed file extended past its inline data keeps its first block
+ * compressed */
+static void inline_grow(FSNode* dir) {
+    int err;
+    FSNode* node = wexfs_create(dir, "grow", WEXFS_FILE, &err);
+    if (!node) {
+        failf(wexfs_strerror(err), "/z/grow");
+        return;
+    }
+    memset(iobuf, 'a', WEXFS_BLOCK_SIZE);
+    if (wexfs_write(node, 0, iobuf, 40) != 40 || !(node->di.flags & WEXFS_INODE_INLINE) ||
+        wexfs_truncate(node, WEXFS_BLOCK_SIZE) != WEXFS_OK) {
+        failf("inline file operations", "/z/grow");
+    } else if (!WEXFS_PTR_SECTORS(node->di.blocks[0])) {
+        failf("first block stored uncompressed", "/z/grow");
+    } else if (wexfs_read(node, 0, iobuf, WEXFS_BLOCK_SIZE) != WEXFS_BLOCK_SIZE || iobuf[39] != 'a' ||
+               iobuf[40] != 0) {
+        failf("inline data lost", "/z/grow");
+    }
+    if (wexfs_remove(node) != WEXFS_OK) failf("remove", "/z/grow");
+}
+
+/* A full log rotates on its own, but not inside a caller's transaction */
+static void log_check(u32 seed) {
+    int err;
+    FSNode* node = wexfs_create(wexfs_root(), "log", WEXFS_FILE, &err);
+    if (!node) {
+        failf(wexfs_strerror(err), "/log");
+        return;
+    }
+    fill(iobuf, 300);
+    if (wexfs_set_log(node, 512, 2) != WEXFS_OK || wexfs_append(node, iobuf, 300) != 300 ||
+        wexfs_append(node, iobuf, 300) != 300 || wexfs_append(node, iobuf, 300) != 300 ||
+        !wexfs_lookup("/log.2") || node->di.size != 300 || wexfs_append(node, iobuf, 100) != 100) {
+        failf("log operations", "/log");
+    }
+    if (wexfs_tx_begin() == WEXFS_OK) {
+        if (wexfs_append(node, iobuf, 300) != WEXFS_EINVAL) failf("rotated inside a transaction", "/log");
+        wexfs_tx_commit();
+    }
+    FSNode* gen = wexfs_lookup("/log.1");
+    FSNode* old = wexfs_lookup("/log.2");
+    if (node->di.size != 400 || !gen || gen->di.size != 300 || !old || old->di.size != 300) {
+        failf("log changed by a refused append", "/log");
+    }
+    check_fsck(seed);
+    const char* paths[] = { "/log", "/log.1", "/log.2" };
+    for (int i = 0; i < 3; i++) {
+        FSNode* n = wexfs_lookup(paths[i]);
+        if (n && wexfs_remove(n) != WEXFS_OK) failf("remove", paths[i]);
+    }
+}
+
+/* A long append goes in pieces that each fit a journal record; inside a
+ * caller's transaction it cannot, and the commit says so */
+static void append_split(u32 seed) {
+    const u32 len = MODEL_FILE_MAX;     /* sectors well past one record */
+    int err;
+    FSNode* node = wexfs_create(wexfs_root(), "big", WEXFS_FILE, &err);
+    if (!node) {
+        failf(wexfs_strerror(err), "/big");
+        return;
+    }
+    fill(iobuf, len);
+    if (wexfs_append(node, iobuf, len) != (int)len) failf("append", "/big");
+    if (wexfs_tx_begin() == WEXFS_OK) {
+        if (wexfs_append(node, iobuf, len) != (int)len) failf("append in a transaction", "/big");
+        if (wexfs_tx_commit() != WEXFS_EFBIG) failf("split transaction not reported", "/big");
+    }
+    if (node->di.size != 2 * len) failf("size after appends", "/big");
+    check_fsck(seed);
+    if (wexfs_remove(node) != WEXFS_OK) failf("remove", "/big");
+}
+
+/* Offline defragmentation renumbers a directory in one journal record:
+ * its children keep their change numbers, and a directory with more
+ * children than a record can take is left where it is. Runs on a volume
+ * of its own, so the free slots are known. */
+#define DEFRAG_WIDE 500         /* children, inode sectors past one record */
+
+static FSNode* defrag_files(FSNode* dir, u32 count) {
+    char name[16];
+    for (u32 i = 0; i < count && dir; i++) {
+        int err;
+        itoa(i, name, 10);
+        if (!wexfs_create(dir, name, WEXFS_FILE, &err)) {
+            failf(wexfs_strerror(err), "defrag volume");
+            return NULL;
+        }
+    }
+    return dir;
+}
+
+static void defrag_run(void) {
+    WexDefrag df;
+    int rc = wexfs_defrag_begin(&df, WEXFS_DEFRAG_OFFLINE);
+    while (rc == 0) rc = wexfs_defrag_step(&df, 0xFFFFFFFF);
+    wexfs_defrag_end(&df);
+    if (rc < 0) failf(wexfs_strerror(rc), "defrag");
+}
+
+static void defrag_check(u32 seed) {
+    int err = volume_create(MODEL_VOLUME);
+    FSNode* root = wexfs_root();
+    FSNode* tmp = err == WEXFS_OK ? defrag_files(wexfs_create(root, "tmp", WEXFS_DIR, &err), 3) : NULL;
+    FSNode* hole = tmp ? wexfs_create(root, "hole", WEXFS_FILE, &err) : NULL;
+    FSNode* small = hole ? wexfs_create(root, "small", WEXFS_DIR, &err) : NULL;
+    if (!small) {
+        failf(wexfs_strerror(err), "defrag volume");
+        return;
+    }
+    // Children below their directory and free slots only under it
+    wexfs_remove(hole);
+    FSNode* kids[3];
+    u32 change[3];
+    for (int i = 0; i < 3; i++) {
+        kids[i] = tmp->children;
+        wexfs_rename(kids[i], small, kids[i]->name);
+        change[i] = kids[i]->di.change;
+    }
+    wexfs_remove(tmp);
+    u32 ino = small->ino;
+    defrag_run();
+    if (small->ino == ino) failf("directory not renumbered", "/small");
+    for (int i = 0; i < 3; i++) {
+        if (kids[i]->di.parent != small->ino || kids[i]->di.change != change[i]) {
+            failf("child changed by its directory's move", kids[i]->name);
+        }
+    }
+
+    // More free slots than children under the wide directory, so it is
+    // the next to move once they have
+    FSNode* holes = defrag_files(wexfs_create(root, "holes", WEXFS_DIR, &err), DEFRAG_WIDE + 1);
+    FSNode* wide = holes ? defrag_files(wexfs_create(root, "wide", WEXFS_DIR, &err), DEFRAG_WIDE) : NULL;
+    if (!wide) return;
+    wexfs_remove(holes);
+    ino = wide->ino;
+    defrag_run();
+    if (wide->ino != ino) failf("renumbered past one journal record", "/wide");
+    check_fsck(seed);
+}
+
+/* ---------- Snapshots ---------- */
+
+static u32 snap_free;           /* free blocks before the snapshot */
+
+static void snapshot_take(void) {
+    snap_free = wexfs_free_blocks;
+    int err = wexfs_snapshot_create("half");
+    if (err != WEXFS_OK) {
+        failf(wexfs_strerror(err), "snapshot create");
+        return;
+    }
+    WexSnapshot s;
+    wexfs_snapshot_list(&s, 1);
+    // Only metadata is copied: file data has to be shared, not taken again
+    if (snap_free - wexfs_free_blocks != s.blocks ||
+        s.blocks * 2 > wexfs_sb.total_blocks - snap_free) {
+        printf("FAIL: snapshot took %u blocks of %u in use\n", snap_free - wexfs_free_blocks,
+               wexfs_sb.total_blocks - snap_free);
+        failures++;
+    }
+    model_save();
+}
+
+static void snapshot_roll(u32 seed, const char* name, u32 op) {
+    int err = wexfs_snapshot_restore(name);
+    if (err != WEXFS_OK) {
+        failf(wexfs_strerror(err), name);
+        return;
+    }
+    model_swap();
+    check_tree(seed, op);
+    check_fsck(seed);
+}
+
+/* Back to the snapshot, forward again to the end state, then drop it */
+static void snapshot_check(u32 seed, u32 ops) {
+    if (!saved_count) return;
+    check_fsck(seed);
+    snapshot_roll(seed, "half", ops / 2);
+    snapshot_roll(seed, "half~", ops);
+    WexSnapshot list[WEXFS_MAX_SNAPSHOTS];
+    int count = wexfs_snapshot_list(list, WEXFS_MAX_SNAPSHOTS);
+    if (count != 1 || strcmp(list[0].name, "half~~") != 0) failf("wrong snapshot list", "half~~");
+    int err = wexfs_snapshot_delete("half~~");
+    if (err != WEXFS_OK) failf(wexfs_strerror(err), "snapshot delete");
+    if (wexfs_snapshot_list(list, WEXFS_MAX_SNAPSHOTS) != 0) failf("snapshot still listed", "half~~");
+    check_fsck(seed);
+    check_tree(seed, ops);
+}
+
+/* A damaged superblock fails the mount and is not formatted over */
+static void mount_damaged(u32 seed, u32 ops) {
+    u8 good[SECTOR_SIZE];
+    u8 bad[SECTOR_SIZE];
+    ata_read_sector(FS_SECTOR_START, good);
+    memcpy(bad, good, SECTOR_SIZE);
+    bad[0] ^= 0xFF;
+    ata_write_sector(FS_SECTOR_START, bad);
+    int err = wexfs_mount();
+    ata_read_sector(FS_SECTOR_START, bad);
+    if (err != WEXFS_EINVAL || wexfs_root() || bad[0] != (u8)(good[0] ^ 0xFF)) {
+        printf("FAIL: seed %u: damaged superblock mounted as %s\n", seed, wexfs_strerror(err));
+        failures++;
+    }
+    ata_write_sector(FS_SECTOR_START, good);
+    check_tree(seed, ops);
+}
+
+/* ---------- Backups ---------- */
+
+static u8* backup_disk = NULL;
+static u32 backup_budget;       /* sectors the target takes before writes fail */
+static u32 backup_full_sectors;
+
+static int backup_read(u32 lba, u32 count, u8* buffer) {
+    memcpy(buffer, backup_disk + (unsigned long)lba * SECTOR_SIZE, count * SECTOR_SIZE);
+    return 0;
+}
+
+static int backup_write(u32 lba, u32 count, const u8* buffer) {
+    if (count > backup_budget) {
+        backup_budget = 0;
+        return -1;
+    }
+    backup_budget -= count;
+    memcpy(backup_disk + (unsigned long)lba * SECTOR_SIZE, (void*)buffer, count * SECTOR_SIZE);
+    return 0;
+}
+
+static int backup_flush(void) {
+    return 0;
+}
+
+static const BackupDev backup_dev = { BACKUP_SECTORS, backup_read, backup_write, backup_flush };
+
+static u32 model_files(void) {
+    u32 n = 0;
+    for (u32 i = 0; i < MODEL_MAX; i++) {
+        if (model[i].path[0] && !model[i].is_dir && model[i].size) n++;
+    }
+    return n;
+}
+
+/* A session that has to be full or incremental and list every object */
+static int backup_session(u32 seed, int full, BackupResult* res) {
+    backup_budget = 0xFFFFFFFF;
+    int err = backup_run(&backup_dev, 0, res);
+    if (err != WEXFS_OK) {
+        failf(wexfs_strerror(err), "backup");
+        return 0;
+    }
+    if (res->full != full || res->objects != model_count + 1) {
+        printf("FAIL: seed %u: %s backup of %u objects, the model has %u\n", seed,
+               res->full ? "full" : "incremental", res->objects, model_count + 1);
+        failures++;
+        return 0;
+    }
+    return 1;
+}
+
+static void backup_first(u32 seed) {
+    BackupResult res;
+    if (!backup_session(seed, 1, &res)) return;
+    backup_full_sectors = res.sectors;
+    if (res.files != model_files()) {
+        printf("FAIL: seed %u: full backup copied %u files of %u\n", seed, res.files, model_files());
+        failures++;
+    }
+}
+
+/* Only the files the last few operations touched are copied again, the
+ * rest come from the full session. Sizes are not compared: the touched
+ * files may well have grown past everything the full session held. */
+static void backup_again(u32 seed) {
+    BackupResult res;
+    if (!backup_session(seed, 0, &res)) return;
+    if (res.files > BACKUP_AGAIN || res.files + res.reused != model_files()) {
+        printf("FAIL: seed %u: incremental backup copied %u files and reused %u, the model has %u\n",
+               seed, res.files, res.reused, model_files());
+        failures++;
+    }
+}
+
+/* Cut the last session short and resume it, then bring the volume back
+ * from the target after formatting it */
+static void backup_check(u32 seed, u32 ops) {
+    if (!backup_full_sectors) return;
+    BackupResult res;
+    backup_budget = BACKUP_CHECKPOINT + 2 * BACKUP_RUN;
+    int err = backup_run(&backup_dev, 0, &res);
+    int cut = err != WEXFS_OK;
+    if (cut && err != WEXFS_EIO) failf(wexfs_strerror(err), "backup cut short");
+    if (!backup_session(seed, 0, &res)) return;
+    if (res.resumed != cut) failf(cut ? "not resumed" : "resumed", "backup");
+
+    err = wexfs_format(0);
+    if (err == WEXFS_OK) err = backup_restore(&backup_dev, wexfs_root(), &res);
+    if (err != WEXFS_OK || res.failed) {
+        printf("FAIL: seed %u: restore: %s, %u objects failed\n", seed, wexfs_strerror(err), res.failed);
+        failures++;
+        return;
+    }
+    check_tree(seed, ops);
+    check_fsck(seed);
+    FSNode* z = wexfs_lookup("/z");
+    if (z && !(z->di.flags & WEXFS_INODE_COMPRESS)) failf("compression not restored", "/z");
+
+    // The restored volume is another one, even with the counters of the
+    // backup: its next backup starts the target over
+    BackupHeader hdr;
+    if (backup_header(&backup_dev, &hdr) == WEXFS_OK) {
+        wexfs_backup_mark(hdr.change, wexfs_sb.frozen);
+        backup_session(seed, 1, &res);
+    }
+}
+
+static void model_test(u32 seed, u32 ops) {
+    int before = failures;
+    defrag_check(seed);
+    int err = volume_create(MODEL_VOLUME);
+    if (err != WEXFS_OK) {
+        failf(wexfs_strerror(err), "model volume");
+        return;
+    }
+    model_clear();
+    memset(backup_disk, 0, SECTOR_SIZE);
+    backup_full_sectors = 0;
+    rng_state = seed * 2654435761u;
+    if (!rng_state) rng_state = 1;
+    name_seq = 0;
+
+    // Part of the tree is compressed, to cover that path too
+    int e;
+    FSNode* z = wexfs_create(wexfs_root(), "z", WEXFS_DIR, &e);
+    if (z && wexfs_set_compress(z, 1) == WEXFS_OK) model_add("/z", 1);
+    if (z) inline_grow(z);
+    sparse_shrink(seed);
+    log_check(seed);
+    append_split(seed);
+
+    for (u32 i = 1; i <= ops && failures - before < 10; i++) {
+        op_random();
+        if (i % CHECK_EVERY == 0) check_tree(seed, i);
+        if (i == ops / 2) snapshot_take();
+        if (i == ops / 4) backup_first(seed);
+        if (i == ops / 4 + BACKUP_AGAIN) backup_again(seed);
+    }
+    check_tree(seed, ops);
+    snapshot_check(seed, ops);
+    mount_damaged(seed, ops);
+    backup_check(seed, ops);
+    printf("model seed %-6u %u ops, %u objects, %u blocks free: %s\n", seed, ops, model_count,
+           wexfs_free_blocks, failures == before ? "ok" : "FAILED");
+    model_clear();
+    host_disk_free();
+}
+
+/* ---------- Benchmark ---------- */
+
+typedef struct {
+    char op[16];
+    char volume[16];
+    u32 files;
+    double written;         /* sectors per operation */
+    double read;
+    double rate;            /* operations per second */
+    double disk;            /* simulated drive busy, us per operation */
+} BenchResult;
+
+static BenchResult results[BENCH_MAX];
+static u32 result_count = 0;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static DiskModel bench_model;
+static DiskSim bench_disk;
+static int bench_disk_on = 0;
+static FILE* trace_file = NULL;
+static double trace_base = -1;
+
+static void disk_hook(int write, u32 lba, u32 count, double start_us, double end_us) {
+    if (bench_disk_on) disksim_command(&bench_disk, 0, write, lba, count);
+    if (trace_file) {
+        if (trace_base < 0) trace_base = start_us;
+        DiskTraceRecord r = { start_us - trace_base, end_us - start_us, write, lba, count };
+        disksim_trace_write(trace_file, &r);
+    }
+}
+
+static double bench_start_time;
+static double bench_start_disk;
+static HostDiskStats bench_start_io;
+
+static void bench_start(void) {
+    bench_start_io = host_disk_stats;
+    bench_start_disk = bench_disk.now;
+    bench_start_time = now();
+}
+
+/* `ops` operations on `files` files */
+static void bench_end(const char* op, const char* volume, u32 files, u32 ops) {
+    double secs = now() - bench_start_time;
+    if (result_count == BENCH_MAX || !ops) return;
+    BenchResult* r = &results[result_count++];
+    strcpy(r->op, op);
+    strcpy(r->volume, volume);
+    r->files = files;
+    r->written = (double)(host_disk_stats.sectors_written - bench_start_io.sectors_written) / ops;
+    r->read = (double)(host_disk_stats.sectors_read - bench_start_io.sectors_read) / ops;
+    r->rate = secs > 0 ? ops / secs : 1e9;
+    disksim_flush(&bench_disk);
+    r->disk = (bench_disk.now - bench_start_disk) / ops;
+    printf("bench %-7s %-5s %6u files %10.0f ops/sec %8.2f written/op %8.2f read/op %8.1f disk us/op\n", op,
+           volume, files, r->rate, r->written, r->read, r->disk);
+}
+
+/* The kernel's fsbench, on a volume of `volume` */
+static void bench_volume(const char* volume) {
+    int err = volume_create((u32)host_parse_size(volume));
+    FSNode* dir = err == WEXFS_OK ? wexfs_create(wexfs_root(), "bench", WEXFS_DIR, &err) : NULL;
+    if (!dir) {
+        failf(wexfs_strerror(err), volume);
+        host_disk_free();
+        return;
+    }
+    disksim_init(&bench_disk, &bench_model, host_disk_sectors());
+    bench_disk_on = 1;
+
+    char name[32];
+    char path[48];
+    u32 created = 0;
+    bench_start();
+    for (u32 i = 0; i < BENCH_FILES; i++) {
+        strcpy(name, "f");
+        itoa(i, name + 1, 10);
+        if (!wexfs_create(dir, name, WEXFS_FILE, &err)) {
+            failf(wexfs_strerror(err), name);
+            break;
+        }
+        created++;
+    }
+    bench_end("create", volume, created, created);
+
+    // Full paths in a scattered order
+    u32 found = 0;
+    bench_start();
+    for (u32 pass = 0; pass < BENCH_PASSES; pass++) {
+        for (u32 i = 0; i < created; i++) {
+            strcpy(path, "/bench/f");
+            itoa((int)((i * 7919u) % created), path + 8, 10);
+            if (wexfs_lookup(path)) found++;
+        }
+    }
+    bench_end("lookup", volume, created, created * BENCH_PASSES);
+    found /= BENCH_PASSES;
+
+    // Sorted, one screen-sized page per readdir run
+    u32 listed = 0;
+    bench_start();
+    for (u32 pass = 0; pass < BENCH_PASSES; pass++) {
+        WexDir d;
+        wexfs_opendir(dir, WEXFS_DIR_SORTED, &d);
+        u32 page;
+        do {
+            page = 0;
+            while (page < 20 && wexfs_readdir(&d)) page++;
+            listed += page;
+        } while (page == 20);
+    }
+    bench_end("list", volume, created, listed);
+    listed /= BENCH_PASSES;
+
+    u32 removed = 0;
+    bench_start();
+    while (dir->children) {
+        if (wexfs_remove(dir->children) != WEXFS_OK) break;
+        removed++;
+    }
+    bench_end("remove", volume, removed, removed);
+
+    if (found != created || listed != created || removed != created) {
+        failf("object counts do not match", volume);
+    }
+    bench_disk_on = 0;
+    disksim_free(&bench_disk);
+    host_disk_free();
+}
+
+/* ---------- Baseline ---------- */
+
+static int write_baseline(const char* file) {
+    FILE* f = fopen(file, "w");
+    if (!f) {
+        failf("cannot write", file);
+        return 0;
+    }
+    fprintf(f, "# wexfs-test benchmark baseline, written by make bench-baseline\n"
+               "# op volume files written/op read/op ops/sec disk_us/op (" BENCH_MODEL ")\n");
+    for (u32 i = 0; i < result_count; i++) {
+        BenchResult* r = &results[i];
+        fprintf(f, "%s %s %u %.2f %.2f %.0f %.1f\n", r->op, r->volume, r->files, r->written, r->read, r->rate,
+                r->disk);
+    }
+    fclose(f);
+    printf("baseline written to %s\n", file);
+    return 1;
+}
+
+static int over(double now, double base) {
+    return now > base * (100 + BENCH_SECTOR_SLACK) / 100 + 0.05;
+}
+
+static void check_baseline(const char* file) {
+    FILE* f = fopen(file, "r");
+    if (!f) {
+        failf("cannot read", file);
+        return;
+    }
+    char line[256];
+    u32 compared = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        BenchResult b;
+        if (sscanf(line, "%15s %15s %u %lf %lf %lf %lf", b.op, b.volume, &b.files, &b.written, &b.read,
+                   &b.rate, &b.disk) != 7) {
+            failf("malformed line", file);
+            continue;
+        }
+        for (u32 i = 0; i < result_count; i++) {
+            BenchResult* r = &results[i];
+            if (strcmp(r->op, b.op) != 0 || strcmp(r->volume, b.volume) != 0 || r->files != b.files) continue;
+            compared++;
+            if (over(r->written, b.written) || over(r->read, b.read)) {
+                printf("REGRESSION: %s %s: %.2f written/op, %.2f read/op, baseline %.2f, %.2f\n",
+                       b.op, b.volume, r->written, r->read, b.written, b.read);
+                failures++;
+            }
+            if (r->rate * BENCH_SPEED_FACTOR < b.rate) {
+                printf("REGRESSION: %s %s: %.0f ops/sec, baseline %.0f\n", b.op, b.volume, r->rate, b.rate);
+                failures++;
+            }
+            if (over(r->disk, b.disk)) {
+                printf("REGRESSION: %s %s: %.1f disk us/op, baseline %.1f\n", b.op, b.volume, r->disk, b.disk);
+                failures++;
+            }
+        }
+    }
+    fclose(f);
+    if (compared != result_count) {
+        printf("FAIL: %u of %u results have a baseline in %s\n", compared, result_count, file);
+        failures++;
+    }
+}
+
+/* ---------- Main ---------- */
+
+static void usage(void) {
+    fprintf(stderr, "Usage: wexfs-test [-s seed] [-n ops] [-b baseline] [-w baseline] [-t trace]\n"
+                    "  -s seed      run the model test with this seed only\n"
+                    "  -n ops       operations per seed (default %u)\n"
+                    "  -b baseline  fail on a benchmark regression from this file\n"
+                    "  -w baseline  write the benchmark numbers to this file\n"
+                    "  -t trace     record the disk commands for disk-replay\n", MODEL_OPS);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    u32 seed = 0;
+    u32 ops = MODEL_OPS;
+    const char* baseline = NULL;
+    const char* new_baseline = NULL;
+    const char* trace = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) seed = (u32)atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) ops = (u32)atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) baseline = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) new_baseline = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) trace = argv[++i];
+        else usage();
+    }
+    disk_model_parse(&bench_model, BENCH_MODEL);
+    if (trace) {
+        trace_file = fopen(trace, "w");
+        if (!trace_file) {
+            fprintf(stderr, "wexfs-test: cannot write %s\n", trace);
+            return 1;
+        }
+        disksim_trace_header(trace_file);
+    }
+    host_disk_hook = disk_hook;
+    backup_disk = (u8*)calloc(BACKUP_SECTORS, SECTOR_SIZE);
+    if (!backup_disk || host_init() != WEXFS_OK) {
+        fprintf(stderr, "wexfs-test: out of memory\n");
+        return 1;
+    }
+
+    if (seed) model_test(seed, ops);
+    else for (u32 s = 1; s <= MODEL_SEEDS; s++) model_test(s, ops);
+
+    for (u32 i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) bench_volume(bench_sizes[i]);
+    if (baseline) check_baseline(baseline);
+    if (new_baseline && !failures) write_baseline(new_baseline);
+    if (trace_file) fclose(trace_file);
+
+    if (failures) {
+        printf("wexfs-test: %d failures\n", failures);
+        return 1;
+    }
+    printf("wexfs-test: passed\n");
+    return 0;
+}